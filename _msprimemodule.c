@@ -60,32 +60,38 @@ typedef struct {
 typedef struct {
     PyObject_HEAD
     node_table_t *node_table;
+    int in_use;
 } NodeTable;
 
 typedef struct {
     PyObject_HEAD
     edgeset_table_t *edgeset_table;
+    int in_use;
 } EdgesetTable;
 
 typedef struct {
     PyObject_HEAD
     site_table_t *site_table;
+    int in_use;
 } SiteTable;
 
 typedef struct {
     PyObject_HEAD
     mutation_table_t *mutation_table;
+    int in_use;
 } MutationTable;
 
 typedef struct {
     PyObject_HEAD
     migration_table_t *migration_table;
+    int in_use;
 } MigrationTable;
 
 typedef struct {
     PyObject_HEAD
     msp_t *sim;
     RandomGenerator *random_generator;
+    int in_use;
 } Simulator;
 
 typedef struct {
@@ -96,6 +102,8 @@ typedef struct {
 typedef struct {
     PyObject_HEAD
     tree_sequence_t *tree_sequence;
+    int num_readers;
+    int modifying;
 } TreeSequence;
 
 typedef struct {
@@ -134,6 +142,7 @@ typedef struct {
     PyObject_HEAD
     TreeSequence *tree_sequence;
     vcf_converter_t *vcf_converter;
+    int in_use;
 } VcfConverter;
 
 typedef struct {
@@ -149,6 +158,7 @@ typedef struct {
     vargen_t *variant_generator;
     Py_buffer buffer;
     int buffer_acquired;
+    int in_use;
 } VariantGenerator;
 
 typedef struct {
@@ -173,6 +183,67 @@ handle_input_error(int err)
     PyErr_SetString(MsprimeInputError, msp_strerror(err));
 }
 
+/* Methods that release the GIL mark the objects they use as in use until
+ * they have reacquired it, and other threads get an error rather than
+ * access these objects in the meantime. The marks are only read or
+ * written while holding the GIL.
+ */
+static int
+check_not_in_use(int in_use, const char *name)
+{
+    int ret = 0;
+    if (in_use) {
+        PyErr_Format(PyExc_RuntimeError, "%s is in use by another thread", name);
+        ret = -1;
+    }
+    return ret;
+}
+
+/* Sets the in use mark for the specified tables, any of which may be NULL.
+ * The tables must have been checked with the corresponding check_state
+ * function. */
+static void
+set_tables_in_use(NodeTable *nodes, EdgesetTable *edgesets,
+        MigrationTable *migrations, SiteTable *sites, MutationTable *mutations,
+        int in_use)
+{
+    if (nodes != NULL) {
+        nodes->in_use = in_use;
+    }
+    if (edgesets != NULL) {
+        edgesets->in_use = in_use;
+    }
+    if (migrations != NULL) {
+        migrations->in_use = in_use;
+    }
+    if (sites != NULL) {
+        sites->in_use = in_use;
+    }
+    if (mutations != NULL) {
+        mutations->in_use = in_use;
+    }
+}
+
+/* Held while calling into HDF5 with the GIL released, unless the HDF5
+ * library is threadsafe. */
+static PyThread_type_lock hdf5_lock = NULL;
+
+static void
+acquire_hdf5_lock(void)
+{
+    if (hdf5_lock != NULL) {
+        PyThread_acquire_lock(hdf5_lock, WAIT_LOCK);
+    }
+}
+
+static void
+release_hdf5_lock(void)
+{
+    if (hdf5_lock != NULL) {
+        PyThread_release_lock(hdf5_lock);
+    }
+}
+
 static int
 parse_sample_ids(PyObject *py_samples, tree_sequence_t *ts, size_t *num_samples,
         node_id_t **samples)
@@ -730,6 +801,30 @@ out:
     return ret;
 }
 
+static PyObject *
+RandomGenerator_set_seed(RandomGenerator *self, PyObject *args)
+{
+    PyObject *ret = NULL;
+    unsigned long long seed = 0;
+
+    if (RandomGenerator_check_state(self) != 0) {
+        goto out;
+    }
+    if (!PyArg_ParseTuple(args, "K", &seed)) {
+        goto out;
+    }
+    if (seed == 0 || seed >= (1ULL<<32)) {
+        PyErr_Format(PyExc_ValueError,
+            "seeds must be greater than 0 and less than 2^32");
+        goto out;
+    }
+    self->seed = seed;
+    gsl_rng_set(self->rng, self->seed);
+    ret = Py_BuildValue("");
+out:
+    return ret;
+}
+
 static PyMemberDef RandomGenerator_members[] = {
     {NULL}  /* Sentinel */
 };
@@ -737,6 +832,8 @@ static PyMemberDef RandomGenerator_members[] = {
 static PyMethodDef RandomGenerator_methods[] = {
     {"get_seed", (PyCFunction) RandomGenerator_get_seed,
         METH_NOARGS, "Returns the random seed for this generator."},
+    {"set_seed", (PyCFunction) RandomGenerator_set_seed,
+        METH_VARARGS, "Resets the state of this generator using the specified seed."},
     {NULL}  /* Sentinel */
 };
 
@@ -851,6 +948,7 @@ NodeTable_check_state(NodeTable *self)
         ret = -1;
         goto out;
     }
+    ret = check_not_in_use(self->in_use, "NodeTable");
 out:
     return ret;
 }
@@ -1210,6 +1308,7 @@ EdgesetTable_check_state(EdgesetTable *self)
         ret = -1;
         goto out;
     }
+    ret = check_not_in_use(self->in_use, "EdgesetTable");
 out:
     return ret;
 }
@@ -1589,6 +1688,7 @@ MigrationTable_check_state(MigrationTable *self)
         ret = -1;
         goto out;
     }
+    ret = check_not_in_use(self->in_use, "MigrationTable");
 out:
     return ret;
 }
@@ -1915,6 +2015,7 @@ SiteTable_check_state(SiteTable *self)
         ret = -1;
         goto out;
     }
+    ret = check_not_in_use(self->in_use, "SiteTable");
 out:
     return ret;
 }
@@ -2245,6 +2346,7 @@ MutationTable_check_state(MutationTable *self)
         ret = -1;
         goto out;
     }
+    ret = check_not_in_use(self->in_use, "MutationTable");
 out:
     return ret;
 }
@@ -2663,6 +2765,19 @@ out:
     return ret;
 }
 
+static PyObject *
+MutationGenerator_get_random_generator(MutationGenerator *self)
+{
+    PyObject *ret = NULL;
+
+    if (MutationGenerator_check_state(self) != 0) {
+        goto out;
+    }
+    ret = (PyObject *) self->random_generator;
+    Py_INCREF(ret);
+out:
+    return ret;
+}
 
 static PyObject *
 MutationGenerator_generate(MutationGenerator *self, PyObject *args, PyObject *kwds)
@@ -2697,14 +2812,16 @@ MutationGenerator_generate(MutationGenerator *self, PyObject *args, PyObject *kw
     if (MutationTable_check_state(mutations) != 0) {
         goto out;
     }
+    set_tables_in_use(nodes, edgesets, NULL, sites, mutations, 1);
+    Py_BEGIN_ALLOW_THREADS
     err = mutgen_generate_tables_tmp(self->mutgen, nodes->node_table,
             edgesets->edgeset_table);
-    if (err != 0) {
-        handle_library_error(err);
-        goto out;
+    if (err == 0) {
+        err = mutgen_populate_tables(self->mutgen, sites->site_table,
+                mutations->mutation_table);
     }
-    err = mutgen_populate_tables(self->mutgen, sites->site_table,
-            mutations->mutation_table);
+    Py_END_ALLOW_THREADS
+    set_tables_in_use(nodes, edgesets, NULL, sites, mutations, 0);
     if (err != 0) {
         handle_library_error(err);
         goto out;
@@ -2721,6 +2838,8 @@ static PyMemberDef MutationGenerator_members[] = {
 static PyMethodDef MutationGenerator_methods[] = {
     {"get_mutation_rate", (PyCFunction) MutationGenerator_get_mutation_rate,
         METH_NOARGS, "Returns the mutation rate for this mutation generator."},
+    {"get_random_generator", (PyCFunction) MutationGenerator_get_random_generator,
+        METH_NOARGS, "Returns the random generator for this mutation generator."},
     {"generate", (PyCFunction) MutationGenerator_generate,
         METH_VARARGS|METH_KEYWORDS,
         "Generate mutations and write to the specified table."},
@@ -3106,10 +3225,40 @@ TreeSequence_check_tree_sequence(TreeSequence *self)
     if (self->tree_sequence == NULL) {
         PyErr_SetString(PyExc_ValueError, "tree_sequence not initialised");
         ret = -1;
+    } else {
+        ret = check_not_in_use(self->modifying, "TreeSequence");
+    }
+    return ret;
+}
+
+/* Marks the tree sequence as in use before releasing the GIL. Any number
+ * of threads may read a tree sequence at once, but it can only be
+ * modified by one thread while no others are reading it. */
+static int
+TreeSequence_begin_access(TreeSequence *self, int modify)
+{
+    int ret = check_not_in_use(self->modifying || (modify && self->num_readers > 0),
+            "TreeSequence");
+    if (ret == 0) {
+        if (modify) {
+            self->modifying = 1;
+        } else {
+            self->num_readers++;
+        }
     }
     return ret;
 }
 
+static void
+TreeSequence_end_access(TreeSequence *self, int modify)
+{
+    if (modify) {
+        self->modifying = 0;
+    } else {
+        self->num_readers--;
+    }
+}
+
 static void
 TreeSequence_dealloc(TreeSequence* self)
 {
@@ -3163,12 +3312,19 @@ TreeSequence_dump(TreeSequence *self, PyObject *args, PyObject *kwds)
     if (zlib_compression) {
         flags = MSP_DUMP_ZLIB_COMPRESSION;
     }
-    /* Silence the low-level error reporting HDF5 */
-    if (H5Eset_auto(H5E_DEFAULT, NULL, NULL) < 0) {
-        PyErr_SetString(PyExc_RuntimeError, "Error silencing HDF5 errors");
+    if (TreeSequence_begin_access(self, 0) != 0) {
         goto out;
     }
-    err = tree_sequence_dump(self->tree_sequence, path, flags);
+    Py_BEGIN_ALLOW_THREADS
+    acquire_hdf5_lock();
+    /* Silence the low-level error reporting HDF5 */
+    err = MSP_ERR_HDF5;
+    if (H5Eset_auto(H5E_DEFAULT, NULL, NULL) >= 0) {
+        err = tree_sequence_dump(self->tree_sequence, path, flags);
+    }
+    release_hdf5_lock();
+    Py_END_ALLOW_THREADS
+    TreeSequence_end_access(self, 0);
     if (err != 0) {
         handle_library_error(err);
         goto out;
@@ -3196,17 +3352,19 @@ TreeSequence_load_tables(TreeSequence *self, PyObject *args, PyObject *kwds)
     migration_table_t *migrations = NULL;
     mutation_table_t *mutations = NULL;
     site_table_t *sites = NULL;
+    int take_tables = 0;
 
     static char *kwlist[] = {"nodes", "edgesets", "migrations",
-        "sites", "mutations", "provenance_strings", NULL};
+        "sites", "mutations", "provenance_strings", "take_tables", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O!|O!O!O!O!", kwlist,
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O!|O!O!O!O!i", kwlist,
             &NodeTableType, &py_nodes,
             &EdgesetTableType, &py_edgesets,
             &MigrationTableType, &py_migrations,
             &SiteTableType, &py_sites,
             &MutationTableType, &py_mutations,
-            &PyList_Type, &py_provenance_strings)) {
+            &PyList_Type, &py_provenance_strings,
+            &take_tables)) {
         goto out;
     }
     if (TreeSequence_check_tree_sequence(self) != 0) {
@@ -3249,9 +3407,23 @@ TreeSequence_load_tables(TreeSequence *self, PyObject *args, PyObject *kwds)
         PyErr_SetString(PyExc_TypeError, "Must specify both mutations and mutation types");
         goto out;
     }
-    err = tree_sequence_load_tables_tmp(self->tree_sequence,
-        nodes, edgesets, migrations, sites, mutations,
-        num_provenance_strings, provenance_strings);
+    if (TreeSequence_begin_access(self, 1) != 0) {
+        goto out;
+    }
+    set_tables_in_use(py_nodes, py_edgesets, py_migrations, py_sites, py_mutations, 1);
+    Py_BEGIN_ALLOW_THREADS
+    if (take_tables) {
+        err = tree_sequence_take_tables_tmp(self->tree_sequence,
+            nodes, edgesets, migrations, sites, mutations,
+            num_provenance_strings, provenance_strings);
+    } else {
+        err = tree_sequence_load_tables_tmp(self->tree_sequence,
+            nodes, edgesets, migrations, sites, mutations,
+            num_provenance_strings, provenance_strings);
+    }
+    Py_END_ALLOW_THREADS
+    set_tables_in_use(py_nodes, py_edgesets, py_migrations, py_sites, py_mutations, 0);
+    TreeSequence_end_access(self, 1);
     if (err != 0) {
         handle_library_error(err);
         goto out;
@@ -3349,12 +3521,19 @@ TreeSequence_load(TreeSequence *self, PyObject *args, PyObject *kwds)
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "s", kwlist, &path)) {
         goto out;
     }
-    /* Silence the low-level error reporting HDF5 */
-    if (H5Eset_auto(H5E_DEFAULT, NULL, NULL) < 0) {
-        PyErr_SetString(PyExc_RuntimeError, "Error silencing HDF5 errors");
+    if (TreeSequence_begin_access(self, 1) != 0) {
         goto out;
     }
-    err = tree_sequence_load(self->tree_sequence, path, flags);
+    Py_BEGIN_ALLOW_THREADS
+    acquire_hdf5_lock();
+    /* Silence the low-level error reporting HDF5 */
+    err = MSP_ERR_HDF5;
+    if (H5Eset_auto(H5E_DEFAULT, NULL, NULL) >= 0) {
+        err = tree_sequence_load(self->tree_sequence, path, flags);
+    }
+    release_hdf5_lock();
+    Py_END_ALLOW_THREADS
+    TreeSequence_end_access(self, 1);
     if (err != 0) {
         handle_library_error(err);
         goto out;
@@ -3720,8 +3899,14 @@ TreeSequence_get_pairwise_diversity(TreeSequence *self, PyObject *args, PyObject
     if (parse_sample_ids(py_samples, self->tree_sequence, &num_samples, &samples) != 0) {
         goto out;
     }
+    if (TreeSequence_begin_access(self, 0) != 0) {
+        goto out;
+    }
+    Py_BEGIN_ALLOW_THREADS
     err = tree_sequence_get_pairwise_diversity(
         self->tree_sequence, samples, (uint32_t) num_samples, &pi);
+    Py_END_ALLOW_THREADS
+    TreeSequence_end_access(self, 0);
     if (err != 0) {
         handle_library_error(err);
         goto out;
@@ -3735,93 +3920,632 @@ out:
     return ret;
 }
 
-/* Forward declaration */
-static PyTypeObject TreeSequenceType;
+#ifdef HAVE_NUMPY
+
+/* Parses a sequence of sequences of node IDs into the flattened arrays
+ * used by the branch statistics functions.
+ */
+static int
+parse_sample_sets(PyObject *py_sample_sets, size_t *num_sample_sets,
+        size_t **sample_set_sizes, node_id_t **sample_sets)
+{
+    int ret = -1;
+    PyObject *seq = NULL;
+    PyArrayObject *array = NULL;
+    size_t j, size, total = 0;
+    Py_ssize_t num_sets;
+    size_t *sizes = NULL;
+    node_id_t *sets = NULL;
+    node_id_t *tmp;
+
+    seq = PySequence_Fast(py_sample_sets, "sample_sets must be a sequence");
+    if (seq == NULL) {
+        goto out;
+    }
+    num_sets = PySequence_Fast_GET_SIZE(seq);
+    if (num_sets < 1) {
+        PyErr_SetString(PyExc_ValueError, "Must provide at least one sample set");
+        goto out;
+    }
+    sizes = PyMem_Malloc(num_sets * sizeof(size_t));
+    if (sizes == NULL) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    for (j = 0; j < (size_t) num_sets; j++) {
+        array = (PyArrayObject *) PyArray_FROM_OTF(
+                PySequence_Fast_GET_ITEM(seq, j), NPY_INT32, NPY_ARRAY_IN_ARRAY);
+        if (array == NULL) {
+            goto out;
+        }
+        if (PyArray_NDIM(array) != 1) {
+            PyErr_SetString(PyExc_ValueError, "Sample sets must be 1D");
+            goto out;
+        }
+        size = (size_t) PyArray_DIMS(array)[0];
+        tmp = PyMem_Realloc(sets, GSL_MAX(1, total + size) * sizeof(node_id_t));
+        if (tmp == NULL) {
+            PyErr_NoMemory();
+            goto out;
+        }
+        sets = tmp;
+        memcpy(sets + total, PyArray_DATA(array), size * sizeof(node_id_t));
+        total += size;
+        sizes[j] = size;
+        Py_DECREF(array);
+        array = NULL;
+    }
+    *num_sample_sets = (size_t) num_sets;
+    *sample_set_sizes = sizes;
+    *sample_sets = sets;
+    sizes = NULL;
+    sets = NULL;
+    ret = 0;
+out:
+    Py_XDECREF(seq);
+    Py_XDECREF(array);
+    if (sizes != NULL) {
+        PyMem_Free(sizes);
+    }
+    if (sets != NULL) {
+        PyMem_Free(sets);
+    }
+    return ret;
+}
+
+/* Calls the Python weight function with a (num_rows, num_sample_sets) array
+ * of counts; it must return an array of shape (num_rows, num_outputs).
+ */
+static int
+branch_stat_python_weights(size_t num_rows, size_t num_sample_sets, double *counts,
+        size_t num_outputs, double *weights, void *params)
+{
+    int ret = MSP_ERR_GENERIC;
+    PyObject *weight_function = (PyObject *) params;
+    PyArrayObject *counts_array = NULL;
+    PyArrayObject *weights_array = NULL;
+    PyObject *result = NULL;
+    npy_intp dims[2];
+
+    dims[0] = (npy_intp) num_rows;
+    dims[1] = (npy_intp) num_sample_sets;
+    counts_array = (PyArrayObject *) PyArray_SimpleNew(2, dims, NPY_FLOAT64);
+    if (counts_array == NULL) {
+        goto out;
+    }
+    memcpy(PyArray_DATA(counts_array), counts,
+            num_rows * num_sample_sets * sizeof(double));
+    result = PyObject_CallFunctionObjArgs(weight_function, counts_array, NULL);
+    if (result == NULL) {
+        goto out;
+    }
+    weights_array = (PyArrayObject *) PyArray_FROM_OTF(result, NPY_FLOAT64,
+            NPY_ARRAY_IN_ARRAY);
+    if (weights_array == NULL) {
+        goto out;
+    }
+    if (PyArray_NDIM(weights_array) != 2
+            || PyArray_DIMS(weights_array)[0] != (npy_intp) num_rows
+            || PyArray_DIMS(weights_array)[1] != (npy_intp) num_outputs) {
+        PyErr_SetString(PyExc_ValueError,
+                "Weight function must return an array of shape "
+                "(num_rows, num_outputs)");
+        goto out;
+    }
+    memcpy(weights, PyArray_DATA(weights_array),
+            num_rows * num_outputs * sizeof(double));
+    ret = 0;
+out:
+    Py_XDECREF(counts_array);
+    Py_XDECREF(weights_array);
+    Py_XDECREF(result);
+    return ret;
+}
+
 static PyObject *
-TreeSequence_simplify(TreeSequence *self, PyObject *args, PyObject *kwds)
+TreeSequence_get_branch_stats(TreeSequence *self, PyObject *args, PyObject *kwds)
 {
     PyObject *ret = NULL;
-    PyObject *py_samples = NULL;
-    static char *kwlist[] = {"output", "samples", "filter_invariant_sites", NULL};
-    node_id_t *samples = NULL;
-    size_t num_samples = 0;
-    TreeSequence *output = NULL;
-    int filter_invariant_sites = 1;
-    int flags = 0;
+    static char *kwlist[] = {"sample_sets", "windows", "num_outputs",
+        "weight_function", NULL};
+    PyObject *py_sample_sets = NULL;
+    PyObject *py_windows = NULL;
+    PyObject *weight_function = NULL;
+    PyArrayObject *windows_array = NULL;
+    PyArrayObject *result_array = NULL;
+    unsigned int num_outputs;
+    size_t num_sample_sets, num_windows;
+    size_t *sample_set_sizes = NULL;
+    node_id_t *sample_sets = NULL;
+    npy_intp dims[2];
     int err;
 
     if (TreeSequence_check_tree_sequence(self) != 0) {
         goto out;
     }
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O!|i", kwlist,
-            &TreeSequenceType, &output,
-            &PyList_Type, &py_samples,
-            &filter_invariant_sites)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOIO", kwlist,
+            &py_sample_sets, &py_windows, &num_outputs, &weight_function)) {
         goto out;
     }
-    if (TreeSequence_check_tree_sequence(output) != 0) {
+    if (!PyCallable_Check(weight_function)) {
+        PyErr_SetString(PyExc_TypeError, "weight_function must be callable");
         goto out;
     }
-    if (parse_sample_ids(py_samples, self->tree_sequence, &num_samples, &samples) != 0) {
+    if (parse_sample_sets(py_sample_sets, &num_sample_sets, &sample_set_sizes,
+                &sample_sets) != 0) {
         goto out;
     }
-    if (filter_invariant_sites) {
-        flags |= MSP_FILTER_INVARIANT_SITES;
+    windows_array = table_read_column_array(py_windows, NPY_FLOAT64, &num_windows,
+            false);
+    if (windows_array == NULL) {
+        goto out;
     }
-    err = tree_sequence_simplify(
-        self->tree_sequence, samples, (uint32_t) num_samples, flags, output->tree_sequence);
+    num_windows = num_windows > 0? num_windows - 1: 0;
+    dims[0] = (npy_intp) num_windows;
+    dims[1] = (npy_intp) num_outputs;
+    result_array = (PyArrayObject *) PyArray_SimpleNew(2, dims, NPY_FLOAT64);
+    if (result_array == NULL) {
+        goto out;
+    }
+    if (TreeSequence_begin_access(self, 0) != 0) {
+        goto out;
+    }
+    /* The weight function is Python code, so we must keep the GIL. */
+    err = tree_sequence_get_branch_stats(self->tree_sequence, num_sample_sets,
+            sample_set_sizes, sample_sets, num_windows, PyArray_DATA(windows_array),
+            num_outputs, branch_stat_python_weights, weight_function,
+            PyArray_DATA(result_array));
+    TreeSequence_end_access(self, 0);
     if (err != 0) {
-        handle_library_error(err);
+        if (!PyErr_Occurred()) {
+            handle_library_error(err);
+        }
         goto out;
     }
-    ret = Py_BuildValue("");
+    ret = (PyObject *) result_array;
+    result_array = NULL;
 out:
-    if (samples != NULL) {
-        PyMem_Free(samples);
+    if (sample_set_sizes != NULL) {
+        PyMem_Free(sample_set_sizes);
     }
+    if (sample_sets != NULL) {
+        PyMem_Free(sample_sets);
+    }
+    Py_XDECREF(windows_array);
+    Py_XDECREF(result_array);
     return ret;
 }
 
 static PyObject *
-TreeSequence_get_num_mutations(TreeSequence  *self)
+TreeSequence_get_branch_stat(TreeSequence *self, PyObject *args, PyObject *kwds)
 {
     PyObject *ret = NULL;
-    size_t num_mutations;
+    static char *kwlist[] = {"statistic", "sample_sets", "indexes", "windows", NULL};
+    PyObject *py_sample_sets = NULL;
+    PyObject *py_indexes = NULL;
+    PyObject *py_windows = NULL;
+    PyArrayObject *indexes_array = NULL;
+    PyArrayObject *windows_array = NULL;
+    PyArrayObject *result_array = NULL;
+    int statistic;
+    size_t arity, num_outputs, num_sample_sets, num_windows;
+    size_t *sample_set_sizes = NULL;
+    node_id_t *sample_sets = NULL;
+    npy_intp dims[2];
+    int err;
 
     if (TreeSequence_check_tree_sequence(self) != 0) {
         goto out;
     }
-    num_mutations = tree_sequence_get_num_mutations(self->tree_sequence);
-    ret = Py_BuildValue("n", (Py_ssize_t) num_mutations);
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iOOO", kwlist,
+            &statistic, &py_sample_sets, &py_indexes, &py_windows)) {
+        goto out;
+    }
+    arity = branch_stat_get_arity(statistic);
+    if (arity == 0) {
+        PyErr_SetString(PyExc_ValueError, "Unknown statistic");
+        goto out;
+    }
+    if (parse_sample_sets(py_sample_sets, &num_sample_sets, &sample_set_sizes,
+                &sample_sets) != 0) {
+        goto out;
+    }
+    indexes_array = (PyArrayObject *) PyArray_FROM_OTF(py_indexes, NPY_UINT32,
+            NPY_ARRAY_IN_ARRAY);
+    if (indexes_array == NULL) {
+        goto out;
+    }
+    if (PyArray_NDIM(indexes_array) != 2
+            || PyArray_DIMS(indexes_array)[1] != (npy_intp) arity) {
+        PyErr_SetString(PyExc_ValueError,
+                "indexes must be a 2D array with one column per sample set "
+                "used by the statistic");
+        goto out;
+    }
+    num_outputs = (size_t) PyArray_DIMS(indexes_array)[0];
+    windows_array = table_read_column_array(py_windows, NPY_FLOAT64, &num_windows,
+            false);
+    if (windows_array == NULL) {
+        goto out;
+    }
+    num_windows = num_windows > 0? num_windows - 1: 0;
+    dims[0] = (npy_intp) num_windows;
+    dims[1] = (npy_intp) num_outputs;
+    result_array = (PyArrayObject *) PyArray_SimpleNew(2, dims, NPY_FLOAT64);
+    if (result_array == NULL) {
+        goto out;
+    }
+    if (TreeSequence_begin_access(self, 0) != 0) {
+        goto out;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    err = tree_sequence_get_branch_stat(self->tree_sequence, statistic,
+            num_sample_sets, sample_set_sizes, sample_sets, num_outputs,
+            PyArray_DATA(indexes_array), num_windows, PyArray_DATA(windows_array),
+            PyArray_DATA(result_array));
+    Py_END_ALLOW_THREADS
+    TreeSequence_end_access(self, 0);
+    if (err != 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    ret = (PyObject *) result_array;
+    result_array = NULL;
 out:
+    if (sample_set_sizes != NULL) {
+        PyMem_Free(sample_set_sizes);
+    }
+    if (sample_sets != NULL) {
+        PyMem_Free(sample_sets);
+    }
+    Py_XDECREF(indexes_array);
+    Py_XDECREF(windows_array);
+    Py_XDECREF(result_array);
     return ret;
 }
 
 static PyObject *
-TreeSequence_get_num_sites(TreeSequence  *self)
+TreeSequence_get_site_stats(TreeSequence *self, PyObject *args, PyObject *kwds)
 {
     PyObject *ret = NULL;
-    size_t num_sites;
+    static char *kwlist[] = {"sample_sets", "windows", "statistics", "divergence",
+        "sfs", "num_threads", NULL};
+    PyObject *py_sample_sets = NULL;
+    PyObject *py_windows = NULL;
+    PyObject *py_statistics = NULL;
+    PyArrayObject *windows_array = NULL;
+    PyArrayObject *statistics_array = NULL;
+    PyArrayObject *result_array = NULL;
+    PyArrayObject *divergence_array = NULL;
+    PyArrayObject *sfs_array = NULL;
+    int compute_divergence = 0;
+    int compute_sfs = 0;
+    unsigned int num_threads = 1;
+    size_t j, num_sample_sets, num_windows, num_stats;
+    size_t max_set_size = 0;
+    size_t *sample_set_sizes = NULL;
+    node_id_t *sample_sets = NULL;
+    double *divergence = NULL;
+    double *sfs = NULL;
+    npy_intp dims[3];
+    int err;
 
     if (TreeSequence_check_tree_sequence(self) != 0) {
         goto out;
     }
-    num_sites = tree_sequence_get_num_sites(self->tree_sequence);
-    ret = Py_BuildValue("n", (Py_ssize_t) num_sites);
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOO|iiI", kwlist,
+            &py_sample_sets, &py_windows, &py_statistics, &compute_divergence,
+            &compute_sfs, &num_threads)) {
+        goto out;
+    }
+    if (parse_sample_sets(py_sample_sets, &num_sample_sets, &sample_set_sizes,
+                &sample_sets) != 0) {
+        goto out;
+    }
+    for (j = 0; j < num_sample_sets; j++) {
+        max_set_size = GSL_MAX(max_set_size, sample_set_sizes[j]);
+    }
+    statistics_array = table_read_column_array(py_statistics, NPY_INT32, &num_stats,
+            false);
+    if (statistics_array == NULL) {
+        goto out;
+    }
+    windows_array = table_read_column_array(py_windows, NPY_FLOAT64, &num_windows,
+            false);
+    if (windows_array == NULL) {
+        goto out;
+    }
+    num_windows = num_windows > 0? num_windows - 1: 0;
+    dims[0] = (npy_intp) num_windows;
+    dims[1] = (npy_intp) num_stats;
+    dims[2] = (npy_intp) num_sample_sets;
+    result_array = (PyArrayObject *) PyArray_SimpleNew(3, dims, NPY_FLOAT64);
+    if (result_array == NULL) {
+        goto out;
+    }
+    if (compute_divergence) {
+        dims[1] = (npy_intp) num_sample_sets;
+        divergence_array = (PyArrayObject *) PyArray_SimpleNew(3, dims, NPY_FLOAT64);
+        if (divergence_array == NULL) {
+            goto out;
+        }
+        divergence = PyArray_DATA(divergence_array);
+    }
+    if (compute_sfs) {
+        dims[1] = (npy_intp) num_sample_sets;
+        dims[2] = (npy_intp) max_set_size + 1;
+        sfs_array = (PyArrayObject *) PyArray_SimpleNew(3, dims, NPY_FLOAT64);
+        if (sfs_array == NULL) {
+            goto out;
+        }
+        sfs = PyArray_DATA(sfs_array);
+    }
+    if (TreeSequence_begin_access(self, 0) != 0) {
+        goto out;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    err = tree_sequence_get_site_stats(self->tree_sequence, num_sample_sets,
+            sample_set_sizes, sample_sets, num_windows, PyArray_DATA(windows_array),
+            num_stats, PyArray_DATA(statistics_array), (size_t) num_threads,
+            PyArray_DATA(result_array), divergence, sfs);
+    Py_END_ALLOW_THREADS
+    TreeSequence_end_access(self, 0);
+    if (err != 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    ret = Py_BuildValue("OOO", result_array,
+            divergence_array == NULL? Py_None: (PyObject *) divergence_array,
+            sfs_array == NULL? Py_None: (PyObject *) sfs_array);
 out:
+    if (sample_set_sizes != NULL) {
+        PyMem_Free(sample_set_sizes);
+    }
+    if (sample_sets != NULL) {
+        PyMem_Free(sample_sets);
+    }
+    Py_XDECREF(statistics_array);
+    Py_XDECREF(windows_array);
+    Py_XDECREF(result_array);
+    Py_XDECREF(divergence_array);
+    Py_XDECREF(sfs_array);
     return ret;
 }
 
-static PyMemberDef TreeSequence_members[] = {
-    {NULL}  /* Sentinel */
-};
+static PyObject *
+TreeSequence_get_branch_sfs(TreeSequence *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *ret = NULL;
+    static char *kwlist[] = {"windows", NULL};
+    PyObject *py_windows = NULL;
+    PyArrayObject *windows_array = NULL;
+    PyArrayObject *result_array = NULL;
+    size_t num_windows;
+    npy_intp dims[2];
+    int err;
 
-static PyMethodDef TreeSequence_methods[] = {
-    {"dump", (PyCFunction) TreeSequence_dump,
-        METH_VARARGS|METH_KEYWORDS,
-        "Writes the tree sequence out to the specified path."},
-    {"load", (PyCFunction) TreeSequence_load,
-        METH_VARARGS|METH_KEYWORDS,
+    if (TreeSequence_check_tree_sequence(self) != 0) {
+        goto out;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &py_windows)) {
+        goto out;
+    }
+    windows_array = table_read_column_array(py_windows, NPY_FLOAT64, &num_windows,
+            false);
+    if (windows_array == NULL) {
+        goto out;
+    }
+    num_windows = num_windows > 0? num_windows - 1: 0;
+    dims[0] = (npy_intp) num_windows;
+    dims[1] = (npy_intp) tree_sequence_get_sample_size(self->tree_sequence) + 1;
+    result_array = (PyArrayObject *) PyArray_SimpleNew(2, dims, NPY_FLOAT64);
+    if (result_array == NULL) {
+        goto out;
+    }
+    if (TreeSequence_begin_access(self, 0) != 0) {
+        goto out;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    err = tree_sequence_get_branch_sfs(self->tree_sequence, num_windows,
+            PyArray_DATA(windows_array), PyArray_DATA(result_array));
+    Py_END_ALLOW_THREADS
+    TreeSequence_end_access(self, 0);
+    if (err != 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    ret = (PyObject *) result_array;
+    result_array = NULL;
+out:
+    Py_XDECREF(windows_array);
+    Py_XDECREF(result_array);
+    return ret;
+}
+
+static PyObject *
+TreeSequence_get_sfs(TreeSequence *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *ret = NULL;
+    static char *kwlist[] = {"sample_sets", "windows", "folded", NULL};
+    PyObject *py_sample_sets = NULL;
+    PyObject *py_windows = NULL;
+    PyArrayObject *windows_array = NULL;
+    PyArrayObject *result_array = NULL;
+    int folded = 0;
+    int flags = 0;
+    size_t j, num_sample_sets, num_windows;
+    size_t *sample_set_sizes = NULL;
+    node_id_t *sample_sets = NULL;
+    npy_intp *dims = NULL;
+    int err;
+
+    if (TreeSequence_check_tree_sequence(self) != 0) {
+        goto out;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|i", kwlist,
+            &py_sample_sets, &py_windows, &folded)) {
+        goto out;
+    }
+    if (folded) {
+        flags = MSP_SFS_FOLDED;
+    }
+    if (parse_sample_sets(py_sample_sets, &num_sample_sets, &sample_set_sizes,
+                &sample_sets) != 0) {
+        goto out;
+    }
+    if (num_sample_sets >= NPY_MAXDIMS) {
+        PyErr_SetString(PyExc_ValueError, "Too many sample sets");
+        goto out;
+    }
+    windows_array = table_read_column_array(py_windows, NPY_FLOAT64, &num_windows,
+            false);
+    if (windows_array == NULL) {
+        goto out;
+    }
+    num_windows = num_windows > 0? num_windows - 1: 0;
+    dims = PyMem_Malloc((num_sample_sets + 1) * sizeof(npy_intp));
+    if (dims == NULL) {
+        PyErr_NoMemory();
+        goto out;
+    }
+    dims[0] = (npy_intp) num_windows;
+    for (j = 0; j < num_sample_sets; j++) {
+        dims[j + 1] = (npy_intp) sample_set_sizes[j] + 1;
+    }
+    result_array = (PyArrayObject *) PyArray_SimpleNew((int) num_sample_sets + 1,
+            dims, NPY_FLOAT64);
+    if (result_array == NULL) {
+        goto out;
+    }
+    if (TreeSequence_begin_access(self, 0) != 0) {
+        goto out;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    err = tree_sequence_get_sfs(self->tree_sequence, num_sample_sets,
+            sample_set_sizes, sample_sets, num_windows, PyArray_DATA(windows_array),
+            flags, PyArray_DATA(result_array));
+    Py_END_ALLOW_THREADS
+    TreeSequence_end_access(self, 0);
+    if (err != 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    ret = (PyObject *) result_array;
+    result_array = NULL;
+out:
+    if (sample_set_sizes != NULL) {
+        PyMem_Free(sample_set_sizes);
+    }
+    if (sample_sets != NULL) {
+        PyMem_Free(sample_sets);
+    }
+    if (dims != NULL) {
+        PyMem_Free(dims);
+    }
+    Py_XDECREF(windows_array);
+    Py_XDECREF(result_array);
+    return ret;
+}
+#endif
+
+/* Forward declaration */
+static PyTypeObject TreeSequenceType;
+static PyObject *
+TreeSequence_simplify(TreeSequence *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *ret = NULL;
+    PyObject *py_samples = NULL;
+    static char *kwlist[] = {"output", "samples", "filter_invariant_sites", NULL};
+    node_id_t *samples = NULL;
+    size_t num_samples = 0;
+    TreeSequence *output = NULL;
+    int filter_invariant_sites = 1;
+    int flags = 0;
+    int err;
+
+    if (TreeSequence_check_tree_sequence(self) != 0) {
+        goto out;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O!|i", kwlist,
+            &TreeSequenceType, &output,
+            &PyList_Type, &py_samples,
+            &filter_invariant_sites)) {
+        goto out;
+    }
+    if (TreeSequence_check_tree_sequence(output) != 0) {
+        goto out;
+    }
+    if (parse_sample_ids(py_samples, self->tree_sequence, &num_samples, &samples) != 0) {
+        goto out;
+    }
+    if (filter_invariant_sites) {
+        flags |= MSP_FILTER_INVARIANT_SITES;
+    }
+    if (TreeSequence_begin_access(self, 0) != 0) {
+        goto out;
+    }
+    if (TreeSequence_begin_access(output, 1) != 0) {
+        TreeSequence_end_access(self, 0);
+        goto out;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    err = tree_sequence_simplify(
+        self->tree_sequence, samples, (uint32_t) num_samples, flags, output->tree_sequence);
+    Py_END_ALLOW_THREADS
+    TreeSequence_end_access(output, 1);
+    TreeSequence_end_access(self, 0);
+    if (err != 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    ret = Py_BuildValue("");
+out:
+    if (samples != NULL) {
+        PyMem_Free(samples);
+    }
+    return ret;
+}
+
+static PyObject *
+TreeSequence_get_num_mutations(TreeSequence  *self)
+{
+    PyObject *ret = NULL;
+    size_t num_mutations;
+
+    if (TreeSequence_check_tree_sequence(self) != 0) {
+        goto out;
+    }
+    num_mutations = tree_sequence_get_num_mutations(self->tree_sequence);
+    ret = Py_BuildValue("n", (Py_ssize_t) num_mutations);
+out:
+    return ret;
+}
+
+static PyObject *
+TreeSequence_get_num_sites(TreeSequence  *self)
+{
+    PyObject *ret = NULL;
+    size_t num_sites;
+
+    if (TreeSequence_check_tree_sequence(self) != 0) {
+        goto out;
+    }
+    num_sites = tree_sequence_get_num_sites(self->tree_sequence);
+    ret = Py_BuildValue("n", (Py_ssize_t) num_sites);
+out:
+    return ret;
+}
+
+static PyMemberDef TreeSequence_members[] = {
+    {NULL}  /* Sentinel */
+};
+
+static PyMethodDef TreeSequence_methods[] = {
+    {"dump", (PyCFunction) TreeSequence_dump,
+        METH_VARARGS|METH_KEYWORDS,
+        "Writes the tree sequence out to the specified path."},
+    {"load", (PyCFunction) TreeSequence_load,
+        METH_VARARGS|METH_KEYWORDS,
         "Loads a tree sequence from the specified path."},
     {"load_tables", (PyCFunction) TreeSequence_load_tables,
         METH_VARARGS|METH_KEYWORDS,
@@ -3869,6 +4593,28 @@ static PyMethodDef TreeSequence_methods[] = {
     {"get_pairwise_diversity",
         (PyCFunction) TreeSequence_get_pairwise_diversity,
         METH_VARARGS|METH_KEYWORDS, "Returns the average pairwise diversity." },
+#ifdef HAVE_NUMPY
+    {"get_branch_stats",
+        (PyCFunction) TreeSequence_get_branch_stats,
+        METH_VARARGS|METH_KEYWORDS,
+        "Returns the windowed branch statistics defined by a weight function." },
+    {"get_branch_stat",
+        (PyCFunction) TreeSequence_get_branch_stat,
+        METH_VARARGS|METH_KEYWORDS,
+        "Returns the windowed values of a built-in branch statistic." },
+    {"get_site_stats",
+        (PyCFunction) TreeSequence_get_site_stats,
+        METH_VARARGS|METH_KEYWORDS,
+        "Returns windowed site statistics for a list of sample sets." },
+    {"get_branch_sfs",
+        (PyCFunction) TreeSequence_get_branch_sfs,
+        METH_VARARGS|METH_KEYWORDS,
+        "Returns the windowed branch length site frequency spectrum." },
+    {"get_sfs",
+        (PyCFunction) TreeSequence_get_sfs,
+        METH_VARARGS|METH_KEYWORDS,
+        "Returns the windowed joint site frequency spectrum of the sample sets." },
+#endif
     {"simplify", (PyCFunction) TreeSequence_simplify,
         METH_VARARGS|METH_KEYWORDS,
         "Returns a simplified version of this tree sequence."},
@@ -4282,6 +5028,77 @@ out:
     return ret;
 }
 
+static PyObject *
+SparseTree_seek(SparseTree *self, PyObject *args)
+{
+    PyObject *ret = NULL;
+    double position;
+    int err;
+
+    if (SparseTree_check_sparse_tree(self) != 0) {
+        goto out;
+    }
+    if (!PyArg_ParseTuple(args, "d", &position)) {
+        goto out;
+    }
+    err = sparse_tree_seek(self->sparse_tree, position);
+    if (err < 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    ret = Py_BuildValue("");
+out:
+    return ret;
+}
+
+static PyObject *
+SparseTree_get_total_branch_length(SparseTree *self)
+{
+    PyObject *ret = NULL;
+    double length;
+    int err;
+
+    if (SparseTree_check_sparse_tree(self) != 0) {
+        goto out;
+    }
+    err = sparse_tree_get_total_branch_length(self->sparse_tree, &length);
+    if (err != 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    ret = Py_BuildValue("d", length);
+out:
+    return ret;
+}
+
+#ifdef HAVE_NUMPY
+static PyObject *
+SparseTree_get_branch_length_by_count(SparseTree *self)
+{
+    PyObject *ret = NULL;
+    PyArrayObject *array = NULL;
+    npy_intp dims;
+
+    if (SparseTree_check_sparse_tree(self) != 0) {
+        goto out;
+    }
+    if (!(self->sparse_tree->flags & MSP_BRANCH_LENGTHS)) {
+        handle_library_error(MSP_ERR_UNSUPPORTED_OPERATION);
+        goto out;
+    }
+    dims = (npy_intp) self->sparse_tree->sample_size + 1;
+    array = (PyArrayObject *) PyArray_SimpleNew(1, &dims, NPY_FLOAT64);
+    if (array == NULL) {
+        goto out;
+    }
+    memcpy(PyArray_DATA(array), self->sparse_tree->branch_length_by_count,
+            (size_t) dims * sizeof(double));
+    ret = (PyObject *) array;
+out:
+    return ret;
+}
+#endif
+
 static PyObject *
 SparseTree_get_num_tracked_leaves(SparseTree *self, PyObject *args)
 {
@@ -4353,6 +5170,15 @@ static PyMethodDef SparseTree_methods[] = {
             "Returns the list of sites on this tree." },
     {"get_flags", (PyCFunction) SparseTree_get_flags, METH_NOARGS,
             "Returns the value of the flags variable." },
+    {"seek", (PyCFunction) SparseTree_seek, METH_VARARGS,
+        "Moves to the tree covering the specified position." },
+    {"get_total_branch_length", (PyCFunction) SparseTree_get_total_branch_length,
+        METH_NOARGS, "Returns the total branch length of this tree." },
+#ifdef HAVE_NUMPY
+    {"get_branch_length_by_count",
+        (PyCFunction) SparseTree_get_branch_length_by_count, METH_NOARGS,
+        "Returns the total length of branches subtending each number of leaves." },
+#endif
     {"get_num_sites", (PyCFunction) SparseTree_get_num_sites, METH_NOARGS,
             "Returns the number of sites on this tree." },
     {"get_parent", (PyCFunction) SparseTree_get_parent, METH_VARARGS,
@@ -5012,6 +5838,8 @@ VcfConverter_check_state(VcfConverter *self)
     if (self->vcf_converter == NULL) {
         PyErr_SetString(PyExc_SystemError, "converter not initialised");
         ret = -1;
+    } else {
+        ret = check_not_in_use(self->in_use, "VcfConverter");
     }
     return ret;
 }
@@ -5083,7 +5911,15 @@ VcfConverter_next(VcfConverter  *self)
     if (VcfConverter_check_state(self) != 0) {
         goto out;
     }
+    if (TreeSequence_begin_access(self->tree_sequence, 0) != 0) {
+        goto out;
+    }
+    self->in_use = 1;
+    Py_BEGIN_ALLOW_THREADS
     err = vcf_converter_next(self->vcf_converter, &record);
+    Py_END_ALLOW_THREADS
+    self->in_use = 0;
+    TreeSequence_end_access(self->tree_sequence, 0);
     if (err < 0) {
         handle_library_error(err);
         goto out;
@@ -5217,8 +6053,14 @@ HaplotypeGenerator_init(HaplotypeGenerator *self, PyObject *args, PyObject *kwds
         goto out;
     }
     memset(self->haplotype_generator, 0, sizeof(hapgen_t));
+    if (TreeSequence_begin_access(self->tree_sequence, 0) != 0) {
+        goto out;
+    }
+    Py_BEGIN_ALLOW_THREADS
     err = hapgen_alloc(self->haplotype_generator,
             self->tree_sequence->tree_sequence);
+    Py_END_ALLOW_THREADS
+    TreeSequence_end_access(self->tree_sequence, 0);
     if (err != 0) {
         handle_library_error(err);
         goto out;
@@ -5315,6 +6157,8 @@ VariantGenerator_check_state(VariantGenerator *self)
     if (self->variant_generator == NULL) {
         PyErr_SetString(PyExc_SystemError, "converter not initialised");
         ret = -1;
+    } else {
+        ret = check_not_in_use(self->in_use, "VariantGenerator");
     }
     return ret;
 }
@@ -5351,6 +6195,7 @@ VariantGenerator_init(VariantGenerator *self, PyObject *args, PyObject *kwds)
     self->tree_sequence = NULL;
     self->genotypes_buffer = NULL;
     self->buffer_acquired = 0;
+    self->in_use = 0;
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O|i", kwlist,
             &TreeSequenceType, &tree_sequence, &genotypes_buffer,
             &as_char)) {
@@ -5419,11 +6264,89 @@ out:
     return ret;
 }
 
+static PyObject *
+VariantGenerator_next_packed(VariantGenerator *self, PyObject *args, PyObject *kwds)
+{
+    int err;
+    PyObject *ret = NULL;
+    static char *kwlist[] = {"dest", "max_sites", "two_bit", "sample_major", NULL};
+    PyObject *dest = NULL;
+    Py_buffer buffer;
+    Py_ssize_t max_sites;
+    int two_bit = 0;
+    int sample_major = 0;
+    int options = 0;
+    size_t bits, sample_size, size;
+    size_t num_sites = 0;
+    int buffer_acquired = 0;
+
+    if (VariantGenerator_check_state(self) != 0) {
+        goto out;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "On|ii", kwlist,
+            &dest, &max_sites, &two_bit, &sample_major)) {
+        goto out;
+    }
+    if (max_sites < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_sites must be >= 0");
+        goto out;
+    }
+    if (!PyObject_CheckBuffer(dest)) {
+        PyErr_SetString(PyExc_TypeError,
+            "dest buffer must support the Python buffer protocol.");
+        goto out;
+    }
+    if (PyObject_GetBuffer(dest, &buffer, PyBUF_SIMPLE|PyBUF_WRITABLE) != 0) {
+        goto out;
+    }
+    buffer_acquired = 1;
+    bits = two_bit? 2: 1;
+    sample_size = self->variant_generator->sample_size;
+    if (two_bit) {
+        options |= MSP_GENOTYPES_2BIT;
+    }
+    if (sample_major) {
+        options |= MSP_GENOTYPES_SAMPLE_MAJOR;
+        size = sample_size * (((size_t) max_sites * bits + 7) / 8);
+    } else {
+        size = (size_t) max_sites * ((sample_size * bits + 7) / 8);
+    }
+    if (size > (size_t) buffer.len) {
+        PyErr_SetString(PyExc_BufferError,
+            "dest buffer is too small for the results");
+        goto out;
+    }
+    if (TreeSequence_begin_access(self->tree_sequence, 0) != 0) {
+        goto out;
+    }
+    self->in_use = 1;
+    Py_BEGIN_ALLOW_THREADS
+    err = vargen_next_packed(self->variant_generator, (size_t) max_sites, options,
+            (uint8_t *) buffer.buf, &num_sites);
+    Py_END_ALLOW_THREADS
+    self->in_use = 0;
+    TreeSequence_end_access(self->tree_sequence, 0);
+    if (err != 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    ret = Py_BuildValue("n", (Py_ssize_t) num_sites);
+out:
+    if (buffer_acquired) {
+        PyBuffer_Release(&buffer);
+    }
+    return ret;
+}
+
 static PyMemberDef VariantGenerator_members[] = {
     {NULL}  /* Sentinel */
 };
 
 static PyMethodDef VariantGenerator_methods[] = {
+    {"next_packed", (PyCFunction) VariantGenerator_next_packed,
+        METH_VARARGS|METH_KEYWORDS,
+        "Writes the bit-packed genotypes of the next block of sites into the "
+        "specified buffer and returns the number of sites written"},
     {NULL}  /* Sentinel */
 };
 
@@ -5543,9 +6466,13 @@ LdCalculator_get_r2(LdCalculator *self, PyObject *args)
     if (!PyArg_ParseTuple(args, "nn", &a, &b)) {
         goto out;
     }
+    if (TreeSequence_begin_access(self->tree_sequence, 0) != 0) {
+        goto out;
+    }
     Py_BEGIN_ALLOW_THREADS
     err = ld_calc_get_r2(self->ld_calc, (size_t) a, (size_t) b, &r2);
     Py_END_ALLOW_THREADS
+    TreeSequence_end_access(self->tree_sequence, 0);
     if (err != 0) {
         handle_library_error(err);
         goto out;
@@ -5562,21 +6489,23 @@ LdCalculator_get_r2_array(LdCalculator *self, PyObject *args, PyObject *kwds)
     PyObject *ret = NULL;
     static char *kwlist[] = {
         "dest", "source_index", "direction", "max_mutations",
-        "max_distance", NULL};
+        "max_distance", "statistic", NULL};
     PyObject *dest = NULL;
     Py_buffer buffer;
     Py_ssize_t source_index;
     Py_ssize_t max_mutations = -1;
     double max_distance = DBL_MAX;
     int direction = MSP_DIR_FORWARD;
+    int statistic = MSP_LD_STAT_R2;
     size_t num_r2_values = 0;
     int buffer_acquired = 0;
 
     if (LdCalculator_check_state(self) != 0) {
         goto out;
     }
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "On|ind", kwlist,
-            &dest, &source_index, &direction, &max_mutations, &max_distance)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "On|indi", kwlist,
+            &dest, &source_index, &direction, &max_mutations, &max_distance,
+            &statistic)) {
         goto out;
     }
     if (direction != MSP_DIR_FORWARD && direction != MSP_DIR_REVERSE) {
@@ -5605,12 +6534,16 @@ LdCalculator_get_r2_array(LdCalculator *self, PyObject *args, PyObject *kwds)
         goto out;
     }
 
+    if (TreeSequence_begin_access(self->tree_sequence, 0) != 0) {
+        goto out;
+    }
     Py_BEGIN_ALLOW_THREADS
     err = ld_calc_get_r2_array(
         self->ld_calc, (size_t) source_index, direction,
-        (size_t) max_mutations, max_distance,
+        (size_t) max_mutations, max_distance, statistic,
         (double *) buffer.buf, &num_r2_values);
     Py_END_ALLOW_THREADS
+    TreeSequence_end_access(self->tree_sequence, 0);
     if (err != 0) {
         handle_library_error(err);
         goto out;
@@ -5623,6 +6556,286 @@ out:
     return ret;
 }
 
+#ifdef HAVE_NUMPY
+
+/* The destination of the tiles of an r2 matrix. Tiles are written by the
+ * worker threads without the GIL, so only C memory can be used. */
+typedef struct {
+    size_t num_sites;
+    size_t item_size;
+    char *matrix;
+    size_t num_entries;
+    size_t max_entries;
+    site_id_t *rows;
+    site_id_t *columns;
+    char *values;
+} r2_matrix_output_t;
+
+static int
+LdCalculator_write_dense_tile(ld_tile_t *tile, void *params)
+{
+    r2_matrix_output_t *self = (r2_matrix_output_t *) params;
+    size_t m = self->num_sites;
+    size_t z = self->item_size;
+    size_t j, a, b;
+    char *row;
+
+    for (j = 0; j < tile->num_rows; j++) {
+        a = tile->row_start + j;
+        row = (char *) tile->values + j * m * z;
+        memcpy(self->matrix + (a * m + a) * z, row + a * z, (m - a) * z);
+        for (b = a + 1; b < m; b++) {
+            memcpy(self->matrix + (b * m + a) * z, row + b * z, z);
+        }
+    }
+    return 0;
+}
+
+static int
+LdCalculator_write_sparse_tile(ld_tile_t *tile, void *params)
+{
+    int ret = 0;
+    r2_matrix_output_t *self = (r2_matrix_output_t *) params;
+    size_t n = self->num_entries + tile->num_entries;
+    size_t z = self->item_size;
+    void *p;
+
+    if (n > self->max_entries) {
+        self->max_entries = GSL_MAX(n, 2 * self->max_entries);
+        p = realloc(self->rows, self->max_entries * sizeof(site_id_t));
+        if (p == NULL) {
+            ret = MSP_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->rows = p;
+        p = realloc(self->columns, self->max_entries * sizeof(site_id_t));
+        if (p == NULL) {
+            ret = MSP_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->columns = p;
+        p = realloc(self->values, self->max_entries * z);
+        if (p == NULL) {
+            ret = MSP_ERR_NO_MEMORY;
+            goto out;
+        }
+        self->values = p;
+    }
+    if (tile->num_entries > 0) {
+        memcpy(self->rows + self->num_entries, tile->rows,
+                tile->num_entries * sizeof(site_id_t));
+        memcpy(self->columns + self->num_entries, tile->columns,
+                tile->num_entries * sizeof(site_id_t));
+        memcpy(self->values + self->num_entries * z, tile->values,
+                tile->num_entries * z);
+        self->num_entries = n;
+    }
+out:
+    return ret;
+}
+
+static PyObject *
+LdCalculator_get_r2_matrix(LdCalculator *self, PyObject *args, PyObject *kwds)
+{
+    int err;
+    PyObject *ret = NULL;
+    static char *kwlist[] = {
+        "num_threads", "tile_size", "float32", "sparse", "threshold", NULL};
+    Py_ssize_t num_threads = 1;
+    Py_ssize_t tile_size = 16;
+    int float32 = 0;
+    int sparse = 0;
+    double threshold = 0;
+    int flags = 0;
+    int npy_type;
+    size_t m;
+    npy_intp dims[2];
+    r2_matrix_output_t output;
+    PyArrayObject *matrix_array = NULL;
+    PyArrayObject *rows_array = NULL;
+    PyArrayObject *columns_array = NULL;
+    PyArrayObject *values_array = NULL;
+
+    memset(&output, 0, sizeof(output));
+    if (LdCalculator_check_state(self) != 0) {
+        goto out;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nniid", kwlist,
+            &num_threads, &tile_size, &float32, &sparse, &threshold)) {
+        goto out;
+    }
+    if (num_threads < 1) {
+        PyErr_SetString(PyExc_ValueError, "num_threads must be >= 1");
+        goto out;
+    }
+    if (tile_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "tile_size must be >= 1");
+        goto out;
+    }
+    m = tree_sequence_get_num_sites(self->tree_sequence->tree_sequence);
+    npy_type = NPY_FLOAT64;
+    output.item_size = sizeof(double);
+    if (float32) {
+        flags |= MSP_LD_FLOAT32;
+        npy_type = NPY_FLOAT32;
+        output.item_size = sizeof(float);
+    }
+    output.num_sites = m;
+    if (sparse) {
+        flags |= MSP_LD_SPARSE;
+    } else {
+        dims[0] = (npy_intp) m;
+        dims[1] = (npy_intp) m;
+        matrix_array = (PyArrayObject *) PyArray_SimpleNew(2, dims, npy_type);
+        if (matrix_array == NULL) {
+            goto out;
+        }
+        output.matrix = PyArray_DATA(matrix_array);
+    }
+    if (TreeSequence_begin_access(self->tree_sequence, 0) != 0) {
+        goto out;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    err = ld_calc_get_r2_matrix(self->ld_calc, (size_t) tile_size,
+            (size_t) num_threads, flags, threshold,
+            sparse? LdCalculator_write_sparse_tile: LdCalculator_write_dense_tile,
+            &output);
+    Py_END_ALLOW_THREADS
+    TreeSequence_end_access(self->tree_sequence, 0);
+    if (err != 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    if (sparse) {
+        dims[0] = (npy_intp) output.num_entries;
+        rows_array = (PyArrayObject *) PyArray_SimpleNew(1, dims, NPY_INT32);
+        columns_array = (PyArrayObject *) PyArray_SimpleNew(1, dims, NPY_INT32);
+        values_array = (PyArrayObject *) PyArray_SimpleNew(1, dims, npy_type);
+        if (rows_array == NULL || columns_array == NULL || values_array == NULL) {
+            goto out;
+        }
+        if (output.num_entries > 0) {
+            memcpy(PyArray_DATA(rows_array), output.rows,
+                    output.num_entries * sizeof(site_id_t));
+            memcpy(PyArray_DATA(columns_array), output.columns,
+                    output.num_entries * sizeof(site_id_t));
+            memcpy(PyArray_DATA(values_array), output.values,
+                    output.num_entries * output.item_size);
+        }
+        ret = Py_BuildValue("OOO", rows_array, columns_array, values_array);
+    } else {
+        ret = (PyObject *) matrix_array;
+        matrix_array = NULL;
+    }
+out:
+    msp_safe_free(output.rows);
+    msp_safe_free(output.columns);
+    msp_safe_free(output.values);
+    Py_XDECREF(matrix_array);
+    Py_XDECREF(rows_array);
+    Py_XDECREF(columns_array);
+    Py_XDECREF(values_array);
+    return ret;
+}
+
+static PyObject *
+LdCalculator_get_r2_decay(LdCalculator *self, PyObject *args, PyObject *kwds)
+{
+    int err;
+    PyObject *ret = NULL;
+    static char *kwlist[] = {
+        "distance_breaks", "frequency_breaks", "max_mutations", "num_threads",
+        NULL};
+    PyObject *distance_breaks_input = NULL;
+    PyObject *frequency_breaks_input = Py_None;
+    PyArrayObject *distance_breaks_array = NULL;
+    PyArrayObject *frequency_breaks_array = NULL;
+    PyArrayObject *r2_sum_array = NULL;
+    PyArrayObject *num_pairs_array = NULL;
+    Py_ssize_t max_mutations = -1;
+    Py_ssize_t num_threads = 1;
+    size_t num_distance_breaks, num_frequency_breaks;
+    size_t num_distance_bins, num_frequency_bins;
+    double *frequency_breaks = NULL;
+    npy_intp dims[2];
+
+    if (LdCalculator_check_state(self) != 0) {
+        goto out;
+    }
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|Onn", kwlist,
+            &distance_breaks_input, &frequency_breaks_input, &max_mutations,
+            &num_threads)) {
+        goto out;
+    }
+    if (num_threads < 1) {
+        PyErr_SetString(PyExc_ValueError, "num_threads must be >= 1");
+        goto out;
+    }
+    if (max_mutations == -1) {
+        max_mutations = (Py_ssize_t) tree_sequence_get_num_sites(
+                self->tree_sequence->tree_sequence);
+    } else if (max_mutations < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_mutations must be >= 0");
+        goto out;
+    }
+    distance_breaks_array = table_read_column_array(distance_breaks_input,
+            NPY_FLOAT64, &num_distance_breaks, false);
+    if (distance_breaks_array == NULL) {
+        goto out;
+    }
+    if (num_distance_breaks < 2) {
+        PyErr_SetString(PyExc_ValueError,
+                "At least two distance breaks are required");
+        goto out;
+    }
+    num_distance_bins = num_distance_breaks - 1;
+    num_frequency_bins = 0;
+    if (frequency_breaks_input != Py_None) {
+        frequency_breaks_array = table_read_column_array(frequency_breaks_input,
+                NPY_FLOAT64, &num_frequency_breaks, false);
+        if (frequency_breaks_array == NULL) {
+            goto out;
+        }
+        if (num_frequency_breaks < 2) {
+            PyErr_SetString(PyExc_ValueError,
+                    "At least two frequency breaks are required");
+            goto out;
+        }
+        num_frequency_bins = num_frequency_breaks - 1;
+        frequency_breaks = PyArray_DATA(frequency_breaks_array);
+    }
+    dims[0] = (npy_intp) GSL_MAX(num_frequency_bins, 1);
+    dims[1] = (npy_intp) num_distance_bins;
+    r2_sum_array = (PyArrayObject *) PyArray_SimpleNew(2, dims, NPY_FLOAT64);
+    num_pairs_array = (PyArrayObject *) PyArray_SimpleNew(2, dims, NPY_UINT64);
+    if (r2_sum_array == NULL || num_pairs_array == NULL) {
+        goto out;
+    }
+    if (TreeSequence_begin_access(self->tree_sequence, 0) != 0) {
+        goto out;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    err = ld_calc_get_r2_decay(self->ld_calc, num_distance_bins,
+            PyArray_DATA(distance_breaks_array), num_frequency_bins,
+            frequency_breaks, (size_t) max_mutations, (size_t) num_threads,
+            PyArray_DATA(r2_sum_array), PyArray_DATA(num_pairs_array));
+    Py_END_ALLOW_THREADS
+    TreeSequence_end_access(self->tree_sequence, 0);
+    if (err != 0) {
+        handle_library_error(err);
+        goto out;
+    }
+    ret = Py_BuildValue("OO", r2_sum_array, num_pairs_array);
+out:
+    Py_XDECREF(distance_breaks_array);
+    Py_XDECREF(frequency_breaks_array);
+    Py_XDECREF(r2_sum_array);
+    Py_XDECREF(num_pairs_array);
+    return ret;
+}
+
+#endif
+
 static PyMemberDef LdCalculator_members[] = {
     {NULL}  /* Sentinel */
 };
@@ -5634,6 +6847,15 @@ static PyMethodDef LdCalculator_methods[] = {
     {"get_r2_array", (PyCFunction) LdCalculator_get_r2_array,
         METH_VARARGS|METH_KEYWORDS,
         "Returns r2 statistic for a given mutation over specified range"},
+#ifdef HAVE_NUMPY
+    {"get_r2_matrix", (PyCFunction) LdCalculator_get_r2_matrix,
+        METH_VARARGS|METH_KEYWORDS,
+        "Returns r2 between all pairs of mutations, computed in parallel"},
+    {"get_r2_decay", (PyCFunction) LdCalculator_get_r2_decay,
+        METH_VARARGS|METH_KEYWORDS,
+        "Returns the sums of r2 and numbers of pairs of mutations in bins of "
+        "distance and minor allele frequency"},
+#endif
     {NULL}  /* Sentinel */
 };
 
@@ -5689,6 +6911,8 @@ Simulator_check_sim(Simulator *self)
     if (self->sim == NULL) {
         PyErr_SetString(PyExc_SystemError, "simulator not initialised");
         ret = -1;
+    } else {
+        ret = check_not_in_use(self->in_use, "Simulator");
     }
     return ret;
 }
@@ -5806,9 +7030,10 @@ Simulator_parse_simulation_model(Simulator *self, PyObject *py_model)
     PyObject *smc_prime_s = NULL;
     PyObject *dirac_s = NULL;
     PyObject *beta_s = NULL;
+    PyObject *dtwf_s = NULL;
     PyObject *value;
-    int is_hudson, is_smc, is_smc_prime, is_dirac, is_beta;
-    double psi, c, alpha, truncation_point;
+    int is_hudson, is_smc, is_smc_prime, is_dirac, is_beta, is_dtwf;
+    double psi, c, alpha, truncation_point, population_size, num_generations;
 
     if (Simulator_check_sim(self) != 0) {
         goto out;
@@ -5833,6 +7058,10 @@ Simulator_parse_simulation_model(Simulator *self, PyObject *py_model)
     if (beta_s == NULL) {
         goto out;
     }
+    dtwf_s = Py_BuildValue("s", "dtwf");
+    if (dtwf_s == NULL) {
+        goto out;
+    }
     py_name = get_dict_value(py_model, "name");
     if (py_name == NULL) {
         goto out;
@@ -5911,7 +7140,34 @@ Simulator_parse_simulation_model(Simulator *self, PyObject *py_model)
         err = msp_set_simulation_model_beta(self->sim, alpha, truncation_point);
     }
 
-    if (! (is_hudson || is_smc || is_smc_prime || is_dirac || is_beta)) {
+    is_dtwf = PyObject_RichCompareBool(py_name, dtwf_s, Py_EQ);
+    if (is_dtwf == -1) {
+        goto out;
+    }
+    if (is_dtwf) {
+        value = get_dict_number(py_model, "population_size");
+        if (value == NULL) {
+            goto out;
+        }
+        population_size = PyFloat_AsDouble(value);
+        value = get_dict_number(py_model, "num_generations");
+        if (value == NULL) {
+            goto out;
+        }
+        num_generations = PyFloat_AsDouble(value);
+        if (population_size <= 0) {
+            PyErr_SetString(PyExc_ValueError, "population_size must be > 0");
+            goto out;
+        }
+        if (num_generations < 0) {
+            PyErr_SetString(PyExc_ValueError, "num_generations must be >= 0");
+            goto out;
+        }
+        err = msp_set_simulation_model_dtwf(self->sim, population_size,
+                num_generations);
+    }
+
+    if (! (is_hudson || is_smc || is_smc_prime || is_dirac || is_beta || is_dtwf)) {
         PyErr_SetString(PyExc_ValueError, "Unknown simulation model");
         goto out;
     }
@@ -5926,6 +7182,7 @@ out:
     Py_XDECREF(smc_prime_s);
     Py_XDECREF(beta_s);
     Py_XDECREF(dirac_s);
+    Py_XDECREF(dtwf_s);
     return ret;
 }
 
@@ -6178,6 +7435,7 @@ Simulator_init(Simulator *self, PyObject *args, PyObject *kwds)
 
     self->sim = NULL;
     self->random_generator = NULL;
+    self->in_use = 0;
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O!|kdO!O!O!O!nnnnnni", kwlist,
             &PyList_Type, &py_samples,
             &RandomGeneratorType, &random_generator,
@@ -6361,6 +7619,25 @@ Simulator_get_model(Simulator *self)
         }
         Py_DECREF(value);
         value = NULL;
+    } else if (model->type == MSP_MODEL_DTWF) {
+        value = Py_BuildValue("d", model->params.dtwf.population_size);
+        if (value == NULL) {
+            goto out;
+        }
+        if (PyDict_SetItemString(d, "population_size", value) != 0) {
+            goto out;
+        }
+        Py_DECREF(value);
+        value = NULL;
+        value = Py_BuildValue("d", model->params.dtwf.num_generations);
+        if (value == NULL) {
+            goto out;
+        }
+        if (PyDict_SetItemString(d, "num_generations", value) != 0) {
+            goto out;
+        }
+        Py_DECREF(value);
+        value = NULL;
     }
     ret = d;
     d = NULL;
@@ -6727,19 +8004,26 @@ out:
 }
 
 static PyObject *
-Simulator_individual_to_python(Simulator *self, segment_t *ind)
+Simulator_individual_to_python(Simulator *self, segment_id_t ind)
 {
     PyObject *ret = NULL;
     PyObject *l = NULL;
     PyObject *t = NULL;
     size_t num_segments, j;
-    segment_t *u;
+    segment_id_t u;
+    segment_t seg;
+    int err;
 
     num_segments = 0;
     u = ind;
-    while (u != NULL) {
+    while (u != MSP_NULL_SEGMENT) {
+        err = msp_get_segment(self->sim, u, &seg);
+        if (err != 0) {
+            handle_library_error(err);
+            goto out;
+        }
         num_segments++;
-        u = u->next;
+        u = seg.next;
     }
     l = PyList_New(num_segments);
     if (l == NULL) {
@@ -6747,16 +8031,22 @@ Simulator_individual_to_python(Simulator *self, segment_t *ind)
     }
     u = ind;
     j = 0;
-    while (u != NULL) {
-        t = Py_BuildValue("(I,I,I,I)", u->left, u->right, u->value,
-                u->population_id);
+    while (u != MSP_NULL_SEGMENT) {
+        err = msp_get_segment(self->sim, u, &seg);
+        if (err != 0) {
+            Py_DECREF(l);
+            handle_library_error(err);
+            goto out;
+        }
+        t = Py_BuildValue("(I,I,I,I)", seg.left, seg.right, seg.value,
+                seg.population_id);
         if (t == NULL) {
             Py_DECREF(l);
             goto out;
         }
         PyList_SET_ITEM(l, j, t);
         j++;
-        u = u->next;
+        u = seg.next;
     }
     ret = l;
 out:
@@ -6769,7 +8059,7 @@ Simulator_get_ancestors(Simulator *self)
     PyObject *ret = NULL;
     PyObject *l = NULL;
     PyObject *py_ind = NULL;
-    segment_t **ancestors = NULL;
+    segment_id_t *ancestors = NULL;
     size_t num_ancestors, j;
     int err;
 
@@ -6777,7 +8067,7 @@ Simulator_get_ancestors(Simulator *self)
         goto out;
     }
     num_ancestors = msp_get_num_ancestors(self->sim);
-    ancestors = PyMem_Malloc(num_ancestors * sizeof(segment_t *));
+    ancestors = PyMem_Malloc(num_ancestors * sizeof(segment_id_t));
     if (ancestors == NULL) {
         PyErr_NoMemory();
         goto out;
@@ -7041,20 +8331,24 @@ Simulator_run(Simulator *self, PyObject *args)
     if (!PyArg_ParseTuple(args, "|d", &max_time)) {
         goto out;
     }
+    self->in_use = 1;
     not_done = 1;
     while (not_done) {
         Py_BEGIN_ALLOW_THREADS
         status = msp_run(self->sim, max_time, chunk);
         Py_END_ALLOW_THREADS
         if (status < 0) {
+            self->in_use = 0;
             handle_library_error(status);
             goto out;
         }
         not_done = status == 1;
         if (PyErr_CheckSignals() < 0) {
+            self->in_use = 0;
             goto out;
         }
     }
+    self->in_use = 0;
     coalesced = status == 0;
     /* return True if complete coalescence has occured */
     ret = coalesced ? Py_True : Py_False;
@@ -7125,9 +8419,15 @@ Simulator_populate_tables(Simulator *self, PyObject *args, PyObject *kwds)
         }
         recomb_map = recombination_map->recomb_map;
     }
+    self->in_use = 1;
+    set_tables_in_use(nodes, edgesets, migrations, NULL, NULL, 1);
+    Py_BEGIN_ALLOW_THREADS
     err = msp_populate_tables(self->sim, Ne, recomb_map,
         nodes->node_table, edgesets->edgeset_table,
         migrations->migration_table);
+    Py_END_ALLOW_THREADS
+    set_tables_in_use(nodes, edgesets, migrations, NULL, NULL, 0);
+    self->in_use = 0;
     if (err != 0) {
         handle_library_error(err);
         goto out;
@@ -7426,6 +8726,8 @@ init_msprime(void)
 #else
     PyObject *module = Py_InitModule3("_msprime", msprime_methods, MODULE_DOC);
 #endif
+    hbool_t hdf5_threadsafe = 0;
+
     if (module == NULL) {
         INITERROR;
     }
@@ -7609,13 +8911,49 @@ init_msprime(void)
     /* Tree flags */
     PyModule_AddIntConstant(module, "LEAF_COUNTS", MSP_LEAF_COUNTS);
     PyModule_AddIntConstant(module, "LEAF_LISTS", MSP_LEAF_LISTS);
+    PyModule_AddIntConstant(module, "BRANCH_LENGTHS", MSP_BRANCH_LENGTHS);
     /* Directions */
     PyModule_AddIntConstant(module, "FORWARD", MSP_DIR_FORWARD);
     PyModule_AddIntConstant(module, "REVERSE", MSP_DIR_REVERSE);
+    /* LD statistics */
+    PyModule_AddIntConstant(module, "LD_STAT_R2", MSP_LD_STAT_R2);
+    PyModule_AddIntConstant(module, "LD_STAT_D", MSP_LD_STAT_D);
+    PyModule_AddIntConstant(module, "LD_STAT_D_PRIME", MSP_LD_STAT_D_PRIME);
+    PyModule_AddIntConstant(module, "LD_STAT_R", MSP_LD_STAT_R);
+    PyModule_AddIntConstant(module, "LD_STAT_R2_MULTIALLELIC",
+            MSP_LD_STAT_R2_MULTIALLELIC);
+    /* Branch statistics */
+    PyModule_AddIntConstant(module, "STAT_DIVERSITY", MSP_STAT_DIVERSITY);
+    PyModule_AddIntConstant(module, "STAT_DIVERGENCE", MSP_STAT_DIVERGENCE);
+    PyModule_AddIntConstant(module, "STAT_Y2", MSP_STAT_Y2);
+    PyModule_AddIntConstant(module, "STAT_Y3", MSP_STAT_Y3);
+    PyModule_AddIntConstant(module, "STAT_F2", MSP_STAT_F2);
+    PyModule_AddIntConstant(module, "STAT_F3", MSP_STAT_F3);
+    PyModule_AddIntConstant(module, "STAT_F4", MSP_STAT_F4);
+    PyModule_AddIntConstant(module, "SITE_STAT_DIVERSITY", MSP_SITE_STAT_DIVERSITY);
+    PyModule_AddIntConstant(module, "SITE_STAT_SEGREGATING_SITES",
+            MSP_SITE_STAT_SEGREGATING_SITES);
+    PyModule_AddIntConstant(module, "SITE_STAT_TAJIMAS_D", MSP_SITE_STAT_TAJIMAS_D);
 
     /* turn off GSL error handler so we don't abort on memory error */
     gsl_set_error_handler_off();
 
+    /* HDF5 is called with the GIL released, so unless the library is
+     * threadsafe we must make sure only one thread uses it at a time. */
+#ifdef H5_VERSION_GE
+#if H5_VERSION_GE(1, 8, 16)
+    if (H5is_library_threadsafe(&hdf5_threadsafe) < 0) {
+        hdf5_threadsafe = 0;
+    }
+#endif
+#endif
+    if (!hdf5_threadsafe) {
+        hdf5_lock = PyThread_allocate_lock();
+        if (hdf5_lock == NULL) {
+            INITERROR;
+        }
+    }
+
 #if PY_MAJOR_VERSION >= 3
     return module;
 #endif
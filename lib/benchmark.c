@@ -0,0 +1,952 @@
+/*
+** Copyright (C) 2017 University of Oxford
+**
+** This file is part of msprime.
+**
+** msprime is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** msprime is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with msprime.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Benchmarks for performance critical parts of the low-level msprime API.
+ * Run ./benchmark to run all benchmarks, or ./benchmark <name> to run
+ * a single one. Timings are written to stdout.
+ */
+
+#include "msprime.h"
+
+#include <float.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <gsl/gsl_rng.h>
+
+typedef struct {
+    const char *name;
+    void (*func)(void);
+} benchmark_t;
+
+static void
+fatal_library_error(int err, const char *msg)
+{
+    fprintf(stderr, "error: %s: %s\n", msg, msp_strerror(err));
+    exit(EXIT_FAILURE);
+}
+
+static double
+get_elapsed(clock_t start)
+{
+    return ((double) (clock() - start)) / CLOCKS_PER_SEC;
+}
+
+/* Runs a single locus island model with the specified number of demes and
+ * samples per deme, and returns the number of events processed. */
+static unsigned long
+run_island_model(gsl_rng *rng, uint32_t num_populations,
+        uint32_t samples_per_population, double migration_rate,
+        double *elapsed)
+{
+    int ret;
+    msp_t msp;
+    uint32_t j, k;
+    uint32_t n = num_populations * samples_per_population;
+    unsigned long num_events = 0;
+    sample_t *samples = malloc(n * sizeof(sample_t));
+    double *M = calloc(num_populations * num_populations, sizeof(double));
+    clock_t start;
+
+    if (samples == NULL || M == NULL) {
+        fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+    }
+    for (j = 0; j < n; j++) {
+        samples[j].population_id = (population_id_t) (j / samples_per_population);
+        samples[j].time = 0;
+    }
+    for (j = 0; j < num_populations; j++) {
+        for (k = 0; k < num_populations; k++) {
+            if (j != k) {
+                M[j * num_populations + k] = migration_rate / (num_populations - 1);
+            }
+        }
+    }
+    ret = msp_alloc(&msp, n, samples, rng);
+    if (ret != 0) {
+        fatal_library_error(ret, "msp_alloc");
+    }
+    ret = msp_set_num_populations(&msp, num_populations);
+    if (ret != 0) {
+        fatal_library_error(ret, "msp_set_num_populations");
+    }
+    ret = msp_set_migration_matrix(&msp, num_populations * num_populations, M);
+    if (ret != 0) {
+        fatal_library_error(ret, "msp_set_migration_matrix");
+    }
+    ret = msp_initialise(&msp);
+    if (ret != 0) {
+        fatal_library_error(ret, "msp_initialise");
+    }
+    start = clock();
+    while ((ret = msp_run(&msp, DBL_MAX, 1)) == 1) {
+        num_events++;
+    }
+    *elapsed = get_elapsed(start);
+    if (ret != 0) {
+        fatal_library_error(ret, "msp_run");
+    }
+    num_events++;
+    msp_free(&msp);
+    free(samples);
+    free(M);
+    return num_events;
+}
+
+static void
+benchmark_island_model_migration(void)
+{
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+    uint32_t num_populations[] = {2, 5, 10, 25, 50, 100, 200};
+    uint32_t j;
+    unsigned long num_events;
+    double elapsed;
+
+    printf("%10s\t%10s\t%10s\t%10s\n", "demes", "events", "time", "ns/event");
+    for (j = 0; j < sizeof(num_populations) / sizeof(uint32_t); j++) {
+        gsl_rng_set(rng, j + 1);
+        num_events = run_island_model(rng, num_populations[j], 10, 1.0,
+                &elapsed);
+        printf("%10d\t%10lu\t%10.3f\t%10.1f\n", (int) num_populations[j],
+                num_events, elapsed, 1e9 * elapsed / (double) num_events);
+    }
+    gsl_rng_free(rng);
+}
+
+/* Runs a large single population simulation with recombination, where
+ * the time is dominated by following segment chains. */
+static void
+benchmark_segment_chains(void)
+{
+    int ret;
+    msp_t msp;
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+    uint32_t j;
+    uint32_t n = 100000;
+    uint32_t num_loci = 100000000;
+    double rho[] = {100, 1000, 10000};
+    unsigned long num_events;
+    sample_t *samples = calloc(n, sizeof(sample_t));
+    clock_t start;
+    double elapsed;
+
+    if (samples == NULL || rng == NULL) {
+        fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+    }
+    printf("%10s\t%10s\t%10s\t%10s\t%10s\t%10s\n", "rho", "events", "time",
+            "ns/event", "seg_blocks", "memory(MiB)");
+    for (j = 0; j < sizeof(rho) / sizeof(double); j++) {
+        gsl_rng_set(rng, j + 1);
+        ret = msp_alloc(&msp, n, samples, rng);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_alloc");
+        }
+        ret = msp_set_num_loci(&msp, num_loci);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_set_num_loci");
+        }
+        /* rho is the scaled recombination rate over the whole sequence */
+        ret = msp_set_scaled_recombination_rate(&msp, rho[j] / (num_loci - 1));
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_set_scaled_recombination_rate");
+        }
+        ret = msp_set_max_memory(&msp, SIZE_MAX);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_set_max_memory");
+        }
+        ret = msp_initialise(&msp);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_initialise");
+        }
+        start = clock();
+        ret = msp_run(&msp, DBL_MAX, ULONG_MAX);
+        elapsed = get_elapsed(start);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_run");
+        }
+        num_events = msp_get_num_common_ancestor_events(&msp)
+            + msp_get_num_recombination_events(&msp);
+        printf("%10.0f\t%10lu\t%10.3f\t%10.1f\t%10d\t%10.1f\n", rho[j],
+                num_events, elapsed, 1e9 * elapsed / (double) num_events,
+                (int) msp_get_num_segment_blocks(&msp),
+                (double) msp_get_used_memory(&msp) / (1024.0 * 1024.0));
+        msp_free(&msp);
+    }
+    free(samples);
+    gsl_rng_free(rng);
+}
+
+/* Compares the Fenwick tree and sum tree links indexes, first on their own
+ * with a mix of increments and searches like that done during simulation,
+ * and then in simulations with high recombination rates.
+ */
+static void
+benchmark_links_index(void)
+{
+    int ret;
+    msp_t msp;
+    fenwick_t fenwick;
+    sum_tree_t sum_tree;
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+    uint32_t j, k, l;
+    uint32_t n = 1000;
+    uint32_t num_loci = 100000000;
+    double rho[] = {1000, 10000};
+    int links_index[] = {MSP_LINKS_FENWICK, MSP_LINKS_SUM_TREE};
+    const char *links_index_names[] = {"fenwick", "sum_tree"};
+    size_t sizes[] = {1000, 100000, 10000000};
+    size_t m, index, num_ops = 10000000;
+    int64_t total, cumulative, checksum;
+    unsigned long num_events;
+    sample_t *samples = calloc(n, sizeof(sample_t));
+    clock_t start;
+    double elapsed;
+
+    if (samples == NULL || rng == NULL) {
+        fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+    }
+    printf("%10s\t%10s\t%10s\t%10s\n", "index", "size", "ns/op", "checksum");
+    for (j = 0; j < sizeof(sizes) / sizeof(size_t); j++) {
+        m = sizes[j];
+        for (k = 0; k < 2; k++) {
+            gsl_rng_set(rng, 1);
+            if (k == 0) {
+                ret = fenwick_alloc(&fenwick, m);
+            } else {
+                ret = sum_tree_alloc(&sum_tree, m);
+            }
+            if (ret != 0) {
+                fatal_library_error(ret, "alloc");
+            }
+            checksum = 0;
+            start = clock();
+            for (index = 1; index <= m; index++) {
+                if (k == 0) {
+                    fenwick_set_value(&fenwick, index, 1000);
+                } else {
+                    sum_tree_set_value(&sum_tree, index, 1000);
+                }
+            }
+            /* Each search is followed by a few nearby updates, as happens
+             * when a segment is split by a recombination. */
+            for (l = 0; l < num_ops / 4; l++) {
+                if (k == 0) {
+                    total = fenwick_get_total(&fenwick);
+                    index = fenwick_find_with_sum(&fenwick,
+                            1 + (int64_t) gsl_rng_uniform_int(rng, (unsigned long) total),
+                            &cumulative);
+                } else {
+                    total = sum_tree_get_total(&sum_tree);
+                    index = sum_tree_find_with_sum(&sum_tree,
+                            1 + (int64_t) gsl_rng_uniform_int(rng, (unsigned long) total),
+                            &cumulative);
+                }
+                checksum += cumulative;
+                if (index < m) {
+                    if (k == 0) {
+                        fenwick_increment(&fenwick, index, -1);
+                        fenwick_increment(&fenwick, index + 1, 1);
+                    } else {
+                        sum_tree_increment(&sum_tree, index, -1);
+                        sum_tree_increment(&sum_tree, index + 1, 1);
+                    }
+                }
+            }
+            elapsed = get_elapsed(start);
+            printf("%10s\t%10d\t%10.1f\t%10" PRId64 "\n", links_index_names[k],
+                    (int) m, 1e9 * elapsed / (double) (m + num_ops), checksum);
+            if (k == 0) {
+                fenwick_free(&fenwick);
+            } else {
+                sum_tree_free(&sum_tree);
+            }
+        }
+    }
+
+    printf("%10s\t%10s\t%10s\t%10s\t%10s\n", "index", "rho", "events", "time",
+            "ns/event");
+    for (j = 0; j < sizeof(rho) / sizeof(double); j++) {
+        for (k = 0; k < 2; k++) {
+            gsl_rng_set(rng, j + 1);
+            ret = msp_alloc(&msp, n, samples, rng);
+            if (ret != 0) {
+                fatal_library_error(ret, "msp_alloc");
+            }
+            ret = msp_set_links_index(&msp, links_index[k]);
+            if (ret != 0) {
+                fatal_library_error(ret, "msp_set_links_index");
+            }
+            ret = msp_set_num_loci(&msp, num_loci);
+            if (ret != 0) {
+                fatal_library_error(ret, "msp_set_num_loci");
+            }
+            ret = msp_set_scaled_recombination_rate(&msp, rho[j] / (num_loci - 1));
+            if (ret != 0) {
+                fatal_library_error(ret, "msp_set_scaled_recombination_rate");
+            }
+            ret = msp_set_max_memory(&msp, SIZE_MAX);
+            if (ret != 0) {
+                fatal_library_error(ret, "msp_set_max_memory");
+            }
+            ret = msp_initialise(&msp);
+            if (ret != 0) {
+                fatal_library_error(ret, "msp_initialise");
+            }
+            start = clock();
+            ret = msp_run(&msp, DBL_MAX, ULONG_MAX);
+            elapsed = get_elapsed(start);
+            if (ret != 0) {
+                fatal_library_error(ret, "msp_run");
+            }
+            num_events = msp_get_num_common_ancestor_events(&msp)
+                + msp_get_num_recombination_events(&msp);
+            printf("%10s\t%10.0f\t%10lu\t%10.3f\t%10.1f\n", links_index_names[k],
+                    rho[j], num_events, elapsed,
+                    1e9 * elapsed / (double) num_events);
+            msp_free(&msp);
+        }
+    }
+    free(samples);
+    gsl_rng_free(rng);
+}
+
+/* Compares the radix sort and qsort index builders on simulated tree
+ * sequences, with integer coordinates and with continuous coordinates
+ * from a recombination map.
+ */
+static void
+benchmark_build_indexes(void)
+{
+    int ret;
+    msp_t msp;
+    recomb_map_t recomb_map;
+    tree_sequence_t ts;
+    node_table_t nodes;
+    edgeset_table_t edgesets;
+    migration_table_t migrations;
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+    uint32_t j, k, l, m;
+    uint32_t n = 1000;
+    uint32_t num_loci = 100000000;
+    uint32_t num_repeats = 5;
+    double rho[] = {1000, 10000};
+    double positions[] = {0, 1};
+    double rates[] = {0, 0};
+    int flags[] = {MSP_INDEX_QSORT, 0};
+    const char *flag_names[] = {"qsort", "radix"};
+    const char *coordinate_names[] = {"integer", "continuous"};
+    sample_t *samples = calloc(n, sizeof(sample_t));
+    clock_t start;
+    double elapsed;
+
+    if (samples == NULL || rng == NULL) {
+        fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+    }
+    if (node_table_alloc(&nodes, 1024, 1024) != 0
+            || edgeset_table_alloc(&edgesets, 1024, 1024) != 0
+            || migration_table_alloc(&migrations, 1024) != 0
+            || tree_sequence_initialise(&ts) != 0) {
+        fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+    }
+    printf("%10s\t%10s\t%10s\t%10s\t%10s\n", "sort", "coords", "edgesets",
+            "time", "ns/edgeset");
+    for (j = 0; j < sizeof(rho) / sizeof(double); j++) {
+        gsl_rng_set(rng, j + 1);
+        ret = msp_alloc(&msp, n, samples, rng);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_alloc");
+        }
+        ret = msp_set_num_loci(&msp, num_loci);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_set_num_loci");
+        }
+        ret = msp_set_scaled_recombination_rate(&msp, rho[j] / (num_loci - 1));
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_set_scaled_recombination_rate");
+        }
+        ret = msp_set_max_memory(&msp, SIZE_MAX);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_set_max_memory");
+        }
+        ret = msp_initialise(&msp);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_initialise");
+        }
+        ret = msp_run(&msp, DBL_MAX, ULONG_MAX);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_run");
+        }
+        rates[0] = rho[j];
+        ret = recomb_map_alloc(&recomb_map, num_loci, 1.0, positions, rates, 2);
+        if (ret != 0) {
+            fatal_library_error(ret, "recomb_map_alloc");
+        }
+        for (k = 0; k < 2; k++) {
+            ret = msp_populate_tables(&msp, 0.25, k == 0 ? NULL : &recomb_map,
+                    &nodes, &edgesets, &migrations);
+            if (ret != 0) {
+                fatal_library_error(ret, "msp_populate_tables");
+            }
+            ret = tree_sequence_take_tables_tmp(&ts, &nodes, &edgesets, &migrations,
+                    NULL, NULL, 0, NULL);
+            if (ret != 0) {
+                fatal_library_error(ret, "tree_sequence_take_tables_tmp");
+            }
+            for (l = 0; l < 2; l++) {
+                start = clock();
+                for (m = 0; m < num_repeats; m++) {
+                    ret = tree_sequence_build_indexes(&ts, flags[l]);
+                    if (ret != 0) {
+                        fatal_library_error(ret, "tree_sequence_build_indexes");
+                    }
+                }
+                elapsed = get_elapsed(start) / num_repeats;
+                printf("%10s\t%10s\t%10d\t%10.3f\t%10.1f\n", flag_names[l],
+                        coordinate_names[k],
+                        (int) tree_sequence_get_num_edgesets(&ts), elapsed,
+                        1e9 * elapsed / (double) tree_sequence_get_num_edgesets(&ts));
+            }
+        }
+        recomb_map_free(&recomb_map);
+        msp_free(&msp);
+    }
+    tree_sequence_free(&ts);
+    node_table_free(&nodes);
+    edgeset_table_free(&edgesets);
+    migration_table_free(&migrations);
+    free(samples);
+    gsl_rng_free(rng);
+}
+
+static void
+benchmark_simplify(void)
+{
+    int ret;
+    msp_t msp;
+    tree_sequence_t ts, subset;
+    simplifier_t simplifier;
+    node_table_t nodes;
+    edgeset_table_t edgesets;
+    migration_table_t migrations;
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+    uint32_t j, k, l;
+    uint32_t n = 10000;
+    uint32_t num_loci = 100000000;
+    double rho[] = {1000, 20000};
+    uint32_t subset_sizes[] = {10, 100, 1000};
+    int flags[] = {MSP_SIMPLIFY_TREE_DIFFS, 0, 0};
+    const char *flag_names[] = {"tree_diffs", "segments", "reused"};
+    sample_t *samples = calloc(n, sizeof(sample_t));
+    node_id_t *sample_ids;
+    clock_t start;
+    double elapsed;
+
+    if (samples == NULL || rng == NULL) {
+        fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+    }
+    if (node_table_alloc(&nodes, 1024, 1024) != 0
+            || edgeset_table_alloc(&edgesets, 1024, 1024) != 0
+            || migration_table_alloc(&migrations, 1024) != 0
+            || tree_sequence_initialise(&ts) != 0
+            || tree_sequence_initialise(&subset) != 0
+            || simplifier_alloc(&simplifier, 0) != 0) {
+        fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+    }
+    printf("%10s\t%10s\t%10s\t%10s\t%10s\n", "engine", "edgesets", "subset",
+            "output", "time");
+    for (j = 0; j < sizeof(rho) / sizeof(double); j++) {
+        gsl_rng_set(rng, j + 1);
+        ret = msp_alloc(&msp, n, samples, rng);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_alloc");
+        }
+        ret = msp_set_num_loci(&msp, num_loci);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_set_num_loci");
+        }
+        ret = msp_set_scaled_recombination_rate(&msp, rho[j] / (num_loci - 1));
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_set_scaled_recombination_rate");
+        }
+        ret = msp_set_max_memory(&msp, SIZE_MAX);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_set_max_memory");
+        }
+        ret = msp_initialise(&msp);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_initialise");
+        }
+        ret = msp_run(&msp, DBL_MAX, ULONG_MAX);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_run");
+        }
+        ret = msp_populate_tables(&msp, 0.25, NULL, &nodes, &edgesets, &migrations);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_populate_tables");
+        }
+        ret = tree_sequence_take_tables_tmp(&ts, &nodes, &edgesets, &migrations,
+                NULL, NULL, 0, NULL);
+        if (ret != 0) {
+            fatal_library_error(ret, "tree_sequence_take_tables_tmp");
+        }
+        ret = tree_sequence_get_samples(&ts, &sample_ids);
+        if (ret != 0) {
+            fatal_library_error(ret, "tree_sequence_get_samples");
+        }
+        for (k = 0; k < sizeof(subset_sizes) / sizeof(uint32_t); k++) {
+            for (l = 0; l < 3; l++) {
+                start = clock();
+                if (l < 2) {
+                    ret = tree_sequence_simplify(&ts, sample_ids, subset_sizes[k],
+                            flags[l], &subset);
+                } else {
+                    /* Except for the first subset, the simplifier's arenas
+                     * are already large enough and nothing is allocated. */
+                    ret = simplifier_run(&simplifier, &ts, sample_ids,
+                            subset_sizes[k], &subset);
+                }
+                if (ret != 0) {
+                    fatal_library_error(ret, "tree_sequence_simplify");
+                }
+                elapsed = get_elapsed(start);
+                printf("%10s\t%10d\t%10d\t%10d\t%10.3f\n", flag_names[l],
+                        (int) tree_sequence_get_num_edgesets(&ts),
+                        (int) subset_sizes[k],
+                        (int) tree_sequence_get_num_edgesets(&subset), elapsed);
+            }
+        }
+        msp_free(&msp);
+    }
+    tree_sequence_free(&ts);
+    tree_sequence_free(&subset);
+    simplifier_free(&simplifier);
+    node_table_free(&nodes);
+    edgeset_table_free(&edgesets);
+    migration_table_free(&migrations);
+    free(samples);
+    gsl_rng_free(rng);
+}
+
+/* Times repeated calls to sparse_tree_first() and sparse_tree_seek() on
+ * tree sequences with increasing numbers of nodes, but trees of the same
+ * size. Resetting the tree only clears the nodes of the trees visited, so
+ * the time per call should not grow with the number of nodes. */
+static void
+benchmark_sparse_tree_reset(void)
+{
+    int ret;
+    msp_t msp;
+    tree_sequence_t ts;
+    sparse_tree_t tree;
+    node_table_t nodes;
+    edgeset_table_t edgesets;
+    migration_table_t migrations;
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+    uint32_t j, k;
+    uint32_t n = 1000;
+    uint32_t num_loci = 100000000;
+    uint32_t num_calls = 1000;
+    double rho[] = {10, 100, 1000, 10000};
+    sample_t *samples = calloc(n, sizeof(sample_t));
+    double L, elapsed[2];
+    clock_t start;
+
+    if (samples == NULL || rng == NULL) {
+        fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+    }
+    if (node_table_alloc(&nodes, 1024, 1024) != 0
+            || edgeset_table_alloc(&edgesets, 1024, 1024) != 0
+            || migration_table_alloc(&migrations, 1024) != 0
+            || tree_sequence_initialise(&ts) != 0) {
+        fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+    }
+    printf("%10s\t%10s\t%10s\t%10s\n", "nodes", "trees", "first_us", "seek_us");
+    for (j = 0; j < sizeof(rho) / sizeof(double); j++) {
+        gsl_rng_set(rng, j + 1);
+        ret = msp_alloc(&msp, n, samples, rng);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_alloc");
+        }
+        ret = msp_set_num_loci(&msp, num_loci);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_set_num_loci");
+        }
+        ret = msp_set_scaled_recombination_rate(&msp, rho[j] / (num_loci - 1));
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_set_scaled_recombination_rate");
+        }
+        ret = msp_set_max_memory(&msp, SIZE_MAX);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_set_max_memory");
+        }
+        ret = msp_initialise(&msp);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_initialise");
+        }
+        ret = msp_run(&msp, DBL_MAX, ULONG_MAX);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_run");
+        }
+        ret = msp_populate_tables(&msp, 0.25, NULL, &nodes, &edgesets, &migrations);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_populate_tables");
+        }
+        ret = tree_sequence_take_tables_tmp(&ts, &nodes, &edgesets, &migrations,
+                NULL, NULL, 0, NULL);
+        if (ret != 0) {
+            fatal_library_error(ret, "tree_sequence_take_tables_tmp");
+        }
+        ret = sparse_tree_alloc(&tree, &ts, MSP_LEAF_COUNTS);
+        if (ret != 0) {
+            fatal_library_error(ret, "sparse_tree_alloc");
+        }
+        start = clock();
+        for (k = 0; k < num_calls; k++) {
+            ret = sparse_tree_first(&tree);
+            if (ret < 0) {
+                fatal_library_error(ret, "sparse_tree_first");
+            }
+        }
+        elapsed[0] = get_elapsed(start);
+        L = tree_sequence_get_sequence_length(&ts);
+        start = clock();
+        for (k = 0; k < num_calls; k++) {
+            /* Visit well separated trees so that each seek touches new nodes */
+            ret = sparse_tree_seek(&tree, L * (double) ((k * 7919) % num_calls)
+                    / num_calls);
+            if (ret < 0) {
+                fatal_library_error(ret, "sparse_tree_seek");
+            }
+        }
+        elapsed[1] = get_elapsed(start);
+        printf("%10d\t%10d\t%10.1f\t%10.1f\n", (int) tree_sequence_get_num_nodes(&ts),
+                (int) tree_sequence_get_num_trees(&ts), 1e6 * elapsed[0] / num_calls,
+                1e6 * elapsed[1] / num_calls);
+        sparse_tree_free(&tree);
+        msp_free(&msp);
+    }
+    tree_sequence_free(&ts);
+    node_table_free(&nodes);
+    edgeset_table_free(&edgesets);
+    migration_table_free(&migrations);
+    free(samples);
+    gsl_rng_free(rng);
+}
+
+/* Times windowed r2 calculations using the trees directly and using the
+ * cached bitsets of the samples carrying each mutation, for increasing
+ * sample sizes. Each focal site is compared with the following window
+ * sites, as in a sliding window LD scan. */
+static void
+benchmark_ld_bitsets(void)
+{
+    int ret;
+    msp_t msp;
+    mutgen_t mutgen;
+    tree_sequence_t ts;
+    ld_calc_t ld_calc;
+    node_table_t nodes;
+    edgeset_table_t edgesets;
+    migration_table_t migrations;
+    site_table_t sites;
+    mutation_table_t mutations;
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+    uint32_t sample_sizes[] = {100, 1000, 2500, 5000, 10000};
+    uint32_t num_loci = 1000000;
+    size_t max_focal_sites = 2000;
+    size_t window = 1000;
+    size_t j, k, l, m, num_r2, num_pairs;
+    sample_t *samples = NULL;
+    double *r2 = malloc(window * sizeof(double));
+    double elapsed[2];
+    clock_t start;
+
+    if (rng == NULL || r2 == NULL) {
+        fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+    }
+    if (node_table_alloc(&nodes, 1024, 1024) != 0
+            || edgeset_table_alloc(&edgesets, 1024, 1024) != 0
+            || migration_table_alloc(&migrations, 1024) != 0
+            || site_table_alloc(&sites, 1024, 1024) != 0
+            || mutation_table_alloc(&mutations, 1024, 1024) != 0
+            || tree_sequence_initialise(&ts) != 0) {
+        fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+    }
+    printf("%10s\t%10s\t%10s\t%10s\t%10s\n", "n", "sites", "pairs", "trees",
+            "bitsets");
+    for (j = 0; j < sizeof(sample_sizes) / sizeof(uint32_t); j++) {
+        gsl_rng_set(rng, j + 1);
+        samples = calloc(sample_sizes[j], sizeof(sample_t));
+        if (samples == NULL) {
+            fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+        }
+        ret = msp_alloc(&msp, sample_sizes[j], samples, rng);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_alloc");
+        }
+        ret = msp_set_num_loci(&msp, num_loci);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_set_num_loci");
+        }
+        ret = msp_set_scaled_recombination_rate(&msp, 100.0 / (num_loci - 1));
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_set_scaled_recombination_rate");
+        }
+        ret = msp_initialise(&msp);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_initialise");
+        }
+        ret = msp_run(&msp, DBL_MAX, ULONG_MAX);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_run");
+        }
+        ret = msp_populate_tables(&msp, 0.25, NULL, &nodes, &edgesets, &migrations);
+        if (ret != 0) {
+            fatal_library_error(ret, "msp_populate_tables");
+        }
+        ret = mutgen_alloc(&mutgen, 4000.0 / num_loci, rng, MSP_ALPHABET_BINARY, 1024);
+        if (ret != 0) {
+            fatal_library_error(ret, "mutgen_alloc");
+        }
+        ret = mutgen_generate_tables_tmp(&mutgen, &nodes, &edgesets);
+        if (ret != 0) {
+            fatal_library_error(ret, "mutgen_generate_tables_tmp");
+        }
+        ret = mutgen_populate_tables(&mutgen, &sites, &mutations);
+        if (ret != 0) {
+            fatal_library_error(ret, "mutgen_populate_tables");
+        }
+        ret = tree_sequence_take_tables_tmp(&ts, &nodes, &edgesets, &migrations,
+                &sites, &mutations, 0, NULL);
+        if (ret != 0) {
+            fatal_library_error(ret, "tree_sequence_take_tables_tmp");
+        }
+        m = GSL_MIN(max_focal_sites, tree_sequence_get_num_sites(&ts));
+        num_pairs = 0;
+        for (k = 0; k < 2; k++) {
+            ret = ld_calc_alloc(&ld_calc, &ts);
+            if (ret != 0) {
+                fatal_library_error(ret, "ld_calc_alloc");
+            }
+            ret = ld_calc_set_max_bitset_sites(&ld_calc,
+                    k == 0? 0: MSP_LD_DEFAULT_MAX_BITSET_SITES);
+            if (ret != 0) {
+                fatal_library_error(ret, "ld_calc_set_max_bitset_sites");
+            }
+            num_pairs = 0;
+            start = clock();
+            for (l = 0; l < m; l++) {
+                ret = ld_calc_get_r2_array(&ld_calc, l, MSP_DIR_FORWARD, window,
+                        DBL_MAX, MSP_LD_STAT_R2, r2, &num_r2);
+                if (ret != 0) {
+                    fatal_library_error(ret, "ld_calc_get_r2_array");
+                }
+                num_pairs += num_r2;
+            }
+            elapsed[k] = get_elapsed(start);
+            ld_calc_free(&ld_calc);
+        }
+        printf("%10d\t%10d\t%10d\t%10.3f\t%10.3f\n", (int) sample_sizes[j], (int) m,
+                (int) num_pairs, elapsed[0], elapsed[1]);
+        mutgen_free(&mutgen);
+        msp_free(&msp);
+        free(samples);
+    }
+    tree_sequence_free(&ts);
+    node_table_free(&nodes);
+    edgeset_table_free(&edgesets);
+    migration_table_free(&migrations);
+    site_table_free(&sites);
+    mutation_table_free(&mutations);
+    free(r2);
+    gsl_rng_free(rng);
+}
+
+/* Runs a haploid Wright-Fisher simulation in which each birth involves a
+ * recombination with the specified probability, simplifying the tables
+ * every simplify_interval generations, and returns the total time spent
+ * simplifying. If incremental is false, the simplifier is reset
+ * before each call, so that the retained rows are processed from scratch. */
+static double
+run_forward_simplify(gsl_rng *rng, size_t N, double recombination_probability,
+        uint32_t num_generations, uint32_t simplify_interval, bool incremental,
+        size_t *num_edgesets)
+{
+    int ret;
+    simplifier_t simplifier;
+    node_table_t nodes;
+    edgeset_table_t edgesets;
+    node_id_t *alive = malloc(N * sizeof(node_id_t));
+    node_id_t *parents = malloc(N * sizeof(node_id_t));
+    node_id_t *node_map = NULL;
+    node_id_t u;
+    size_t j, a, b;
+    uint32_t g;
+    double x;
+    clock_t start;
+    double elapsed = 0;
+
+    if (alive == NULL || parents == NULL
+            || node_table_alloc(&nodes, 1024, 1024) != 0
+            || edgeset_table_alloc(&edgesets, 1024, 1024) != 0
+            || simplifier_alloc(&simplifier, 0) != 0) {
+        fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+    }
+    for (j = 0; j < N; j++) {
+        ret = node_table_add_row(&nodes, MSP_NODE_IS_SAMPLE, num_generations, 0, "");
+        if (ret != 0) {
+            fatal_library_error(ret, "node_table_add_row");
+        }
+        alive[j] = (node_id_t) j;
+    }
+    for (g = 1; g <= num_generations; g++) {
+        memcpy(parents, alive, N * sizeof(node_id_t));
+        for (j = 0; j < N; j++) {
+            u = (node_id_t) nodes.num_rows;
+            ret = node_table_add_row(&nodes, MSP_NODE_IS_SAMPLE, num_generations - g,
+                    0, "");
+            if (ret != 0) {
+                fatal_library_error(ret, "node_table_add_row");
+            }
+            a = gsl_rng_uniform_int(rng, N);
+            b = gsl_rng_uniform_int(rng, N);
+            x = 1.0;
+            if (a != b && gsl_rng_uniform(rng) < recombination_probability) {
+                x = gsl_rng_uniform_pos(rng);
+            }
+            ret = edgeset_table_add_row(&edgesets, 0, x, parents[a], &u, 1);
+            if (ret == 0 && x < 1.0) {
+                ret = edgeset_table_add_row(&edgesets, x, 1, parents[b], &u, 1);
+            }
+            if (ret != 0) {
+                fatal_library_error(ret, "edgeset_table_add_row");
+            }
+            alive[j] = u;
+        }
+        if (g % simplify_interval == 0) {
+            node_map = realloc(node_map, nodes.num_rows * sizeof(node_id_t));
+            if (node_map == NULL) {
+                fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+            }
+            start = clock();
+            ret = 0;
+            if (!incremental) {
+                ret = simplifier_reset(&simplifier);
+            }
+            if (ret == 0) {
+                ret = simplifier_simplify_tables(&simplifier, alive, N, 1.0, &nodes,
+                        &edgesets, node_map);
+            }
+            if (ret != 0) {
+                fatal_library_error(ret, "simplifier_simplify_tables");
+            }
+            elapsed += get_elapsed(start);
+            for (j = 0; j < N; j++) {
+                alive[j] = node_map[alive[j]];
+            }
+        }
+    }
+    *num_edgesets = edgesets.num_rows;
+    simplifier_free(&simplifier);
+    node_table_free(&nodes);
+    edgeset_table_free(&edgesets);
+    free(alive);
+    free(parents);
+    free(node_map);
+    return elapsed;
+}
+
+static void
+benchmark_forward_simplify(void)
+{
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+    size_t N = 1000;
+    uint32_t num_generations = 500;
+    double recombination_probability[] = {0.01, 1.0};
+    uint32_t intervals[] = {1, 10, 100};
+    size_t j, k, num_edgesets;
+    double elapsed[2];
+
+    if (rng == NULL) {
+        fatal_library_error(MSP_ERR_NO_MEMORY, "alloc");
+    }
+    printf("%10s\t%10s\t%10s\t%10s\t%10s\n", "rec_prob", "interval", "edgesets",
+            "scratch", "incremental");
+    for (j = 0; j < sizeof(recombination_probability) / sizeof(double); j++) {
+        for (k = 0; k < sizeof(intervals) / sizeof(uint32_t); k++) {
+            /* Both runs make the same random choices */
+            gsl_rng_set(rng, 1);
+            elapsed[0] = run_forward_simplify(rng, N, recombination_probability[j],
+                    num_generations, intervals[k], false, &num_edgesets);
+            gsl_rng_set(rng, 1);
+            elapsed[1] = run_forward_simplify(rng, N, recombination_probability[j],
+                    num_generations, intervals[k], true, &num_edgesets);
+            printf("%10.2f\t%10d\t%10d\t%10.3f\t%10.3f\n",
+                    recombination_probability[j], (int) intervals[k],
+                    (int) num_edgesets, elapsed[0], elapsed[1]);
+        }
+    }
+    gsl_rng_free(rng);
+}
+
+int
+main(int argc, char **argv)
+{
+    int ret = EXIT_SUCCESS;
+    size_t j;
+    benchmark_t benchmarks[] = {
+        {"island_model_migration", benchmark_island_model_migration},
+        {"segment_chains", benchmark_segment_chains},
+        {"links_index", benchmark_links_index},
+        {"build_indexes", benchmark_build_indexes},
+        {"simplify", benchmark_simplify},
+        {"forward_simplify", benchmark_forward_simplify},
+        {"sparse_tree_reset", benchmark_sparse_tree_reset},
+        {"ld_bitsets", benchmark_ld_bitsets},
+        {NULL, NULL},
+    };
+
+    if (argc == 1) {
+        for (j = 0; benchmarks[j].name != NULL; j++) {
+            printf("== %s\n", benchmarks[j].name);
+            benchmarks[j].func();
+        }
+    } else if (argc == 2) {
+        for (j = 0; benchmarks[j].name != NULL; j++) {
+            if (strcmp(argv[1], benchmarks[j].name) == 0) {
+                break;
+            }
+        }
+        if (benchmarks[j].name == NULL) {
+            printf("Benchmark '%s' not found\n", argv[1]);
+            ret = EXIT_FAILURE;
+        } else {
+            benchmarks[j].func();
+        }
+    } else {
+        printf("usage: ./benchmark <benchmark_name>\n");
+        ret = EXIT_FAILURE;
+    }
+    return ret;
+}
@@ -92,5 +92,7 @@
 #define MSP_ERR_UNSORTED_MUTATIONS                                  -62
 #define MSP_ERR_UNDEFINED_MULTIPLE_MERGER_COALESCENT                -63
 #define MSP_ERR_NODE_SAMPLE_INTERNAL                                -64
+#define MSP_ERR_BAD_WINDOWS                                         -65
+#define MSP_ERR_THREAD                                              -66
 
 #endif /*__ERR_H__*/
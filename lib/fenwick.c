@@ -178,8 +178,12 @@ fenwick_get_value(fenwick_t *self, size_t index)
 }
 
 
+/* Returns the smallest index such that the cumulative sum up to and
+ * including it is >= sum, and stores this cumulative sum. This saves
+ * a separate call to fenwick_get_cumulative_sum.
+ */
 size_t
-fenwick_find(fenwick_t *self, int64_t sum)
+fenwick_find_with_sum(fenwick_t *self, int64_t sum, int64_t *cumulative_sum)
 {
     size_t j = 0;
     size_t k;
@@ -198,5 +202,16 @@ fenwick_find(fenwick_t *self, int64_t sum)
         }
         half >>= 1;
     }
+    assert(j < self->size);
+    /* s is now sum minus the cumulative sum up to j */
+    *cumulative_sum = sum - s + self->values[j + 1];
     return j + 1;
 }
+
+size_t
+fenwick_find(fenwick_t *self, int64_t sum)
+{
+    int64_t cumulative_sum;
+
+    return fenwick_find_with_sum(self, sum, &cumulative_sum);
+}
@@ -40,6 +40,7 @@ void fenwick_set_value(fenwick_t *, size_t, int64_t);
 int64_t fenwick_get_cumulative_sum(fenwick_t *, size_t);
 int64_t fenwick_get_value(fenwick_t *, size_t);
 size_t fenwick_find(fenwick_t *, int64_t);
+size_t fenwick_find_with_sum(fenwick_t *, int64_t, int64_t *);
 size_t fenwick_get_size(fenwick_t *);
 
 #endif /*__FENWICK_H__*/
@@ -16,10 +16,12 @@
 ** You should have received a copy of the GNU General Public License
 ** along with msprime.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <float.h>
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <gsl/gsl_math.h>
 
@@ -54,9 +56,61 @@ ld_calc_print_state(ld_calc_t *self, FILE *out)
     fprintf(out, "inner tree index = %d\n", (int) self->inner_tree->index);
     fprintf(out, "inner tree interval = (%f, %f)\n",
             self->inner_tree->left, self->inner_tree->right);
+    fprintf(out, "max_bitset_sites = %d\n", (int) self->max_bitset_sites);
+    fprintf(out, "bitset_words = %d\n", (int) self->bitset_words);
     ld_calc_check_state(self);
 }
 
+static inline uint32_t
+ld_popcount(uint64_t x)
+{
+#ifdef __GNUC__
+    return (uint32_t) __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (uint32_t) ((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/* Returns the number of samples in both of the specified bitsets. This is
+ * written as a simple loop so that the compiler can vectorise it where
+ * hardware popcount instructions are available. */
+static inline node_id_t
+ld_bitset_overlap(const uint64_t *restrict a, const uint64_t *restrict b,
+        size_t num_words)
+{
+    size_t j;
+    uint32_t count = 0;
+
+    for (j = 0; j < num_words; j++) {
+        count += ld_popcount(a[j] & b[j]);
+    }
+    return (node_id_t) count;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LD_POPCNT_DISPATCH
+/* Generic x86 builds do not assume the popcnt instruction, so
+ * __builtin_popcountll becomes a library call. We compile a second copy of
+ * the overlap loop for CPUs that have it and choose between them in
+ * ld_calc_alloc(). */
+__attribute__((target("popcnt")))
+static node_id_t
+ld_bitset_overlap_popcnt(const uint64_t *restrict a, const uint64_t *restrict b,
+        size_t num_words)
+{
+    size_t j;
+    uint64_t count = 0;
+
+    for (j = 0; j < num_words; j++) {
+        count += (uint64_t) __builtin_popcountll(a[j] & b[j]);
+    }
+    return (node_id_t) count;
+}
+#endif
+
 int WARN_UNUSED
 ld_calc_alloc(ld_calc_t *self, tree_sequence_t *tree_sequence)
 {
@@ -64,7 +118,24 @@ ld_calc_alloc(ld_calc_t *self, tree_sequence_t *tree_sequence)
 
     memset(self, 0, sizeof(ld_calc_t));
     self->tree_sequence = tree_sequence;
+    self->allele_site = -1;
+    self->bitset_overlap = ld_bitset_overlap;
+#ifdef LD_POPCNT_DISPATCH
+    if (__builtin_cpu_supports("popcnt")) {
+        self->bitset_overlap = ld_bitset_overlap_popcnt;
+    }
+#endif
     self->num_sites = tree_sequence_get_num_sites(tree_sequence);
+    self->bitset_words = (tree_sequence_get_sample_size(tree_sequence) + 63) / 64;
+    if (self->bitset_words > 0
+            && self->bitset_words <= MSP_LD_MAX_DEFAULT_BITSET_WORDS) {
+        self->max_bitset_sites = GSL_MIN(MSP_LD_DEFAULT_MAX_BITSET_SITES,
+                MSP_LD_MAX_BITSET_MEMORY / (self->bitset_words * sizeof(uint64_t)));
+    }
+    ret = tree_sequence_get_sample_index_map(tree_sequence, &self->sample_index_map);
+    if (ret != 0) {
+        goto out;
+    }
     self->outer_tree = malloc(sizeof(sparse_tree_t));
     self->inner_tree = malloc(sizeof(sparse_tree_t));
     if (self->outer_tree == NULL || self->inner_tree == NULL) {
@@ -94,9 +165,25 @@ out:
     return ret;
 }
 
+static void
+ld_calc_free_bitsets(ld_calc_t *self)
+{
+    msp_safe_free(self->bitsets);
+    msp_safe_free(self->bitset_site);
+    msp_safe_free(self->bitset_count);
+}
+
 int
 ld_calc_free(ld_calc_t *self)
 {
+    ld_calc_free_bitsets(self);
+    if (self->site_tree != NULL) {
+        sparse_tree_free(self->site_tree);
+        free(self->site_tree);
+    }
+    msp_safe_free(self->sample_alleles);
+    msp_safe_free(self->mutation_alleles);
+    msp_safe_free(self->allele_counts);
     if (self->inner_tree != NULL) {
         sparse_tree_free(self->inner_tree);
         free(self->inner_tree);
@@ -199,15 +286,449 @@ out:
     return ret;
 }
 
+/* Sets the maximum number of sites for which bitsets are cached. Windowed
+ * queries spanning more sites than this use the trees directly, so 0
+ * disables the bitset path. */
+int WARN_UNUSED
+ld_calc_set_max_bitset_sites(ld_calc_t *self, size_t max_bitset_sites)
+{
+    ld_calc_free_bitsets(self);
+    self->max_bitset_sites = max_bitset_sites;
+    return 0;
+}
+
+static int WARN_UNUSED
+ld_calc_alloc_bitsets(ld_calc_t *self)
+{
+    int ret = MSP_ERR_NO_MEMORY;
+    size_t N = self->max_bitset_sites;
+
+    self->bitsets = malloc(N * self->bitset_words * sizeof(uint64_t));
+    self->bitset_site = malloc(N * sizeof(site_id_t));
+    self->bitset_count = malloc(N * sizeof(node_id_t));
+    if (self->bitsets == NULL || self->bitset_site == NULL
+            || self->bitset_count == NULL) {
+        goto out;
+    }
+    memset(self->bitset_site, 0xff, N * sizeof(site_id_t));
+    ret = 0;
+out:
+    if (ret != 0) {
+        ld_calc_free_bitsets(self);
+    }
+    return ret;
+}
+
+/* Moves the site tree to the tree containing the specified position,
+ * allocating it on first use. */
+static int WARN_UNUSED
+ld_calc_seek_site_tree(ld_calc_t *self, double position)
+{
+    int ret = 0;
+    sparse_tree_t *t = self->site_tree;
+
+    if (t == NULL) {
+        t = malloc(sizeof(sparse_tree_t));
+        if (t == NULL) {
+            ret = MSP_ERR_NO_MEMORY;
+            goto out;
+        }
+        ret = sparse_tree_alloc(t, self->tree_sequence, MSP_LEAF_LISTS);
+        if (ret != 0) {
+            sparse_tree_free(t);
+            free(t);
+            goto out;
+        }
+        self->site_tree = t;
+        ret = sparse_tree_first(t);
+        if (ret < 0) {
+            goto out;
+        }
+    }
+    while (position >= t->right) {
+        ret = sparse_tree_next(t);
+        if (ret < 0) {
+            goto out;
+        }
+        assert(ret == 1);
+    }
+    while (position < t->left) {
+        ret = sparse_tree_prev(t);
+        if (ret < 0) {
+            goto out;
+        }
+        assert(ret == 1);
+    }
+    ret = 0;
+out:
+    return ret;
+}
+
+/* Sets the allele of each sample at the specified site, where allele 0 is
+ * the ancestral state and the distinct derived states are numbered in
+ * order of first appearance. As in vargen, the mutations are applied in
+ * order, so later mutations overwrite the states of the samples below them.
+ */
+static int WARN_UNUSED
+ld_calc_get_sample_alleles(ld_calc_t *self, site_id_t site_id, uint32_t *alleles,
+        uint32_t *num_alleles)
+{
+    int ret = 0;
+    size_t n = tree_sequence_get_sample_size(self->tree_sequence);
+    leaf_list_node_t *w, *tail;
+    mutation_t *mut;
+    node_id_t k;
+    list_len_t j, l;
+    uint32_t allele, num_distinct;
+    site_t site;
+
+    ret = tree_sequence_get_site(self->tree_sequence, site_id, &site);
+    if (ret != 0) {
+        goto out;
+    }
+    if (site.mutations_length > self->max_mutation_alleles) {
+        ret = msp_expand_array(self->mutation_alleles, &self->max_mutation_alleles,
+                site.mutations_length);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    ret = ld_calc_seek_site_tree(self, site.position);
+    if (ret != 0) {
+        goto out;
+    }
+    memset(alleles, 0, n * sizeof(uint32_t));
+    num_distinct = 1;
+    for (j = 0; j < site.mutations_length; j++) {
+        mut = &site.mutations[j];
+        allele = 0;
+        if (mut->derived_state_length != site.ancestral_state_length
+                || memcmp(mut->derived_state, site.ancestral_state,
+                    site.ancestral_state_length) != 0) {
+            allele = num_distinct;
+            for (l = 0; l < j; l++) {
+                if (mut->derived_state_length == site.mutations[l].derived_state_length
+                        && memcmp(mut->derived_state, site.mutations[l].derived_state,
+                            mut->derived_state_length) == 0) {
+                    allele = self->mutation_alleles[l];
+                    break;
+                }
+            }
+            if (allele == num_distinct) {
+                num_distinct++;
+            }
+        }
+        self->mutation_alleles[j] = allele;
+        ret = sparse_tree_get_leaf_list(self->site_tree, mut->node, &w, &tail);
+        if (ret != 0) {
+            goto out;
+        }
+        while (w != NULL) {
+            k = self->sample_index_map[w->node];
+            assert(k >= 0);
+            alleles[k] = allele;
+            w = w == tail? NULL: w->next;
+        }
+    }
+    *num_alleles = num_distinct;
+out:
+    return ret;
+}
+
+static int WARN_UNUSED
+ld_calc_alloc_sample_alleles(ld_calc_t *self)
+{
+    int ret = 0;
+    size_t n = tree_sequence_get_sample_size(self->tree_sequence);
+
+    if (self->sample_alleles == NULL) {
+        self->sample_alleles = malloc(2 * GSL_MAX(n, 1) * sizeof(uint32_t));
+        if (self->sample_alleles == NULL) {
+            ret = MSP_ERR_NO_MEMORY;
+        }
+    }
+    return ret;
+}
+
+/* Returns the bitset of samples whose state at the specified site differs
+ * from the ancestral state, building it from the leaf lists of the site's
+ * tree if it is not cached. */
+static int WARN_UNUSED
+ld_calc_get_bitset(ld_calc_t *self, size_t site_index, uint64_t **bitset,
+        node_id_t *count)
+{
+    int ret = 0;
+    size_t slot = site_index % self->max_bitset_sites;
+    size_t n = tree_sequence_get_sample_size(self->tree_sequence);
+    uint64_t *b;
+    uint32_t *alleles;
+    uint32_t num_alleles;
+    leaf_list_node_t *w, *tail;
+    node_id_t k, num_leaves;
+    site_t site;
+
+    if (self->bitsets == NULL) {
+        ret = ld_calc_alloc_bitsets(self);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    b = self->bitsets + slot * self->bitset_words;
+    if (self->bitset_site[slot] != (site_id_t) site_index) {
+        ret = tree_sequence_get_site(self->tree_sequence, (site_id_t) site_index,
+                &site);
+        if (ret != 0) {
+            goto out;
+        }
+        memset(b, 0, self->bitset_words * sizeof(uint64_t));
+        num_leaves = 0;
+        if (site.mutations_length == 1) {
+            ret = ld_calc_seek_site_tree(self, site.position);
+            if (ret != 0) {
+                goto out;
+            }
+            ret = sparse_tree_get_leaf_list(self->site_tree, site.mutations[0].node,
+                    &w, &tail);
+            if (ret != 0) {
+                goto out;
+            }
+            while (w != NULL) {
+                k = self->sample_index_map[w->node];
+                assert(k >= 0);
+                b[k / 64] |= 1ULL << (k % 64);
+                num_leaves++;
+                w = w == tail? NULL: w->next;
+            }
+        } else {
+            ret = ld_calc_alloc_sample_alleles(self);
+            if (ret != 0) {
+                goto out;
+            }
+            alleles = self->sample_alleles + n;
+            ret = ld_calc_get_sample_alleles(self, site.id, alleles, &num_alleles);
+            if (ret != 0) {
+                goto out;
+            }
+            for (k = 0; k < (node_id_t) n; k++) {
+                if (alleles[k] != 0) {
+                    b[k / 64] |= 1ULL << (k % 64);
+                    num_leaves++;
+                }
+            }
+        }
+        self->bitset_site[slot] = (site_id_t) site_index;
+        self->bitset_count[slot] = num_leaves;
+    }
+    *bitset = b;
+    *count = self->bitset_count[slot];
+    ret = 0;
+out:
+    return ret;
+}
+
+/* Returns the value of the specified statistic for a pair of biallelic
+ * sites, given the numbers of samples carrying A, B and both. */
+static inline double
+ld_compute_stat(int statistic, double n, double nA, double nB, double nAB)
+{
+    double fA = nA / n;
+    double fB = nB / n;
+    double fAB = nAB / n;
+    double D = fAB - fA * fB;
+    double D_max;
+    double ret;
+
+    switch (statistic) {
+        case MSP_LD_STAT_D:
+            ret = D;
+            break;
+        case MSP_LD_STAT_D_PRIME:
+            if (D >= 0) {
+                D_max = GSL_MIN(fA * (1 - fB), (1 - fA) * fB);
+            } else {
+                D_max = GSL_MIN(fA * fB, (1 - fA) * (1 - fB));
+            }
+            ret = D / D_max;
+            break;
+        case MSP_LD_STAT_R:
+            ret = D / sqrt(fA * fB * (1 - fA) * (1 - fB));
+            break;
+        default:
+            ret = D * D / (fA * fB * (1 - fA) * (1 - fB));
+            break;
+    }
+    return ret;
+}
+
+/* Computes the specified statistic between sites a and b from the alleles
+ * of the samples at each. This is used for pairs in which either site does
+ * not have exactly one mutation. The multiallelic r2 is the sum of
+ * D_ij^2 / (p_i q_j) over all pairs of alleles, divided by one less than
+ * the smaller number of alleles present, which is r2 for biallelic sites.
+ */
+static int WARN_UNUSED
+ld_calc_get_general_stat(ld_calc_t *self, site_id_t a, site_id_t b, int statistic,
+        double *result)
+{
+    int ret = 0;
+    size_t n = tree_sequence_get_sample_size(self->tree_sequence);
+    uint32_t *alleles_a, *alleles_b, *counts, *row_sums, *column_sums;
+    uint32_t kA, kB, num_present_a, num_present_b;
+    uint32_t i, j, x, nA, nB, nAB;
+    double fA, fB, D, sum;
+    size_t k, size;
+
+    ret = ld_calc_alloc_sample_alleles(self);
+    if (ret != 0) {
+        goto out;
+    }
+    alleles_a = self->sample_alleles;
+    alleles_b = self->sample_alleles + n;
+    if (self->allele_site != a) {
+        self->allele_site = -1;
+        ret = ld_calc_get_sample_alleles(self, a, alleles_a, &self->num_site_alleles);
+        if (ret != 0) {
+            goto out;
+        }
+        self->allele_site = a;
+    }
+    kA = self->num_site_alleles;
+    ret = ld_calc_get_sample_alleles(self, b, alleles_b, &kB);
+    if (ret != 0) {
+        goto out;
+    }
+    /* The kA x kB table of allele counts followed by its margins */
+    size = ((size_t) kA) * kB + kA + kB;
+    if (size > self->max_allele_counts) {
+        ret = msp_expand_array(self->allele_counts, &self->max_allele_counts, size);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    counts = self->allele_counts;
+    row_sums = counts + ((size_t) kA) * kB;
+    column_sums = row_sums + kA;
+    memset(counts, 0, size * sizeof(uint32_t));
+    for (k = 0; k < n; k++) {
+        counts[alleles_a[k] * kB + alleles_b[k]]++;
+        row_sums[alleles_a[k]]++;
+        column_sums[alleles_b[k]]++;
+    }
+    if (statistic != MSP_LD_STAT_R2_MULTIALLELIC) {
+        nA = (uint32_t) n - row_sums[0];
+        nB = (uint32_t) n - column_sums[0];
+        nAB = nA - (column_sums[0] - counts[0]);
+        *result = ld_compute_stat(statistic, (double) n, nA, nB, nAB);
+    } else {
+        num_present_a = 0;
+        num_present_b = 0;
+        for (i = 0; i < kA; i++) {
+            num_present_a += row_sums[i] > 0;
+        }
+        for (j = 0; j < kB; j++) {
+            num_present_b += column_sums[j] > 0;
+        }
+        sum = 0;
+        for (i = 0; i < kA; i++) {
+            for (j = 0; j < kB; j++) {
+                if (row_sums[i] > 0 && column_sums[j] > 0) {
+                    fA = row_sums[i] / (double) n;
+                    fB = column_sums[j] / (double) n;
+                    D = counts[i * kB + j] / (double) n - fA * fB;
+                    sum += D * D / (fA * fB);
+                }
+            }
+        }
+        x = GSL_MIN(num_present_a, num_present_b);
+        *result = x > 1? sum / (x - 1): NAN;
+    }
+out:
+    return ret;
+}
+
+/* Computes the statistic between site a and the num_sites following or
+ * preceding sites in the specified direction using bitsets. */
+static int WARN_UNUSED
+ld_calc_get_r2_array_bitset(ld_calc_t *self, size_t a, int direction,
+        size_t num_sites, int statistic, double *r2)
+{
+    int ret = 0;
+    double n = (double) tree_sequence_get_sample_size(self->tree_sequence);
+    list_len_t *mutations_length = self->tree_sequence->sites.site_mutations_length;
+    bool multiallelic = statistic == MSP_LD_STAT_R2_MULTIALLELIC;
+    uint64_t *bA, *bB;
+    node_id_t nA, nB, nAB;
+    size_t j, b;
+
+    ret = ld_calc_get_bitset(self, a, &bA, &nA);
+    if (ret != 0) {
+        goto out;
+    }
+    for (j = 0; j < num_sites; j++) {
+        b = direction == MSP_DIR_FORWARD? a + j + 1: a - j - 1;
+        if (multiallelic && (mutations_length[a] != 1 || mutations_length[b] != 1)) {
+            ret = ld_calc_get_general_stat(self, (site_id_t) a, (site_id_t) b,
+                    statistic, r2 + j);
+            if (ret != 0) {
+                goto out;
+            }
+            continue;
+        }
+        ret = ld_calc_get_bitset(self, b, &bB, &nB);
+        if (ret != 0) {
+            goto out;
+        }
+        nAB = self->bitset_overlap(bA, bB, self->bitset_words);
+        r2[j] = ld_compute_stat(statistic, n, nA, nB, nAB);
+    }
+out:
+    return ret;
+}
+
+/* Returns the number of sites within the specified window of site a if the
+ * bitset cache can hold all of them along with the focal site, and 0
+ * otherwise. */
+static size_t
+ld_calc_get_bitset_window(ld_calc_t *self, size_t a, int direction,
+        size_t max_sites, double max_distance)
+{
+    double *position = self->tree_sequence->sites.position;
+    size_t num_sites = 0;
+    size_t b;
+
+    while (num_sites < max_sites && num_sites < self->max_bitset_sites) {
+        if (direction == MSP_DIR_FORWARD) {
+            b = a + num_sites + 1;
+            if (b >= self->num_sites || position[b] - position[a] > max_distance) {
+                break;
+            }
+        } else {
+            if (num_sites >= a) {
+                break;
+            }
+            b = a - num_sites - 1;
+            if (position[a] - position[b] > max_distance) {
+                break;
+            }
+        }
+        num_sites++;
+    }
+    if (num_sites >= self->max_bitset_sites) {
+        num_sites = 0;
+    }
+    return num_sites;
+}
+
 static int WARN_UNUSED
 ld_calc_get_r2_array_forward(ld_calc_t *self, size_t source_index,
-        size_t max_sites, double max_distance, double *r2,
+        size_t max_sites, double max_distance, int statistic, double *r2,
         size_t *num_r2_values)
 {
     int ret = MSP_ERR_GENERIC;
     site_t sA, sB;
-    double fA, fB, fAB, D;
+    double nA, nB;
     int tracked_leaves_set = 0;
+    bool simple_a;
     sparse_tree_t *tA, *tB;
     double n = (double) tree_sequence_get_sample_size(self->tree_sequence);
     size_t j;
@@ -219,10 +740,15 @@ ld_calc_get_r2_array_forward(ld_calc_t *self, size_t source_index,
     if (ret != 0) {
         goto out;
     }
-    assert(sA.mutations_length == 1);
-    assert(tA->parent[sA.mutations[0].node] != MSP_NULL_NODE);
-    fA = ((double) tA->num_leaves[sA.mutations[0].node]) / n;
-    assert(fA > 0);
+    /* Pairs involving sites without exactly one mutation are computed
+     * from the alleles of the samples. */
+    simple_a = sA.mutations_length == 1;
+    nA = 0;
+    if (simple_a) {
+        assert(tA->parent[sA.mutations[0].node] != MSP_NULL_NODE);
+        nA = (double) tA->num_leaves[sA.mutations[0].node];
+        assert(nA > 0);
+    }
     tB->mark = 1;
     for (j = 0; j < max_sites; j++) {
         if (source_index + j + 1 >= self->num_sites) {
@@ -233,7 +759,6 @@ ld_calc_get_r2_array_forward(ld_calc_t *self, size_t source_index,
         if (ret != 0) {
             goto out;
         }
-        assert(sB.mutations_length == 1);
         if (sB.position - sA.position > max_distance) {
             break;
         }
@@ -244,9 +769,16 @@ ld_calc_get_r2_array_forward(ld_calc_t *self, size_t source_index,
             }
             assert(ret == 1);
         }
+        if (!simple_a || sB.mutations_length != 1) {
+            ret = ld_calc_get_general_stat(self, sA.id, sB.id, statistic, r2 + j);
+            if (ret != 0) {
+                goto out;
+            }
+            continue;
+        }
         assert(tB->parent[sB.mutations[0].node] != MSP_NULL_NODE);
-        fB = ((double) tB->num_leaves[sB.mutations[0].node]) / n;
-        assert(fB > 0);
+        nB = (double) tB->num_leaves[sB.mutations[0].node];
+        assert(nB > 0);
         if (sB.position < tA->right) {
             nAB = ld_calc_overlap_within_tree(self, sA, sB);
         } else {
@@ -263,9 +795,7 @@ ld_calc_get_r2_array_forward(ld_calc_t *self, size_t source_index,
                 nAB = ld_calc_overlap_within_tree(self, sA, sB);
             }
         }
-        fAB = nAB / n;
-        D = fAB - fA * fB;
-        r2[j] = D * D / (fA * fB * (1 - fA) * (1 - fB));
+        r2[j] = ld_compute_stat(statistic, n, nA, nB, nAB);
     }
 
     /* Now rewind back the inner iterator and unmark all nodes that
@@ -286,13 +816,14 @@ out:
 
 static int WARN_UNUSED
 ld_calc_get_r2_array_reverse(ld_calc_t *self, size_t source_index,
-        size_t max_sites, double max_distance, double *r2,
+        size_t max_sites, double max_distance, int statistic, double *r2,
         size_t *num_r2_values)
 {
     int ret = MSP_ERR_GENERIC;
     site_t sA, sB;
-    double fA, fB, fAB, D;
+    double nA, nB;
     int tracked_leaves_set = 0;
+    bool simple_a;
     sparse_tree_t *tA, *tB;
     double n = (double) tree_sequence_get_sample_size(self->tree_sequence);
     size_t j;
@@ -305,10 +836,15 @@ ld_calc_get_r2_array_reverse(ld_calc_t *self, size_t source_index,
     if (ret != 0) {
         goto out;
     }
-    assert(sA.mutations_length == 1);
-    assert(tA->parent[sA.mutations[0].node] != MSP_NULL_NODE);
-    fA = ((double) tA->num_leaves[sA.mutations[0].node]) / n;
-    assert(fA > 0);
+    /* Pairs involving sites without exactly one mutation are computed
+     * from the alleles of the samples. */
+    simple_a = sA.mutations_length == 1;
+    nA = 0;
+    if (simple_a) {
+        assert(tA->parent[sA.mutations[0].node] != MSP_NULL_NODE);
+        nA = (double) tA->num_leaves[sA.mutations[0].node];
+        assert(nA > 0);
+    }
     tB->mark = 1;
     for (j = 0; j < max_sites; j++) {
         site_index = ((int64_t) source_index) - ((int64_t) j) - 1;
@@ -329,9 +865,16 @@ ld_calc_get_r2_array_reverse(ld_calc_t *self, size_t source_index,
             }
             assert(ret == 1);
         }
+        if (!simple_a || sB.mutations_length != 1) {
+            ret = ld_calc_get_general_stat(self, sA.id, sB.id, statistic, r2 + j);
+            if (ret != 0) {
+                goto out;
+            }
+            continue;
+        }
         assert(tB->parent[sB.mutations[0].node] != MSP_NULL_NODE);
-        fB = ((double) tB->num_leaves[sB.mutations[0].node]) / n;
-        assert(fB > 0);
+        nB = (double) tB->num_leaves[sB.mutations[0].node];
+        assert(nB > 0);
         if (sB.position >= tA->left) {
             nAB = ld_calc_overlap_within_tree(self, sA, sB);
         } else {
@@ -348,9 +891,7 @@ ld_calc_get_r2_array_reverse(ld_calc_t *self, size_t source_index,
                 nAB = ld_calc_overlap_within_tree(self, sA, sB);
             }
         }
-        fAB = nAB / n;
-        D = fAB - fA * fB;
-        r2[j] = D * D / (fA * fB * (1 - fA) * (1 - fB));
+        r2[j] = ld_compute_stat(statistic, n, nA, nB, nAB);
     }
 
     /* Now fast forward the inner iterator and unmark all nodes that
@@ -369,27 +910,44 @@ out:
     return ret;
 }
 
+/* Computes the specified statistic between site a and the sites following
+ * or preceding it in the specified direction, stopping after max_sites sites
+ * or once they are more than max_distance away. */
 int WARN_UNUSED
 ld_calc_get_r2_array(ld_calc_t *self, size_t a, int direction,
-        size_t max_sites, double max_distance, double *r2,
+        size_t max_sites, double max_distance, int statistic, double *r2,
         size_t *num_r2_values)
 {
     int ret = MSP_ERR_GENERIC;
+    size_t num_window_sites;
 
     if (a >= self->num_sites) {
         ret = MSP_ERR_OUT_OF_BOUNDS;
         goto out;
     }
+    if (statistic < MSP_LD_STAT_R2 || statistic > MSP_LD_STAT_R2_MULTIALLELIC) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
+        goto out;
+    }
     ret = ld_calc_position_trees(self, a);
     if (ret != 0) {
         goto out;
     }
-    if (direction == MSP_DIR_FORWARD) {
+    num_window_sites = 0;
+    if (direction == MSP_DIR_FORWARD || direction == MSP_DIR_REVERSE) {
+        num_window_sites = ld_calc_get_bitset_window(self, a, direction, max_sites,
+                max_distance);
+    }
+    if (num_window_sites > 0) {
+        ret = ld_calc_get_r2_array_bitset(self, a, direction, num_window_sites,
+                statistic, r2);
+        *num_r2_values = num_window_sites;
+    } else if (direction == MSP_DIR_FORWARD) {
         ret = ld_calc_get_r2_array_forward(self, a, max_sites, max_distance,
-                r2, num_r2_values);
+                statistic, r2, num_r2_values);
     } else if (direction == MSP_DIR_REVERSE) {
         ret = ld_calc_get_r2_array_reverse(self, a, max_sites, max_distance,
-                r2, num_r2_values);
+                statistic, r2, num_r2_values);
     } else {
         ret = MSP_ERR_BAD_PARAM_VALUE;
     }
@@ -402,10 +960,9 @@ ld_calc_get_r2(ld_calc_t *self, size_t a, size_t b, double *r2)
 {
     int ret = MSP_ERR_GENERIC;
     site_t sA, sB;
-    double fA, fB, fAB, D;
     sparse_tree_t *tA, *tB;
     double n = (double) tree_sequence_get_sample_size(self->tree_sequence);
-    double nAB;
+    double nA, nB, nAB;
     size_t tmp;
 
     if (a >= self->num_sites || b >= self->num_sites) {
@@ -432,10 +989,13 @@ ld_calc_get_r2(ld_calc_t *self, size_t a, size_t b, double *r2)
     if (ret != 0) {
         goto out;
     }
-    assert(sA.mutations_length == 1);
+    if (sA.mutations_length != 1 || sB.mutations_length != 1) {
+        ret = ld_calc_get_general_stat(self, sA.id, sB.id, MSP_LD_STAT_R2, r2);
+        goto out;
+    }
     assert(tA->parent[sA.mutations[0].node] != MSP_NULL_NODE);
-    fA = ((double) tA->num_leaves[sA.mutations[0].node]) / n;
-    assert(fA > 0);
+    nA = (double) tA->num_leaves[sA.mutations[0].node];
+    assert(nA > 0);
     ret = ld_calc_set_tracked_leaves(self, sA);
     if (ret != 0) {
         goto out;
@@ -449,12 +1009,10 @@ ld_calc_get_r2(ld_calc_t *self, size_t a, size_t b, double *r2)
         assert(ret == 1);
     }
     assert(tB->parent[sB.mutations[0].node] != MSP_NULL_NODE);
-    fB = ((double) tB->num_leaves[sB.mutations[0].node]) / n;
-    assert(fB > 0);
+    nB = (double) tB->num_leaves[sB.mutations[0].node];
+    assert(nB > 0);
     nAB = (double) tB->num_tracked_leaves[sB.mutations[0].node];
-    fAB = nAB / n;
-    D = fAB - fA * fB;
-    *r2 = D * D / (fA * fB * (1 - fA) * (1 - fB));
+    *r2 = ld_compute_stat(MSP_LD_STAT_R2, n, nA, nB, nAB);
 
     /* Now rewind the inner iterator back. */
     while (tB->index > tA->index) {
@@ -468,3 +1026,559 @@ ld_calc_get_r2(ld_calc_t *self, size_t a, size_t b, double *r2)
 out:
     return ret;
 }
+
+/* ======================================================== *
+ * Parallel work over focal sites
+ * ======================================================== */
+
+/* The focal sites divided into chunks of consecutive sites, which are
+ * handed out to worker threads in order. */
+typedef struct {
+    tree_sequence_t *tree_sequence;
+    size_t max_bitset_sites;
+    size_t num_sites;
+    size_t chunk_size;
+    size_t num_chunks;
+    size_t next_chunk;
+    int error;
+    pthread_mutex_t mutex;
+} ld_site_queue_t;
+
+static void
+ld_site_queue_init(ld_site_queue_t *self, ld_calc_t *ld_calc, size_t chunk_size)
+{
+    self->tree_sequence = ld_calc->tree_sequence;
+    self->max_bitset_sites = ld_calc->max_bitset_sites;
+    self->num_sites = ld_calc->num_sites;
+    self->chunk_size = chunk_size;
+    self->num_chunks = (self->num_sites + chunk_size - 1) / chunk_size;
+    self->next_chunk = 0;
+    self->error = 0;
+}
+
+/* Records the first error from any worker; the others stop at their next
+ * call to ld_site_queue_next. */
+static void
+ld_site_queue_set_error(ld_site_queue_t *self, int err)
+{
+    pthread_mutex_lock(&self->mutex);
+    if (self->error == 0) {
+        self->error = err;
+    }
+    pthread_mutex_unlock(&self->mutex);
+}
+
+/* Allocates a worker's calculator, which caches bitsets for the same number
+ * of sites as the calculator the queue was initialised from. */
+static int WARN_UNUSED
+ld_site_queue_alloc_calc(ld_site_queue_t *self, ld_calc_t *ld_calc)
+{
+    int ret = ld_calc_alloc(ld_calc, self->tree_sequence);
+
+    if (ret != 0) {
+        goto out;
+    }
+    ret = ld_calc_set_max_bitset_sites(ld_calc, self->max_bitset_sites);
+out:
+    return ret;
+}
+
+/* Claims the next chunk of focal sites [*start, *end). Returns false when
+ * all chunks have been claimed or a worker has failed. */
+static bool
+ld_site_queue_next(ld_site_queue_t *self, size_t *start, size_t *end)
+{
+    size_t index;
+
+    pthread_mutex_lock(&self->mutex);
+    index = self->next_chunk;
+    self->next_chunk++;
+    if (self->error != 0) {
+        index = self->num_chunks;
+    }
+    pthread_mutex_unlock(&self->mutex);
+    if (index >= self->num_chunks) {
+        return false;
+    }
+    *start = index * self->chunk_size;
+    *end = GSL_MIN(*start + self->chunk_size, self->num_sites);
+    return true;
+}
+
+/* Runs worker(arg) in up to num_threads threads, or in the calling thread
+ * if only one is needed, and returns the first error reported to the queue.
+ */
+static int WARN_UNUSED
+ld_site_queue_run(ld_site_queue_t *self, size_t num_threads,
+        void *(*worker)(void *), void *arg)
+{
+    int ret = 0;
+    pthread_t *threads = NULL;
+    size_t j, num_started;
+
+    num_threads = GSL_MAX(1, GSL_MIN(num_threads, self->num_chunks));
+    threads = malloc(num_threads * sizeof(pthread_t));
+    if (threads == NULL) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    if (pthread_mutex_init(&self->mutex, NULL) != 0) {
+        ret = MSP_ERR_THREAD;
+        goto out;
+    }
+    if (num_threads == 1) {
+        worker(arg);
+    } else {
+        for (num_started = 0; num_started < num_threads; num_started++) {
+            if (pthread_create(&threads[num_started], NULL, worker, arg) != 0) {
+                ld_site_queue_set_error(self, MSP_ERR_THREAD);
+                break;
+            }
+        }
+        for (j = 0; j < num_started; j++) {
+            if (pthread_join(threads[j], NULL) != 0) {
+                ld_site_queue_set_error(self, MSP_ERR_THREAD);
+            }
+        }
+    }
+    ret = self->error;
+    pthread_mutex_destroy(&self->mutex);
+out:
+    msp_safe_free(threads);
+    return ret;
+}
+
+/* ======================================================== *
+ * Parallel r2 matrix
+ * ======================================================== */
+
+typedef struct {
+    ld_site_queue_t queue;
+    int flags;
+    double threshold;
+    ld_tile_func_t func;
+    void *params;
+} ld_tile_job_t;
+
+/* Fills the specified tile with the rows starting at tile->row_start,
+ * using the r2 buffer for each row. */
+static int WARN_UNUSED
+ld_calc_fill_tile(ld_calc_t *self, ld_tile_t *tile, size_t *max_entries,
+        int flags, double threshold, double *r2)
+{
+    int ret = 0;
+    size_t m = tile->num_columns;
+    size_t j, k, a, b, num_values, n;
+    double *dense64 = (double *) tile->values;
+    float *dense32 = (float *) tile->values;
+    void *p;
+
+    tile->num_entries = 0;
+    for (j = 0; j < tile->num_rows; j++) {
+        a = tile->row_start + j;
+        num_values = 0;
+        if (a + 1 < m) {
+            ret = ld_calc_get_r2_array(self, a, MSP_DIR_FORWARD, m - a - 1, DBL_MAX,
+                    MSP_LD_STAT_R2, r2, &num_values);
+            if (ret != 0) {
+                goto out;
+            }
+        }
+        assert(num_values == m - a - 1);
+        if (flags & MSP_LD_SPARSE) {
+            for (k = 0; k < num_values; k++) {
+                if (r2[k] > threshold) {
+                    n = tile->num_entries;
+                    if (n == *max_entries) {
+                        *max_entries = 2 * GSL_MAX(*max_entries, 512);
+                        p = realloc(tile->rows, *max_entries * sizeof(site_id_t));
+                        if (p == NULL) {
+                            ret = MSP_ERR_NO_MEMORY;
+                            goto out;
+                        }
+                        tile->rows = p;
+                        p = realloc(tile->columns, *max_entries * sizeof(site_id_t));
+                        if (p == NULL) {
+                            ret = MSP_ERR_NO_MEMORY;
+                            goto out;
+                        }
+                        tile->columns = p;
+                        p = realloc(tile->values, *max_entries * sizeof(double));
+                        if (p == NULL) {
+                            ret = MSP_ERR_NO_MEMORY;
+                            goto out;
+                        }
+                        tile->values = p;
+                    }
+                    b = a + k + 1;
+                    tile->rows[n] = (site_id_t) a;
+                    tile->columns[n] = (site_id_t) b;
+                    if (flags & MSP_LD_FLOAT32) {
+                        ((float *) tile->values)[n] = (float) r2[k];
+                    } else {
+                        ((double *) tile->values)[n] = r2[k];
+                    }
+                    tile->num_entries++;
+                }
+            }
+        } else if (flags & MSP_LD_FLOAT32) {
+            dense32[j * m + a] = 1;
+            for (k = 0; k < num_values; k++) {
+                dense32[j * m + a + k + 1] = (float) r2[k];
+            }
+        } else {
+            dense64[j * m + a] = 1;
+            memcpy(dense64 + j * m + a + 1, r2, num_values * sizeof(double));
+        }
+    }
+out:
+    return ret;
+}
+
+/* Takes tiles from the queue until it is empty, computing each with a
+ * separate ld_calc and passing the results to func. Calls to func are
+ * serialised by the queue mutex. */
+static void *
+ld_tile_worker(void *arg)
+{
+    int ret = 0;
+    ld_tile_job_t *self = (ld_tile_job_t *) arg;
+    ld_site_queue_t *queue = &self->queue;
+    ld_calc_t ld_calc;
+    ld_tile_t tile;
+    size_t m = queue->num_sites;
+    size_t start, end;
+    size_t max_entries = 0;
+    size_t item_size = self->flags & MSP_LD_FLOAT32? sizeof(float): sizeof(double);
+    double *r2 = malloc(m * sizeof(double));
+
+    memset(&ld_calc, 0, sizeof(ld_calc));
+    memset(&tile, 0, sizeof(tile));
+    tile.num_columns = m;
+    if (!(self->flags & MSP_LD_SPARSE)) {
+        tile.values = calloc(queue->chunk_size * m, item_size);
+        if (tile.values == NULL) {
+            ret = MSP_ERR_NO_MEMORY;
+            goto out;
+        }
+    }
+    if (r2 == NULL) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    ret = ld_site_queue_alloc_calc(queue, &ld_calc);
+    if (ret != 0) {
+        goto out;
+    }
+    while (ld_site_queue_next(queue, &start, &end)) {
+        tile.row_start = start;
+        tile.num_rows = end - start;
+        ret = ld_calc_fill_tile(&ld_calc, &tile, &max_entries, self->flags,
+                self->threshold, r2);
+        if (ret != 0) {
+            goto out;
+        }
+        pthread_mutex_lock(&queue->mutex);
+        ret = self->func(&tile, self->params);
+        pthread_mutex_unlock(&queue->mutex);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+out:
+    if (ret != 0) {
+        ld_site_queue_set_error(queue, ret);
+    }
+    ld_calc_free(&ld_calc);
+    msp_safe_free(tile.rows);
+    msp_safe_free(tile.columns);
+    msp_safe_free(tile.values);
+    msp_safe_free(r2);
+    return NULL;
+}
+
+/* Computes r2 between all pairs of sites, in tiles of tile_size rows of
+ * the upper triangle which are divided among num_threads worker threads.
+ * Each thread has its own calculator, which caches bitsets for the same
+ * number of sites as self. Each tile is passed to func once it is
+ * complete; tiles may arrive in any order, but calls to func never overlap.
+ * If MSP_LD_SPARSE is set, only the pairs with r2 greater than threshold
+ * are reported. The tile's memory is reused once func returns.
+ */
+int WARN_UNUSED
+ld_calc_get_r2_matrix(ld_calc_t *self, size_t tile_size, size_t num_threads,
+        int flags, double threshold, ld_tile_func_t func, void *params)
+{
+    int ret = 0;
+    ld_tile_job_t job;
+
+    memset(&job, 0, sizeof(job));
+    if (tile_size < 1 || num_threads < 1 || func == NULL) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
+        goto out;
+    }
+    if (self->num_sites == 0) {
+        goto out;
+    }
+    ld_site_queue_init(&job.queue, self, tile_size);
+    job.flags = flags;
+    job.threshold = threshold;
+    job.func = func;
+    job.params = params;
+    ret = ld_site_queue_run(&job.queue, num_threads, ld_tile_worker, &job);
+out:
+    return ret;
+}
+
+/* ======================================================== *
+ * r2 decay with distance
+ * ======================================================== */
+
+typedef struct {
+    ld_site_queue_t queue;
+    size_t num_distance_bins;
+    double *distance_breaks;
+    size_t num_frequency_bins;
+    size_t *frequency_bin;
+    size_t max_sites;
+    double *r2_sum;
+    uint64_t *num_pairs;
+} ld_decay_job_t;
+
+/* Returns the index of the bin containing x, where bin j is the interval
+ * [breaks[j], breaks[j + 1]) except for the last bin, which also contains
+ * its upper break. Returns num_bins if x is not in any bin. */
+static size_t
+ld_find_bin(const double *breaks, size_t num_bins, double x)
+{
+    size_t lo = 0;
+    size_t hi = num_bins;
+    size_t mid;
+
+    if (!(x >= breaks[0] && x <= breaks[num_bins])) {
+        return num_bins;
+    }
+    if (x == breaks[num_bins]) {
+        return num_bins - 1;
+    }
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (x < breaks[mid]) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+    return lo;
+}
+
+static bool
+ld_breaks_valid(const double *breaks, size_t num_bins)
+{
+    size_t j;
+
+    for (j = 0; j < num_bins; j++) {
+        if (!(breaks[j] < breaks[j + 1])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Sets the bin of the minor allele frequency of each site, counting every
+ * non-ancestral state as the derived allele. */
+static int WARN_UNUSED
+ld_calc_get_frequency_bins(ld_calc_t *self, size_t num_bins, double *breaks,
+        size_t *frequency_bin)
+{
+    int ret = 0;
+    double n = (double) tree_sequence_get_sample_size(self->tree_sequence);
+    ld_calc_t ld_calc;
+    sparse_tree_t tree;
+    site_t *sites;
+    list_len_t j, num_sites;
+    uint32_t *alleles, num_alleles;
+    size_t k;
+    double count, f;
+
+    /* Work on a separate ld_calc so that we do not change the state of self,
+     * which is not used by the worker threads. */
+    memset(&ld_calc, 0, sizeof(ld_calc));
+    memset(&tree, 0, sizeof(tree));
+    ret = ld_calc_alloc(&ld_calc, self->tree_sequence);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = ld_calc_alloc_sample_alleles(&ld_calc);
+    if (ret != 0) {
+        goto out;
+    }
+    alleles = ld_calc.sample_alleles;
+    ret = sparse_tree_alloc(&tree, self->tree_sequence, MSP_LEAF_COUNTS);
+    if (ret != 0) {
+        goto out;
+    }
+    for (ret = sparse_tree_first(&tree); ret == 1; ret = sparse_tree_next(&tree)) {
+        ret = sparse_tree_get_sites(&tree, &sites, &num_sites);
+        if (ret != 0) {
+            goto out;
+        }
+        for (j = 0; j < num_sites; j++) {
+            if (sites[j].mutations_length == 1) {
+                count = (double) tree.num_leaves[sites[j].mutations[0].node];
+            } else {
+                ret = ld_calc_get_sample_alleles(&ld_calc, sites[j].id, alleles,
+                        &num_alleles);
+                if (ret != 0) {
+                    goto out;
+                }
+                count = 0;
+                for (k = 0; k < (size_t) n; k++) {
+                    count += alleles[k] != 0;
+                }
+            }
+            f = count / n;
+            frequency_bin[sites[j].id] = ld_find_bin(breaks, num_bins,
+                    GSL_MIN(f, 1 - f));
+        }
+    }
+out:
+    sparse_tree_free(&tree);
+    ld_calc_free(&ld_calc);
+    return ret;
+}
+
+/* Takes chunks of focal sites from the queue until it is empty, adding the
+ * r2 values for the pairs within each bin to local totals, which are added
+ * to the queue's totals at the end. */
+static void *
+ld_decay_worker(void *arg)
+{
+    int ret = 0;
+    ld_decay_job_t *self = (ld_decay_job_t *) arg;
+    ld_site_queue_t *queue = &self->queue;
+    ld_calc_t ld_calc;
+    size_t D = self->num_distance_bins;
+    size_t F = self->num_frequency_bins;
+    double *breaks = self->distance_breaks;
+    double *position = queue->tree_sequence->sites.position;
+    size_t num_values = GSL_MIN(self->max_sites, queue->num_sites);
+    double *r2 = malloc(GSL_MAX(num_values, 1) * sizeof(double));
+    double *r2_sum = calloc(F * D, sizeof(double));
+    uint64_t *num_pairs = calloc(F * D, sizeof(uint64_t));
+    size_t start, end, a, b, j, k, l, num_r2;
+
+    memset(&ld_calc, 0, sizeof(ld_calc));
+    if (r2 == NULL || r2_sum == NULL || num_pairs == NULL) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    ret = ld_site_queue_alloc_calc(queue, &ld_calc);
+    if (ret != 0) {
+        goto out;
+    }
+    while (ld_site_queue_next(queue, &start, &end)) {
+        for (a = start; a < end; a++) {
+            if (self->frequency_bin[a] == F) {
+                continue;
+            }
+            ret = ld_calc_get_r2_array(&ld_calc, a, MSP_DIR_FORWARD, num_values,
+                    breaks[D], MSP_LD_STAT_R2, r2, &num_r2);
+            if (ret != 0) {
+                goto out;
+            }
+            for (j = 0; j < num_r2; j++) {
+                b = a + j + 1;
+                k = ld_find_bin(breaks, D, position[b] - position[a]);
+                l = GSL_MIN(self->frequency_bin[a], self->frequency_bin[b]);
+                if (k < D && self->frequency_bin[b] < F && !isnan(r2[j])) {
+                    r2_sum[l * D + k] += r2[j];
+                    num_pairs[l * D + k]++;
+                }
+            }
+        }
+    }
+    pthread_mutex_lock(&queue->mutex);
+    for (j = 0; j < F * D; j++) {
+        self->r2_sum[j] += r2_sum[j];
+        self->num_pairs[j] += num_pairs[j];
+    }
+    pthread_mutex_unlock(&queue->mutex);
+out:
+    if (ret != 0) {
+        ld_site_queue_set_error(queue, ret);
+    }
+    ld_calc_free(&ld_calc);
+    msp_safe_free(r2);
+    msp_safe_free(r2_sum);
+    msp_safe_free(num_pairs);
+    return NULL;
+}
+
+/* Sums r2 over the pairs of sites a < b within each of num_distance_bins
+ * bins of the distance between them, where bin j is
+ * [distance_breaks[j], distance_breaks[j + 1]) and the last bin also
+ * includes its upper break. Each site is compared with at most max_sites
+ * following sites. If num_frequency_bins > 0, pairs are also binned by the
+ * smaller minor allele frequency of the two sites in the same way, and
+ * pairs with a site outside all of these bins are ignored. The sums and
+ * the numbers of pairs are stored in r2_sum and num_pairs, which have
+ * max(num_frequency_bins, 1) rows of num_distance_bins values. Pairs with
+ * undefined r2 are not counted. The focal sites are divided into chunks
+ * which are shared among num_threads worker threads, so the sums may
+ * differ in the last few bits from run to run.
+ */
+int WARN_UNUSED
+ld_calc_get_r2_decay(ld_calc_t *self, size_t num_distance_bins,
+        double *distance_breaks, size_t num_frequency_bins, double *frequency_breaks,
+        size_t max_sites, size_t num_threads, double *r2_sum, uint64_t *num_pairs)
+{
+    int ret = 0;
+    ld_decay_job_t job;
+    size_t num_bins;
+
+    memset(&job, 0, sizeof(job));
+    if (num_distance_bins < 1 || num_threads < 1
+            || !ld_breaks_valid(distance_breaks, num_distance_bins)
+            || distance_breaks[0] < 0) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
+        goto out;
+    }
+    if (num_frequency_bins > 0
+            && !ld_breaks_valid(frequency_breaks, num_frequency_bins)) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
+        goto out;
+    }
+    num_bins = GSL_MAX(num_frequency_bins, 1) * num_distance_bins;
+    memset(r2_sum, 0, num_bins * sizeof(double));
+    memset(num_pairs, 0, num_bins * sizeof(uint64_t));
+    if (self->num_sites == 0) {
+        goto out;
+    }
+    /* Several chunks per thread so that the work is balanced when the
+     * density of sites varies. */
+    ld_site_queue_init(&job.queue, self,
+            GSL_MAX(1, self->num_sites / (8 * num_threads)));
+    job.num_distance_bins = num_distance_bins;
+    job.distance_breaks = distance_breaks;
+    job.num_frequency_bins = GSL_MAX(num_frequency_bins, 1);
+    job.max_sites = max_sites;
+    job.r2_sum = r2_sum;
+    job.num_pairs = num_pairs;
+    job.frequency_bin = calloc(self->num_sites, sizeof(size_t));
+    if (job.frequency_bin == NULL) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    if (num_frequency_bins > 0) {
+        ret = ld_calc_get_frequency_bins(self, num_frequency_bins, frequency_breaks,
+                job.frequency_bin);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    ret = ld_site_queue_run(&job.queue, num_threads, ld_decay_worker, &job);
+out:
+    msp_safe_free(job.frequency_bin);
+    return ret;
+}
@@ -0,0 +1,457 @@
+/*
+** Copyright (C) 2017 University of Oxford
+**
+** This file is part of msprime.
+**
+** msprime is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** msprime is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with msprime.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Ordered map from loci to uint32_t values. Keys and values are stored
+ * inline in sorted blocks of up to LOCUS_MAP_BLOCK_SIZE entries, and the
+ * blocks are indexed by a sorted array of their first keys. This is a
+ * two level B+ tree; the index is small enough that inserting and
+ * removing blocks by shifting it is cheaper than maintaining more levels.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "err.h"
+#include "locus_map.h"
+
+#define LOCUS_MAP_INITIAL_BLOCKS 16
+
+int WARN_UNUSED
+locus_map_alloc(locus_map_t *self)
+{
+    int ret = MSP_ERR_NO_MEMORY;
+
+    memset(self, 0, sizeof(locus_map_t));
+    self->max_blocks = LOCUS_MAP_INITIAL_BLOCKS;
+    self->first_keys = malloc(self->max_blocks * sizeof(uint32_t));
+    self->blocks = malloc(self->max_blocks * sizeof(locus_map_block_t *));
+    if (self->first_keys == NULL || self->blocks == NULL) {
+        goto out;
+    }
+    self->total_memory = self->max_blocks
+        * (sizeof(uint32_t) + sizeof(locus_map_block_t *));
+    ret = 0;
+out:
+    return ret;
+}
+
+int
+locus_map_free(locus_map_t *self)
+{
+    size_t j;
+
+    if (self->blocks != NULL) {
+        for (j = 0; j < self->num_allocated_blocks; j++) {
+            free(self->blocks[j]);
+        }
+        free(self->blocks);
+        self->blocks = NULL;
+    }
+    if (self->first_keys != NULL) {
+        free(self->first_keys);
+        self->first_keys = NULL;
+    }
+    return 0;
+}
+
+/* Removes all entries, keeping the allocated blocks for reuse. */
+void
+locus_map_clear(locus_map_t *self)
+{
+    self->size = 0;
+    self->num_blocks = 0;
+}
+
+void
+locus_map_print_state(locus_map_t *self, FILE *out)
+{
+    size_t j;
+    uint32_t k;
+    locus_map_block_t *block;
+
+    fprintf(out, "locus_map: size = %d blocks = %d allocated = %d max = %d "
+            "memory = %d\n", (int) self->size, (int) self->num_blocks,
+            (int) self->num_allocated_blocks, (int) self->max_blocks,
+            (int) self->total_memory);
+    for (j = 0; j < self->num_blocks; j++) {
+        block = self->blocks[j];
+        fprintf(out, "\t%d\t[%d]:", (int) self->first_keys[j], (int) block->num_keys);
+        for (k = 0; k < block->num_keys; k++) {
+            fprintf(out, " %d->%d", (int) block->keys[k], (int) block->values[k]);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+size_t
+locus_map_get_size(locus_map_t *self)
+{
+    return self->size;
+}
+
+/* Returns the number of bytes allocated, which never decreases as blocks
+ * are kept for reuse. */
+size_t
+locus_map_get_total_memory(locus_map_t *self)
+{
+    return self->total_memory;
+}
+
+/* Returns the index of the last block whose first key is <= key, or 0
+ * if there is no such block. */
+static size_t
+locus_map_find_block(locus_map_t *self, uint32_t key)
+{
+    size_t lo = 0;
+    size_t hi = self->num_blocks;
+    size_t mid;
+
+    while (hi - lo > 1) {
+        mid = (lo + hi) / 2;
+        if (self->first_keys[mid] <= key) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Returns the index of the first key in the block that is >= key. */
+static uint32_t
+locus_map_block_lower_bound(locus_map_block_t *block, uint32_t key)
+{
+    uint32_t lo = 0;
+    uint32_t hi = block->num_keys;
+    uint32_t mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (block->keys[mid] < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Inserts a new empty block at the specified index. */
+static int WARN_UNUSED
+locus_map_insert_block(locus_map_t *self, size_t index)
+{
+    int ret = MSP_ERR_NO_MEMORY;
+    size_t n = self->num_blocks;
+    locus_map_block_t *block;
+    void *p;
+
+    if (self->num_allocated_blocks == self->max_blocks) {
+        p = realloc(self->first_keys, 2 * self->max_blocks * sizeof(uint32_t));
+        if (p == NULL) {
+            goto out;
+        }
+        self->first_keys = p;
+        p = realloc(self->blocks, 2 * self->max_blocks * sizeof(locus_map_block_t *));
+        if (p == NULL) {
+            goto out;
+        }
+        self->blocks = p;
+        self->total_memory += self->max_blocks
+            * (sizeof(uint32_t) + sizeof(locus_map_block_t *));
+        self->max_blocks *= 2;
+    }
+    if (self->num_allocated_blocks > n) {
+        block = self->blocks[n];
+    } else {
+        block = malloc(sizeof(locus_map_block_t));
+        if (block == NULL) {
+            goto out;
+        }
+        self->total_memory += sizeof(locus_map_block_t);
+        self->num_allocated_blocks++;
+    }
+    memmove(self->blocks + index + 1, self->blocks + index,
+            (n - index) * sizeof(locus_map_block_t *));
+    memmove(self->first_keys + index + 1, self->first_keys + index,
+            (n - index) * sizeof(uint32_t));
+    block->num_keys = 0;
+    self->blocks[index] = block;
+    self->num_blocks++;
+    ret = 0;
+out:
+    return ret;
+}
+
+/* Removes the empty block at the specified index, keeping it for reuse. */
+static void
+locus_map_remove_block(locus_map_t *self, size_t index)
+{
+    locus_map_block_t *block = self->blocks[index];
+    size_t n = self->num_blocks;
+
+    assert(block->num_keys == 0);
+    memmove(self->blocks + index, self->blocks + index + 1,
+            (n - index - 1) * sizeof(locus_map_block_t *));
+    memmove(self->first_keys + index, self->first_keys + index + 1,
+            (n - index - 1) * sizeof(uint32_t));
+    self->num_blocks--;
+    self->blocks[self->num_blocks] = block;
+}
+
+/* Returns a pointer to the value for the specified key, or NULL if the key
+ * is not in the map. */
+uint32_t *
+locus_map_get(locus_map_t *self, uint32_t key)
+{
+    uint32_t *ret = NULL;
+    locus_map_block_t *block;
+    uint32_t j;
+
+    if (self->num_blocks > 0) {
+        block = self->blocks[locus_map_find_block(self, key)];
+        j = locus_map_block_lower_bound(block, key);
+        if (j < block->num_keys && block->keys[j] == key) {
+            ret = &block->values[j];
+        }
+    }
+    return ret;
+}
+
+/* Sets the value for the specified key, inserting it if necessary. */
+int WARN_UNUSED
+locus_map_insert(locus_map_t *self, uint32_t key, uint32_t value)
+{
+    int ret = 0;
+    size_t b;
+    uint32_t j, half;
+    locus_map_block_t *block, *new_block;
+
+    if (self->num_blocks == 0) {
+        ret = locus_map_insert_block(self, 0);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    b = locus_map_find_block(self, key);
+    block = self->blocks[b];
+    j = locus_map_block_lower_bound(block, key);
+    if (j < block->num_keys && block->keys[j] == key) {
+        block->values[j] = value;
+        goto out;
+    }
+    if (block->num_keys == LOCUS_MAP_BLOCK_SIZE) {
+        /* Split the block, moving the upper half into a new block */
+        ret = locus_map_insert_block(self, b + 1);
+        if (ret != 0) {
+            goto out;
+        }
+        half = LOCUS_MAP_BLOCK_SIZE / 2;
+        new_block = self->blocks[b + 1];
+        new_block->num_keys = LOCUS_MAP_BLOCK_SIZE - half;
+        memcpy(new_block->keys, block->keys + half,
+                new_block->num_keys * sizeof(uint32_t));
+        memcpy(new_block->values, block->values + half,
+                new_block->num_keys * sizeof(uint32_t));
+        block->num_keys = half;
+        self->first_keys[b + 1] = new_block->keys[0];
+        if (j > half) {
+            b++;
+            j -= half;
+            block = new_block;
+        }
+    }
+    memmove(block->keys + j + 1, block->keys + j,
+            (block->num_keys - j) * sizeof(uint32_t));
+    memmove(block->values + j + 1, block->values + j,
+            (block->num_keys - j) * sizeof(uint32_t));
+    block->keys[j] = key;
+    block->values[j] = value;
+    block->num_keys++;
+    if (j == 0) {
+        self->first_keys[b] = key;
+    }
+    self->size++;
+out:
+    return ret;
+}
+
+/* Gets the value for the largest key <= the specified key. */
+int WARN_UNUSED
+locus_map_get_floor(locus_map_t *self, uint32_t key, uint32_t *value)
+{
+    int ret = 0;
+    locus_map_cursor_t cursor;
+
+    if (!locus_map_seek(self, key, &cursor)) {
+        ret = MSP_ERR_OUT_OF_BOUNDS;
+        goto out;
+    }
+    *value = *cursor.value;
+out:
+    return ret;
+}
+
+/* Removes all entries with keys in [left, right] that have the same value
+ * as the preceding entry. Blocks that become empty are removed, and
+ * blocks that become small are merged with their predecessor.
+ */
+void
+locus_map_compress(locus_map_t *self, uint32_t left, uint32_t right)
+{
+    size_t b;
+    uint32_t j, k, w;
+    uint32_t last_value = 0;
+    int have_last = 0;
+    int done = 0;
+    locus_map_block_t *block, *prev;
+
+    if (self->size == 0) {
+        return;
+    }
+    b = locus_map_find_block(self, left);
+    block = self->blocks[b];
+    j = locus_map_block_lower_bound(block, left);
+    if (j > 0) {
+        have_last = 1;
+        last_value = block->values[j - 1];
+    } else if (b > 0) {
+        prev = self->blocks[b - 1];
+        have_last = 1;
+        last_value = prev->values[prev->num_keys - 1];
+    }
+    while (!done && b < self->num_blocks) {
+        block = self->blocks[b];
+        w = j;
+        for (k = j; k < block->num_keys; k++) {
+            if (block->keys[k] > right) {
+                done = 1;
+                break;
+            }
+            if (have_last && block->values[k] == last_value) {
+                self->size--;
+            } else {
+                block->keys[w] = block->keys[k];
+                block->values[w] = block->values[k];
+                last_value = block->values[k];
+                have_last = 1;
+                w++;
+            }
+        }
+        if (w != k) {
+            memmove(block->keys + w, block->keys + k,
+                    (block->num_keys - k) * sizeof(uint32_t));
+            memmove(block->values + w, block->values + k,
+                    (block->num_keys - k) * sizeof(uint32_t));
+            block->num_keys -= k - w;
+        }
+        if (block->num_keys == 0) {
+            locus_map_remove_block(self, b);
+        } else {
+            self->first_keys[b] = block->keys[0];
+            if (b > 0 && self->blocks[b - 1]->num_keys + block->num_keys
+                    <= LOCUS_MAP_BLOCK_SIZE / 2) {
+                prev = self->blocks[b - 1];
+                memcpy(prev->keys + prev->num_keys, block->keys,
+                        block->num_keys * sizeof(uint32_t));
+                memcpy(prev->values + prev->num_keys, block->values,
+                        block->num_keys * sizeof(uint32_t));
+                prev->num_keys += block->num_keys;
+                block->num_keys = 0;
+                locus_map_remove_block(self, b);
+            } else {
+                b++;
+            }
+        }
+        j = 0;
+    }
+}
+
+static void
+locus_map_set_cursor(locus_map_t *self, size_t block, uint32_t index,
+        locus_map_cursor_t *cursor)
+{
+    cursor->block = block;
+    cursor->index = index;
+    cursor->key = self->blocks[block]->keys[index];
+    cursor->value = &self->blocks[block]->values[index];
+}
+
+/* Positions the cursor at the first entry. Returns 1 if the map is not
+ * empty, and 0 otherwise. */
+int
+locus_map_first(locus_map_t *self, locus_map_cursor_t *cursor)
+{
+    int ret = 0;
+
+    if (self->size > 0) {
+        locus_map_set_cursor(self, 0, 0, cursor);
+        ret = 1;
+    }
+    return ret;
+}
+
+/* Positions the cursor at the entry with the largest key <= the specified
+ * key. Returns 1 if there is such an entry, and 0 otherwise. */
+int
+locus_map_seek(locus_map_t *self, uint32_t key, locus_map_cursor_t *cursor)
+{
+    int ret = 0;
+    size_t b;
+    uint32_t j;
+    locus_map_block_t *block;
+
+    if (self->size > 0 && self->first_keys[0] <= key) {
+        b = locus_map_find_block(self, key);
+        block = self->blocks[b];
+        j = locus_map_block_lower_bound(block, key);
+        if (j == block->num_keys || block->keys[j] != key) {
+            /* first_keys[b] <= key, so j > 0 */
+            j--;
+        }
+        locus_map_set_cursor(self, b, j, cursor);
+        ret = 1;
+    }
+    return ret;
+}
+
+/* Advances the cursor to the next entry. Returns 1 if there is a next
+ * entry, and 0 otherwise. */
+int
+locus_map_next(locus_map_t *self, locus_map_cursor_t *cursor)
+{
+    int ret = 0;
+    size_t b = cursor->block;
+    uint32_t j = cursor->index + 1;
+
+    if (j == self->blocks[b]->num_keys) {
+        b++;
+        j = 0;
+    }
+    if (b < self->num_blocks) {
+        locus_map_set_cursor(self, b, j, cursor);
+        ret = 1;
+    }
+    return ret;
+}
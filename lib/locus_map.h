@@ -0,0 +1,74 @@
+/*
+** Copyright (C) 2017 University of Oxford
+**
+** This file is part of msprime.
+**
+** msprime is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** msprime is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with msprime.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __LOCUS_MAP_H__
+#define __LOCUS_MAP_H__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#define LOCUS_MAP_BLOCK_SIZE 64
+
+typedef struct {
+    uint32_t num_keys;
+    uint32_t keys[LOCUS_MAP_BLOCK_SIZE];
+    uint32_t values[LOCUS_MAP_BLOCK_SIZE];
+} locus_map_block_t;
+
+typedef struct {
+    size_t size;
+    size_t num_blocks;
+    size_t num_allocated_blocks;
+    size_t max_blocks;
+    /* Bytes allocated for the index and the blocks */
+    size_t total_memory;
+    /* The first key in each block, in order */
+    uint32_t *first_keys;
+    /* The blocks in key order. Entries from num_blocks up to
+     * num_allocated_blocks are empty blocks available for reuse. */
+    locus_map_block_t **blocks;
+} locus_map_t;
+
+/* A position in a locus_map. Key and value refer to the current
+ * entry, and value can be updated in place. The cursor is invalidated
+ * by any insertion or compression.
+ */
+typedef struct {
+    size_t block;
+    uint32_t index;
+    uint32_t key;
+    uint32_t *value;
+} locus_map_cursor_t;
+
+int locus_map_alloc(locus_map_t *self);
+int locus_map_free(locus_map_t *self);
+void locus_map_clear(locus_map_t *self);
+void locus_map_print_state(locus_map_t *self, FILE *out);
+size_t locus_map_get_size(locus_map_t *self);
+size_t locus_map_get_total_memory(locus_map_t *self);
+uint32_t *locus_map_get(locus_map_t *self, uint32_t key);
+int locus_map_insert(locus_map_t *self, uint32_t key, uint32_t value);
+int locus_map_get_floor(locus_map_t *self, uint32_t key, uint32_t *value);
+void locus_map_compress(locus_map_t *self, uint32_t left, uint32_t right);
+int locus_map_first(locus_map_t *self, locus_map_cursor_t *cursor);
+int locus_map_seek(locus_map_t *self, uint32_t key, locus_map_cursor_t *cursor);
+int locus_map_next(locus_map_t *self, locus_map_cursor_t *cursor);
+
+#endif /*__LOCUS_MAP_H__*/
@@ -23,6 +23,7 @@
 #include <stdarg.h>
 #include <float.h>
 
+#include <pthread.h>
 #include <regex.h>
 #include <libconfig.h>
 #include <gsl/gsl_math.h>
@@ -40,6 +41,35 @@ typedef struct {
     double mutation_rate;
 } mutation_params_t;
 
+/* The replicates to be simulated by the worker threads, and the
+ * synchronisation needed to write their output in order. */
+typedef struct {
+    const char *output_file;
+    int verbose;
+    int num_replicates;
+    unsigned long *seeds;
+    int next_replicate;
+    int next_output;
+    int error;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} replicate_queue_t;
+
+/* Each worker thread has its own simulator, tables and random generator */
+typedef struct {
+    replicate_queue_t *queue;
+    gsl_rng *rng;
+    msp_t *msp;
+    tree_sequence_t *tree_seq;
+    recomb_map_t *recomb_map;
+    mutgen_t *mutgen;
+    node_table_t *nodes;
+    edgeset_table_t *edgesets;
+    site_table_t *sites;
+    mutation_table_t *mutations;
+    migration_table_t *migrations;
+} simulate_worker_t;
+
 static void
 fatal_error(const char *msg, ...)
 {
@@ -654,7 +684,7 @@ print_ld_matrix(tree_sequence_t *ts)
     ld_calc_print_state(&ld_calc, stdout);
     for (j = 0; j < num_sites; j++) {
         ret = ld_calc_get_r2_array(&ld_calc, j, MSP_DIR_FORWARD, num_sites,
-                DBL_MAX, r2, &num_r2_values);
+                DBL_MAX, MSP_LD_STAT_R2, r2, &num_r2_values);
         if (ret != 0) {
             fatal_library_error(ret, "ld_calc_get_r2_array");
         }
@@ -784,166 +814,309 @@ print_tree_sequence(tree_sequence_t *ts, int verbose)
     }
 }
 
+/* Frees the resources used by a simulation worker. */
 static void
-run_simulate(const char *conf_file, const char *output_file, int verbose, int num_replicates)
+simulate_worker_free(simulate_worker_t *self)
+{
+    if (self->msp != NULL) {
+        msp_free(self->msp);
+        free(self->msp);
+    }
+    if (self->tree_seq != NULL) {
+        tree_sequence_free(self->tree_seq);
+        free(self->tree_seq);
+    }
+    if (self->recomb_map != NULL) {
+        recomb_map_free(self->recomb_map);
+        free(self->recomb_map);
+    }
+    if (self->mutgen != NULL) {
+        mutgen_free(self->mutgen);
+        free(self->mutgen);
+    }
+    if (self->rng != NULL) {
+        gsl_rng_free(self->rng);
+    }
+    if (self->edgesets != NULL) {
+        edgeset_table_free(self->edgesets);
+        free(self->edgesets);
+    }
+    if (self->nodes != NULL) {
+        node_table_free(self->nodes);
+        free(self->nodes);
+    }
+    if (self->mutations != NULL) {
+        mutation_table_free(self->mutations);
+        free(self->mutations);
+    }
+    if (self->sites != NULL) {
+        site_table_free(self->sites);
+        free(self->sites);
+    }
+    if (self->migrations != NULL) {
+        migration_table_free(self->migrations);
+        free(self->migrations);
+    }
+}
+
+/* Allocates a simulator, tables and mutation generator for a worker,
+ * configured from the specified file.
+ */
+static int
+simulate_worker_alloc(simulate_worker_t *self, replicate_queue_t *queue,
+        const char *conf_file)
 {
     int ret = -1;
-    int j;
     mutation_params_t mutation_params;
-    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
-    msp_t *msp = calloc(1, sizeof(msp_t));
-    tree_sequence_t *tree_seq = calloc(1, sizeof(tree_sequence_t));
-    recomb_map_t *recomb_map = calloc(1, sizeof(recomb_map_t));
-    mutgen_t *mutgen = calloc(1, sizeof(mutgen_t));
-    const char *provenance[] = {"main.simulate"};
-    node_table_t *nodes = malloc(sizeof(node_table_t));
-    edgeset_table_t *edgesets = malloc(sizeof(edgeset_table_t));
-    site_table_t *sites = malloc(sizeof(site_table_t));
-    mutation_table_t *mutations = malloc(sizeof(mutation_table_t));
-    migration_table_t *migrations = malloc(sizeof(migration_table_t));
-
 
-    if (rng == NULL || msp == NULL || tree_seq == NULL || recomb_map == NULL
-            || mutgen == NULL || nodes == NULL || edgesets == NULL
-            || sites == NULL || mutations == NULL || migrations == NULL) {
+    memset(self, 0, sizeof(simulate_worker_t));
+    self->queue = queue;
+    self->rng = gsl_rng_alloc(gsl_rng_default);
+    self->msp = calloc(1, sizeof(msp_t));
+    self->tree_seq = calloc(1, sizeof(tree_sequence_t));
+    self->recomb_map = calloc(1, sizeof(recomb_map_t));
+    self->mutgen = calloc(1, sizeof(mutgen_t));
+    self->nodes = malloc(sizeof(node_table_t));
+    self->edgesets = malloc(sizeof(edgeset_table_t));
+    self->sites = malloc(sizeof(site_table_t));
+    self->mutations = malloc(sizeof(mutation_table_t));
+    self->migrations = malloc(sizeof(migration_table_t));
+    if (self->rng == NULL || self->msp == NULL || self->tree_seq == NULL
+            || self->recomb_map == NULL || self->mutgen == NULL
+            || self->nodes == NULL || self->edgesets == NULL
+            || self->sites == NULL || self->mutations == NULL
+            || self->migrations == NULL) {
         goto out;
     }
-    ret = get_configuration(rng, msp, &mutation_params, recomb_map, conf_file);
+    ret = get_configuration(self->rng, self->msp, &mutation_params,
+            self->recomb_map, conf_file);
     if (ret != 0) {
         goto out;
     }
-    ret = edgeset_table_alloc(edgesets, 10, 10);
+    ret = edgeset_table_alloc(self->edgesets, 10, 10);
     if (ret != 0) {
         goto out;
     }
-    ret = node_table_alloc(nodes, 10, 10);
+    ret = node_table_alloc(self->nodes, 10, 10);
     if (ret != 0) {
         goto out;
     }
-    ret = site_table_alloc(sites, 1, 1);
+    ret = site_table_alloc(self->sites, 1, 1);
     if (ret != 0) {
         goto out;
     }
-    ret = mutation_table_alloc(mutations, 10, 10);
+    ret = mutation_table_alloc(self->mutations, 10, 10);
     if (ret != 0) {
         goto out;
     }
-    ret = migration_table_alloc(migrations, 10);
+    ret = migration_table_alloc(self->migrations, 10);
     if (ret != 0) {
         goto out;
     }
-    ret = mutgen_alloc(mutgen, mutation_params.mutation_rate, rng,
+    ret = mutgen_alloc(self->mutgen, mutation_params.mutation_rate, self->rng,
             mutation_params.alphabet, 1024);
     if (ret != 0) {
         goto out;
     }
-    ret = msp_initialise(msp);
+    ret = msp_initialise(self->msp);
     if (ret != 0) {
         goto out;
     }
-    ret = tree_sequence_initialise(tree_seq);
+    ret = tree_sequence_initialise(self->tree_seq);
+out:
+    return ret;
+}
+
+/* Simulates the specified replicate and loads the result into the
+ * worker's tree sequence.
+ */
+static int
+simulate_worker_run_replicate(simulate_worker_t *self, int replicate)
+{
+    int ret = 0;
+    const char *provenance[] = {"main.simulate"};
+
+    gsl_rng_set(self->rng, self->queue->seeds[replicate]);
+    ret = msp_reset(self->msp);
     if (ret != 0) {
         goto out;
     }
-    for (j = 0; j < num_replicates; j++) {
-        if (verbose >= 1) {
-            printf("=====================\n");
-            printf("replicate %d\n", j);
-            printf("=====================\n");
-        }
-        ret = msp_reset(msp);
+    ret = msp_run(self->msp, DBL_MAX, UINT32_MAX);
+    if (ret < 0) {
+        goto out;
+    }
+    msp_verify(self->msp);
+    /* Create the tree_sequence from the state of the simulator.
+     * We want to use coalescent time here, so use an Ne of 1/4
+     * to cancel scaling factor. */
+    ret = msp_populate_tables(self->msp, 0.25, self->recomb_map, self->nodes,
+            self->edgesets, self->migrations);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = mutgen_generate_tables_tmp(self->mutgen, self->nodes, self->edgesets);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = mutgen_populate_tables(self->mutgen, self->sites, self->mutations);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = tree_sequence_take_tables_tmp(self->tree_seq, self->nodes,
+            self->edgesets, self->migrations, self->sites, self->mutations,
+            1, (char **) &provenance);
+out:
+    return ret;
+}
+
+/* Writes the output for the specified replicate. This is called with the
+ * queue mutex held, in replicate order.
+ */
+static int
+simulate_worker_write_replicate(simulate_worker_t *self, int replicate)
+{
+    int ret = 0;
+    replicate_queue_t *queue = self->queue;
+
+    if (queue->verbose >= 1) {
+        printf("=====================\n");
+        printf("replicate %d\n", replicate);
+        printf("=====================\n");
+        ret = msp_print_state(self->msp, stdout);
         if (ret != 0) {
             goto out;
         }
-        ret = msp_run(msp, DBL_MAX, UINT32_MAX);
-        if (ret < 0) {
-            goto out;
-        }
-        msp_verify(msp);
-        if (verbose >= 1) {
-            ret = msp_print_state(msp, stdout);
-        }
+    }
+    if (queue->output_file != NULL) {
+        ret = tree_sequence_dump(self->tree_seq, queue->output_file, 0);
         if (ret != 0) {
             goto out;
         }
-        /* Create the tree_sequence from the state of the simulator.
-         * We want to use coalescent time here, so use an Ne of 1/4
-         * to cancel scaling factor. */
-        ret = msp_populate_tables(msp, 0.25, recomb_map, nodes, edgesets, migrations);
-        if (ret != 0) {
-            goto out;
+    }
+    if (queue->verbose >= 1) {
+        node_table_print_state(self->nodes, stdout);
+        edgeset_table_print_state(self->edgesets, stdout);
+        site_table_print_state(self->sites, stdout);
+        mutation_table_print_state(self->mutations, stdout);
+        migration_table_print_state(self->migrations, stdout);
+        printf("-----------------\n");
+        mutgen_print_state(self->mutgen, stdout);
+        printf("-----------------\n");
+        tree_sequence_print_state(self->tree_seq, stdout);
+    }
+out:
+    return ret;
+}
+
+/* Takes replicates from the queue until it is empty. The simulations run
+ * concurrently, but the output for each replicate is written in order.
+ */
+static void *
+simulate_worker_thread(void *arg)
+{
+    int ret = 0;
+    int replicate;
+    simulate_worker_t *self = (simulate_worker_t *) arg;
+    replicate_queue_t *queue = self->queue;
+
+    while (true) {
+        pthread_mutex_lock(&queue->mutex);
+        replicate = queue->next_replicate;
+        queue->next_replicate++;
+        if (queue->error != 0) {
+            replicate = queue->num_replicates;
         }
-        ret = mutgen_generate_tables_tmp(mutgen, nodes, edgesets);
-        if (ret != 0) {
-            goto out;
+        pthread_mutex_unlock(&queue->mutex);
+        if (replicate >= queue->num_replicates) {
+            break;
         }
-        ret = mutgen_populate_tables(mutgen, sites, mutations);
-        if (ret != 0) {
-            goto out;
+        ret = simulate_worker_run_replicate(self, replicate);
+
+        pthread_mutex_lock(&queue->mutex);
+        while (queue->next_output != replicate && queue->error == 0) {
+            pthread_cond_wait(&queue->cond, &queue->mutex);
         }
-        ret = tree_sequence_load_tables_tmp(tree_seq, nodes, edgesets, migrations,
-                sites, mutations, 1, (char **) &provenance);
-        if (ret != 0) {
-            goto out;
+        if (ret == 0 && queue->error == 0) {
+            ret = simulate_worker_write_replicate(self, replicate);
         }
-        if (output_file != NULL) {
-            ret = tree_sequence_dump(tree_seq, output_file, 0);
-            if (ret != 0) {
-                goto out;
-            }
+        if (ret != 0 && queue->error == 0) {
+            queue->error = ret;
         }
-        if (verbose >= 1) {
-            node_table_print_state(nodes, stdout);
-            edgeset_table_print_state(edgesets, stdout);
-            site_table_print_state(sites, stdout);
-            mutation_table_print_state(mutations, stdout);
-            migration_table_print_state(migrations, stdout);
-            printf("-----------------\n");
-            mutgen_print_state(mutgen, stdout);
-            printf("-----------------\n");
-            tree_sequence_print_state(tree_seq, stdout);
+        queue->next_output++;
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->mutex);
+        if (ret != 0) {
+            break;
         }
     }
-out:
-    if (msp != NULL) {
-        msp_free(msp);
-        free(msp);
-    }
-    if (tree_seq != NULL) {
-        tree_sequence_free(tree_seq);
-        free(tree_seq);
-    }
-    if (recomb_map != NULL) {
-        recomb_map_free(recomb_map);
-        free(recomb_map);
+    return NULL;
+}
+
+static void
+run_simulate(const char *conf_file, const char *output_file, int verbose,
+        int num_replicates, int num_threads)
+{
+    int ret = -1;
+    int j;
+    simulate_worker_t *workers = NULL;
+    pthread_t *threads = NULL;
+    replicate_queue_t queue;
+
+    if (num_threads < 1) {
+        fatal_error("number of threads must be >= 1");
+    }
+    num_threads = GSL_MAX(1, GSL_MIN(num_threads, num_replicates));
+    memset(&queue, 0, sizeof(queue));
+    queue.output_file = output_file;
+    queue.verbose = verbose;
+    queue.num_replicates = num_replicates;
+    pthread_mutex_init(&queue.mutex, NULL);
+    pthread_cond_init(&queue.cond, NULL);
+    workers = calloc((size_t) num_threads, sizeof(simulate_worker_t));
+    threads = malloc((size_t) num_threads * sizeof(pthread_t));
+    queue.seeds = malloc((size_t) GSL_MAX(1, num_replicates) * sizeof(unsigned long));
+    if (workers == NULL || threads == NULL || queue.seeds == NULL) {
+        goto out;
     }
-    if (mutgen != NULL) {
-        mutgen_free(mutgen);
-        free(mutgen);
+    for (j = 0; j < num_threads; j++) {
+        ret = simulate_worker_alloc(&workers[j], &queue, conf_file);
+        if (ret != 0) {
+            goto out;
+        }
     }
-    if (rng != NULL) {
-        gsl_rng_free(rng);
+    /* Each replicate gets its own seed, drawn from the random_seed in the
+     * configuration, so that the output doesn't depend on the number of
+     * threads. */
+    for (j = 0; j < num_replicates; j++) {
+        queue.seeds[j] = gsl_rng_get(workers[0].rng);
     }
-    if (edgesets != NULL) {
-        edgeset_table_free(edgesets);
-        free(edgesets);
+    for (j = 0; j < num_threads; j++) {
+        if (pthread_create(&threads[j], NULL, simulate_worker_thread,
+                    &workers[j]) != 0) {
+            fatal_error("cannot create thread");
+        }
     }
-    if (nodes != NULL) {
-        node_table_free(nodes);
-        free(nodes);
+    for (j = 0; j < num_threads; j++) {
+        if (pthread_join(threads[j], NULL) != 0) {
+            fatal_error("cannot join thread");
+        }
     }
-    if (mutations != NULL) {
-        mutation_table_free(mutations);
-        free(mutations);
+    ret = queue.error;
+out:
+    if (workers != NULL) {
+        for (j = 0; j < num_threads; j++) {
+            simulate_worker_free(&workers[j]);
+        }
+        free(workers);
     }
-    if (sites != NULL) {
-        site_table_free(sites);
-        free(sites);
+    if (threads != NULL) {
+        free(threads);
     }
-    if (migrations != NULL) {
-        migration_table_free(migrations);
-        free(migrations);
+    if (queue.seeds != NULL) {
+        free(queue.seeds);
     }
+    pthread_mutex_destroy(&queue.mutex);
+    pthread_cond_destroy(&queue.cond);
     if (ret != 0) {
         printf("error occured:%d:%s\n", ret, msp_strerror(ret));
     }
@@ -1071,16 +1244,19 @@ run_simplify(const char *input_filename, const char *output_filename, int verbos
 int
 main(int argc, char** argv)
 {
-    /* SYNTAX 1: simulate [-v] <config-file> -o <output-file> */
+    /* SYNTAX 1: simulate [-v] <config-file> -o <output-file> [-t <num-threads>] */
     struct arg_rex *cmd1 = arg_rex1(NULL, NULL, "simulate", NULL, REG_ICASE, NULL);
     struct arg_lit *verbose1 = arg_lit0("v", "verbose", NULL);
     struct arg_int *replicates1 = arg_int0("r", "replicates", "<num-replicates>",
             "number of replicates to run");
+    struct arg_int *threads1 = arg_int0("t", "threads", "<num-threads>",
+            "number of threads used to run replicates");
     struct arg_file *infiles1 = arg_file1(NULL, NULL, NULL, NULL);
     struct arg_file *output1 = arg_file0("o", "output", "output-file",
             "Output HDF5 file");
     struct arg_end *end1 = arg_end(20);
-    void* argtable1[] = {cmd1, verbose1, infiles1, output1, replicates1, end1};
+    void* argtable1[] = {cmd1, verbose1, infiles1, output1, replicates1, threads1,
+        end1};
     int nerrors1;
 
     /* SYNTAX 2: ld [-v] <input-file> */
@@ -1157,6 +1333,7 @@ main(int argc, char** argv)
 
     /* Set defaults */
     replicates1->ival[0] = 1;
+    threads1->ival[0] = 1;
     output1->filename[0] = NULL;
     ploidy5->ival[0] = 1;
     chrom5->sval[0] = "1";
@@ -1173,7 +1350,7 @@ main(int argc, char** argv)
 
     if (nerrors1 == 0) {
         run_simulate(infiles1->filename[0], output1->filename[0], verbose1->count,
-                replicates1->ival[0]);
+                replicates1->ival[0], threads1->ival[0]);
     } else if (nerrors2 == 0) {
         run_ld(infiles2->filename[0], verbose2->count);
     } else if (nerrors3 == 0) {
@@ -33,6 +33,7 @@
 #include "avl.h"
 #include "object_heap.h"
 #include "fenwick.h"
+#include "sum_tree.h"
 #include "msprime.h"
 
 #define MSP_HDF5_ERR_MSG_SIZE 1024
@@ -139,6 +140,13 @@ msp_strerror(int err)
         case MSP_ERR_NODE_SAMPLE_INTERNAL:
             ret = "Cannot sample internal nodes.";
             break;
+        case MSP_ERR_BAD_WINDOWS:
+            ret = "Windows must start at 0, end at the sequence length "
+                "and be strictly increasing.";
+            break;
+        case MSP_ERR_THREAD:
+            ret = "Error creating or joining a thread.";
+            break;
         case MSP_ERR_BAD_EDGESET_NONMATCHING_RIGHT:
             ret = "Bad edgeset in file: right coordinate not matching any left coordinate.";
             break;
@@ -288,32 +296,53 @@ __msp_safe_free(void **ptr) {
     }
 }
 
+/* Ensures the specified array can hold at least min_size objects, at least
+ * doubling its size when it must grow. */
+int WARN_UNUSED
+__msp_expand_array(void **array, size_t *max_size, size_t min_size,
+        size_t object_size)
+{
+    int ret = 0;
+    size_t new_size;
+    void *tmp;
+
+    if (min_size > *max_size) {
+        new_size = GSL_MAX(2 * *max_size, min_size);
+        tmp = realloc(*array, new_size * object_size);
+        if (tmp == NULL) {
+            ret = MSP_ERR_NO_MEMORY;
+            goto out;
+        }
+        *array = tmp;
+        *max_size = new_size;
+    }
+out:
+    return ret;
+}
+
+/* The items in the population AVL trees are the IDs of the head segments
+ * of each ancestor, stored directly in the item pointer. */
 static int
 cmp_individual(const void *a, const void *b) {
-    const segment_t *ia = (const segment_t *) a;
-    const segment_t *ib = (const segment_t *) b;
-    return (ia->id > ib->id) - (ia->id < ib->id);
+    uintptr_t ia = (uintptr_t) a;
+    uintptr_t ib = (uintptr_t) b;
+    return (ia > ib) - (ia < ib);
 }
 
 /* For the segment priority queue we want to sort on the left
- * coordinate and to break ties we arbitrarily use the ID */
+ * coordinate and to break ties we arbitrarily use the ID. The items
+ * are node mappings from the left coordinate to the segment ID. */
 static int
 cmp_segment_queue(const void *a, const void *b) {
-    const segment_t *ia = (const segment_t *) a;
-    const segment_t *ib = (const segment_t *) b;
+    const node_mapping_t *ia = (const node_mapping_t *) a;
+    const node_mapping_t *ib = (const node_mapping_t *) b;
     int ret = (ia->left > ib->left) - (ia->left < ib->left);
     if (ret == 0)  {
-        ret = (ia->id > ib->id) - (ia->id < ib->id);
+        ret = (ia->value > ib->value) - (ia->value < ib->value);
     }
     return ret;
 }
 
-static int
-cmp_node_mapping(const void *a, const void *b) {
-    const node_mapping_t *ia = (const node_mapping_t *) a;
-    const node_mapping_t *ib = (const node_mapping_t *) b;
-    return (ia->left > ib->left) - (ia->left < ib->left);
-}
 
 static int
 cmp_sampling_event(const void *a, const void *b) {
@@ -322,6 +351,32 @@ cmp_sampling_event(const void *a, const void *b) {
     return (ia->time > ib->time) - (ia->time < ib->time);
 }
 
+/* A lineage in the DTWF model, along with the population and index of
+ * the diploid parent that it descends from in the previous generation.
+ */
+typedef struct {
+    population_id_t population_id;
+    uint32_t parent;
+    segment_id_t head;
+} dtwf_lineage_t;
+
+/* Sort lineages by parent, so that lineages with the same parent are
+ * adjacent, breaking ties by ID to keep the order deterministic. */
+static int
+cmp_dtwf_lineage(const void *a, const void *b) {
+    const dtwf_lineage_t *ia = (const dtwf_lineage_t *) a;
+    const dtwf_lineage_t *ib = (const dtwf_lineage_t *) b;
+    int ret = (ia->population_id > ib->population_id)
+        - (ia->population_id < ib->population_id);
+    if (ret == 0) {
+        ret = (ia->parent > ib->parent) - (ia->parent < ib->parent);
+    }
+    if (ret == 0) {
+        ret = (ia->head > ib->head) - (ia->head < ib->head);
+    }
+    return ret;
+}
+
 static int
 cmp_node_id_t(const void *a, const void *b) {
     const node_id_t *ia = (const node_id_t *) a;
@@ -329,11 +384,11 @@ cmp_node_id_t(const void *a, const void *b) {
     return (*ia > *ib) - (*ia < *ib);
 }
 
-static void
-segment_init(void **obj, size_t id)
-{
-    segment_t *seg = (segment_t *) obj;
-    seg->id = id + 1;
+static int
+cmp_double(const void *a, const void *b) {
+    const double *ia = (const double *) a;
+    const double *ib = (const double *) b;
+    return (*ia > *ib) - (*ia < *ib);
 }
 
 static size_t
@@ -353,9 +408,10 @@ msp_get_binary_children_mem_increment(msp_t *self)
 static size_t
 msp_get_segment_mem_increment(msp_t *self)
 {
-    /* we have a segment, a pointer to it and an entry in the Fenwick tree */
-    size_t s = sizeof(segment_t) + sizeof(void *) + 2 * sizeof(int64_t);
-    return sizeof(void *) + self->segment_block_size * s;
+    /* we have an entry in each of the segment columns and in the Fenwick tree */
+    size_t s = sizeof(population_id_t) + 2 * sizeof(uint32_t) + sizeof(node_id_t)
+        + 2 * sizeof(segment_id_t) + 2 * sizeof(int64_t);
+    return self->segment_block_size * s;
 }
 
 static size_t
@@ -380,7 +436,7 @@ msp_get_num_node_mapping_blocks(msp_t *self)
 size_t
 msp_get_num_segment_blocks(msp_t *self)
 {
-    return self->segment_heap.num_blocks;
+    return self->segments.size / self->segment_block_size;
 }
 
 size_t
@@ -419,6 +475,21 @@ msp_get_num_recombination_events(msp_t *self)
     return self->num_re_events;
 }
 
+static int
+msp_set_simulation_model(msp_t *self, int model)
+{
+    int ret = 0;
+
+    if (self->demographic_events_head != NULL) {
+        /* We must set the model before any demographic events */
+        ret = MSP_ERR_UNSUPPORTED_OPERATION;
+        goto out;
+    }
+    self->model.type = model;
+out:
+    return ret;
+}
+
 int
 msp_set_simulation_model_non_parametric(msp_t *self, int model)
 {
@@ -431,12 +502,7 @@ msp_set_simulation_model_non_parametric(msp_t *self, int model)
         ret = MSP_ERR_BAD_MODEL;
         goto out;
     }
-    if (self->demographic_events_head != NULL) {
-        /* We must set the model before any demographic events */
-        ret = MSP_ERR_UNSUPPORTED_OPERATION;
-        goto out;
-    }
-    self->model.type = model;
+    ret = msp_set_simulation_model(self, model);
 out:
     return ret;
 }
@@ -474,6 +540,26 @@ out:
     return ret;
 }
 
+int
+msp_set_simulation_model_dtwf(msp_t *self, double population_size,
+        double num_generations)
+{
+    int ret = 0;
+
+    if (population_size <= 0 || num_generations < 0) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
+        goto out;
+    }
+    ret = msp_set_simulation_model(self, MSP_MODEL_DTWF);
+    if (ret != 0) {
+        goto out;
+    }
+    self->model.params.dtwf.population_size = population_size;
+    self->model.params.dtwf.num_generations = num_generations;
+out:
+    return ret;
+}
+
 int
 msp_set_store_migrations(msp_t *self, bool store_migrations)
 {
@@ -513,6 +599,9 @@ msp_set_num_populations(msp_t *self, size_t num_populations)
     if (self->migration_matrix != NULL) {
         free(self->migration_matrix);
     }
+    if (self->migration_rate_totals != NULL) {
+        free(self->migration_rate_totals);
+    }
     if (self->num_migration_events != NULL) {
         free(self->num_migration_events);
     }
@@ -527,11 +616,13 @@ msp_set_num_populations(msp_t *self, size_t num_populations)
             sizeof(double));
     self->migration_matrix = calloc(num_populations * num_populations,
             sizeof(double));
+    self->migration_rate_totals = calloc(num_populations, sizeof(double));
     self->num_migration_events = calloc(num_populations * num_populations,
             sizeof(size_t));
     self->initial_populations = calloc(num_populations, sizeof(population_t));
     self->populations = calloc(num_populations, sizeof(population_t));
     if (self->migration_matrix == NULL
+            || self->migration_rate_totals == NULL
             || self->initial_migration_matrix == NULL
             || self->num_migration_events == NULL
             || self->initial_populations == NULL
@@ -656,6 +747,24 @@ out:
     return ret;
 }
 
+int
+msp_set_links_index(msp_t *self, int links_index)
+{
+    int ret = 0;
+
+    if (links_index != MSP_LINKS_FENWICK && links_index != MSP_LINKS_SUM_TREE) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
+        goto out;
+    }
+    if (self->state != MSP_STATE_NEW) {
+        ret = MSP_ERR_BAD_STATE;
+        goto out;
+    }
+    self->links_index = links_index;
+out:
+    return ret;
+}
+
 int
 msp_set_avl_node_block_size(msp_t *self, size_t block_size)
 {
@@ -698,6 +807,203 @@ out:
     return ret;
 }
 
+/* The links index records the number of links in each segment, and is
+ * indexed by segment ID. It is either a Fenwick tree or a B-ary sum tree.
+ */
+
+static int WARN_UNUSED
+msp_links_alloc(msp_t *self)
+{
+    int ret;
+
+    if (self->links_index == MSP_LINKS_SUM_TREE) {
+        ret = sum_tree_alloc(&self->links_sum_tree, self->segment_block_size);
+    } else {
+        ret = fenwick_alloc(&self->links, self->segment_block_size);
+    }
+    return ret;
+}
+
+static int WARN_UNUSED
+msp_links_expand(msp_t *self)
+{
+    int ret;
+
+    if (self->links_index == MSP_LINKS_SUM_TREE) {
+        ret = sum_tree_expand(&self->links_sum_tree, self->segment_block_size);
+    } else {
+        ret = fenwick_expand(&self->links, self->segment_block_size);
+    }
+    return ret;
+}
+
+static void
+msp_links_free(msp_t *self)
+{
+    fenwick_free(&self->links);
+    sum_tree_free(&self->links_sum_tree);
+}
+
+static inline size_t
+msp_links_get_size(msp_t *self)
+{
+    size_t ret;
+
+    if (self->links_index == MSP_LINKS_SUM_TREE) {
+        ret = sum_tree_get_size(&self->links_sum_tree);
+    } else {
+        ret = fenwick_get_size(&self->links);
+    }
+    return ret;
+}
+
+static inline int64_t
+msp_links_get_total(msp_t *self)
+{
+    int64_t ret;
+
+    if (self->links_index == MSP_LINKS_SUM_TREE) {
+        ret = sum_tree_get_total(&self->links_sum_tree);
+    } else {
+        ret = fenwick_get_total(&self->links);
+    }
+    return ret;
+}
+
+static inline int64_t
+msp_links_get_value(msp_t *self, segment_id_t seg)
+{
+    int64_t ret;
+
+    if (self->links_index == MSP_LINKS_SUM_TREE) {
+        ret = sum_tree_get_value(&self->links_sum_tree, seg);
+    } else {
+        ret = fenwick_get_value(&self->links, seg);
+    }
+    return ret;
+}
+
+static inline void
+msp_links_increment(msp_t *self, segment_id_t seg, int64_t value)
+{
+    if (self->links_index == MSP_LINKS_SUM_TREE) {
+        sum_tree_increment(&self->links_sum_tree, seg, value);
+    } else {
+        fenwick_increment(&self->links, seg, value);
+    }
+}
+
+static inline void
+msp_links_set_value(msp_t *self, segment_id_t seg, int64_t value)
+{
+    if (self->links_index == MSP_LINKS_SUM_TREE) {
+        sum_tree_set_value(&self->links_sum_tree, seg, value);
+    } else {
+        fenwick_set_value(&self->links, seg, value);
+    }
+}
+
+/* Returns the segment containing the specified link, and the total number
+ * of links up to and including this segment. */
+static inline segment_id_t
+msp_links_find(msp_t *self, int64_t link, int64_t *cumulative_links)
+{
+    size_t ret;
+
+    if (self->links_index == MSP_LINKS_SUM_TREE) {
+        ret = sum_tree_find_with_sum(&self->links_sum_tree, link, cumulative_links);
+    } else {
+        ret = fenwick_find_with_sum(&self->links, link, cumulative_links);
+    }
+    return (segment_id_t) ret;
+}
+
+/* Segment pool. Segments are stored in a set of contiguous columns which
+ * are grown by segment_block_size slots at a time. Since all references to
+ * segments are IDs, the columns can be freely moved by realloc.
+ */
+
+static int WARN_UNUSED
+msp_expand_segment_pool(msp_t *self)
+{
+    int ret = MSP_ERR_NO_MEMORY;
+    segment_pool_t *pool = &self->segments;
+    size_t j;
+    size_t size = pool->size + self->segment_block_size;
+    /* Slot 0 is reserved for MSP_NULL_SEGMENT */
+    size_t n = size + 1;
+    void *p;
+
+    if (size >= UINT32_MAX) {
+        goto out;
+    }
+    p = realloc(pool->population_id, n * sizeof(population_id_t));
+    if (p == NULL) {
+        goto out;
+    }
+    pool->population_id = p;
+    p = realloc(pool->left, n * sizeof(uint32_t));
+    if (p == NULL) {
+        goto out;
+    }
+    pool->left = p;
+    p = realloc(pool->right, n * sizeof(uint32_t));
+    if (p == NULL) {
+        goto out;
+    }
+    pool->right = p;
+    p = realloc(pool->value, n * sizeof(node_id_t));
+    if (p == NULL) {
+        goto out;
+    }
+    pool->value = p;
+    p = realloc(pool->prev, n * sizeof(segment_id_t));
+    if (p == NULL) {
+        goto out;
+    }
+    pool->prev = p;
+    p = realloc(pool->next, n * sizeof(segment_id_t));
+    if (p == NULL) {
+        goto out;
+    }
+    pool->next = p;
+    /* Push the new slots onto the free list so that the lowest IDs are
+     * allocated first. */
+    for (j = size; j > pool->size; j--) {
+        pool->next[j] = pool->free_head;
+        pool->free_head = (segment_id_t) j;
+    }
+    pool->size = size;
+    ret = 0;
+out:
+    return ret;
+}
+
+static void
+msp_free_segment_pool(msp_t *self)
+{
+    segment_pool_t *pool = &self->segments;
+
+    if (pool->population_id != NULL) {
+        free(pool->population_id);
+    }
+    if (pool->left != NULL) {
+        free(pool->left);
+    }
+    if (pool->right != NULL) {
+        free(pool->right);
+    }
+    if (pool->value != NULL) {
+        free(pool->value);
+    }
+    if (pool->prev != NULL) {
+        free(pool->prev);
+    }
+    if (pool->next != NULL) {
+        free(pool->next);
+    }
+}
+
 /* Top level allocators and initialisation */
 
 int
@@ -715,6 +1021,7 @@ msp_alloc(msp_t *self, size_t sample_size, sample_t *samples, gsl_rng *rng)
     self->rng = rng;
     self->num_loci = 1;
     self->scaled_recombination_rate = 0.0;
+    self->links_index = MSP_LINKS_SUM_TREE;
     self->samples = malloc(sample_size * sizeof(sample_t));
     if (self->samples == NULL) {
         ret = MSP_ERR_NO_MEMORY;
@@ -775,9 +1082,6 @@ msp_alloc(msp_t *self, size_t sample_size, sample_t *samples, gsl_rng *rng)
     self->max_memory = 1024 * 1024 * 1024; /* 1MiB */
     self->coalescence_record_block_size = 1024;
     self->migration_block_size = 1024;
-    /* set up the AVL trees */
-    avl_init_tree(&self->breakpoints, cmp_node_mapping, NULL);
-    avl_init_tree(&self->overlap_counts, cmp_node_mapping, NULL);
     /* Set up the demographic events */
     self->demographic_events_head = NULL;
     self->demographic_events_tail = NULL;
@@ -815,13 +1119,26 @@ msp_alloc_memory_blocks(msp_t *self)
     if (ret != 0) {
         goto out;
     }
+    ret = locus_map_alloc(&self->breakpoints);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = locus_map_alloc(&self->overlap_counts);
+    if (ret != 0) {
+        goto out;
+    }
+    self->used_memory += locus_map_get_total_memory(&self->breakpoints)
+        + locus_map_get_total_memory(&self->overlap_counts);
+    if (self->used_memory > self->max_memory) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
     /* allocate the segments and Fenwick tree */
-    ret = object_heap_init(&self->segment_heap, sizeof(segment_t),
-           self->segment_block_size, segment_init);
+    ret = msp_expand_segment_pool(self);
     if (ret != 0) {
         goto out;
     }
-    ret = fenwick_alloc(&self->links, self->segment_block_size);
+    ret = msp_links_alloc(self);
     if (ret != 0) {
         goto out;
     }
@@ -926,6 +1243,9 @@ msp_free(msp_t *self)
     if (self->migration_matrix != NULL) {
         free(self->migration_matrix);
     }
+    if (self->migration_rate_totals != NULL) {
+        free(self->migration_rate_totals);
+    }
     if (self->num_migration_events != NULL) {
         free(self->num_migration_events);
     }
@@ -943,10 +1263,12 @@ msp_free(msp_t *self)
     }
     /* free the object heaps */
     object_heap_free(&self->avl_node_heap);
-    object_heap_free(&self->segment_heap);
+    msp_free_segment_pool(self);
     object_heap_free(&self->node_mapping_heap);
     object_heap_free(&self->binary_children_heap);
-    fenwick_free(&self->links);
+    msp_links_free(self);
+    locus_map_free(&self->breakpoints);
+    locus_map_free(&self->overlap_counts);
     if (self->coalescence_records != NULL) {
         free(self->coalescence_records);
     }
@@ -1008,87 +1330,90 @@ msp_free_node_mapping(msp_t *self, node_mapping_t *nm)
     object_heap_free_object(&self->node_mapping_heap, nm);
 }
 
-static segment_t * WARN_UNUSED
+static segment_id_t WARN_UNUSED
 msp_alloc_segment(msp_t *self, uint32_t left, uint32_t right, node_id_t value,
-        population_id_t population_id, segment_t *prev, segment_t *next)
+        population_id_t population_id, segment_id_t prev, segment_id_t next)
 {
-    segment_t *seg = NULL;
+    segment_pool_t *pool = &self->segments;
+    segment_id_t seg = MSP_NULL_SEGMENT;
 
-    if (object_heap_empty(&self->segment_heap)) {
+    if (pool->free_head == MSP_NULL_SEGMENT) {
         self->used_memory += msp_get_segment_mem_increment(self);
         if (self->used_memory > self->max_memory) {
             goto out;
         }
-        if (object_heap_expand(&self->segment_heap) != 0) {
+        if (msp_expand_segment_pool(self) != 0) {
             goto out;
         }
-        if (fenwick_expand(&self->links, self->segment_block_size) != 0) {
+        if (msp_links_expand(self) != 0) {
             goto out;
         }
     }
-    seg = (segment_t *) object_heap_alloc_object(&self->segment_heap);
-    if (seg == NULL) {
-        goto out;
-    }
-    seg->prev = prev;
-    seg->next = next;
-    seg->left = left;
-    seg->right = right;
-    seg->value = value;
-    seg->population_id = population_id;
+    seg = pool->free_head;
+    pool->free_head = pool->next[seg];
+    pool->num_allocated++;
+    pool->prev[seg] = prev;
+    pool->next[seg] = next;
+    pool->left[seg] = left;
+    pool->right[seg] = right;
+    pool->value[seg] = value;
+    pool->population_id[seg] = population_id;
 out:
     return seg;
 }
 
-/*
- * Returns the segment with the specified id.
+/* Returns the segment to the pool. Note that this overwrites the next
+ * pointer of seg.
  */
-static segment_t *
-msp_get_segment(msp_t *self, size_t id)
+static void
+msp_free_segment(msp_t *self, segment_id_t seg)
 {
-    segment_t *u = object_heap_get_object(&self->segment_heap, id - 1);
+    segment_pool_t *pool = &self->segments;
 
-    assert(u != NULL);
-    assert(u->id == id);
-    return u;
+    assert(seg != MSP_NULL_SEGMENT);
+    pool->next[seg] = pool->free_head;
+    pool->free_head = seg;
+    pool->num_allocated--;
+    msp_links_set_value(self, seg, 0);
 }
 
-static void
-msp_free_segment(msp_t *self, segment_t *seg)
+static inline segment_id_t
+msp_get_avl_node_segment(avl_node_t *node)
 {
-    object_heap_free_object(&self->segment_heap, seg);
-    fenwick_set_value(&self->links, seg->id, 0);
+    return (segment_id_t) (uintptr_t) node->item;
 }
 
 static inline int WARN_UNUSED
-msp_insert_individual(msp_t *self, segment_t *u)
+msp_insert_individual(msp_t *self, segment_id_t u)
 {
     int ret = 0;
     avl_node_t *node;
 
-    assert(u != NULL);
+    assert(u != MSP_NULL_SEGMENT);
     node = msp_alloc_avl_node(self);
     if (node == NULL) {
         ret = MSP_ERR_NO_MEMORY;
         goto out;
     }
-    avl_init_node(node, u);
+    avl_init_node(node, (void *) (uintptr_t) u);
     node = avl_insert_node(
-        &self->populations[u->population_id].ancestors, node);
+        &self->populations[self->segments.population_id[u]].ancestors, node);
     assert(node != NULL);
 out:
     return ret;
 }
 
 static void
-msp_print_segment_chain(msp_t *self, segment_t *head, FILE *out)
+msp_print_segment_chain(msp_t *self, segment_id_t head, FILE *out)
 {
-    segment_t *s = head;
+    segment_pool_t *pool = &self->segments;
+    segment_id_t s = head;
 
-    fprintf(out, "[%d]", (int) s->population_id);
-    while (s != NULL) {
-        fprintf(out, "[(%d-%d) %d] ", s->left, s->right, (int) s->value);
-        s = s->next;
+    fprintf(out, "[%d]", (int) pool->population_id[s]);
+    while (s != MSP_NULL_SEGMENT) {
+        fprintf(out, "[(%d-%d) %d] ", pool->left[s], pool->right[s],
+                (int) pool->value[s]);
+        s = pool->next[s];
     }
     fprintf(out, "\n");
 }
@@ -1096,55 +1421,54 @@ msp_print_segment_chain(msp_t *self, segment_t *head, FILE *out)
 static void
 msp_verify_segments(msp_t *self)
 {
-    int64_t s, ss, total_links, left, right, alt_total_links;
+    int64_t s, ss, total_links, left, alt_total_links;
+    int64_t right = 0;
     size_t j;
     size_t total_segments = 0;
     size_t total_avl_nodes = 0;
     avl_node_t *node;
-    segment_t *u;
+    segment_pool_t *pool = &self->segments;
+    segment_id_t u;
 
     total_links = 0;
     alt_total_links = 0;
     for (j = 0; j < self->num_populations; j++) {
         node = (&self->populations[j].ancestors)->head;
         while (node != NULL) {
-            u = (segment_t *) node->item;
-            assert(u->prev == NULL);
-            left = u->left;
-            while (u != NULL) {
+            u = msp_get_avl_node_segment(node);
+            assert(pool->prev[u] == MSP_NULL_SEGMENT);
+            left = pool->left[u];
+            while (u != MSP_NULL_SEGMENT) {
                 total_segments++;
-                assert(u->population_id == (population_id_t) j);
-                assert(u->left < u->right);
-                assert(u->right <= self->num_loci);
-                if (u->prev != NULL) {
-                    s = u->right - u->prev->right;
+                assert(pool->population_id[u] == (population_id_t) j);
+                assert(pool->left[u] < pool->right[u]);
+                assert(pool->right[u] <= self->num_loci);
+                if (pool->prev[u] != MSP_NULL_SEGMENT) {
+                    assert(pool->next[pool->prev[u]] == u);
+                    s = pool->right[u] - pool->right[pool->prev[u]];
                 } else {
-                    s = u->right - u->left - 1;
+                    s = pool->right[u] - pool->left[u] - 1;
                 }
-                ss = fenwick_get_value(&self->links, u->id);
+                ss = msp_links_get_value(self, u);
                 total_links += ss;
                 assert(s == ss);
                 if (s == ss) {
                     /* do nothing; just to keep compiler happy - see below also */
                 }
-                right = u->right;
-                u = u->next;
+                right = pool->right[u];
+                u = pool->next[u];
             }
             alt_total_links += right - left - 1;
             node = node->next;
         }
     }
-    assert(total_links == fenwick_get_total(&self->links));
+    assert(total_links == msp_links_get_total(self));
     assert(total_links == alt_total_links);
-    assert(total_segments == object_heap_get_num_allocated(
-                &self->segment_heap));
-    total_avl_nodes = msp_get_num_ancestors(self)
-            + avl_count(&self->breakpoints)
-            + avl_count(&self->overlap_counts);
+    assert(total_segments == pool->num_allocated);
+    total_avl_nodes = msp_get_num_ancestors(self);
     assert(total_avl_nodes == object_heap_get_num_allocated(
                 &self->avl_node_heap));
-    assert(total_avl_nodes - msp_get_num_ancestors(self)
-            == object_heap_get_num_allocated(&self->node_mapping_heap));
+    assert(object_heap_get_num_allocated(&self->node_mapping_heap) == 0);
     if (total_avl_nodes == total_segments) {
         /* do nothing - this is just to keep the compiler happy when
          * asserts are turned off.
@@ -1155,9 +1479,11 @@ msp_verify_segments(msp_t *self)
 static void
 msp_verify_overlaps(msp_t *self)
 {
+    int more;
     avl_node_t *node;
-    node_mapping_t *nm;
-    segment_t *u;
+    locus_map_cursor_t cursor;
+    segment_pool_t *pool = &self->segments;
+    segment_id_t u;
     uint32_t j, k, left, right, count;
     /* We check for every locus, so obviously this rules out large numbers
      * of loci. This code should never be called except during testing,
@@ -1179,23 +1505,31 @@ msp_verify_overlaps(msp_t *self)
     for (j = 0; j < self->num_populations; j++) {
         for (node = (&self->populations[j].ancestors)->head; node != NULL;
                 node = node->next) {
-            u = (segment_t *) node->item;
-            while (u != NULL) {
-                for (k = u->left; k < u->right; k++) {
+            u = msp_get_avl_node_segment(node);
+            while (u != MSP_NULL_SEGMENT) {
+                for (k = pool->left[u]; k < pool->right[u]; k++) {
                     overlaps[k]++;
                 }
-                u = u->next;
+                u = pool->next[u];
             }
         }
     }
-    for (node = self->overlap_counts.head; node->next != NULL;
-            node = node->next) {
-        nm = (node_mapping_t *) node->item;
-        left = nm->left;
-        right = ((node_mapping_t *) node->next->item)->left;
-        count = nm->value;
-        for (k = left; k < right; k++) {
-            assert(overlaps[k] == count);
+    more = locus_map_first(&self->overlap_counts, &cursor);
+    assert(more);
+    assert(cursor.key == 0);
+    while (more) {
+        left = cursor.key;
+        count = *cursor.value;
+        more = locus_map_next(&self->overlap_counts, &cursor);
+        if (more) {
+            right = cursor.key;
+            /* Adjacent intervals with the same count are always merged */
+            assert(*cursor.value != count);
+            for (k = left; k < right; k++) {
+                assert(overlaps[k] == count);
+            }
+        } else {
+            assert(left == self->num_loci);
         }
     }
     free(overlaps);
@@ -1212,9 +1546,9 @@ int
 msp_print_state(msp_t *self, FILE *out)
 {
     int ret = 0;
-    avl_node_t *node;
-    node_mapping_t *nm;
-    segment_t *u;
+    int more;
+    locus_map_cursor_t cursor;
+    segment_pool_t *pool = &self->segments;
     coalescence_record_t *cr;
     migration_t *mr;
     demographic_event_t *de;
@@ -1222,8 +1556,8 @@ msp_print_state(msp_t *self, FILE *out)
     int64_t v;
     uint32_t j, k;
     double gig = 1024.0 * 1024;
-    segment_t **ancestors = malloc(msp_get_num_ancestors(self)
-            * sizeof(segment_t *));
+    segment_id_t *ancestors = malloc(msp_get_num_ancestors(self)
+            * sizeof(segment_id_t));
 
     if (ancestors == NULL && msp_get_num_ancestors(self) != 0) {
         ret = MSP_ERR_NO_MEMORY;
@@ -1242,6 +1576,10 @@ msp_print_state(msp_t *self, FILE *out)
         fprintf(out, "\tdirac coalescent parameters: psi = %f, c = %f\n",
                 self->model.params.dirac_coalescent.psi,
                 self->model.params.dirac_coalescent.c);
+    } else if (self->model.type == MSP_MODEL_DTWF) {
+        fprintf(out, "\tdtwf parameters: population_size = %f, num_generations = %f\n",
+                self->model.params.dtwf.population_size,
+                self->model.params.dtwf.num_generations);
     }
     fprintf(out, "used_memory = %f MiB\n", (double) self->used_memory / gig);
     fprintf(out, "max_memory  = %f MiB\n", (double) self->max_memory / gig);
@@ -1279,7 +1617,8 @@ msp_print_state(msp_t *self, FILE *out)
         fprintf(out, "\n");
     }
 
-    fprintf(out, "num_links = %ld\n", (long) fenwick_get_total(&self->links));
+    fprintf(out, "links_index = %d\n", self->links_index);
+    fprintf(out, "num_links = %ld\n", (long) msp_links_get_total(self));
     for (j = 0; j < self->num_populations; j++) {
         fprintf(out, "population[%d] = %d\n", j,
             avl_count(&self->populations[j].ancestors));
@@ -1293,24 +1632,26 @@ msp_print_state(msp_t *self, FILE *out)
         msp_print_segment_chain(self, ancestors[j], out);
     }
     fprintf(out, "Fenwick tree\n");
-    for (j = 1; j <= (uint32_t) fenwick_get_size(&self->links); j++) {
-        u = msp_get_segment(self, j);
-        v = fenwick_get_value(&self->links, j);
+    for (j = 1; j <= (uint32_t) msp_links_get_size(self); j++) {
+        v = msp_links_get_value(self, j);
         if (v != 0) {
-            fprintf(out, "\t%ld\ti=%d l=%d r=%d v=%d prev=%p next=%p\n", (long) v,
-                    (int) u->id, u->left,
-                    u->right, (int) u->value, (void *) u->prev, (void *) u->next);
+            fprintf(out, "\t%ld\ti=%d l=%d r=%d v=%d prev=%d next=%d\n", (long) v,
+                    (int) j, pool->left[j], pool->right[j], (int) pool->value[j],
+                    (int) pool->prev[j], (int) pool->next[j]);
         }
     }
-    fprintf(out, "Breakpoints = %d\n", avl_count(&self->breakpoints));
-    for (node = self->breakpoints.head; node != NULL; node = node->next) {
-        nm = (node_mapping_t *) node->item;
-        fprintf(out, "\t%d -> %d\n", nm->left, nm->value);
+    fprintf(out, "Breakpoints = %d\n", (int) locus_map_get_size(&self->breakpoints));
+    more = locus_map_first(&self->breakpoints, &cursor);
+    while (more) {
+        fprintf(out, "\t%d -> %d\n", cursor.key, *cursor.value);
+        more = locus_map_next(&self->breakpoints, &cursor);
     }
-    fprintf(out, "Overlap count = %d\n", avl_count(&self->overlap_counts));
-    for (node = self->overlap_counts.head; node != NULL; node = node->next) {
-        nm = (node_mapping_t *) node->item;
-        fprintf(out, "\t%d -> %d\n", nm->left, nm->value);
+    fprintf(out, "Overlap count = %d\n",
+            (int) locus_map_get_size(&self->overlap_counts));
+    more = locus_map_first(&self->overlap_counts, &cursor);
+    while (more) {
+        fprintf(out, "\t%d -> %d\n", cursor.key, *cursor.value);
+        more = locus_map_next(&self->overlap_counts, &cursor);
     }
     fprintf(out, "Coalescence records = %ld\n",
             (long) self->num_coalescence_records);
@@ -1335,10 +1676,14 @@ msp_print_state(msp_t *self, FILE *out)
     fprintf(out, "Memory heaps\n");
     fprintf(out, "avl_node_heap:");
     object_heap_print_state(&self->avl_node_heap, out);
-    fprintf(out, "segment_heap:");
-    object_heap_print_state(&self->segment_heap, out);
+    fprintf(out, "segment_pool: size = %d allocated = %d\n",
+            (int) pool->size, (int) pool->num_allocated);
     fprintf(out, "node_mapping_heap:");
     object_heap_print_state(&self->node_mapping_heap, out);
+    fprintf(out, "breakpoints ");
+    locus_map_print_state(&self->breakpoints, out);
+    fprintf(out, "overlap_counts ");
+    locus_map_print_state(&self->overlap_counts, out);
     fprintf(out, "binary_children_heap:");
     object_heap_print_state(&self->binary_children_heap, out);
     msp_verify(self);
@@ -1381,28 +1726,45 @@ out:
     return ret;
 }
 
+/* Sets the population_id for each segment in the chain starting at ind,
+ * recording the migrations if necessary.
+ */
 static int WARN_UNUSED
-msp_move_individual(msp_t *self, avl_node_t *node, avl_tree_t *source,
+msp_set_segment_chain_population(msp_t *self, segment_id_t ind,
         population_id_t dest_pop)
 {
     int ret = 0;
-    segment_t *ind, *x;
+    segment_pool_t *pool = &self->segments;
+    segment_id_t x = ind;
 
-    ind = (segment_t *) node->item;
-    avl_unlink_node(source, node);
-    msp_free_avl_node(self, node);
-    /* Need to set the population_id for each segment. */
-    x = ind;
-    while (x != NULL) {
+    while (x != MSP_NULL_SEGMENT) {
         if (self->store_migrations) {
-            ret = msp_record_migration(self, x->left, x->right, x->value,
-                    x->population_id, dest_pop);
+            ret = msp_record_migration(self, pool->left[x], pool->right[x],
+                    pool->value[x], pool->population_id[x], dest_pop);
             if (ret != 0) {
                 goto out;
             }
         }
-        x->population_id = dest_pop;
-        x = x->next;
+        pool->population_id[x] = dest_pop;
+        x = pool->next[x];
+    }
+out:
+    return ret;
+}
+
+static int WARN_UNUSED
+msp_move_individual(msp_t *self, avl_node_t *node, avl_tree_t *source,
+        population_id_t dest_pop)
+{
+    int ret = 0;
+    segment_id_t ind;
+
+    ind = msp_get_avl_node_segment(node);
+    avl_unlink_node(source, node);
+    msp_free_avl_node(self, node);
+    ret = msp_set_segment_chain_population(self, ind, dest_pop);
+    if (ret != 0) {
+        goto out;
     }
     ret = msp_insert_individual(self, ind);
 out:
@@ -1410,28 +1772,36 @@ out:
 }
 
 /*
- * Inserts a new breakpoint at the specified locus left.
+ * Inserts the specified key into a locus map, adding any memory allocated
+ * by the map to the total used.
  */
 static int WARN_UNUSED
-msp_insert_breakpoint(msp_t *self, uint32_t left)
+msp_locus_map_insert(msp_t *self, locus_map_t *map, uint32_t key, uint32_t value)
 {
     int ret = 0;
-    avl_node_t *node = msp_alloc_avl_node(self);
-    node_mapping_t *m = msp_alloc_node_mapping(self);
+    size_t before = locus_map_get_total_memory(map);
 
-    if (node == NULL || m == NULL) {
-        ret = MSP_ERR_NO_MEMORY;
+    ret = locus_map_insert(map, key, value);
+    if (ret != 0) {
         goto out;
     }
-    m->left = left;
-    m->value = 0;
-    avl_init_node(node, m);
-    node = avl_insert_node(&self->breakpoints, node);
-    assert(node != NULL);
+    self->used_memory += locus_map_get_total_memory(map) - before;
+    if (self->used_memory > self->max_memory) {
+        ret = MSP_ERR_NO_MEMORY;
+    }
 out:
     return ret;
 }
 
+/*
+ * Inserts a new breakpoint at the specified locus left.
+ */
+static int WARN_UNUSED
+msp_insert_breakpoint(msp_t *self, uint32_t left)
+{
+    return msp_locus_map_insert(self, &self->breakpoints, left, 0);
+}
+
 
 /*
  * Inserts a new overlap_count at the specified locus left, mapping to the
@@ -1440,44 +1810,27 @@ out:
 static int WARN_UNUSED
 msp_insert_overlap_count(msp_t *self, uint32_t left, uint32_t v)
 {
-    int ret = 0;
-    avl_node_t *node = msp_alloc_avl_node(self);
-    node_mapping_t *m = msp_alloc_node_mapping(self);
-
-    if (node == NULL || m == NULL) {
-        ret = MSP_ERR_NO_MEMORY;
-        goto out;
-    }
-    m->left = left;
-    m->value = v;
-    avl_init_node(node, m);
-    node = avl_insert_node(&self->overlap_counts, node);
-    assert(node != NULL);
-out:
-    return ret;
+    return msp_locus_map_insert(self, &self->overlap_counts, left, v);
 }
 
 /*
- * Inserts a new overlap_count at the specified locus, and copies its
- * node mapping from the containing overlap_count.
+ * Inserts a new overlap_count at the specified locus if there is not
+ * already one, copying its value from the containing overlap_count.
  */
 static int WARN_UNUSED
 msp_copy_overlap_count(msp_t *self, uint32_t k)
 {
-    int ret;
-    node_mapping_t search, *nm;
-    avl_node_t *node;
+    int ret = 0;
+    uint32_t v;
 
-    search.left = k;
-    avl_search_closest(&self->overlap_counts, &search, &node);
-    assert(node != NULL);
-    nm = (node_mapping_t *) node->item;
-    if (nm->left > k) {
-        node = node->prev;
-        assert(node != NULL);
-        nm = (node_mapping_t *) node->item;
+    if (locus_map_get(&self->overlap_counts, k) == NULL) {
+        ret = locus_map_get_floor(&self->overlap_counts, k, &v);
+        if (ret != 0) {
+            goto out;
+        }
+        ret = msp_insert_overlap_count(self, k, v);
     }
-    ret = msp_insert_overlap_count(self, k, nm->value);
+out:
     return ret;
 }
 
@@ -1539,72 +1892,36 @@ out:
     return ret;
 }
 
-static int
-msp_compress_overlap_counts(msp_t *self, uint32_t l, uint32_t r)
-{
-    int ret = 0;
-    avl_node_t *node1, *node2;
-    node_mapping_t search, *nm1, *nm2;
-
-    search.left = l;
-    node1 = avl_search(&self->overlap_counts, &search);
-    assert(node1 != NULL);
-    if (node1->prev != NULL) {
-        node1 = node1->prev;
-    }
-    node2 = node1->next;
-    do {
-        nm1 = (node_mapping_t *) node1->item;
-        nm2 = (node_mapping_t *) node2->item;
-        if (nm1->value == nm2->value) {
-            avl_unlink_node(&self->overlap_counts, node2);
-            msp_free_avl_node(self, node2);
-            msp_free_node_mapping(self, nm2);
-            node2 = node1->next;
-        } else {
-            node1 = node2;
-            node2 = node2->next;
-        }
-    } while (node2 != NULL && nm2->left <= r);
-    return ret;
-}
-
-static int WARN_UNUSED
-msp_conditional_compress_overlap_counts(msp_t *self, uint32_t l, uint32_t r)
+/*
+ * Removes redundant overlap counts after a merge step has updated the
+ * counts in [l, r) having inserted counts at l and r_max.
+ */
+static void
+msp_compress_overlap_counts(msp_t *self, uint32_t l, uint32_t r, uint32_t r_max)
 {
-    int ret = 0;
-    double covered_fraction = (r - l) / (double) self->num_loci;
-
-    /* This is a heuristic to prevent us spending a lot of time pointlessly
-     * trying to defragment during the early stages of the simulation.
-     * 5% of the overall length seems like a good value and leads to
-     * a ~15% time reduction when doing large simulations.
-     */
-    if (covered_fraction < 0.05) {
-        ret = msp_compress_overlap_counts(self, l, r);
-        if (ret != 0) {
-            goto out;
-        }
+    locus_map_compress(&self->overlap_counts, l, r);
+    if (r < r_max) {
+        locus_map_compress(&self->overlap_counts, r_max, r_max);
     }
-out:
-    return ret;
 }
 
+
 static int WARN_UNUSED
-msp_defrag_segment_chain(msp_t *self, segment_t *z)
+msp_defrag_segment_chain(msp_t *self, segment_id_t z)
 {
-    segment_t *y, *x;
+    segment_pool_t *pool = &self->segments;
+    segment_id_t y, x;
 
     y = z;
-    while (y->prev != NULL) {
-        x = y->prev;
-        if (x->right == y->left && x->value == y->value) {
-            x->right = y->right;
-            x->next = y->next;
-            if (y->next != NULL) {
-                y->next->prev = x;
-            }
-            fenwick_increment(&self->links, x->id, y->right - y->left);
+    while (pool->prev[y] != MSP_NULL_SEGMENT) {
+        x = pool->prev[y];
+        if (pool->right[x] == pool->left[y] && pool->value[x] == pool->value[y]) {
+            pool->right[x] = pool->right[y];
+            pool->next[x] = pool->next[y];
+            if (pool->next[y] != MSP_NULL_SEGMENT) {
+                pool->prev[pool->next[y]] = x;
+            }
+            msp_links_increment(self, x, pool->right[y] - pool->left[y]);
             msp_free_segment(self, y);
         }
         y = x;
@@ -1617,39 +1934,34 @@ msp_recombination_event(msp_t *self)
 {
     int ret = 0;
     int64_t l, t, gap, k;
-    size_t segment_id;
-    node_mapping_t search;
-    segment_t *x, *y, *z;
-    int64_t num_links = fenwick_get_total(&self->links);
+    segment_pool_t *pool = &self->segments;
+    segment_id_t x, y, z;
+    int64_t num_links = msp_links_get_total(self);
 
     self->num_re_events++;
     /* We can't use the GSL integer generator here as the range is too large */
     l = 1 + (int64_t) (gsl_rng_uniform(self->rng) * (double) num_links);
-    //printf( "l = %d, num_links = %d\n", (int)l, (int)num_links);
     assert(l > 0 && l <= num_links);
-    segment_id = fenwick_find(&self->links, l);
-    t = fenwick_get_cumulative_sum(&self->links, segment_id);
+    y = msp_links_find(self, l, &t);
     gap = t - l;
     assert(gap >= 0 && gap < self->num_loci);
-    y = msp_get_segment(self, segment_id);
-    x = y->prev;
-    k = y->right - gap - 1;
+    x = pool->prev[y];
+    k = pool->right[y] - gap - 1;
     assert(k >= 0 && k < self->num_loci);
-    if (y->left < k) {
-        z = msp_alloc_segment(self, (uint32_t) k, y->right, y->value,
-                y->population_id, NULL, y->next);
-        if (z == NULL) {
+    if (pool->left[y] < k) {
+        z = msp_alloc_segment(self, (uint32_t) k, pool->right[y], pool->value[y],
+                pool->population_id[y], MSP_NULL_SEGMENT, pool->next[y]);
+        if (z == MSP_NULL_SEGMENT) {
             ret = MSP_ERR_NO_MEMORY;
             goto out;
         }
-        if (y->next != NULL) {
-            y->next->prev = z;
+        if (pool->next[y] != MSP_NULL_SEGMENT) {
+            pool->prev[pool->next[y]] = z;
         }
-        y->next = NULL;
-        y->right = (uint32_t) k;
-        fenwick_increment(&self->links, y->id, k - z->right);
-        search.left = (uint32_t) k;
-        if (avl_search(&self->breakpoints, &search) == NULL) {
+        pool->next[y] = MSP_NULL_SEGMENT;
+        pool->right[y] = (uint32_t) k;
+        msp_links_increment(self, y, k - pool->right[z]);
+        if (locus_map_get(&self->breakpoints, (uint32_t) k) == NULL) {
             ret = msp_insert_breakpoint(self, (uint32_t) k);
             if (ret != 0) {
                 goto out;
@@ -1658,13 +1970,13 @@ msp_recombination_event(msp_t *self)
             self->num_multiple_re_events++;
         }
     } else {
-        assert(x != NULL);
-        x->next = NULL;
-        y->prev = NULL;
+        assert(x != MSP_NULL_SEGMENT);
+        pool->next[x] = MSP_NULL_SEGMENT;
+        pool->prev[y] = MSP_NULL_SEGMENT;
         z = y;
         self->num_trapped_re_events++;
     }
-    fenwick_set_value(&self->links, z->id, z->right - z->left - 1);
+    msp_links_set_value(self, z, pool->right[z] - pool->left[z] - 1);
     ret = msp_insert_individual(self, z);
 out:
     return ret;
@@ -1674,135 +1986,127 @@ out:
  * there aren't any overlapping segments.
  */
 static int WARN_UNUSED
-msp_reject_ca_event(msp_t *self, segment_t *a, segment_t *b)
+msp_reject_ca_event(msp_t *self, segment_id_t a, segment_id_t b)
 {
     int ret = 0;
-    segment_t *x = a;
-    segment_t *y = b;
-    segment_t *beta;
+    segment_pool_t *pool = &self->segments;
+    segment_id_t x = a;
+    segment_id_t y = b;
+    segment_id_t beta;
     int64_t overlap, min_overlap;
 
     if (self->model.type == MSP_MODEL_SMC || self->model.type == MSP_MODEL_SMC_PRIME) {
         ret = 1;
         min_overlap = self->model.type == MSP_MODEL_SMC ? 1: 0;
-        while (x != NULL && y != NULL) {
-            if (y->left < x->left) {
+        while (x != MSP_NULL_SEGMENT && y != MSP_NULL_SEGMENT) {
+            if (pool->left[y] < pool->left[x]) {
                 beta = x;
                 x = y;
                 y = beta;
             }
-            overlap = ((int64_t) x->right) - ((int64_t) y->left);
+            overlap = ((int64_t) pool->right[x]) - ((int64_t) pool->left[y]);
             if (overlap >= min_overlap) {
                 ret = 0;
                 break;
             }
-            x = x->next;
+            x = pool->next[x];
         }
     }
     return ret;
 }
 
 static int WARN_UNUSED
-msp_merge_two_ancestors(msp_t *self, population_id_t population_id, segment_t *a,
-        segment_t *b)
+msp_merge_two_ancestors(msp_t *self, population_id_t population_id, segment_id_t a,
+        segment_id_t b)
 {
     int ret = 0;
     int coalescence = 0;
     int defrag_required = 0;
     node_id_t v, *children;
-    uint32_t l, r, l_min, r_max;
-    avl_node_t *node;
-    node_mapping_t *nm, search;
-    segment_t *x, *y, *z, *alpha, *beta;
+    uint32_t l, r, r_max;
+    locus_map_cursor_t cursor;
+    segment_pool_t *pool = &self->segments;
+    segment_id_t x, y, z, alpha, beta;
 
     x = a;
     y = b;
-    /* Keep GCC happy */
-    l_min = 0;
-    r_max = 0;
 
     /* update num_links and get ready for loop */
-    z = NULL;
-    while (x != NULL || y != NULL) {
-        alpha = NULL;
-        if (x == NULL || y == NULL) {
-            if (x != NULL) {
+    z = MSP_NULL_SEGMENT;
+    while (x != MSP_NULL_SEGMENT || y != MSP_NULL_SEGMENT) {
+        alpha = MSP_NULL_SEGMENT;
+        if (x == MSP_NULL_SEGMENT || y == MSP_NULL_SEGMENT) {
+            if (x != MSP_NULL_SEGMENT) {
                 alpha = x;
-                x = NULL;
+                x = MSP_NULL_SEGMENT;
             }
-            if (y != NULL) {
+            if (y != MSP_NULL_SEGMENT) {
                 alpha = y;
-                y = NULL;
+                y = MSP_NULL_SEGMENT;
             }
         } else {
-            if (y->left < x->left) {
+            if (pool->left[y] < pool->left[x]) {
                 beta = x;
                 x = y;
                 y = beta;
             }
-            if (x->right <= y->left) {
+            if (pool->right[x] <= pool->left[y]) {
                 alpha = x;
-                x = x->next;
-                alpha->next = NULL;
-            } else if (x->left != y->left) {
-                alpha = msp_alloc_segment(self, x->left, y->left, x->value,
-                        x->population_id, NULL, NULL);
-                if (alpha == NULL) {
+                x = pool->next[x];
+                pool->next[alpha] = MSP_NULL_SEGMENT;
+            } else if (pool->left[x] != pool->left[y]) {
+                alpha = msp_alloc_segment(self, pool->left[x], pool->left[y],
+                        pool->value[x], pool->population_id[x],
+                        MSP_NULL_SEGMENT, MSP_NULL_SEGMENT);
+                if (alpha == MSP_NULL_SEGMENT) {
                     ret = MSP_ERR_NO_MEMORY;
                     goto out;
                 }
-                x->left = y->left;
+                pool->left[x] = pool->left[y];
             } else {
-                l = x->left;
-                r_max = GSL_MIN(x->right, y->right);
+                l = pool->left[x];
+                r_max = GSL_MIN(pool->right[x], pool->right[y]);
                 if (!coalescence) {
                     coalescence = 1;
-                    l_min = l;
                     self->next_node++;
                     /* Check for overflow */
                     assert(self->next_node != 0);
                 }
                 v = self->next_node - 1;
                 /* Insert overlap counts for bounds, if necessary */
-                search.left = l;
-                node = avl_search(&self->overlap_counts, &search);
-                if (node == NULL) {
-                    ret = msp_copy_overlap_count(self, l);
-                    if (ret < 0) {
-                        goto out;
-                    }
+                ret = msp_copy_overlap_count(self, l);
+                if (ret != 0) {
+                    goto out;
                 }
-                search.left = r_max;
-                node = avl_search(&self->overlap_counts, &search);
-                if (node == NULL) {
-                    ret = msp_copy_overlap_count(self, r_max);
-                    if (ret < 0) {
-                        goto out;
-                    }
+                ret = msp_copy_overlap_count(self, r_max);
+                if (ret != 0) {
+                    goto out;
                 }
                 /* Now get overlap count at the left */
-                search.left = l;
-                node = avl_search(&self->overlap_counts, &search);
-                assert(node != NULL);
-                nm = (node_mapping_t *) node->item;
-                if (nm->value == 2) {
-                    nm->value = 0;
-                    node = node->next;
-                    assert(node != NULL);
-                    nm = (node_mapping_t *) node->item;
-                    r = nm->left;
+                locus_map_seek(&self->overlap_counts, l, &cursor);
+                assert(cursor.key == l);
+                if (*cursor.value == 2) {
+                    *cursor.value = 0;
+                    if (!locus_map_next(&self->overlap_counts, &cursor)) {
+                        ret = MSP_ERR_ASSERTION_FAILED;
+                        goto out;
+                    }
+                    r = cursor.key;
+                    msp_compress_overlap_counts(self, l, r, r_max);
                 } else {
                     r = l;
-                    while (nm->value != 2 && r < r_max) {
-                        nm->value--;
-                        node = node->next;
-                        assert(node != NULL);
-                        nm = (node_mapping_t *) node->item;
-                        r = nm->left;
+                    while (*cursor.value != 2 && r < r_max) {
+                        (*cursor.value)--;
+                        if (!locus_map_next(&self->overlap_counts, &cursor)) {
+                            ret = MSP_ERR_ASSERTION_FAILED;
+                            goto out;
+                        }
+                        r = cursor.key;
                     }
+                    msp_compress_overlap_counts(self, l, r, r_max);
                     alpha = msp_alloc_segment(self, l, r, v, population_id,
-                            NULL, NULL);
-                    if (alpha == NULL) {
+                            MSP_NULL_SEGMENT, MSP_NULL_SEGMENT);
+                    if (alpha == MSP_NULL_SEGMENT) {
                         ret = MSP_ERR_NO_MEMORY;
                         goto out;
                     }
@@ -1812,44 +2116,46 @@ msp_merge_two_ancestors(msp_t *self, population_id_t population_id, segment_t *a
                     ret = MSP_ERR_NO_MEMORY;
                     goto out;
                 }
-                children[0] = x->value;
-                children[1] = y->value;
+                children[0] = pool->value[x];
+                children[1] = pool->value[y];
                 ret = msp_record_coalescence(self, l, r, 2, children, v,
                         population_id);
                 if (ret != 0) {
                     goto out;
                 }
                 /* Trim the ends of x and y, and prepare for next iteration. */
-                if (x->right == r) {
+                if (pool->right[x] == r) {
                     beta = x;
-                    x = x->next;
+                    x = pool->next[x];
                     msp_free_segment(self, beta);
                 } else {
-                    x->left = r;
+                    pool->left[x] = r;
                 }
-                if (y->right == r) {
+                if (pool->right[y] == r) {
                     beta = y;
-                    y = y->next;
+                    y = pool->next[y];
                     msp_free_segment(self, beta);
                 } else {
-                    y->left = r;
+                    pool->left[y] = r;
                 }
             }
         }
-        if (alpha != NULL) {
-            if (z == NULL) {
+        if (alpha != MSP_NULL_SEGMENT) {
+            if (z == MSP_NULL_SEGMENT) {
                 ret = msp_insert_individual(self, alpha);
                 if (ret != 0) {
                     goto out;
                 }
-                fenwick_set_value(&self->links, alpha->id,
-                        alpha->right - alpha->left - 1);
+                msp_links_set_value(self, alpha,
+                        pool->right[alpha] - pool->left[alpha] - 1);
             } else {
-                defrag_required |= z->right == alpha->left && z->value == alpha->value;
-                z->next = alpha;
-                fenwick_set_value(&self->links, alpha->id, alpha->right - z->right);
+                defrag_required |= pool->right[z] == pool->left[alpha]
+                    && pool->value[z] == pool->value[alpha];
+                pool->next[z] = alpha;
+                msp_links_set_value(self, alpha,
+                        pool->right[alpha] - pool->right[z]);
             }
-            alpha->prev = z;
+            pool->prev[alpha] = z;
             z = alpha;
         }
     }
@@ -1859,36 +2165,52 @@ msp_merge_two_ancestors(msp_t *self, population_id_t population_id, segment_t *a
             goto out;
         }
     }
-    if (coalescence) {
-        ret = msp_conditional_compress_overlap_counts(self, l_min, r_max);
-        if (ret != 0) {
-            goto out;
-        }
-
-    }
 out:
     return ret;
 }
 
 static int WARN_UNUSED
-msp_priority_queue_insert(msp_t *self, avl_tree_t *Q, segment_t *u)
+msp_priority_queue_insert(msp_t *self, avl_tree_t *Q, segment_id_t u)
 {
     int ret = 0;
     avl_node_t *node;
+    node_mapping_t *nm;
 
-    assert(u != NULL);
+    assert(u != MSP_NULL_SEGMENT);
     node = msp_alloc_avl_node(self);
     if (node == NULL) {
         ret = MSP_ERR_NO_MEMORY;
         goto out;
     }
-    avl_init_node(node, u);
+    nm = msp_alloc_node_mapping(self);
+    if (nm == NULL) {
+        msp_free_avl_node(self, node);
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    nm->left = self->segments.left[u];
+    nm->value = u;
+    avl_init_node(node, nm);
     node = avl_insert_node(Q, node);
     assert(node != NULL);
 out:
     return ret;
 }
 
+/* Moves the ancestor in the specified population AVL node into the
+ * priority queue Q.
+ */
+static int WARN_UNUSED
+msp_priority_queue_move(msp_t *self, avl_tree_t *Q, avl_tree_t *source,
+        avl_node_t *node)
+{
+    segment_id_t u = msp_get_avl_node_segment(node);
+
+    avl_unlink_node(source, node);
+    msp_free_avl_node(self, node);
+    return msp_priority_queue_insert(self, Q, u);
+}
+
 /* Merge the specified set of ancestors into a single ancestor. This is a
  * generalisation of the msp_common_ancestor_event method where we allow
  * any number of ancestors to merge. The AVL tree is a priority queue in
@@ -1901,54 +2223,60 @@ msp_merge_ancestors(msp_t *self, avl_tree_t *Q, population_id_t population_id)
     int coalescence = 0;
     int defrag_required = 0;
     node_id_t v, *children;
-    uint32_t j, l, r, h, r_max, next_l, l_min;
+    uint32_t j, l, r, h, r_max, next_l;
     avl_node_t *node;
-    node_mapping_t *nm, search;
-    segment_t *x, *z, *alpha;
-    segment_t **H = NULL;
+    avl_node_t *next;
+    node_mapping_t *nm;
+    locus_map_cursor_t cursor;
+    segment_pool_t *pool = &self->segments;
+    segment_id_t x, next_x, z, alpha;
+    segment_id_t *H = NULL;
 
-    H = malloc(avl_count(Q) * sizeof(segment_t *));
+    H = malloc(avl_count(Q) * sizeof(segment_id_t));
     if (H == NULL) {
         ret = MSP_ERR_NO_MEMORY;
         goto out;
     }
-    l_min = 0;
-    z = NULL;
+    z = MSP_NULL_SEGMENT;
     while (avl_count(Q) > 0) {
         h = 0;
         node = Q->head;
-        l = ((segment_t *) node->item)->left;
+        l = ((node_mapping_t *) node->item)->left;
         r_max = self->num_loci;
-        while (node != NULL && ((segment_t *) node->item)->left == l) {
-            H[h] = (segment_t *) node->item;
-            r_max = GSL_MIN(r_max, H[h]->right);
+        while (node != NULL && ((node_mapping_t *) node->item)->left == l) {
+            nm = (node_mapping_t *) node->item;
+            H[h] = (segment_id_t) nm->value;
+            r_max = GSL_MIN(r_max, pool->right[H[h]]);
             h++;
-            msp_free_avl_node(self, node);
+            next = node->next;
             avl_unlink_node(Q, node);
-            node = node->next;
+            msp_free_avl_node(self, node);
+            msp_free_node_mapping(self, nm);
+            node = next;
         }
         next_l = 0;
         if (node != NULL) {
-            next_l = ((segment_t *) node->item)->left;
+            next_l = ((node_mapping_t *) node->item)->left;
             r_max = GSL_MIN(r_max, next_l);
         }
-        alpha = NULL;
+        alpha = MSP_NULL_SEGMENT;
         if (h == 1) {
             x = H[0];
-            if (node != NULL && next_l < x->right) {
-                alpha = msp_alloc_segment(self, x->left, next_l, x->value,
-                        x->population_id, NULL, NULL);
-                if (alpha == NULL) {
+            if (node != NULL && next_l < pool->right[x]) {
+                alpha = msp_alloc_segment(self, pool->left[x], next_l,
+                        pool->value[x], pool->population_id[x],
+                        MSP_NULL_SEGMENT, MSP_NULL_SEGMENT);
+                if (alpha == MSP_NULL_SEGMENT) {
                     ret = MSP_ERR_NO_MEMORY;
                     goto out;
                 }
-                x->left = next_l;
+                pool->left[x] = next_l;
             } else {
                 alpha = x;
-                x = x->next;
-                alpha->next = NULL;
+                x = pool->next[x];
+                pool->next[alpha] = MSP_NULL_SEGMENT;
             }
-            if (x != NULL) {
+            if (x != MSP_NULL_SEGMENT) {
                 ret = msp_priority_queue_insert(self, Q, x);
                 if (ret != 0) {
                     goto out;
@@ -1957,53 +2285,46 @@ msp_merge_ancestors(msp_t *self, avl_tree_t *Q, population_id_t population_id)
         } else {
             if (!coalescence) {
                 coalescence = 1;
-                l_min = l;
                 self->next_node++;
                 /* Check for overflow */
                 assert(self->next_node != 0);
             }
             v = self->next_node - 1;
             /* Insert overlap counts for bounds, if necessary */
-            search.left = l;
-            node = avl_search(&self->overlap_counts, &search);
-            if (node == NULL) {
-                ret = msp_copy_overlap_count(self, l);
-                if (ret < 0) {
-                    goto out;
-                }
+            ret = msp_copy_overlap_count(self, l);
+            if (ret != 0) {
+                goto out;
             }
-            search.left = r_max;
-            node = avl_search(&self->overlap_counts, &search);
-            if (node == NULL) {
-                ret = msp_copy_overlap_count(self, r_max);
-                if (ret < 0) {
-                    goto out;
-                }
+            ret = msp_copy_overlap_count(self, r_max);
+            if (ret != 0) {
+                goto out;
             }
             /* Update the extant segments and allocate alpha if the interval
              * has not coalesced. */
-            search.left = l;
-            node = avl_search(&self->overlap_counts, &search);
-            assert(node != NULL);
-            nm = (node_mapping_t *) node->item;
-            if (nm->value == h) {
-                nm->value = 0;
-                node = node->next;
-                assert(node != NULL);
-                nm = (node_mapping_t *) node->item;
-                r = nm->left;
+            locus_map_seek(&self->overlap_counts, l, &cursor);
+            assert(cursor.key == l);
+            if (*cursor.value == h) {
+                *cursor.value = 0;
+                if (!locus_map_next(&self->overlap_counts, &cursor)) {
+                    ret = MSP_ERR_ASSERTION_FAILED;
+                    goto out;
+                }
+                r = cursor.key;
+                msp_compress_overlap_counts(self, l, r, r_max);
             } else {
                 r = l;
-                while (nm->value != h && r < r_max) {
-                    nm->value -= h - 1;
-                    node = node->next;
-                    assert(node != NULL);
-                    nm = (node_mapping_t *) node->item;
-                    r = nm->left;
+                while (*cursor.value != h && r < r_max) {
+                    *cursor.value -= h - 1;
+                    if (!locus_map_next(&self->overlap_counts, &cursor)) {
+                        ret = MSP_ERR_ASSERTION_FAILED;
+                        goto out;
+                    }
+                    r = cursor.key;
                 }
+                msp_compress_overlap_counts(self, l, r, r_max);
                 alpha = msp_alloc_segment(self, l, r, v, population_id,
-                        NULL, NULL);
-                if (alpha == NULL) {
+                        MSP_NULL_SEGMENT, MSP_NULL_SEGMENT);
+                if (alpha == MSP_NULL_SEGMENT) {
                     ret = MSP_ERR_NO_MEMORY;
                     goto out;
                 }
@@ -2016,14 +2337,15 @@ msp_merge_ancestors(msp_t *self, avl_tree_t *Q, population_id_t population_id)
             }
             for (j = 0; j < h; j++) {
                 x = H[j];
-                children[j] = x->value;
-                if (x->right == r) {
+                children[j] = pool->value[x];
+                if (pool->right[x] == r) {
+                    next_x = pool->next[x];
                     msp_free_segment(self, x);
-                    x = x->next;
-                } else if (x->right > r) {
-                    x->left = r;
+                    x = next_x;
+                } else if (pool->right[x] > r) {
+                    pool->left[x] = r;
                 }
-                if (x != NULL) {
+                if (x != MSP_NULL_SEGMENT) {
                     ret = msp_priority_queue_insert(self, Q, x);
                     if (ret != 0) {
                         goto out;
@@ -2036,22 +2358,22 @@ msp_merge_ancestors(msp_t *self, avl_tree_t *Q, population_id_t population_id)
             }
         }
         /* Loop tail; integrate alpha into the global state */
-        if (alpha != NULL) {
-            if (z == NULL) {
+        if (alpha != MSP_NULL_SEGMENT) {
+            if (z == MSP_NULL_SEGMENT) {
                 ret = msp_insert_individual(self, alpha);
                 if (ret != 0) {
                     goto out;
                 }
-                fenwick_set_value(&self->links, alpha->id,
-                        alpha->right - alpha->left - 1);
+                msp_links_set_value(self, alpha,
+                        pool->right[alpha] - pool->left[alpha] - 1);
             } else {
-                defrag_required |=
-                    z->right == alpha->left && z->value == alpha->value;
-                z->next = alpha;
-                fenwick_set_value(&self->links, alpha->id,
-                        alpha->right - z->right);
+                defrag_required |= pool->right[z] == pool->left[alpha]
+                    && pool->value[z] == pool->value[alpha];
+                pool->next[z] = alpha;
+                msp_links_set_value(self, alpha,
+                        pool->right[alpha] - pool->right[z]);
             }
-            alpha->prev = z;
+            pool->prev[alpha] = z;
             z = alpha;
         }
     }
@@ -2061,13 +2383,6 @@ msp_merge_ancestors(msp_t *self, avl_tree_t *Q, population_id_t population_id)
             goto out;
         }
     }
-    if (coalescence) {
-        ret = msp_conditional_compress_overlap_counts(self, l_min, r_max);
-        if (ret != 0) {
-            goto out;
-        }
-
-    }
     ret = 0;
 out:
     if (H != NULL) {
@@ -2085,7 +2400,7 @@ msp_common_ancestor_event(msp_t *self, population_id_t population_id)
     uint32_t j, n;
     avl_tree_t *ancestors;
     avl_node_t *x_node, *y_node, *node;
-    segment_t *x, *y;
+    segment_id_t x, y;
 
     ancestors = &self->populations[population_id].ancestors;
     /* Choose x and y */
@@ -2093,12 +2408,12 @@ msp_common_ancestor_event(msp_t *self, population_id_t population_id)
     j = (uint32_t) gsl_rng_uniform_int(self->rng, n);
     x_node = avl_at(ancestors, j);
     assert(x_node != NULL);
-    x = (segment_t *) x_node->item;
+    x = msp_get_avl_node_segment(x_node);
     avl_unlink_node(ancestors, x_node);
     j = (uint32_t) gsl_rng_uniform_int(self->rng, n - 1);
     y_node = avl_at(ancestors, j);
     assert(y_node != NULL);
-    y = (segment_t *) y_node->item;
+    y = msp_get_avl_node_segment(y_node);
     avl_unlink_node(ancestors, y_node);
 
     /* For SMC and SMC' models we reject some events to get the required
@@ -2106,10 +2421,10 @@ msp_common_ancestor_event(msp_t *self, population_id_t population_id)
     if (msp_reject_ca_event(self, x, y)) {
         self->num_rejected_ca_events++;
         /* insert x and y back into the population */
-        assert(x_node->item == x);
+        assert(msp_get_avl_node_segment(x_node) == x);
         node = avl_insert_node(ancestors, x_node);
         assert(node != NULL);
-        assert(y_node->item == y);
+        assert(msp_get_avl_node_segment(y_node) == y);
         node = avl_insert_node(ancestors, y_node);
         assert(node != NULL);
     } else {
@@ -2186,8 +2501,8 @@ msp_multiple_merger_common_ancestor_event_dirac(msp_t *self)
     uint32_t j, n, max_pot_size;
     const uint32_t num_pots = 4;
     avl_tree_t *ancestors, Q[4]; /* MSVC won't let us use num_pots here */
-    avl_node_t *x_node, *y_node, *node, *next, *q_node;
-    segment_t *x, *y, *u;
+    avl_node_t *x_node, *y_node, *node, *next;
+    segment_id_t x, y;
 
     ancestors = &self->populations[0].ancestors;
     if (gsl_rng_uniform(self->rng) < (1 / (1.0 + self->model.params.dirac_coalescent.c))) {
@@ -2196,12 +2511,12 @@ msp_multiple_merger_common_ancestor_event_dirac(msp_t *self)
         j = (uint32_t) gsl_rng_uniform_int(self->rng, n);
         x_node = avl_at(ancestors, j);
         assert(x_node != NULL);
-        x = (segment_t *) x_node->item;
+        x = msp_get_avl_node_segment(x_node);
         avl_unlink_node(ancestors, x_node);
         j = (uint32_t) gsl_rng_uniform_int(self->rng, n - 1);
         y_node = avl_at(ancestors, j);
         assert(y_node != NULL);
-        y = (segment_t *) y_node->item;
+        y = msp_get_avl_node_segment(y_node);
         avl_unlink_node(ancestors, y_node);
         self->num_ca_events++;
         msp_free_avl_node(self, x_node);
@@ -2220,19 +2535,12 @@ msp_multiple_merger_common_ancestor_event_dirac(msp_t *self)
             next = node->next;
             /* With probability psi / 4, a given lineage participates in this event. */
             if (gsl_rng_uniform(self->rng) < self->model.params.dirac_coalescent.psi / 4.0) {
-                u = (segment_t *) node->item;
-                avl_unlink_node(ancestors, node);
-                msp_free_avl_node(self, node);
-                q_node = msp_alloc_avl_node(self);
-                if (q_node == NULL) {
-                    ret = MSP_ERR_NO_MEMORY;
-                    goto out;
-                }
-                avl_init_node(q_node, u);
                 /* Now assign this ancestor to a uniformly chosen pot */
                 j = (uint32_t) gsl_rng_uniform_int(self->rng, num_pots);
-                q_node = avl_insert_node(&Q[j], q_node);
-                assert(q_node != NULL);
+                ret = msp_priority_queue_move(self, &Q[j], ancestors, node);
+                if (ret != 0) {
+                    goto out;
+                }
             }
             node = next;
         }
@@ -2264,8 +2572,8 @@ msp_multiple_merger_common_ancestor_event_beta(msp_t *self)
     int ret = 0;
     uint32_t j, n;
     avl_tree_t *ancestors, Q;
-    avl_node_t *x_node, *y_node, *node, *next, *q_node;
-    segment_t *x, *y, *u;
+    avl_node_t *x_node, *y_node, *node, *next;
+    segment_id_t x, y;
 
     ancestors = &self->populations[0].ancestors;
     /* This is just an example to show how to perform the two regimes. With probability 1/2
@@ -2277,12 +2585,12 @@ msp_multiple_merger_common_ancestor_event_beta(msp_t *self)
         j = (uint32_t) gsl_rng_uniform_int(self->rng, n);
         x_node = avl_at(ancestors, j);
         assert(x_node != NULL);
-        x = (segment_t *) x_node->item;
+        x = msp_get_avl_node_segment(x_node);
         avl_unlink_node(ancestors, x_node);
         j = (uint32_t) gsl_rng_uniform_int(self->rng, n - 1);
         y_node = avl_at(ancestors, j);
         assert(y_node != NULL);
-        y = (segment_t *) y_node->item;
+        y = msp_get_avl_node_segment(y_node);
         avl_unlink_node(ancestors, y_node);
         self->num_ca_events++;
         msp_free_avl_node(self, x_node);
@@ -2298,25 +2606,102 @@ msp_multiple_merger_common_ancestor_event_beta(msp_t *self)
         while (node != NULL) {
             next = node->next;
             if (gsl_rng_uniform(self->rng) < 0.5) {
-                u = (segment_t *) node->item;
-                avl_unlink_node(ancestors, node);
-                msp_free_avl_node(self, node);
-                q_node = msp_alloc_avl_node(self);
-                if (q_node == NULL) {
-                    ret = MSP_ERR_NO_MEMORY;
+                ret = msp_priority_queue_move(self, &Q, ancestors, node);
+                if (ret != 0) {
                     goto out;
                 }
-                avl_init_node(q_node, u);
-                q_node = avl_insert_node(&Q, q_node);
-                assert(q_node != NULL);
             }
-            node = next;
+            node = next;
+        }
+        /* Now that we have filled Q in the correct way, we can merge the ancestors. */
+        ret = msp_merge_ancestors(self, &Q, 0);
+    }
+out:
+    return ret;
+}
+
+/* Updates the total rate of migration out of each population. This must be
+ * called whenever the migration matrix changes.
+ */
+static void
+msp_update_migration_rate_totals(msp_t *self)
+{
+    size_t j, k;
+    size_t N = self->num_populations;
+    double total;
+
+    for (j = 0; j < N; j++) {
+        total = 0.0;
+        for (k = 0; k < N; k++) {
+            total += self->migration_matrix[j * N + k];
+        }
+        self->migration_rate_totals[j] = total;
+    }
+}
+
+/* Returns the total rate of migration summed over all pairs of populations.
+ * Because the migration_rate_totals are kept up to date as the migration
+ * matrix changes, this is linear in the number of populations.
+ */
+static double
+msp_get_total_migration_rate(msp_t *self)
+{
+    double ret = 0.0;
+    uint32_t j;
+
+    for (j = 0; j < self->num_populations; j++) {
+        ret += avl_count(&self->populations[j].ancestors)
+            * self->migration_rate_totals[j];
+    }
+    return ret;
+}
+
+/* Chooses the source and destination populations for a migration event,
+ * so that each pair (j, k) is selected with probability proportional to
+ * n_j * m[j, k]. The value u must be uniform on [0, total rate), where
+ * the total rate is the value returned by msp_get_total_migration_rate.
+ */
+static void
+msp_choose_migration_populations(msp_t *self, double u,
+        population_id_t *source_pop, population_id_t *dest_pop)
+{
+    uint32_t j, k;
+    uint32_t N = self->num_populations;
+    double w;
+    double source_w = 0.0;
+    double *row;
+
+    /* To guard against rounding errors, we default to the last population
+     * with a non-zero weight if we run off the end of the array. */
+    *source_pop = 0;
+    for (j = 0; j < N; j++) {
+        w = avl_count(&self->populations[j].ancestors)
+            * self->migration_rate_totals[j];
+        if (w > 0.0) {
+            *source_pop = (population_id_t) j;
+            source_w = w;
+            if (u < w) {
+                break;
+            }
+            u -= w;
         }
-        /* Now that we have filled Q in the correct way, we can merge the ancestors. */
-        ret = msp_merge_ancestors(self, &Q, 0);
     }
-out:
-    return ret;
+    j = (uint32_t) *source_pop;
+    assert(source_w > 0.0);
+    /* Rescale the remainder so we can reuse it to choose the destination */
+    u = GSL_MIN(u, source_w) / avl_count(&self->populations[j].ancestors);
+    row = self->migration_matrix + j * N;
+    *dest_pop = 0;
+    for (k = 0; k < N; k++) {
+        if (row[k] > 0.0) {
+            *dest_pop = (population_id_t) k;
+            if (u < row[k]) {
+                break;
+            }
+            u -= row[k];
+        }
+    }
+    assert(*source_pop != *dest_pop);
 }
 
 static int WARN_UNUSED
@@ -2342,18 +2727,17 @@ msp_reset_memory_state(msp_t *self)
 {
     int ret = 0;
     avl_node_t *node;
-    node_mapping_t *nm;
     population_t *pop;
-    segment_t *u, *v;
+    segment_id_t u, v;
     coalescence_record_t *cr;
     size_t j;
 
     for (j = 0; j < self->num_populations; j++) {
         pop = &self->populations[j];
         for (node = pop->ancestors.head; node != NULL; node = node->next) {
-            u = (segment_t *) node->item;
-            while (u != NULL) {
-                v = u->next;
+            u = msp_get_avl_node_segment(node);
+            while (u != MSP_NULL_SEGMENT) {
+                v = self->segments.next[u];
                 msp_free_segment(self, u);
                 u = v;
             }
@@ -2361,18 +2745,16 @@ msp_reset_memory_state(msp_t *self)
             msp_free_avl_node(self, node);
         }
     }
-    for (node = self->breakpoints.head; node != NULL; node = node->next) {
-        nm = (node_mapping_t *) node->item;
-        avl_unlink_node(&self->breakpoints, node);
-        msp_free_avl_node(self, node);
-        msp_free_node_mapping(self, nm);
-    }
-    for (node = self->overlap_counts.head; node != NULL; node = node->next) {
-        nm = (node_mapping_t *) node->item;
-        avl_unlink_node(&self->overlap_counts, node);
-        msp_free_avl_node(self, node);
-        msp_free_node_mapping(self, nm);
+    /* All segments are now free; rebuild the free list in ID order so that
+     * a reset simulator allocates the same IDs as a new one. */
+    assert(self->segments.num_allocated == 0);
+    self->segments.free_head = MSP_NULL_SEGMENT;
+    for (j = self->segments.size; j > 0; j--) {
+        self->segments.next[j] = self->segments.free_head;
+        self->segments.free_head = (segment_id_t) j;
     }
+    locus_map_clear(&self->breakpoints);
+    locus_map_clear(&self->overlap_counts);
     for (j = 0; j < self->num_coalescence_records; j++) {
         cr = &self->coalescence_records[j];
         if (cr->children != NULL) {
@@ -2387,11 +2769,11 @@ static int WARN_UNUSED
 msp_insert_sample(msp_t *self, node_id_t sample, population_id_t population)
 {
     int ret = MSP_ERR_GENERIC;
-    segment_t *u;
+    segment_id_t u;
 
     u = msp_alloc_segment(self, 0, self->num_loci, sample, population,
-            NULL, NULL);
-    if (u == NULL) {
+            MSP_NULL_SEGMENT, MSP_NULL_SEGMENT);
+    if (u == MSP_NULL_SEGMENT) {
         ret = MSP_ERR_NO_MEMORY;
         goto out;
     }
@@ -2399,7 +2781,7 @@ msp_insert_sample(msp_t *self, node_id_t sample, population_id_t population)
     if (ret != 0) {
         goto out;
     }
-    fenwick_set_value(&self->links, u->id, self->num_loci - 1);
+    msp_links_set_value(self, u, self->num_loci - 1);
 out:
     return ret;
 }
@@ -2440,6 +2822,7 @@ msp_reset(msp_t *self)
     self->next_demographic_event = self->demographic_events_head;
     memcpy(self->migration_matrix, self->initial_migration_matrix,
             N * N * sizeof(double));
+    msp_update_migration_rate_totals(self);
     ret = msp_insert_overlap_count(self, 0, self->sample_size);
     if (ret != 0) {
         goto out;
@@ -2534,6 +2917,62 @@ msp_get_common_ancestor_waiting_time(msp_t *self, uint32_t population_id)
             (uint32_t) avl_count(&pop->ancestors));
 }
 
+/* Returns true if the rate of common ancestor events in the specified
+ * population does not depend on time, so that we can combine it with the
+ * other constant rate processes. Populations that are growing or shrinking
+ * require time rescaling, and so their waiting times must be generated
+ * separately.
+ */
+static bool
+msp_has_constant_common_ancestor_rate(population_t *pop)
+{
+    return pop->growth_rate == 0.0 && pop->initial_size > 0.0;
+}
+
+/* Returns the rate of common ancestor events for a population with a
+ * constant rate. This is consistent with the waiting times returned by
+ * msp_get_common_ancestor_waiting_time_size.
+ */
+static double
+msp_get_common_ancestor_rate(population_t *pop)
+{
+    /* Need to perform n * (n - 1) as a double due to overflow */
+    double n = (double) avl_count(&pop->ancestors);
+
+    assert(msp_has_constant_common_ancestor_rate(pop));
+    return n * (n - 1.0) / pop->initial_size;
+}
+
+/* Chooses the population in which a common ancestor event occurs with
+ * probability proportional to its rate, among the populations with a
+ * constant rate. The value u must be uniform on [0, total rate).
+ */
+static population_id_t
+msp_choose_common_ancestor_population(msp_t *self, double u)
+{
+    population_id_t ret = 0;
+    population_t *pop;
+    uint32_t j;
+    double w;
+
+    /* As for migration, default to the last population with a non-zero
+     * rate to guard against rounding errors. */
+    for (j = 0; j < self->num_populations; j++) {
+        pop = &self->populations[j];
+        if (msp_has_constant_common_ancestor_rate(pop)) {
+            w = msp_get_common_ancestor_rate(pop);
+            if (w > 0.0) {
+                ret = (population_id_t) j;
+                if (u < w) {
+                    break;
+                }
+                u -= w;
+            }
+        }
+    }
+    return ret;
+}
+
 static double
 msp_get_multiple_merger_waiting_time(msp_t *self, uint32_t population_id)
 {
@@ -2614,15 +3053,24 @@ out:
 }
 
 /* The main event loop for the standard coalescent (and SMC variants).
+ *
+ * Recombination, migration and common ancestor events in populations of
+ * constant size all occur at rates that do not change until the next
+ * event. We therefore draw a single waiting time from the sum of these
+ * rates and then choose which type of event occurred with probability
+ * proportional to its rate. Only populations with a non-zero growth rate
+ * need their own waiting times, which we generate by time rescaling.
  */
 static int WARN_UNUSED
 msp_run_standard_coalescent(msp_t *self, double max_time, unsigned long max_events)
 {
     int ret = 0;
-    double lambda, t_temp, t_wait, ca_t_wait, re_t_wait, mig_t_wait,
-           sampling_event_time, demographic_event_time;
+    double t_temp, t_wait, ca_t_wait, const_t_wait, re_rate, ca_rate,
+           mig_rate, total_rate, u, sampling_event_time,
+           demographic_event_time;
     int64_t num_links;
-    uint32_t j, k, n;
+    uint32_t j;
+    population_t *pop;
     population_id_t ca_pop_id, mig_source_pop, mig_dest_pop;
     unsigned long events = 0;
     sampling_event_t *se;
@@ -2630,52 +3078,36 @@ msp_run_standard_coalescent(msp_t *self, double max_time, unsigned long max_even
     while (msp_get_num_ancestors(self) > 0
             && self->time < max_time && events < max_events) {
         events++;
-        num_links = fenwick_get_total(&self->links);
+        num_links = msp_links_get_total(self);
         ret = msp_sanity_check(self, num_links);
         if (ret != 0) {
             goto out;
         }
-        /* Recombination */
-        lambda = (double) num_links * self->scaled_recombination_rate;
-        re_t_wait = DBL_MAX;
-        if (lambda != 0.0) {
-            re_t_wait = gsl_ran_exponential(self->rng, 1.0 / lambda);
-        }
-        /* Common ancestors */
+        re_rate = (double) num_links * self->scaled_recombination_rate;
+        mig_rate = msp_get_total_migration_rate(self);
+        /* Common ancestors. Populations with time varying rates get their
+         * own waiting times; the rest are combined into ca_rate */
+        ca_rate = 0.0;
         ca_t_wait = DBL_MAX;
         ca_pop_id = 0;
         for (j = 0; j < self->num_populations; j++) {
-            t_temp = msp_get_common_ancestor_waiting_time(self, j);
-            if (t_temp < ca_t_wait) {
-                ca_t_wait = t_temp;
-                ca_pop_id = (population_id_t) j;
-            }
-        }
-        /* Migration */
-        mig_t_wait = DBL_MAX;
-        mig_source_pop = 0;
-        mig_dest_pop = 0;
-        for (j = 0; j < self->num_populations; j++) {
-            n = avl_count(&self->populations[j].ancestors);
-            for (k = 0; k < self->num_populations; k++) {
-                lambda = n * self->migration_matrix[
-                    j * self->num_populations + k];
-                if (lambda != 0.0) {
-                    t_temp = gsl_ran_exponential(self->rng, 1.0 / lambda);
-                    if (t_temp < mig_t_wait) {
-                        mig_t_wait = t_temp;
-                        /* m[j, k] is the rate at which migrants move from
-                         * population k to j forwards in time. Backwards
-                         * in time, we move the individual from from
-                         * population j into population k.
-                         */
-                        mig_source_pop = (population_id_t) j;
-                        mig_dest_pop = (population_id_t) k;
-                    }
+            pop = &self->populations[j];
+            if (msp_has_constant_common_ancestor_rate(pop)) {
+                ca_rate += msp_get_common_ancestor_rate(pop);
+            } else {
+                t_temp = msp_get_common_ancestor_waiting_time(self, j);
+                if (t_temp < ca_t_wait) {
+                    ca_t_wait = t_temp;
+                    ca_pop_id = (population_id_t) j;
                 }
             }
         }
-        t_wait = GSL_MIN(GSL_MIN(re_t_wait, ca_t_wait), mig_t_wait);
+        total_rate = re_rate + ca_rate + mig_rate;
+        const_t_wait = DBL_MAX;
+        if (total_rate > 0.0) {
+            const_t_wait = gsl_ran_exponential(self->rng, 1.0 / total_rate);
+        }
+        t_wait = GSL_MIN(const_t_wait, ca_t_wait);
         if (self->next_demographic_event == NULL
                 && self->next_sampling_event == self->num_sampling_events
                 && t_wait == DBL_MAX) {
@@ -2708,12 +3140,28 @@ msp_run_standard_coalescent(msp_t *self, double max_time, unsigned long max_even
             }
         } else {
             self->time += t_wait;
-            if (re_t_wait == t_wait) {
-                ret = msp_recombination_event(self);
-            } else if (ca_t_wait == t_wait) {
+            if (ca_t_wait == t_wait) {
                 ret = msp_common_ancestor_event(self, ca_pop_id);
             } else {
-                ret = msp_migration_event(self, mig_source_pop, mig_dest_pop);
+                u = gsl_rng_uniform(self->rng) * total_rate;
+                if (u < re_rate || (ca_rate == 0.0 && mig_rate == 0.0)) {
+                    ret = msp_recombination_event(self);
+                } else if (u < re_rate + ca_rate || mig_rate == 0.0) {
+                    ca_pop_id = msp_choose_common_ancestor_population(self,
+                            u - re_rate);
+                    ret = msp_common_ancestor_event(self, ca_pop_id);
+                } else {
+                    /* m[j, k] is the rate at which migrants move from
+                     * population k to j forwards in time. Backwards
+                     * in time, we move the individual from from
+                     * population j into population k.
+                     */
+                    msp_choose_migration_populations(self,
+                            u - re_rate - ca_rate, &mig_source_pop,
+                            &mig_dest_pop);
+                    ret = msp_migration_event(self, mig_source_pop,
+                            mig_dest_pop);
+                }
             }
             if (ret != 0) {
                 goto out;
@@ -2740,7 +3188,7 @@ msp_run_multiple_mergers_coalescent(msp_t *self, double max_time, unsigned long
     while (msp_get_num_ancestors(self) > 0
             && self->time < max_time && events < max_events) {
         events++;
-        num_links = fenwick_get_total(&self->links);
+        num_links = msp_links_get_total(self);
         ret = msp_sanity_check(self, num_links);
         if (ret != 0) {
             goto out;
@@ -2784,6 +3232,337 @@ out:
     return ret;
 }
 
+/* Returns the number of links up to and including the next crossover in
+ * the DTWF model, where a crossover occurs at each link independently
+ * with probability r. The value is capped at num_loci, which is beyond
+ * the end of any segment chain.
+ */
+static int64_t
+msp_dtwf_get_crossover_distance(msp_t *self, double r)
+{
+    double d = (double) self->num_loci;
+
+    if (r >= 1.0) {
+        d = 1;
+    } else if (r > 0.0) {
+        d = floor(log(gsl_rng_uniform_pos(self->rng)) / log1p(-r)) + 1;
+        d = GSL_MIN(d, (double) self->num_loci);
+    }
+    return (int64_t) d;
+}
+
+/* Appends the segment x to the chain with the specified head and tail,
+ * and updates its links.
+ */
+static void
+msp_dtwf_append_segment(msp_t *self, segment_id_t x, segment_id_t *head,
+        segment_id_t *tail)
+{
+    segment_pool_t *pool = &self->segments;
+
+    pool->next[x] = MSP_NULL_SEGMENT;
+    pool->prev[x] = *tail;
+    if (*tail == MSP_NULL_SEGMENT) {
+        *head = x;
+        msp_links_set_value(self, x, pool->right[x] - pool->left[x] - 1);
+    } else {
+        pool->next[*tail] = x;
+        msp_links_set_value(self, x, pool->right[x] - pool->right[*tail]);
+    }
+    *tail = x;
+}
+
+/* Splits the segment chain starting at x between the two chromosomes of
+ * its diploid parent. Crossovers occur at each link with probability r,
+ * and the heads of the chains inherited from each parental chromosome are
+ * returned in u[0] and u[1]; either of these may be MSP_NULL_SEGMENT.
+ */
+static int WARN_UNUSED
+msp_dtwf_recombine(msp_t *self, segment_id_t x, double r, segment_id_t *u)
+{
+    int ret = 0;
+    int ix;
+    int64_t k;
+    segment_pool_t *pool = &self->segments;
+    segment_id_t y, z;
+    segment_id_t tail[] = {MSP_NULL_SEGMENT, MSP_NULL_SEGMENT};
+
+    u[0] = MSP_NULL_SEGMENT;
+    u[1] = MSP_NULL_SEGMENT;
+    ix = (int) gsl_rng_uniform_int(self->rng, 2);
+    k = pool->left[x] + msp_dtwf_get_crossover_distance(self, r);
+    if (k >= self->num_loci) {
+        /* No crossovers within the chain, so we can leave it intact */
+        u[ix] = x;
+        goto out;
+    }
+    while (x != MSP_NULL_SEGMENT) {
+        y = pool->next[x];
+        while (k < pool->right[x]) {
+            z = msp_alloc_segment(self, (uint32_t) k, pool->right[x],
+                    pool->value[x], pool->population_id[x],
+                    MSP_NULL_SEGMENT, MSP_NULL_SEGMENT);
+            if (z == MSP_NULL_SEGMENT) {
+                ret = MSP_ERR_NO_MEMORY;
+                goto out;
+            }
+            pool->right[x] = (uint32_t) k;
+            msp_dtwf_append_segment(self, x, &u[ix], &tail[ix]);
+            self->num_re_events++;
+            if (locus_map_get(&self->breakpoints, (uint32_t) k) == NULL) {
+                ret = msp_insert_breakpoint(self, (uint32_t) k);
+                if (ret != 0) {
+                    goto out;
+                }
+            } else {
+                self->num_multiple_re_events++;
+            }
+            ix = 1 - ix;
+            x = z;
+            k += msp_dtwf_get_crossover_distance(self, r);
+        }
+        msp_dtwf_append_segment(self, x, &u[ix], &tail[ix]);
+        /* Crossovers in the gap before the next segment */
+        if (y != MSP_NULL_SEGMENT) {
+            while (k <= pool->left[y]) {
+                self->num_re_events++;
+                self->num_trapped_re_events++;
+                ix = 1 - ix;
+                k += msp_dtwf_get_crossover_distance(self, r);
+            }
+        }
+        x = y;
+    }
+out:
+    return ret;
+}
+
+/* Returns the number of diploid individuals in the specified population
+ * at the current time in the DTWF model.
+ */
+static uint32_t
+msp_dtwf_get_population_size(msp_t *self, population_id_t population_id)
+{
+    population_t *pop = &self->populations[population_id];
+    double size = self->model.params.dtwf.population_size * pop->initial_size
+        * exp(-pop->growth_rate * (self->time - pop->start_time));
+
+    size = GSL_MAX(1.0, GSL_MIN(round(size), (double) UINT32_MAX));
+    return (uint32_t) size;
+}
+
+/* Processes one generation of the DTWF model. Every lineage first migrates
+ * with probability given by the migration matrix, and then chooses a
+ * diploid parent uniformly in its population. Each lineage is split between
+ * the two chromosomes of its parent by recombination, and all the lineages
+ * inheriting from the same parental chromosome are merged.
+ */
+static int WARN_UNUSED
+msp_dtwf_generation(msp_t *self)
+{
+    int ret = 0;
+    uint32_t j, k, h, N = self->num_populations;
+    size_t a, b, n;
+    double dt = 1.0 / (4 * self->model.params.dtwf.population_size);
+    double r = self->scaled_recombination_rate * dt;
+    double p_mig, u, *row;
+    population_t *pop;
+    population_id_t pop_id;
+    avl_node_t *node, *next;
+    avl_tree_t Q[2];
+    node_mapping_t *nm;
+    segment_id_t x[2];
+    uint32_t *population_size = malloc(N * sizeof(uint32_t));
+    dtwf_lineage_t *lineages = malloc(msp_get_num_ancestors(self)
+            * sizeof(dtwf_lineage_t));
+
+    if (population_size == NULL || lineages == NULL) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    for (j = 0; j < N; j++) {
+        population_size[j] = msp_dtwf_get_population_size(self,
+                (population_id_t) j);
+    }
+    /* Take all the lineages out of the populations, and choose the
+     * population and parent for each. */
+    n = 0;
+    for (j = 0; j < N; j++) {
+        pop = &self->populations[j];
+        p_mig = GSL_MIN(1.0, self->migration_rate_totals[j] * dt);
+        row = self->migration_matrix + j * N;
+        node = pop->ancestors.head;
+        while (node != NULL) {
+            next = node->next;
+            lineages[n].head = msp_get_avl_node_segment(node);
+            lineages[n].population_id = (population_id_t) j;
+            avl_unlink_node(&pop->ancestors, node);
+            msp_free_avl_node(self, node);
+            if (p_mig > 0 && gsl_rng_uniform(self->rng) < p_mig) {
+                /* Choose the destination with probability proportional to
+                 * the rates in this row of the migration matrix. */
+                u = gsl_rng_uniform(self->rng) * self->migration_rate_totals[j];
+                pop_id = 0;
+                for (k = 0; k < N; k++) {
+                    if (row[k] > 0.0) {
+                        pop_id = (population_id_t) k;
+                        if (u < row[k]) {
+                            break;
+                        }
+                        u -= row[k];
+                    }
+                }
+                self->num_migration_events[j * N + (uint32_t) pop_id]++;
+                ret = msp_set_segment_chain_population(self, lineages[n].head,
+                        pop_id);
+                if (ret != 0) {
+                    goto out;
+                }
+                lineages[n].population_id = pop_id;
+            }
+            n++;
+            node = next;
+        }
+    }
+    for (a = 0; a < n; a++) {
+        lineages[a].parent = (uint32_t) gsl_rng_uniform_int(self->rng,
+                population_size[lineages[a].population_id]);
+    }
+    qsort(lineages, n, sizeof(dtwf_lineage_t), cmp_dtwf_lineage);
+
+    for (a = 0; a < n; a = b) {
+        b = a + 1;
+        while (b < n && lineages[b].population_id == lineages[a].population_id
+                && lineages[b].parent == lineages[a].parent) {
+            b++;
+        }
+        pop_id = lineages[a].population_id;
+        if (b - a == 1) {
+            /* Only one lineage descends from this parent */
+            ret = msp_dtwf_recombine(self, lineages[a].head, r, x);
+            if (ret != 0) {
+                goto out;
+            }
+            for (h = 0; h < 2; h++) {
+                if (x[h] != MSP_NULL_SEGMENT) {
+                    ret = msp_insert_individual(self, x[h]);
+                    if (ret != 0) {
+                        goto out;
+                    }
+                }
+            }
+            continue;
+        }
+        for (h = 0; h < 2; h++) {
+            avl_init_tree(&Q[h], cmp_segment_queue, NULL);
+        }
+        for (j = 0; a + j < b; j++) {
+            ret = msp_dtwf_recombine(self, lineages[a + j].head, r, x);
+            if (ret != 0) {
+                goto out;
+            }
+            for (h = 0; h < 2; h++) {
+                if (x[h] != MSP_NULL_SEGMENT) {
+                    ret = msp_priority_queue_insert(self, &Q[h], x[h]);
+                    if (ret != 0) {
+                        goto out;
+                    }
+                }
+            }
+        }
+        for (h = 0; h < 2; h++) {
+            if (avl_count(&Q[h]) > 1) {
+                self->num_ca_events++;
+                ret = msp_merge_ancestors(self, &Q[h], pop_id);
+                if (ret != 0) {
+                    goto out;
+                }
+            } else if (avl_count(&Q[h]) == 1) {
+                node = Q[h].head;
+                nm = (node_mapping_t *) node->item;
+                avl_unlink_node(&Q[h], node);
+                msp_free_avl_node(self, node);
+                ret = msp_insert_individual(self, (segment_id_t) nm->value);
+                msp_free_node_mapping(self, nm);
+                if (ret != 0) {
+                    goto out;
+                }
+            }
+        }
+    }
+out:
+    if (population_size != NULL) {
+        free(population_size);
+    }
+    if (lineages != NULL) {
+        free(lineages);
+    }
+    return ret;
+}
+
+/* The main event loop for the discrete time Wright-Fisher model. Each
+ * event is one generation, and sampling and demographic events are
+ * applied before the generation in which they occur. After the specified
+ * number of generations we switch to the standard coalescent.
+ */
+static int WARN_UNUSED
+msp_run_dtwf(msp_t *self, double max_time, unsigned long max_events)
+{
+    int ret = 0;
+    double dt = 1.0 / (4 * self->model.params.dtwf.population_size);
+    double end_time = self->model.params.dtwf.num_generations * dt;
+    double t_next, sampling_event_time, demographic_event_time;
+    unsigned long events = 0;
+    sampling_event_t *se;
+
+    /* Allow for rounding error in the accumulated time */
+    end_time -= dt / 2;
+    while (msp_get_num_ancestors(self) > 0
+            && self->time < max_time && self->time < end_time
+            && events < max_events) {
+        events++;
+        t_next = self->time + dt;
+        while (true) {
+            sampling_event_time = DBL_MAX;
+            if (self->next_sampling_event < self->num_sampling_events) {
+                sampling_event_time = self->sampling_events[
+                    self->next_sampling_event].time;
+            }
+            demographic_event_time = DBL_MAX;
+            if (self->next_demographic_event != NULL) {
+                demographic_event_time = self->next_demographic_event->time;
+            }
+            if (sampling_event_time <= t_next
+                    && sampling_event_time < demographic_event_time) {
+                se = &self->sampling_events[self->next_sampling_event];
+                self->time = se->time;
+                ret = msp_insert_sample(self, se->sample, se->population_id);
+                if (ret != 0) {
+                    goto out;
+                }
+                self->next_sampling_event++;
+            } else if (demographic_event_time <= t_next) {
+                ret = msp_apply_demographic_events(self);
+                if (ret != 0) {
+                    goto out;
+                }
+            } else {
+                break;
+            }
+        }
+        self->time = t_next;
+        ret = msp_dtwf_generation(self);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    if (events < max_events) {
+        ret = msp_run_standard_coalescent(self, max_time, max_events - events);
+    }
+out:
+    return ret;
+}
+
 /* Runs the simulation backwards in time until either the sample has coalesced,
  * or specified maximum simulation time has been reached or the specified maximum
  * number of events has been reached.
@@ -2803,6 +3582,8 @@ msp_run(msp_t *self, double max_time, unsigned long max_events)
     }
     if (model_type == MSP_MODEL_DIRAC || model_type == MSP_MODEL_BETA) {
         ret = msp_run_multiple_mergers_coalescent(self, max_time, max_events);
+    } else if (model_type == MSP_MODEL_DTWF) {
+        ret = msp_run_dtwf(self, max_time, max_events);
     } else {
         ret = msp_run_standard_coalescent(self, max_time, max_events);
     }
@@ -2819,6 +3600,29 @@ out:
     return ret;
 }
 
+/* Returns the physical coordinate for the specified genetic coordinate,
+ * using the sorted list of converted coordinates if possible.
+ */
+static double
+msp_genetic_to_phys(recomb_map_t *recomb_map, size_t num_coordinates,
+        double *genetic, double *physical, double x)
+{
+    double *p;
+
+    p = bsearch(&x, genetic, num_coordinates, sizeof(double), cmp_double);
+    if (p != NULL) {
+        return physical[p - genetic];
+    }
+    return recomb_map_genetic_to_phys(recomb_map, x);
+}
+
+/* Writes the state of the simulation into the specified tables. The
+ * columns are sized up front and written in place, so that the tables
+ * can be passed to tree_sequence_take_tables_tmp without further copying.
+ * Since every record coordinate is either 0, num_loci or a breakpoint, we
+ * convert these to physical coordinates in a single pass over the
+ * recombination map.
+ */
 int WARN_UNUSED
 msp_populate_tables(msp_t *self, double Ne, recomb_map_t *recomb_map,
         node_table_t *nodes, edgeset_table_t *edgesets,
@@ -2826,9 +3630,12 @@ msp_populate_tables(msp_t *self, double Ne, recomb_map_t *recomb_map,
 {
     int ret = 0;
     node_id_t last_node;
-    size_t j;
-    double scaled_time;
-    double left, right;
+    size_t j, num_nodes, num_edgesets, num_children;
+    size_t num_coordinates = 0;
+    double *genetic = NULL;
+    double *physical = NULL;
+    locus_map_cursor_t cursor;
+    int more;
     coalescence_record_t *cr;
     migration_t *mr;
 
@@ -2845,54 +3652,117 @@ msp_populate_tables(msp_t *self, double Ne, recomb_map_t *recomb_map,
     if (ret != 0) {
         goto out;
     }
-    /* Add the node definitions for the samples */
-    for (j = 0; j < self->sample_size; j++) {
-        scaled_time = self->samples[j].time * 4 * Ne;
-        ret = node_table_add_row(nodes, MSP_NODE_IS_SAMPLE, scaled_time,
-                self->samples[j].population_id, "");
+    num_nodes = self->sample_size;
+    num_children = 0;
+    for (j = 0; j < self->num_coalescence_records; j++) {
+        num_children += self->coalescence_records[j].num_children;
+    }
+    if (self->num_coalescence_records > 0) {
+        cr = &self->coalescence_records[self->num_coalescence_records - 1];
+        num_nodes = (size_t) cr->node + 1;
+    }
+    /* Allocate at least one row so that the columns are never NULL */
+    ret = node_table_expand(nodes, GSL_MAX(1, num_nodes), 1);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = edgeset_table_expand(edgesets, GSL_MAX(1, self->num_coalescence_records),
+            GSL_MAX(1, num_children));
+    if (ret != 0) {
+        goto out;
+    }
+    ret = migration_table_expand(migrations, GSL_MAX(1, self->num_migrations));
+    if (ret != 0) {
+        goto out;
+    }
+    if (recomb_map != NULL) {
+        num_coordinates = locus_map_get_size(&self->breakpoints) + 2;
+        genetic = malloc(num_coordinates * sizeof(double));
+        physical = malloc(num_coordinates * sizeof(double));
+        if (genetic == NULL || physical == NULL) {
+            ret = MSP_ERR_NO_MEMORY;
+            goto out;
+        }
+        j = 0;
+        genetic[j++] = 0;
+        more = locus_map_first(&self->breakpoints, &cursor);
+        while (more) {
+            genetic[j++] = (double) cursor.key;
+            more = locus_map_next(&self->breakpoints, &cursor);
+        }
+        genetic[j] = (double) self->num_loci;
+        memcpy(physical, genetic, num_coordinates * sizeof(double));
+        ret = recomb_map_genetic_to_phys_bulk(recomb_map, physical, num_coordinates);
         if (ret != 0) {
             goto out;
         }
     }
+
+    /* Add the node definitions for the samples */
+    for (j = 0; j < self->sample_size; j++) {
+        nodes->flags[j] = MSP_NODE_IS_SAMPLE;
+        nodes->time[j] = self->samples[j].time * 4 * Ne;
+        nodes->population[j] = self->samples[j].population_id;
+        nodes->name_length[j] = 0;
+    }
     /* Go through the records to add nodes and edgesets */
     last_node = MSP_NULL_NODE;
+    num_nodes = self->sample_size;
+    num_edgesets = 0;
+    num_children = 0;
     for (j = 0; j < self->num_coalescence_records; j++) {
         cr = &self->coalescence_records[j];
         if (cr->node != last_node) {
-            assert(cr->node == (node_id_t) nodes->num_rows);
-            scaled_time = cr->time * 4 * Ne;
-            ret = node_table_add_row(nodes, 0, scaled_time, cr->population_id, "");
-            if (ret != 0) {
-                goto out;
-            }
+            assert(cr->node == (node_id_t) num_nodes);
+            nodes->flags[num_nodes] = 0;
+            nodes->time[num_nodes] = cr->time * 4 * Ne;
+            nodes->population[num_nodes] = cr->population_id;
+            nodes->name_length[num_nodes] = 0;
+            num_nodes++;
             last_node = cr->node;
         }
-        left = cr->left;
-        right = cr->right;
+        edgesets->left[num_edgesets] = cr->left;
+        edgesets->right[num_edgesets] = cr->right;
         if (recomb_map != NULL) {
-            left = recomb_map_genetic_to_phys(recomb_map, cr->left);
-            right = recomb_map_genetic_to_phys(recomb_map, cr->right);
+            edgesets->left[num_edgesets] = msp_genetic_to_phys(recomb_map,
+                    num_coordinates, genetic, physical, cr->left);
+            edgesets->right[num_edgesets] = msp_genetic_to_phys(recomb_map,
+                    num_coordinates, genetic, physical, cr->right);
         }
-        ret = edgeset_table_add_row(edgesets, left, right, cr->node,
-                cr->children, cr->num_children);
-    }
+        edgesets->parent[num_edgesets] = cr->node;
+        edgesets->children_length[num_edgesets] = cr->num_children;
+        memcpy(edgesets->children + num_children, cr->children,
+                cr->num_children * sizeof(node_id_t));
+        num_children += cr->num_children;
+        num_edgesets++;
+    }
+    nodes->num_rows = num_nodes;
+    edgesets->num_rows = num_edgesets;
+    edgesets->total_children_length = num_children;
     /* Add in the migration records */
     for (j = 0; j < self->num_migrations; j++) {
         mr = &self->migrations[j];
-        left = mr->left;
-        right = mr->right;
+        migrations->left[j] = mr->left;
+        migrations->right[j] = mr->right;
         if (recomb_map != NULL) {
-            left = recomb_map_genetic_to_phys(recomb_map, mr->left);
-            right = recomb_map_genetic_to_phys(recomb_map, mr->right);
-        }
-        scaled_time = mr->time * 4 * Ne;
-        ret = migration_table_add_row(migrations, left, right, mr->node,
-                mr->source, mr->dest, scaled_time);
-        if (ret != 0) {
-            goto out;
+            migrations->left[j] = msp_genetic_to_phys(recomb_map,
+                    num_coordinates, genetic, physical, mr->left);
+            migrations->right[j] = msp_genetic_to_phys(recomb_map,
+                    num_coordinates, genetic, physical, mr->right);
         }
+        migrations->node[j] = mr->node;
+        migrations->source[j] = mr->source;
+        migrations->dest[j] = mr->dest;
+        migrations->time[j] = mr->time * 4 * Ne;
     }
+    migrations->num_rows = self->num_migrations;
 out:
+    if (genetic != NULL) {
+        free(genetic);
+    }
+    if (physical != NULL) {
+        free(physical);
+    }
     return ret;
 }
 
@@ -2952,6 +3822,9 @@ msp_get_model_name(msp_t *self)
         case MSP_MODEL_BETA:
             ret = "beta";
             break;
+        case MSP_MODEL_DTWF:
+            ret = "dtwf";
+            break;
         default:
             ret = "BUG: bad model in simulator!";
             break;
@@ -2998,7 +3871,7 @@ msp_get_num_ancestors(msp_t *self)
 size_t
 msp_get_num_breakpoints(msp_t *self)
 {
-    return avl_count(&self->breakpoints);
+    return locus_map_get_size(&self->breakpoints);
 }
 
 size_t
@@ -3014,7 +3887,7 @@ msp_get_num_migrations(msp_t *self)
 }
 
 int WARN_UNUSED
-msp_get_ancestors(msp_t *self, segment_t **ancestors)
+msp_get_ancestors(msp_t *self, segment_id_t *ancestors)
 {
     int ret = -1;
     avl_node_t *node;
@@ -3025,7 +3898,7 @@ msp_get_ancestors(msp_t *self, segment_t **ancestors)
     for (j = 0; j < self->num_populations; j++) {
         population_ancestors = &self->populations[j].ancestors;
         for (node = population_ancestors->head; node != NULL; node = node->next) {
-            ancestors[k] = (segment_t *) node->item;
+            ancestors[k] = msp_get_avl_node_segment(node);
             k++;
         }
     }
@@ -3033,18 +3906,39 @@ msp_get_ancestors(msp_t *self, segment_t **ancestors)
     return ret;
 }
 
+int WARN_UNUSED
+msp_get_segment(msp_t *self, segment_id_t id, segment_t *segment)
+{
+    int ret = 0;
+    segment_pool_t *pool = &self->segments;
+
+    if (id == MSP_NULL_SEGMENT || id > pool->size) {
+        ret = MSP_ERR_OUT_OF_BOUNDS;
+        goto out;
+    }
+    segment->population_id = pool->population_id[id];
+    segment->left = pool->left[id];
+    segment->right = pool->right[id];
+    segment->value = pool->value[id];
+    segment->prev = pool->prev[id];
+    segment->next = pool->next[id];
+out:
+    return ret;
+}
+
 int WARN_UNUSED
 msp_get_breakpoints(msp_t *self, size_t *breakpoints)
 {
     int ret = -1;
-    avl_node_t *node;
-    node_mapping_t *nm;
+    int more;
+    locus_map_cursor_t cursor;
     size_t j = 0;
 
-    for (node = (&self->breakpoints)->head; node != NULL; node = node->next) {
-        nm = (node_mapping_t *) node->item;
-        breakpoints[j] = (size_t) nm->left;
+    more = locus_map_first(&self->breakpoints, &cursor);
+    while (more) {
+        breakpoints[j] = (size_t) cursor.key;
         j++;
+        more = locus_map_next(&self->breakpoints, &cursor);
     }
     ret = 0;
     return ret;
@@ -3310,6 +4204,7 @@ msp_change_migration_rate(msp_t *self, demographic_event_t *event)
             goto out;
         }
     }
+    msp_update_migration_rate_totals(self);
 out:
     return ret;
 }
@@ -3448,9 +4343,8 @@ msp_simple_bottleneck(msp_t *self, demographic_event_t *event)
     population_id_t population_id = event->params.simple_bottleneck.population_id;
     double p = event->params.simple_bottleneck.proportion;
     population_id_t N = (population_id_t) self->num_populations;
-    avl_node_t *node, *next, *q_node;
+    avl_node_t *node, *next;
     avl_tree_t *pop, Q;
-    segment_t *u;
 
     /* This should have been caught on adding the event */
     if (population_id < 0 || population_id > N) {
@@ -3467,17 +4361,10 @@ msp_simple_bottleneck(msp_t *self, demographic_event_t *event)
     while (node != NULL) {
         next = node->next;
         if (gsl_rng_uniform(self->rng) < p) {
-            u = (segment_t *) node->item;
-            avl_unlink_node(pop, node);
-            msp_free_avl_node(self, node);
-            q_node = msp_alloc_avl_node(self);
-            if (q_node == NULL) {
-                ret = MSP_ERR_NO_MEMORY;
+            ret = msp_priority_queue_move(self, &Q, pop, node);
+            if (ret != 0) {
                 goto out;
             }
-            avl_init_node(q_node, u);
-            q_node = avl_insert_node(&Q, q_node);
-            assert(q_node != NULL);
         }
         node = next;
     }
@@ -3511,7 +4398,8 @@ msp_add_simple_bottleneck(msp_t *self, double time, int population_id,
         ret = MSP_ERR_BAD_PARAM_VALUE;
         goto out;
     }
-    if (self->model.type != MSP_MODEL_HUDSON) {
+    if (self->model.type != MSP_MODEL_HUDSON
+            && self->model.type != MSP_MODEL_DTWF) {
         ret = MSP_ERR_BAD_MODEL;
         goto out;
     }
@@ -3547,8 +4435,7 @@ msp_instantaneous_bottleneck(msp_t *self, demographic_event_t *event)
     uint32_t j, k, n, num_roots;
     double t;
     avl_tree_t *pop;
-    avl_node_t *node, *set_node;
-    segment_t *individual;
+    avl_node_t *node;
 
     /* This should have been caught on adding the event */
     if (population_id < 0 || population_id >= N) {
@@ -3621,17 +4508,10 @@ msp_instantaneous_bottleneck(msp_t *self, demographic_event_t *event)
         if (u >= (node_id_t) n) {
             /* Remove this node from the population, and add it into the
              * set for the root at u */
-            individual = (segment_t *) avl_nodes[j]->item;
-            avl_unlink_node(pop, avl_nodes[j]);
-            msp_free_avl_node(self, avl_nodes[j]);
-            set_node = msp_alloc_avl_node(self);
-            if (set_node == NULL) {
-                ret = MSP_ERR_NO_MEMORY;
+            ret = msp_priority_queue_move(self, &sets[u], pop, avl_nodes[j]);
+            if (ret != 0) {
                 goto out;
             }
-            avl_init_node(set_node, individual);
-            set_node = avl_insert_node(&sets[u], set_node);
-            assert(set_node != NULL);
         }
     }
     for (j = 0; j < num_roots; j++) {
@@ -3683,7 +4563,8 @@ msp_add_instantaneous_bottleneck(msp_t *self, double time, int population_id,
         ret = MSP_ERR_BAD_PARAM_VALUE;
         goto out;
     }
-    if (self->model.type != MSP_MODEL_HUDSON) {
+    if (self->model.type != MSP_MODEL_HUDSON
+            && self->model.type != MSP_MODEL_DTWF) {
         ret = MSP_ERR_BAD_MODEL;
         goto out;
     }
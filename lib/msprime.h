@@ -32,6 +32,8 @@
 #include "err.h"
 #include "avl.h"
 #include "fenwick.h"
+#include "sum_tree.h"
+#include "locus_map.h"
 
 /* Flags for tree sequence dump/load */
 #define MSP_DUMP_ZLIB_COMPRESSION 1
@@ -40,17 +42,36 @@
 #define MSP_FILE_FORMAT_VERSION_MAJOR 6
 #define MSP_FILE_FORMAT_VERSION_MINOR 0
 
+/* Flags for tree_sequence_build_indexes() */
+#define MSP_INDEX_QSORT 1
+
 /* Flags for simplify() */
 #define MSP_FILTER_INVARIANT_SITES 1
+#define MSP_SIMPLIFY_TREE_DIFFS 2
 
-#define MSP_LEAF_COUNTS  1
-#define MSP_LEAF_LISTS   2
+#define MSP_LEAF_COUNTS     1
+#define MSP_LEAF_LISTS      2
+/* Requires MSP_LEAF_COUNTS */
+#define MSP_BRANCH_LENGTHS  4
 
 #define MSP_DIR_FORWARD 1
 #define MSP_DIR_REVERSE -1
 
 #define MSP_GENOTYPES_AS_CHAR 1
 
+/* Options for vargen_next_packed() */
+#define MSP_GENOTYPES_2BIT          (1 << 0)
+#define MSP_GENOTYPES_SAMPLE_MAJOR  (1 << 1)
+
+/* Built-in branch statistics */
+#define MSP_STAT_DIVERSITY  0
+#define MSP_STAT_DIVERGENCE 1
+#define MSP_STAT_Y2         2
+#define MSP_STAT_Y3         3
+#define MSP_STAT_F2         4
+#define MSP_STAT_F3         5
+#define MSP_STAT_F4         6
+
 #define MSP_ALPHABET_BINARY 0
 #define MSP_ALPHABET_ASCII  1
 
@@ -59,6 +80,11 @@
 #define MSP_MODEL_SMC_PRIME 2
 #define MSP_MODEL_BETA 3
 #define MSP_MODEL_DIRAC 4
+#define MSP_MODEL_DTWF 5
+
+/* Implementations of the links index */
+#define MSP_LINKS_FENWICK 0
+#define MSP_LINKS_SUM_TREE 1
 
 #define MSP_NODE_IS_SAMPLE 1
 
@@ -66,6 +92,8 @@
 
 /* The root node indicator */
 #define MSP_NULL_NODE (-1)
+/* The end of a segment chain */
+#define MSP_NULL_SEGMENT 0
 /* Indicates the that the population ID has not been set. */
 #define MSP_NULL_POPULATION_ID (-1)
 
@@ -142,17 +170,37 @@ typedef struct {
     double *time;
 } migration_table_t;
 
-typedef struct segment_t_t {
+typedef uint32_t segment_id_t;
+
+/* A copy of a single segment in the simulator's segment pool. Segments are
+ * linked into chains by ID, with MSP_NULL_SEGMENT marking the ends. */
+typedef struct {
     population_id_t population_id;
     /* During simulation we use genetic coordinates */
     uint32_t left;
     uint32_t right;
     node_id_t value;
-    size_t id;
-    struct segment_t_t *prev;
-    struct segment_t_t *next;
+    segment_id_t prev;
+    segment_id_t next;
 } segment_t;
 
+/* Segments are stored column-wise in contiguous arrays indexed by
+ * segment ID. ID 0 is never allocated, so that it can be used as
+ * MSP_NULL_SEGMENT and so that IDs can be used directly as indexes into
+ * the links Fenwick tree. Free segments are chained through next.
+ */
+typedef struct {
+    size_t size;
+    size_t num_allocated;
+    segment_id_t free_head;
+    population_id_t *population_id;
+    uint32_t *left;
+    uint32_t *right;
+    node_id_t *value;
+    segment_id_t *prev;
+    segment_id_t *next;
+} segment_pool_t;
+
 typedef struct {
     population_id_t population_id;
     uint32_t num_children;
@@ -224,11 +272,22 @@ typedef struct {
     double c; // constant
 } dirac_coalescent_t;
 
+/* The discrete time Wright-Fisher model is used for the first
+ * num_generations generations, after which we switch to Hudson's
+ * algorithm. Population sizes are relative to population_size diploid
+ * individuals, and one unit of time is 4 * population_size generations.
+ */
+typedef struct {
+    double population_size;
+    double num_generations;
+} dtwf_t;
+
 typedef struct {
     int type;
     union {
         beta_coalescent_t beta_coalescent;
         dirac_coalescent_t dirac_coalescent;
+        dtwf_t dtwf;
     } params;
 } simulation_model_t;
 
@@ -270,13 +329,18 @@ typedef struct {
     double time;
     node_id_t next_node;
     double *migration_matrix;
+    /* The row sums of the migration matrix, so that the total rate of
+     * migration out of population j is n_j * migration_rate_totals[j] */
+    double *migration_rate_totals;
     population_t *populations;
-    avl_tree_t breakpoints;
-    avl_tree_t overlap_counts;
+    locus_map_t breakpoints;
+    locus_map_t overlap_counts;
+    int links_index;
     fenwick_t links;
+    sum_tree_t links_sum_tree;
     /* memory management */
     object_heap_t avl_node_heap;
-    object_heap_t segment_heap;
+    segment_pool_t segments;
     object_heap_t node_mapping_heap;
     object_heap_t binary_children_heap;
     /* coalescence records are stored in a flat array */
@@ -468,6 +532,21 @@ typedef struct {
     size_t max_num_provenance_strings;
 } tree_sequence_t;
 
+/* Windowed site statistics */
+#define MSP_SITE_STAT_DIVERSITY         0
+#define MSP_SITE_STAT_SEGREGATING_SITES 1
+#define MSP_SITE_STAT_TAJIMAS_D         2
+
+/* Site frequency spectrum options */
+#define MSP_SFS_FOLDED (1 << 0)
+
+/* Computes the branch weights for num_rows nodes. Row j of counts holds the
+ * number of members of each of the num_sample_sets sets below the node, and
+ * row j of weights receives the num_outputs weights of the node's branch.
+ */
+typedef int (*branch_stat_weight_func_t)(size_t num_rows, size_t num_sample_sets,
+        double *counts, size_t num_outputs, double *weights, void *params);
+
 /* TODO rename this struct. This is just used in the tree_diff iterator and
  * can easily be confused with the node_t type.
  */
@@ -497,6 +576,90 @@ typedef struct {
     node_record_t *node_records;
 } tree_diff_iterator_t;
 
+typedef struct {
+    double left;
+    double right;
+    node_id_t node;
+} simplify_segment_t;
+
+typedef struct {
+    double time;
+    node_id_t parent;
+    list_len_t num_children;
+    double left;
+    double right;
+    node_id_t *children;
+    size_t index;
+} simplify_edgeset_t;
+
+typedef struct {
+    node_id_t node;
+    list_len_t num_children;
+    double left;
+    double right;
+    double time;
+    size_t children_offset;
+} simplify_record_t;
+
+typedef struct {
+    int flags;
+    double sequence_length;
+    /* The input nodes. These columns are borrowed from the input. */
+    size_t num_input_nodes;
+    uint32_t *node_flags;
+    double *node_time;
+    population_id_t *node_population;
+    /* Arenas indexed by input node */
+    size_t max_nodes;
+    node_id_t *node_map;
+    bool *is_sample;
+    size_t *ancestry_start;
+    size_t *ancestry_length;
+    bool *ancestry_changed;
+    size_t *retained_start;
+    size_t *retained_length;
+    /* The output of the last call to simplifier_simplify_tables, which
+     * forms the first rows of the tables passed to the next call. */
+    size_t num_retained_nodes;
+    size_t num_retained_edgesets;
+    size_t num_retained_samples;
+    double retained_sequence_length;
+    double *retained_left;
+    double *retained_right;
+    /* Growable arenas, retained across calls */
+    size_t num_input_edgesets;
+    size_t max_input_edgesets;
+    simplify_edgeset_t *input_edgesets;
+    size_t max_merged_edgesets;
+    simplify_edgeset_t *merged_edgesets;
+    size_t num_segments;
+    size_t max_segments;
+    simplify_segment_t *segments;
+    size_t max_segment_queue;
+    simplify_segment_t *segment_queue;
+    size_t max_active_segments;
+    simplify_segment_t *active_segments;
+    node_id_t *interval_children;
+    size_t num_records;
+    size_t max_records;
+    simplify_record_t *records;
+    size_t num_record_children;
+    size_t max_record_children;
+    node_id_t *record_children;
+    size_t max_child_intervals;
+    simplify_segment_t *child_intervals;
+    size_t max_output_sites;
+    site_t *output_sites;
+    size_t num_output_mutations;
+    size_t max_output_mutations;
+    mutation_t *output_mutations;
+    /* The output tables */
+    node_table_t nodes;
+    edgeset_table_t edgesets;
+    site_table_t sites;
+    mutation_table_t mutations;
+} simplifier_t;
+
 typedef struct {
     tree_sequence_t *tree_sequence;
     size_t sample_size;
@@ -519,6 +682,20 @@ typedef struct {
      * from a specific subset. */
     node_id_t *num_leaves;
     node_id_t *num_tracked_leaves;
+    /* Optionally, the number of leaves from each of several sets below each
+     * node; the counts for node u are at u * num_tracked_sets. */
+    size_t num_tracked_sets;
+    node_id_t *tracked_set_counts;
+    node_id_t *tracked_set_diff;
+    /* With MSP_BRANCH_LENGTHS, the total length of the branches subtending
+     * exactly k leaves, for k = 0 to sample_size. These are updated as edges
+     * are added and removed, along with the area swept out by each class
+     * since the start of the iteration up to branch_length_position. */
+    double total_branch_length;
+    double *branch_length_by_count;
+    double *branch_length_area;
+    double *branch_length_position;
+    double branch_length_x;
     /* All nodes that are marked during a particular transition are marked
      * with a given value. */
     uint8_t *marked;
@@ -527,6 +704,12 @@ typedef struct {
     leaf_list_node_t **leaf_list_head;
     leaf_list_node_t **leaf_list_tail;
     leaf_list_node_t *leaf_list_node_mem;
+    /* The nodes whose state may differ from the cleared tree, so that
+     * clearing costs time proportional to the size of the trees visited
+     * rather than the number of nodes. */
+    node_id_t *touched_nodes;
+    size_t num_touched_nodes;
+    bool *touched;
     /* traversal stacks */
     node_id_t *stack1;
     node_id_t *stack2;
@@ -539,6 +722,11 @@ typedef struct {
     node_id_t right_index;
 } sparse_tree_t;
 
+/* Processes the trees in [start, end) for the specified chunk; see
+ * tree_sequence_run_chunks(). */
+typedef int (*tree_chunk_func_t)(sparse_tree_t *tree, double start, double end,
+        size_t chunk, void *params);
+
 typedef struct newick_tree_node {
     node_id_t id;
     double time;
@@ -585,6 +773,8 @@ typedef struct {
     int finished;
     sparse_tree_t tree;
     int flags;
+    /* Genotypes of the sites packed into each byte of sample major output */
+    char *packed_genotypes;
 } vargen_t;
 
 typedef struct {
@@ -604,14 +794,80 @@ typedef struct {
     vargen_t *vargen;
 } vcf_converter_t;
 
+/* Windowed LD queries that span at most max_bitset_sites sites compute the
+ * overlaps from packed bitsets of the samples carrying each mutation. By
+ * default, the number of cached bitsets is limited by this many sites and
+ * this much memory. For larger sample sizes the trees are faster, so the
+ * bitset path is only enabled by default for up to this many words. */
+#define MSP_LD_DEFAULT_MAX_BITSET_SITES 4096
+#define MSP_LD_MAX_BITSET_MEMORY (64 * 1024 * 1024)
+#define MSP_LD_MAX_DEFAULT_BITSET_WORDS 64
+
 typedef struct {
     sparse_tree_t *outer_tree;
     sparse_tree_t *inner_tree;
     size_t num_sites;
     int tree_changed;
     tree_sequence_t *tree_sequence;
+    /* Bitsets for recently used sites; site j is stored in slot
+     * j % max_bitset_sites, and bitset_site records which site each slot
+     * currently holds. */
+    size_t max_bitset_sites;
+    size_t bitset_words;
+    uint64_t *bitsets;
+    site_id_t *bitset_site;
+    node_id_t *bitset_count;
+    /* Counts the samples in both of two bitsets; chosen for the CPU in
+     * ld_calc_alloc(). */
+    node_id_t (*bitset_overlap)(const uint64_t *, const uint64_t *, size_t);
+    node_id_t *sample_index_map;
+    /* A tree with leaf lists for finding the samples below each mutation
+     * when building bitsets and sample alleles. */
+    sparse_tree_t *site_tree;
+    /* The alleles of the samples at allele_site followed by those at the
+     * other site of a pair, for sites without exactly one mutation. */
+    site_id_t allele_site;
+    uint32_t num_site_alleles;
+    uint32_t *sample_alleles;
+    uint32_t *mutation_alleles;
+    size_t max_mutation_alleles;
+    uint32_t *allele_counts;
+    size_t max_allele_counts;
 } ld_calc_t;
 
+/* Statistics computed by ld_calc_get_r2_array(). Apart from
+ * MSP_LD_STAT_R2_MULTIALLELIC, these treat every site as biallelic, where
+ * the A allele is carried by the samples whose state differs from the
+ * ancestral state. */
+#define MSP_LD_STAT_R2 0
+#define MSP_LD_STAT_D 1
+#define MSP_LD_STAT_D_PRIME 2
+#define MSP_LD_STAT_R 3
+#define MSP_LD_STAT_R2_MULTIALLELIC 4
+
+/* Options for ld_calc_get_r2_matrix() */
+#define MSP_LD_FLOAT32 (1 << 0)
+#define MSP_LD_SPARSE  (1 << 1)
+
+/* A block of rows of the r2 matrix. For dense output, values holds
+ * num_rows rows of num_columns values, where only the entries on and above
+ * the diagonal are set. For sparse output, the num_entries pairs (rows[j],
+ * columns[j]) with rows[j] < columns[j] and r2 above the threshold are
+ * listed with their values. Values are float if MSP_LD_FLOAT32 is set and
+ * double otherwise. */
+typedef struct {
+    size_t row_start;
+    size_t num_rows;
+    size_t num_columns;
+    size_t num_entries;
+    site_id_t *rows;
+    site_id_t *columns;
+    void *values;
+} ld_tile_t;
+
+/* Receives each tile of the r2 matrix; see ld_calc_get_r2_matrix(). */
+typedef int (*ld_tile_func_t)(ld_tile_t *tile, void *params);
+
 typedef struct {
     double position;
     node_id_t node;
@@ -635,6 +891,8 @@ int msp_alloc(msp_t *self, size_t sample_size, sample_t *samples, gsl_rng *rng);
 int msp_set_simulation_model_non_parametric(msp_t *self, int model);
 int msp_set_simulation_model_dirac(msp_t *self, double psi, double c);
 int msp_set_simulation_model_beta(msp_t *self, double alpha, double truncation_point);
+int msp_set_simulation_model_dtwf(msp_t *self, double population_size,
+        double num_generations);
 int msp_set_num_loci(msp_t *self, size_t num_loci);
 int msp_set_store_migrations(msp_t *self, bool store_migrations);
 int msp_set_num_populations(msp_t *self, size_t num_populations);
@@ -643,6 +901,7 @@ int msp_set_scaled_recombination_rate(msp_t *self,
 int msp_set_max_memory(msp_t *self, size_t max_memory);
 int msp_set_node_mapping_block_size(msp_t *self, size_t block_size);
 int msp_set_segment_block_size(msp_t *self, size_t block_size);
+int msp_set_links_index(msp_t *self, int links_index);
 int msp_set_avl_node_block_size(msp_t *self, size_t block_size);
 int msp_set_coalescence_record_block_size(msp_t *self, size_t block_size);
 int msp_set_migration_block_size(msp_t *self, size_t block_size);
@@ -675,7 +934,8 @@ int msp_print_state(msp_t *self, FILE *out);
 int msp_free(msp_t *self);
 void msp_verify(msp_t *self);
 
-int msp_get_ancestors(msp_t *self, segment_t **ancestors);
+int msp_get_ancestors(msp_t *self, segment_id_t *ancestors);
+int msp_get_segment(msp_t *self, segment_id_t id, segment_t *segment);
 int msp_get_breakpoints(msp_t *self, size_t *breakpoints);
 int msp_get_migration_matrix(msp_t *self, double *migration_matrix);
 int msp_get_num_migration_events(msp_t *self, size_t *num_migration_events);
@@ -716,10 +976,15 @@ int tree_sequence_load_tables_tmp(tree_sequence_t *self,
         node_table_t *nodes, edgeset_table_t *edgesets, migration_table_t *migrations,
         site_table_t *sites, mutation_table_t *mutations,
         size_t num_provenance_strings, char **provenance_strings);
+int tree_sequence_take_tables_tmp(tree_sequence_t *self,
+        node_table_t *nodes, edgeset_table_t *edgesets, migration_table_t *migrations,
+        site_table_t *sites, mutation_table_t *mutations,
+        size_t num_provenance_strings, char **provenance_strings);
 int tree_sequence_dump_tables_tmp(tree_sequence_t *self, node_table_t *node_table,
         edgeset_table_t *edgeset_table, migration_table_t *migration_table,
         site_table_t *sites, mutation_table_t *mutations,
         size_t *num_provenance_strings, char ***provenance_strings);
+int tree_sequence_build_indexes(tree_sequence_t *self, int flags);
 int tree_sequence_load(tree_sequence_t *self, const char *filename, int flags);
 int tree_sequence_dump(tree_sequence_t *self, const char *filename, int flags);
 int tree_sequence_free(tree_sequence_t *self);
@@ -753,6 +1018,37 @@ int tree_sequence_simplify(tree_sequence_t *self, node_id_t *samples,
         size_t sample_size, int flags, tree_sequence_t *output);
 int tree_sequence_get_pairwise_diversity(tree_sequence_t *self,
     node_id_t *samples, size_t num_samples, double *pi);
+int tree_sequence_get_branch_stats(tree_sequence_t *self,
+        size_t num_sample_sets, size_t *sample_set_sizes, node_id_t *sample_sets,
+        size_t num_windows, double *windows, size_t num_outputs,
+        branch_stat_weight_func_t weight_func, void *params, double *result);
+int tree_sequence_get_branch_stat(tree_sequence_t *self, int stat_type,
+        size_t num_sample_sets, size_t *sample_set_sizes, node_id_t *sample_sets,
+        size_t num_outputs, uint32_t *set_indexes, size_t num_windows,
+        double *windows, double *result);
+size_t branch_stat_get_arity(int stat_type);
+int tree_sequence_get_site_stats(tree_sequence_t *self,
+        size_t num_sample_sets, size_t *sample_set_sizes, node_id_t *sample_sets,
+        size_t num_windows, double *windows, size_t num_stats, int *stats,
+        size_t num_threads, double *result, double *divergence, double *sfs);
+int tree_sequence_run_chunks(tree_sequence_t *self, size_t num_chunks,
+        size_t num_threads, int tree_flags, tree_chunk_func_t func, void *params);
+int tree_sequence_get_branch_sfs(tree_sequence_t *self, size_t num_windows,
+        double *windows, double *result);
+size_t tree_sequence_get_sfs_size(size_t num_sample_sets, size_t *sample_set_sizes);
+int tree_sequence_get_sfs(tree_sequence_t *self, size_t num_sample_sets,
+        size_t *sample_set_sizes, node_id_t *sample_sets, size_t num_windows,
+        double *windows, int flags, double *result);
+
+int simplifier_alloc(simplifier_t *self, int flags);
+int simplifier_run(simplifier_t *self, tree_sequence_t *input, node_id_t *samples,
+        size_t num_samples, tree_sequence_t *output);
+int simplifier_simplify_tables(simplifier_t *self, node_id_t *samples,
+        size_t num_samples, double sequence_length, node_table_t *nodes,
+        edgeset_table_t *edgesets, node_id_t *node_map);
+int simplifier_reset(simplifier_t *self);
+int simplifier_free(simplifier_t *self);
+void simplifier_print_state(simplifier_t *self, FILE *out);
 
 int tree_diff_iterator_alloc(tree_diff_iterator_t *self,
         tree_sequence_t *tree_sequence);
@@ -768,6 +1064,8 @@ int sparse_tree_copy(sparse_tree_t *self, sparse_tree_t *source);
 int sparse_tree_equal(sparse_tree_t *self, sparse_tree_t *other);
 int sparse_tree_set_tracked_leaves(sparse_tree_t *self,
         size_t num_tracked_leaves, node_id_t *tracked_leaves);
+int sparse_tree_set_tracked_sample_sets(sparse_tree_t *self, size_t num_sets,
+        size_t *set_sizes, node_id_t *sets);
 int sparse_tree_set_tracked_leaves_from_leaf_list(sparse_tree_t *self,
         leaf_list_node_t *head, leaf_list_node_t *tail);
 int sparse_tree_get_root(sparse_tree_t *self, node_id_t *root);
@@ -781,13 +1079,18 @@ int sparse_tree_get_num_leaves(sparse_tree_t *self, node_id_t u,
         size_t *num_leaves);
 int sparse_tree_get_num_tracked_leaves(sparse_tree_t *self, node_id_t u,
         size_t *num_tracked_leaves);
+int sparse_tree_get_total_branch_length(sparse_tree_t *self, double *length);
 int sparse_tree_get_leaf_list(sparse_tree_t *self, node_id_t u,
         leaf_list_node_t **head, leaf_list_node_t **tail);
 int sparse_tree_get_sites(sparse_tree_t *self, site_t **sites, list_len_t *sites_length);
+int sparse_tree_get_allele_counts(sparse_tree_t *self, site_t *site,
+        size_t *set_sizes, double *allele_counts, const char **allele_states,
+        list_len_t *allele_state_lengths, list_len_t *num_alleles);
 void sparse_tree_print_state(sparse_tree_t *self, FILE *out);
 /* Method for positioning the tree in the sequence. */
 int sparse_tree_first(sparse_tree_t *self);
 int sparse_tree_last(sparse_tree_t *self);
+int sparse_tree_seek(sparse_tree_t *self, double x);
 int sparse_tree_next(sparse_tree_t *self);
 int sparse_tree_prev(sparse_tree_t *self);
 
@@ -809,9 +1112,15 @@ int ld_calc_alloc(ld_calc_t *self, tree_sequence_t *tree_sequence);
 int ld_calc_free(ld_calc_t *self);
 void ld_calc_print_state(ld_calc_t *self, FILE *out);
 int ld_calc_get_r2(ld_calc_t *self, size_t a, size_t b, double *r2);
+int ld_calc_set_max_bitset_sites(ld_calc_t *self, size_t max_bitset_sites);
 int ld_calc_get_r2_array(ld_calc_t *self, size_t a, int direction,
-        size_t max_mutations, double max_distance,
+        size_t max_mutations, double max_distance, int statistic,
         double *r2, size_t *num_r2_values);
+int ld_calc_get_r2_matrix(ld_calc_t *self, size_t tile_size, size_t num_threads,
+        int flags, double threshold, ld_tile_func_t func, void *params);
+int ld_calc_get_r2_decay(ld_calc_t *self, size_t num_distance_bins,
+        double *distance_breaks, size_t num_frequency_bins, double *frequency_breaks,
+        size_t max_sites, size_t num_threads, double *r2_sum, uint64_t *num_pairs);
 
 int hapgen_alloc(hapgen_t *self, tree_sequence_t *tree_sequence);
 int hapgen_get_haplotype(hapgen_t *self, node_id_t j, char **haplotype);
@@ -820,6 +1129,8 @@ void hapgen_print_state(hapgen_t *self, FILE *out);
 
 int vargen_alloc(vargen_t *self, tree_sequence_t *tree_sequence, int flags);
 int vargen_next(vargen_t *self, site_t **site, char *genotypes);
+int vargen_next_packed(vargen_t *self, size_t max_sites, int options,
+        uint8_t *matrix, size_t *num_sites);
 int vargen_free(vargen_t *self);
 void vargen_print_state(vargen_t *self, FILE *out);
 
@@ -857,6 +1168,8 @@ int node_table_add_row(node_table_t *self, uint32_t flags, double time,
         population_id_t population, const char *name);
 int node_table_set_columns(node_table_t *self, size_t num_rows, uint32_t *flags, double *time,
         population_id_t *population, char *name, list_len_t *name_length);
+int node_table_expand(node_table_t *self, size_t max_rows,
+        size_t max_total_name_length);
 int node_table_reset(node_table_t *self);
 int node_table_free(node_table_t *self);
 void node_table_print_state(node_table_t *self, FILE *out);
@@ -868,6 +1181,8 @@ int edgeset_table_add_row(edgeset_table_t *self, double left, double right,
 int edgeset_table_set_columns(edgeset_table_t *self, size_t num_rows, double *left,
         double *right, node_id_t *parent, node_id_t *children,
         list_len_t *children_length);
+int edgeset_table_expand(edgeset_table_t *self, size_t max_rows,
+        size_t max_total_children_length);
 int edgeset_table_reset(edgeset_table_t *self);
 int edgeset_table_free(edgeset_table_t *self);
 void edgeset_table_print_state(edgeset_table_t *self, FILE *out);
@@ -902,16 +1217,21 @@ int migration_table_add_row(migration_table_t *self, double left, double right,
 int migration_table_set_columns(migration_table_t *self, size_t num_rows,
         double *left, double *right, node_id_t *node, population_id_t *source,
         population_id_t *dest, double *time);
+int migration_table_expand(migration_table_t *self, size_t max_rows);
 int migration_table_reset(migration_table_t *self);
 int migration_table_free(migration_table_t *self);
 void migration_table_print_state(migration_table_t *self, FILE *out);
 
 const char * msp_strerror(int err);
 void __msp_safe_free(void **ptr);
+int __msp_expand_array(void **array, size_t *max_size, size_t min_size,
+        size_t object_size);
 
 double compute_falling_factorial_log(unsigned int  m);
 
 #define msp_safe_free(pointer) __msp_safe_free((void **) &(pointer))
+#define msp_expand_array(pointer, max_size, min_size) \
+    __msp_expand_array((void **) &(pointer), max_size, min_size, sizeof(*(pointer)))
 
 
 #endif /*__MSPRIME_H__*/
@@ -0,0 +1,1257 @@
+/*
+** Copyright (C) 2017 University of Oxford
+**
+** This file is part of msprime.
+**
+** msprime is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** msprime is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with msprime.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Segment based simplification.
+ *
+ * Rather than visiting every tree in the input, we propagate the ancestry of
+ * the samples backwards in time, processing all the edgesets for each
+ * parent in one go. The ancestry of an input node is a sorted list of
+ * segments mapping intervals of the sequence to the node in the subset
+ * tree that the input node corresponds to over that interval. Since a node's
+ * ancestry is fully determined when we process its edgesets, the segments
+ * for each node are stored contiguously in a single arena. The cost of
+ * this is therefore proportional to the amount of ancestry that survives
+ * rather than the number of trees in the input.
+ *
+ * All working memory is held in arenas that only ever grow, so that
+ * repeatedly simplifying inputs of a similar size does not allocate once
+ * the arenas have reached their working size.
+ *
+ * Forward time simulators simplify periodically, appending the nodes and
+ * edgesets for each new generation to the output of the last call. Here,
+ * we do not recompute the ancestry of the retained nodes from scratch.
+ * While the ancestry of a retained node is unchanged it is given
+ * implicitly by its retained edgesets, and the retained edgesets of a
+ * parent whose children are all unchanged are output directly. The sweep
+ * is therefore only needed for the new edgesets and the ancestry that
+ * they change.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <assert.h>
+
+#include <gsl/gsl_math.h>
+
+#include "err.h"
+#include "msprime.h"
+
+static int
+cmp_node_id(const void *a, const void *b) {
+    const node_id_t *ia = (const node_id_t *) a;
+    const node_id_t *ib = (const node_id_t *) b;
+    return (*ia > *ib) - (*ia < *ib);
+}
+
+static int
+cmp_segment_left(const void *a, const void *b) {
+    const simplify_segment_t *ia = (const simplify_segment_t *) a;
+    const simplify_segment_t *ib = (const simplify_segment_t *) b;
+    return (ia->left > ib->left) - (ia->left < ib->left);
+}
+
+static int
+cmp_segment_node_left(const void *a, const void *b) {
+    const simplify_segment_t *ia = (const simplify_segment_t *) a;
+    const simplify_segment_t *ib = (const simplify_segment_t *) b;
+    int ret = (ia->node > ib->node) - (ia->node < ib->node);
+    if (ret == 0) {
+        ret = (ia->left > ib->left) - (ia->left < ib->left);
+    }
+    return ret;
+}
+
+static int
+cmp_edgeset(const void *a, const void *b) {
+    const simplify_edgeset_t *ia = (const simplify_edgeset_t *) a;
+    const simplify_edgeset_t *ib = (const simplify_edgeset_t *) b;
+    int ret = (ia->time > ib->time) - (ia->time < ib->time);
+    if (ret == 0) {
+        ret = (ia->parent > ib->parent) - (ia->parent < ib->parent);
+        if (ret == 0) {
+            ret = (ia->left > ib->left) - (ia->left < ib->left);
+        }
+    }
+    return ret;
+}
+
+static int
+cmp_record(const void *a, const void *b) {
+    const simplify_record_t *ia = (const simplify_record_t *) a;
+    const simplify_record_t *ib = (const simplify_record_t *) b;
+    int ret = (ia->time > ib->time) - (ia->time < ib->time);
+    if (ret == 0) {
+        ret = (ia->node > ib->node) - (ia->node < ib->node);
+        if (ret == 0) {
+            ret = (ia->left > ib->left) - (ia->left < ib->left);
+        }
+    }
+    return ret;
+}
+
+/* Returns the index of the first segment in the specified sorted,
+ * non-overlapping run with right coordinate > x, or end if there is none. */
+static size_t
+simplifier_find_segment(simplify_segment_t *segments, size_t start, size_t end,
+        double x)
+{
+    size_t mid;
+
+    while (start < end) {
+        mid = start + (end - start) / 2;
+        if (segments[mid].right <= x) {
+            start = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    return start;
+}
+
+void
+simplifier_print_state(simplifier_t *self, FILE *out)
+{
+    size_t j, k;
+    simplify_record_t *r;
+
+    fprintf(out, "simplifier state\n");
+    fprintf(out, "flags = %d\n", self->flags);
+    fprintf(out, "num_input_nodes = %d (max = %d)\n", (int) self->num_input_nodes,
+            (int) self->max_nodes);
+    fprintf(out, "num_input_edgesets = %d (max = %d)\n",
+            (int) self->num_input_edgesets, (int) self->max_input_edgesets);
+    fprintf(out, "num_retained_nodes = %d\n", (int) self->num_retained_nodes);
+    fprintf(out, "num_retained_edgesets = %d\n", (int) self->num_retained_edgesets);
+    fprintf(out, "num_retained_samples = %d\n", (int) self->num_retained_samples);
+    fprintf(out, "num_segments = %d (max = %d)\n", (int) self->num_segments,
+            (int) self->max_segments);
+    fprintf(out, "max_segment_queue = %d\n", (int) self->max_segment_queue);
+    fprintf(out, "num_records = %d (max = %d)\n", (int) self->num_records,
+            (int) self->max_records);
+    fprintf(out, "num_record_children = %d (max = %d)\n",
+            (int) self->num_record_children, (int) self->max_record_children);
+    fprintf(out, "ancestry = \n");
+    for (j = 0; j < self->num_input_nodes; j++) {
+        if (self->ancestry_length[j] > 0) {
+            fprintf(out, "\t%d:", (int) j);
+            for (k = self->ancestry_start[j];
+                    k < self->ancestry_start[j] + self->ancestry_length[j]; k++) {
+                fprintf(out, " (%f, %f, %d)", self->segments[k].left,
+                        self->segments[k].right, (int) self->segments[k].node);
+            }
+            fprintf(out, "\n");
+        }
+    }
+    fprintf(out, "records = \n");
+    for (j = 0; j < self->num_records; j++) {
+        r = &self->records[j];
+        fprintf(out, "\t%f\t%f\t%d\t(", r->left, r->right, (int) r->node);
+        for (k = 0; k < r->num_children; k++) {
+            fprintf(out, "%d,", (int) self->record_children[r->children_offset + k]);
+        }
+        fprintf(out, ")\n");
+    }
+    node_table_print_state(&self->nodes, out);
+    edgeset_table_print_state(&self->edgesets, out);
+}
+
+int WARN_UNUSED
+simplifier_alloc(simplifier_t *self, int flags)
+{
+    int ret = 0;
+
+    memset(self, 0, sizeof(simplifier_t));
+    self->flags = flags;
+    ret = node_table_alloc(&self->nodes, 1024, 1024);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = edgeset_table_alloc(&self->edgesets, 1024, 1024);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = site_table_alloc(&self->sites, 1024, 1024);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = mutation_table_alloc(&self->mutations, 1024, 1024);
+    if (ret != 0) {
+        goto out;
+    }
+out:
+    return ret;
+}
+
+int
+simplifier_free(simplifier_t *self)
+{
+    msp_safe_free(self->node_map);
+    msp_safe_free(self->is_sample);
+    msp_safe_free(self->ancestry_start);
+    msp_safe_free(self->ancestry_length);
+    msp_safe_free(self->ancestry_changed);
+    msp_safe_free(self->retained_start);
+    msp_safe_free(self->retained_length);
+    msp_safe_free(self->input_edgesets);
+    msp_safe_free(self->merged_edgesets);
+    msp_safe_free(self->segments);
+    msp_safe_free(self->segment_queue);
+    msp_safe_free(self->active_segments);
+    msp_safe_free(self->interval_children);
+    msp_safe_free(self->records);
+    msp_safe_free(self->record_children);
+    msp_safe_free(self->child_intervals);
+    msp_safe_free(self->output_sites);
+    msp_safe_free(self->output_mutations);
+    node_table_free(&self->nodes);
+    edgeset_table_free(&self->edgesets);
+    site_table_free(&self->sites);
+    mutation_table_free(&self->mutations);
+    return 0;
+}
+
+/* Discards the results of the last simplification, keeping all memory
+ * for reuse. */
+int
+simplifier_reset(simplifier_t *self)
+{
+    int ret = 0;
+
+    self->num_input_nodes = 0;
+    self->num_input_edgesets = 0;
+    self->num_retained_nodes = 0;
+    self->num_retained_edgesets = 0;
+    self->num_retained_samples = 0;
+    self->num_segments = 0;
+    self->num_records = 0;
+    self->num_record_children = 0;
+    self->num_output_mutations = 0;
+    ret = node_table_reset(&self->nodes);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = edgeset_table_reset(&self->edgesets);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = site_table_reset(&self->sites);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = mutation_table_reset(&self->mutations);
+out:
+    return ret;
+}
+
+/* Sets up the node arenas for the specified input nodes and checks the
+ * samples. */
+static int WARN_UNUSED
+simplifier_init_nodes(simplifier_t *self, size_t num_nodes, uint32_t *flags,
+        double *time, population_id_t *population, double sequence_length,
+        node_id_t *samples, size_t num_samples)
+{
+    int ret = 0;
+    size_t j, max_nodes;
+    node_id_t u;
+
+    if (num_samples < 2) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
+        goto out;
+    }
+    if (num_nodes > self->max_nodes) {
+        max_nodes = self->max_nodes;
+        ret = msp_expand_array(self->node_map, &max_nodes, num_nodes);
+        if (ret != 0) {
+            goto out;
+        }
+        max_nodes = self->max_nodes;
+        ret = msp_expand_array(self->is_sample, &max_nodes, num_nodes);
+        if (ret != 0) {
+            goto out;
+        }
+        max_nodes = self->max_nodes;
+        ret = msp_expand_array(self->ancestry_start, &max_nodes, num_nodes);
+        if (ret != 0) {
+            goto out;
+        }
+        max_nodes = self->max_nodes;
+        ret = msp_expand_array(self->ancestry_length, &max_nodes, num_nodes);
+        if (ret != 0) {
+            goto out;
+        }
+        max_nodes = self->max_nodes;
+        ret = msp_expand_array(self->ancestry_changed, &max_nodes, num_nodes);
+        if (ret != 0) {
+            goto out;
+        }
+        max_nodes = self->max_nodes;
+        ret = msp_expand_array(self->retained_start, &max_nodes, num_nodes);
+        if (ret != 0) {
+            goto out;
+        }
+        max_nodes = self->max_nodes;
+        ret = msp_expand_array(self->retained_length, &max_nodes, num_nodes);
+        if (ret != 0) {
+            goto out;
+        }
+        self->max_nodes = max_nodes;
+    }
+    self->num_input_nodes = num_nodes;
+    self->node_flags = flags;
+    self->node_time = time;
+    self->node_population = population;
+    self->sequence_length = sequence_length;
+    for (j = 0; j < num_nodes; j++) {
+        self->node_map[j] = MSP_NULL_NODE;
+        self->is_sample[j] = false;
+        self->ancestry_start[j] = 0;
+        self->ancestry_length[j] = 0;
+        self->ancestry_changed[j] = true;
+        self->retained_start[j] = 0;
+        self->retained_length[j] = 0;
+    }
+    for (j = 0; j < num_samples; j++) {
+        u = samples[j];
+        if (u < 0 || u >= (node_id_t) num_nodes) {
+            ret = MSP_ERR_OUT_OF_BOUNDS;
+            goto out;
+        }
+        if (!(flags[u] & MSP_NODE_IS_SAMPLE)) {
+            ret = MSP_ERR_BAD_SAMPLES;
+            goto out;
+        }
+        if (self->is_sample[u]) {
+            ret = MSP_ERR_DUPLICATE_SAMPLE;
+            goto out;
+        }
+        self->is_sample[u] = true;
+    }
+    /* Each sample is ancestral to itself along the whole sequence. */
+    ret = msp_expand_array(self->segments, &self->max_segments, num_samples);
+    if (ret != 0) {
+        goto out;
+    }
+    for (j = 0; j < num_samples; j++) {
+        u = samples[j];
+        self->ancestry_start[u] = j;
+        self->ancestry_length[u] = 1;
+        self->segments[j].left = 0;
+        self->segments[j].right = sequence_length;
+        self->segments[j].node = u;
+    }
+    self->num_segments = num_samples;
+out:
+    return ret;
+}
+
+static int WARN_UNUSED
+simplifier_add_input_edgeset(simplifier_t *self, double left, double right,
+        node_id_t parent, node_id_t *children, list_len_t num_children)
+{
+    int ret = 0;
+    simplify_edgeset_t *e;
+
+    if (parent < 0 || parent >= (node_id_t) self->num_input_nodes) {
+        ret = MSP_ERR_NODE_OUT_OF_BOUNDS;
+        goto out;
+    }
+    ret = msp_expand_array(self->input_edgesets, &self->max_input_edgesets,
+            self->num_input_edgesets + 1);
+    if (ret != 0) {
+        goto out;
+    }
+    e = &self->input_edgesets[self->num_input_edgesets];
+    e->time = self->node_time[parent];
+    e->parent = parent;
+    e->left = left;
+    e->right = right;
+    e->children = children;
+    e->num_children = num_children;
+    e->index = self->num_input_edgesets;
+    self->num_input_edgesets++;
+out:
+    return ret;
+}
+
+static void
+simplifier_sort_edgesets(simplify_edgeset_t *edgesets, size_t num_edgesets)
+{
+    size_t j;
+
+    for (j = 1; j < num_edgesets; j++) {
+        if (cmp_edgeset(&edgesets[j - 1], &edgesets[j]) > 0) {
+            qsort(edgesets, num_edgesets, sizeof(simplify_edgeset_t), cmp_edgeset);
+            break;
+        }
+    }
+}
+
+/* Sorts the retained and new edgesets separately and merges them. */
+static int WARN_UNUSED
+simplifier_merge_input_edgesets(simplifier_t *self)
+{
+    int ret = 0;
+    size_t j, k, num_retained, num_edgesets, max_edgesets;
+    simplify_edgeset_t *a, *b, *merged;
+
+    num_retained = self->num_retained_edgesets;
+    num_edgesets = self->num_input_edgesets;
+    a = self->input_edgesets;
+    b = self->input_edgesets + num_retained;
+    simplifier_sort_edgesets(a, num_retained);
+    simplifier_sort_edgesets(b, num_edgesets - num_retained);
+    if (num_retained == num_edgesets
+            || cmp_edgeset(&a[num_retained - 1], &b[0]) <= 0) {
+        goto out;
+    }
+    ret = msp_expand_array(self->merged_edgesets, &self->max_merged_edgesets,
+            num_edgesets);
+    if (ret != 0) {
+        goto out;
+    }
+    merged = self->merged_edgesets;
+    j = 0;
+    k = 0;
+    while (j < num_retained || k < num_edgesets - num_retained) {
+        if (k == num_edgesets - num_retained
+                || (j < num_retained && cmp_edgeset(&a[j], &b[k]) <= 0)) {
+            *merged = a[j];
+            j++;
+        } else {
+            *merged = b[k];
+            k++;
+        }
+        merged++;
+    }
+    /* Swap the arenas */
+    merged = self->input_edgesets;
+    max_edgesets = self->max_input_edgesets;
+    self->input_edgesets = self->merged_edgesets;
+    self->max_input_edgesets = self->max_merged_edgesets;
+    self->merged_edgesets = merged;
+    self->max_merged_edgesets = max_edgesets;
+out:
+    return ret;
+}
+
+/* We need to process all the edgesets for a given parent together and
+ * visit parents in time order. Input edgesets are usually sorted by time,
+ * but the edgesets for parents with equal times may be interleaved, so
+ * we sort them if necessary. */
+static int WARN_UNUSED
+simplifier_sort_input_edgesets(simplifier_t *self)
+{
+    size_t j;
+    simplify_edgeset_t *e = self->input_edgesets;
+    bool sorted = true;
+    node_id_t u;
+
+    if (self->num_retained_edgesets > 0) {
+        return simplifier_merge_input_edgesets(self);
+    }
+    /* The node map is not in use yet, so we borrow it to mark the parents
+     * we have seen, and clear it afterwards. */
+    for (j = 0; j < self->num_input_edgesets && sorted; j++) {
+        u = e[j].parent;
+        if (j > 0 && u != e[j - 1].parent) {
+            sorted = e[j - 1].time <= e[j].time
+                && self->node_map[u] == MSP_NULL_NODE;
+            self->node_map[e[j - 1].parent] = e[j - 1].parent;
+        }
+    }
+    for (j = 0; j < self->num_input_edgesets; j++) {
+        self->node_map[e[j].parent] = MSP_NULL_NODE;
+    }
+    if (!sorted) {
+        qsort(self->input_edgesets, self->num_input_edgesets,
+                sizeof(simplify_edgeset_t), cmp_edgeset);
+    }
+    return 0;
+}
+
+static int WARN_UNUSED
+simplifier_add_record(simplifier_t *self, double left, double right,
+        node_id_t node, node_id_t *children, size_t num_children)
+{
+    int ret = 0;
+    simplify_record_t *r;
+
+    ret = msp_expand_array(self->records, &self->max_records, self->num_records + 1);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = msp_expand_array(self->record_children, &self->max_record_children,
+            self->num_record_children + num_children);
+    if (ret != 0) {
+        goto out;
+    }
+    memcpy(self->record_children + self->num_record_children, children,
+            num_children * sizeof(node_id_t));
+    r = &self->records[self->num_records];
+    r->left = left;
+    r->right = right;
+    r->node = node;
+    r->time = self->node_time[node];
+    r->num_children = (list_len_t) num_children;
+    r->children_offset = self->num_record_children;
+    self->num_records++;
+    self->num_record_children += num_children;
+out:
+    return ret;
+}
+
+/* Appends the interval [left, right) mapping to the specified node to the
+ * ancestry of u, which must be the last node to have had ancestry added. */
+static int WARN_UNUSED
+simplifier_add_ancestry(simplifier_t *self, node_id_t u, double left,
+        double right, node_id_t node)
+{
+    int ret = 0;
+    simplify_segment_t *seg;
+
+    if (self->ancestry_length[u] > 0) {
+        seg = &self->segments[self->num_segments - 1];
+        if (seg->right == left && seg->node == node) {
+            seg->right = right;
+            goto out;
+        }
+    } else {
+        self->ancestry_start[u] = self->num_segments;
+    }
+    ret = msp_expand_array(self->segments, &self->max_segments,
+            self->num_segments + 1);
+    if (ret != 0) {
+        goto out;
+    }
+    seg = &self->segments[self->num_segments];
+    seg->left = left;
+    seg->right = right;
+    seg->node = node;
+    self->num_segments++;
+    self->ancestry_length[u]++;
+out:
+    return ret;
+}
+
+static int WARN_UNUSED
+simplifier_enqueue_segment(simplifier_t *self, size_t *queue_length, double left,
+        double right, node_id_t node)
+{
+    int ret = 0;
+    simplify_segment_t *seg;
+
+    ret = msp_expand_array(self->segment_queue, &self->max_segment_queue,
+            *queue_length + 1);
+    if (ret != 0) {
+        goto out;
+    }
+    seg = &self->segment_queue[*queue_length];
+    seg->left = left;
+    seg->right = right;
+    seg->node = node;
+    (*queue_length)++;
+out:
+    return ret;
+}
+
+/* Adds the segments of the retained ancestry of v that intersect
+ * [left, right) to the queue. A retained sample is ancestral to itself
+ * everywhere, and any other retained node over its retained edgesets. */
+static int WARN_UNUSED
+simplifier_enqueue_retained_ancestry(simplifier_t *self, size_t *queue_length,
+        node_id_t v, double left, double right)
+{
+    int ret = 0;
+    size_t k, mid, end;
+    double *retained_left = self->retained_left;
+    double *retained_right = self->retained_right;
+
+    if ((size_t) v < self->num_retained_samples) {
+        ret = simplifier_enqueue_segment(self, queue_length, left, right, v);
+        goto out;
+    }
+    k = self->retained_start[v];
+    end = k + self->retained_length[v];
+    while (k < end) {
+        mid = k + (end - k) / 2;
+        if (retained_right[mid] <= left) {
+            k = mid + 1;
+        } else {
+            end = mid;
+        }
+    }
+    end = self->retained_start[v] + self->retained_length[v];
+    for (; k < end && retained_left[k] < right; k++) {
+        ret = simplifier_enqueue_segment(self, queue_length,
+                GSL_MAX(retained_left[k], left), GSL_MIN(retained_right[k], right), v);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+out:
+    return ret;
+}
+
+/* Returns true if the ancestry computed for the retained node u differs
+ * from its retained ancestry. */
+static bool
+simplifier_ancestry_changed(simplifier_t *self, node_id_t u)
+{
+    simplify_segment_t *seg = self->segments + self->ancestry_start[u];
+    size_t num_segments = self->ancestry_length[u];
+    size_t j, k, end;
+    double left, right;
+
+    if ((size_t) u < self->num_retained_samples) {
+        return !(num_segments == 1 && seg->node == u && seg->left == 0
+                && seg->right == self->sequence_length);
+    }
+    j = self->retained_start[u];
+    end = j + self->retained_length[u];
+    k = 0;
+    while (j < end) {
+        left = self->retained_left[j];
+        right = self->retained_right[j];
+        j++;
+        while (j < end && self->retained_left[j] == right) {
+            right = self->retained_right[j];
+            j++;
+        }
+        if (k == num_segments || seg[k].node != u || seg[k].left != left
+                || seg[k].right != right) {
+            return true;
+        }
+        k++;
+    }
+    return k != num_segments;
+}
+
+/* Computes the ancestry of the parent of the specified run of edgesets
+ * from the ancestry of its children, and outputs the records for the
+ * intervals over which it is a node in the subset tree. */
+static int WARN_UNUSED
+simplifier_merge_ancestry(simplifier_t *self, size_t start, size_t end)
+{
+    int ret = 0;
+    node_id_t u = self->input_edgesets[start].parent;
+    bool is_sample = self->is_sample[u];
+    size_t first_record = self->num_records;
+    size_t j, k, num_active, queue_length, seg_end;
+    list_len_t c;
+    node_id_t v, w;
+    double x, next;
+    simplify_edgeset_t *e;
+    simplify_segment_t *queue, *active;
+    node_id_t *interval_children;
+    simplify_record_t *r;
+
+    /* Gather the ancestral segments of the children over each edgeset */
+    queue_length = 0;
+    for (j = start; j < end; j++) {
+        e = &self->input_edgesets[j];
+        for (c = 0; c < e->num_children; c++) {
+            v = e->children[c];
+            if (v < 0 || v >= (node_id_t) self->num_input_nodes) {
+                ret = MSP_ERR_NODE_OUT_OF_BOUNDS;
+                goto out;
+            }
+            if (!self->ancestry_changed[v]) {
+                ret = simplifier_enqueue_retained_ancestry(self, &queue_length, v,
+                        e->left, e->right);
+                if (ret != 0) {
+                    goto out;
+                }
+                continue;
+            }
+            seg_end = self->ancestry_start[v] + self->ancestry_length[v];
+            k = simplifier_find_segment(self->segments, self->ancestry_start[v],
+                    seg_end, e->left);
+            for (; k < seg_end && self->segments[k].left < e->right; k++) {
+                ret = simplifier_enqueue_segment(self, &queue_length,
+                        GSL_MAX(self->segments[k].left, e->left),
+                        GSL_MIN(self->segments[k].right, e->right),
+                        self->segments[k].node);
+                if (ret != 0) {
+                    goto out;
+                }
+            }
+        }
+    }
+    if (queue_length == 0) {
+        goto out;
+    }
+    if (queue_length > self->max_active_segments) {
+        k = self->max_active_segments;
+        ret = msp_expand_array(self->active_segments, &k, queue_length);
+        if (ret != 0) {
+            goto out;
+        }
+        k = self->max_active_segments;
+        ret = msp_expand_array(self->interval_children, &k, queue_length);
+        if (ret != 0) {
+            goto out;
+        }
+        self->max_active_segments = k;
+    }
+    queue = self->segment_queue;
+    active = self->active_segments;
+    interval_children = self->interval_children;
+    qsort(queue, queue_length, sizeof(simplify_segment_t), cmp_segment_left);
+
+    /* Sweep along the sequence, finding the intervals over which u is
+     * ancestral to one or more of the samples. Where the segments for two
+     * or more children overlap, u is a node in the subset tree and we
+     * output a record. A sample node is always in the subset tree. */
+    num_active = 0;
+    k = 0;
+    x = 0;
+    while (k < queue_length || num_active > 0) {
+        if (num_active == 0) {
+            x = queue[k].left;
+        }
+        while (k < queue_length && queue[k].left == x) {
+            active[num_active] = queue[k];
+            num_active++;
+            k++;
+        }
+        next = k < queue_length ? queue[k].left : DBL_MAX;
+        for (j = 0; j < num_active; j++) {
+            next = GSL_MIN(next, active[j].right);
+        }
+        w = active[0].node;
+        if (is_sample || num_active > 1) {
+            w = u;
+            for (j = 0; j < num_active; j++) {
+                interval_children[j] = active[j].node;
+            }
+            qsort(interval_children, num_active, sizeof(node_id_t), cmp_node_id);
+            r = NULL;
+            if (self->num_records > first_record) {
+                r = &self->records[self->num_records - 1];
+            }
+            if (r != NULL && r->right == x && r->num_children == num_active
+                    && memcmp(self->record_children + r->children_offset,
+                        interval_children, num_active * sizeof(node_id_t)) == 0) {
+                r->right = next;
+            } else {
+                ret = simplifier_add_record(self, x, next, u, interval_children,
+                        num_active);
+                if (ret != 0) {
+                    goto out;
+                }
+            }
+        }
+        if (!is_sample) {
+            ret = simplifier_add_ancestry(self, u, x, next, w);
+            if (ret != 0) {
+                goto out;
+            }
+        }
+        /* Remove the segments that end at next */
+        j = 0;
+        while (j < num_active) {
+            if (active[j].right == next) {
+                num_active--;
+                active[j] = active[num_active];
+            } else {
+                j++;
+            }
+        }
+        x = next;
+    }
+out:
+    return ret;
+}
+
+/* Returns true if the specified run of edgesets are all retained, and
+ * neither the children's ancestry nor the sample status of the parent
+ * have changed. The output records for the parent are then exactly its
+ * retained edgesets. */
+static bool
+simplifier_edgesets_unchanged(simplifier_t *self, size_t start, size_t end)
+{
+    node_id_t u = self->input_edgesets[start].parent;
+    size_t j;
+    list_len_t c;
+    node_id_t v;
+    simplify_edgeset_t *e;
+
+    if ((size_t) u >= self->num_retained_nodes
+            || self->is_sample[u] != ((size_t) u < self->num_retained_samples)) {
+        return false;
+    }
+    for (j = start; j < end; j++) {
+        e = &self->input_edgesets[j];
+        if (e->index >= self->num_retained_edgesets) {
+            return false;
+        }
+        for (c = 0; c < e->num_children; c++) {
+            v = e->children[c];
+            if (v < 0 || v >= (node_id_t) self->num_input_nodes
+                    || self->ancestry_changed[v]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static int WARN_UNUSED
+simplifier_propagate_ancestry(simplifier_t *self)
+{
+    int ret = 0;
+    size_t j, k, end;
+    node_id_t u;
+    simplify_edgeset_t *e;
+
+    ret = simplifier_sort_input_edgesets(self);
+    if (ret != 0) {
+        goto out;
+    }
+    j = 0;
+    while (j < self->num_input_edgesets) {
+        u = self->input_edgesets[j].parent;
+        end = j + 1;
+        while (end < self->num_input_edgesets && self->input_edgesets[end].parent == u) {
+            end++;
+        }
+        if (simplifier_edgesets_unchanged(self, j, end)) {
+            for (k = j; k < end; k++) {
+                e = &self->input_edgesets[k];
+                ret = simplifier_add_record(self, e->left, e->right, u, e->children,
+                        e->num_children);
+                if (ret != 0) {
+                    goto out;
+                }
+            }
+            self->ancestry_changed[u] = false;
+        } else {
+            ret = simplifier_merge_ancestry(self, j, end);
+            if (ret != 0) {
+                goto out;
+            }
+            if ((size_t) u < self->num_retained_nodes) {
+                self->ancestry_changed[u] = simplifier_ancestry_changed(self, u);
+            }
+        }
+        j = end;
+    }
+out:
+    return ret;
+}
+
+/* Sorts the records by time, assigns output IDs to the nodes with the
+ * samples first and writes the node and edgeset tables. */
+static int WARN_UNUSED
+simplifier_write_tables(simplifier_t *self, node_id_t *samples, size_t num_samples)
+{
+    int ret = 0;
+    size_t j;
+    list_len_t c;
+    node_id_t u, next_node;
+    node_id_t *children;
+    simplify_record_t *r;
+    bool sorted;
+
+    ret = node_table_reset(&self->nodes);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = edgeset_table_reset(&self->edgesets);
+    if (ret != 0) {
+        goto out;
+    }
+    for (j = 0; j < num_samples; j++) {
+        u = samples[j];
+        self->node_map[u] = (node_id_t) j;
+        ret = node_table_add_row(&self->nodes, MSP_NODE_IS_SAMPLE,
+                self->node_time[u], self->node_population[u], "");
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    for (j = 1; j < self->num_records; j++) {
+        if (cmp_record(&self->records[j - 1], &self->records[j]) > 0) {
+            qsort(self->records, self->num_records, sizeof(simplify_record_t),
+                    cmp_record);
+            break;
+        }
+    }
+    next_node = (node_id_t) num_samples;
+    for (j = 0; j < self->num_records; j++) {
+        r = &self->records[j];
+        u = r->node;
+        if (self->node_map[u] == MSP_NULL_NODE) {
+            self->node_map[u] = next_node;
+            next_node++;
+            ret = node_table_add_row(&self->nodes, 0, self->node_time[u],
+                    self->node_population[u], "");
+            if (ret != 0) {
+                goto out;
+            }
+        }
+        children = self->record_children + r->children_offset;
+        sorted = true;
+        for (c = 0; c < r->num_children; c++) {
+            children[c] = self->node_map[children[c]];
+            sorted = sorted && (c == 0 || children[c - 1] < children[c]);
+        }
+        if (!sorted) {
+            qsort(children, r->num_children, sizeof(node_id_t), cmp_node_id);
+        }
+        ret = edgeset_table_add_row(&self->edgesets, r->left, r->right,
+                self->node_map[u], children, r->num_children);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+out:
+    return ret;
+}
+
+/* Maps the mutations in the input onto the subset tree. A mutation on an
+ * input node is assigned to the subset node it corresponds to, unless that
+ * node is a root at the site, in which case all samples inherit it and it
+ * becomes the ancestral state. This must be called before the node IDs
+ * are mapped by simplifier_write_tables.
+ */
+static int WARN_UNUSED
+simplifier_map_mutations(simplifier_t *self, tree_sequence_t *input)
+{
+    int ret = 0;
+    size_t num_sites = input->sites.num_records;
+    size_t j, k, h, end, num_intervals;
+    list_len_t c;
+    node_id_t u, w;
+    double x;
+    simplify_record_t *r;
+    mutation_t *mut;
+    site_t *site;
+
+    ret = msp_expand_array(self->output_sites, &self->max_output_sites, num_sites);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = msp_expand_array(self->output_mutations, &self->max_output_mutations,
+            input->mutations.num_records);
+    if (ret != 0) {
+        goto out;
+    }
+    /* Index the intervals over which each subset node has a parent */
+    num_intervals = 0;
+    if (input->mutations.num_records > 0) {
+        ret = msp_expand_array(self->child_intervals, &self->max_child_intervals,
+                self->num_record_children);
+        if (ret != 0) {
+            goto out;
+        }
+        for (j = 0; j < self->num_records; j++) {
+            r = &self->records[j];
+            for (c = 0; c < r->num_children; c++) {
+                self->child_intervals[num_intervals].left = r->left;
+                self->child_intervals[num_intervals].right = r->right;
+                self->child_intervals[num_intervals].node =
+                    self->record_children[r->children_offset + c];
+                num_intervals++;
+            }
+        }
+        qsort(self->child_intervals, num_intervals, sizeof(simplify_segment_t),
+                cmp_segment_node_left);
+    }
+    self->num_output_mutations = 0;
+    for (j = 0; j < num_sites; j++) {
+        x = input->sites.position[j];
+        site = &self->output_sites[j];
+        site->position = x;
+        site->ancestral_state = input->sites.ancestral_state[j];
+        site->ancestral_state_length = input->sites.ancestral_state_length[j];
+        for (c = 0; c < input->sites.site_mutations_length[j]; c++) {
+            mut = &input->sites.site_mutations[j][c];
+            u = mut->node;
+            end = self->ancestry_start[u] + self->ancestry_length[u];
+            k = simplifier_find_segment(self->segments, self->ancestry_start[u],
+                    end, x);
+            if (k == end || self->segments[k].left > x) {
+                continue;
+            }
+            w = self->segments[k].node;
+            /* Find the first interval for w with right > x */
+            k = 0;
+            end = num_intervals;
+            while (k < end) {
+                h = k + (end - k) / 2;
+                if (self->child_intervals[h].node < w
+                        || (self->child_intervals[h].node == w
+                            && self->child_intervals[h].right <= x)) {
+                    k = h + 1;
+                } else {
+                    end = h;
+                }
+            }
+            if (k == num_intervals || self->child_intervals[k].node != w
+                    || self->child_intervals[k].left > x) {
+                site->ancestral_state = mut->derived_state;
+                site->ancestral_state_length = mut->derived_state_length;
+            } else {
+                self->output_mutations[self->num_output_mutations] = *mut;
+                self->output_mutations[self->num_output_mutations].site =
+                    (site_id_t) j;
+                self->output_mutations[self->num_output_mutations].node = w;
+                self->num_output_mutations++;
+            }
+        }
+    }
+out:
+    return ret;
+}
+
+/* Writes the site and mutation tables, removing the sites that have no
+ * mutations if MSP_FILTER_INVARIANT_SITES is set. */
+static int WARN_UNUSED
+simplifier_write_site_tables(simplifier_t *self, size_t num_sites)
+{
+    int ret = 0;
+    size_t j, k;
+    site_id_t site_id;
+    site_t *site;
+    mutation_t *mut;
+    bool filter_invariant_sites = self->flags & MSP_FILTER_INVARIANT_SITES;
+
+    ret = site_table_reset(&self->sites);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = mutation_table_reset(&self->mutations);
+    if (ret != 0) {
+        goto out;
+    }
+    k = 0;
+    for (j = 0; j < num_sites; j++) {
+        site = &self->output_sites[j];
+        site_id = (site_id_t) self->sites.num_rows;
+        if (filter_invariant_sites && (k == self->num_output_mutations
+                    || self->output_mutations[k].site != (site_id_t) j)) {
+            continue;
+        }
+        ret = site_table_add_row(&self->sites, site->position,
+                site->ancestral_state, site->ancestral_state_length);
+        if (ret != 0) {
+            goto out;
+        }
+        while (k < self->num_output_mutations
+                && self->output_mutations[k].site == (site_id_t) j) {
+            mut = &self->output_mutations[k];
+            ret = mutation_table_add_row(&self->mutations, site_id,
+                    self->node_map[mut->node], mut->derived_state,
+                    mut->derived_state_length);
+            if (ret != 0) {
+                goto out;
+            }
+            k++;
+        }
+    }
+out:
+    return ret;
+}
+
+/* Simplifies the input tree sequence for the specified samples, writing
+ * the result to output. The simplifier may be reused for any number of
+ * calls, and retains its working memory between them. */
+int WARN_UNUSED
+simplifier_run(simplifier_t *self, tree_sequence_t *input, node_id_t *samples,
+        size_t num_samples, tree_sequence_t *output)
+{
+    int ret = 0;
+    size_t j;
+
+    ret = simplifier_reset(self);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = simplifier_init_nodes(self, input->nodes.num_records, input->nodes.flags,
+            input->nodes.time, input->nodes.population, input->sequence_length,
+            samples, num_samples);
+    if (ret != 0) {
+        goto out;
+    }
+    for (j = 0; j < input->edgesets.num_records; j++) {
+        ret = simplifier_add_input_edgeset(self, input->edgesets.left[j],
+                input->edgesets.right[j], input->edgesets.parent[j],
+                input->edgesets.children[j], input->edgesets.children_length[j]);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    ret = simplifier_propagate_ancestry(self);
+    if (ret != 0) {
+        goto out;
+    }
+    if (self->num_records == 0) {
+        ret = MSP_ERR_CANNOT_SIMPLIFY;
+        goto out;
+    }
+    ret = simplifier_map_mutations(self, input);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = simplifier_write_tables(self, samples, num_samples);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = simplifier_write_site_tables(self, input->sites.num_records);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = tree_sequence_load_tables_tmp(output, &self->nodes, &self->edgesets,
+            NULL, &self->sites, &self->mutations, 0, NULL);
+    if (ret != 0) {
+        tree_sequence_free(output);
+        goto out;
+    }
+out:
+    return ret;
+}
+
+/* Simplifies the specified tables in place for the specified samples, and
+ * sets node_map[u] to the output ID of input node u (or MSP_NULL_NODE)
+ * if node_map is not NULL. Node times need only increase from child to
+ * parent.
+ *
+ * This is intended to be called periodically during a forward time
+ * simulation: the first rows of the tables must be the unmodified output
+ * of the last call, followed by any number of newly appended nodes and
+ * edgesets. Only the new rows are checked. After simplifier_reset the
+ * tables are treated as entirely new.
+ */
+int WARN_UNUSED
+simplifier_simplify_tables(simplifier_t *self, node_id_t *samples,
+        size_t num_samples, double sequence_length, node_table_t *nodes,
+        edgeset_table_t *edgesets, node_id_t *node_map)
+{
+    int ret = 0;
+    size_t j, offset;
+    list_len_t c;
+    node_id_t u, v;
+    node_id_t *children;
+
+    if (sequence_length <= 0 || nodes->num_rows < self->num_retained_nodes
+            || edgesets->num_rows < self->num_retained_edgesets
+            || (self->num_retained_nodes > 0
+                && sequence_length != self->retained_sequence_length)) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
+        goto out;
+    }
+    self->num_input_edgesets = 0;
+    self->num_segments = 0;
+    self->num_records = 0;
+    self->num_record_children = 0;
+    ret = simplifier_init_nodes(self, nodes->num_rows, nodes->flags, nodes->time,
+            nodes->population, sequence_length, samples, num_samples);
+    if (ret != 0) {
+        goto out;
+    }
+    for (j = 0; j < self->num_retained_samples; j++) {
+        self->ancestry_changed[j] = !self->is_sample[j];
+    }
+    self->retained_left = edgesets->left;
+    self->retained_right = edgesets->right;
+    offset = 0;
+    for (j = 0; j < edgesets->num_rows; j++) {
+        u = edgesets->parent[j];
+        children = edgesets->children + offset;
+        offset += edgesets->children_length[j];
+        if (j < self->num_retained_edgesets) {
+            /* The retained edgesets for each node are contiguous */
+            if (u < 0 || (size_t) u >= self->num_retained_nodes) {
+                ret = MSP_ERR_BAD_PARAM_VALUE;
+                goto out;
+            }
+            if (j == 0 || u != edgesets->parent[j - 1]) {
+                if (self->retained_length[u] != 0) {
+                    ret = MSP_ERR_BAD_PARAM_VALUE;
+                    goto out;
+                }
+                self->retained_start[u] = j;
+            }
+            self->retained_length[u]++;
+        } else {
+            if (u < 0 || u >= (node_id_t) nodes->num_rows) {
+                ret = MSP_ERR_NODE_OUT_OF_BOUNDS;
+                goto out;
+            }
+            if (edgesets->left[j] < 0 || edgesets->left[j] >= edgesets->right[j]
+                    || edgesets->right[j] > sequence_length) {
+                ret = MSP_ERR_BAD_RECORD_INTERVAL;
+                goto out;
+            }
+            for (c = 0; c < edgesets->children_length[j]; c++) {
+                v = children[c];
+                if (v < 0 || v >= (node_id_t) nodes->num_rows) {
+                    ret = MSP_ERR_NODE_OUT_OF_BOUNDS;
+                    goto out;
+                }
+                if (nodes->time[v] >= nodes->time[u]) {
+                    ret = MSP_ERR_BAD_NODE_TIME_ORDERING;
+                    goto out;
+                }
+            }
+        }
+        ret = simplifier_add_input_edgeset(self, edgesets->left[j],
+                edgesets->right[j], u, children, edgesets->children_length[j]);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    ret = simplifier_propagate_ancestry(self);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = simplifier_write_tables(self, samples, num_samples);
+    if (ret != 0) {
+        goto out;
+    }
+    if (node_map != NULL) {
+        memcpy(node_map, self->node_map, nodes->num_rows * sizeof(node_id_t));
+    }
+    ret = node_table_set_columns(nodes, self->nodes.num_rows, self->nodes.flags,
+            self->nodes.time, self->nodes.population, self->nodes.name,
+            self->nodes.name_length);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = edgeset_table_set_columns(edgesets, self->edgesets.num_rows,
+            self->edgesets.left, self->edgesets.right, self->edgesets.parent,
+            self->edgesets.children, self->edgesets.children_length);
+    if (ret != 0) {
+        goto out;
+    }
+    self->num_retained_nodes = self->nodes.num_rows;
+    self->num_retained_edgesets = self->edgesets.num_rows;
+    self->num_retained_samples = num_samples;
+    self->retained_sequence_length = sequence_length;
+out:
+    if (ret != 0) {
+        self->num_retained_nodes = 0;
+        self->num_retained_edgesets = 0;
+        self->num_retained_samples = 0;
+    }
+    return ret;
+}
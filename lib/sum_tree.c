@@ -0,0 +1,266 @@
+/*
+** Copyright (C) 2017 University of Oxford
+**
+** This file is part of msprime.
+**
+** msprime is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** msprime is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with msprime.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * B-ary sum tree. This is an alternative to the Fenwick tree for large
+ * numbers of values: each level of the tree is a contiguous array and
+ * finding a value scans one block of SUM_TREE_BRANCHING sums per level,
+ * so a search touches log_B(n) cache lines rather than log_2(n).
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "err.h"
+#include "sum_tree.h"
+
+static void
+sum_tree_free_buffers(sum_tree_t *self)
+{
+    size_t k;
+
+    for (k = 0; k < SUM_TREE_MAX_LEVELS; k++) {
+        if (self->levels[k] != NULL) {
+            free(self->levels[k]);
+            self->levels[k] = NULL;
+        }
+    }
+    if (self->pending != NULL) {
+        free(self->pending);
+        self->pending = NULL;
+    }
+    if (self->is_dirty != NULL) {
+        free(self->is_dirty);
+        self->is_dirty = NULL;
+    }
+    if (self->dirty != NULL) {
+        free(self->dirty);
+        self->dirty = NULL;
+    }
+}
+
+/* Allocates zeroed buffers for the current size. */
+static int WARN_UNUSED
+sum_tree_alloc_buffers(sum_tree_t *self)
+{
+    int ret = MSP_ERR_NO_MEMORY;
+    size_t k, n;
+
+    /* Values are indexed from 1 */
+    n = self->size + 1;
+    k = 0;
+    do {
+        n = SUM_TREE_BRANCHING * ((n + SUM_TREE_BRANCHING - 1) / SUM_TREE_BRANCHING);
+        assert(k < SUM_TREE_MAX_LEVELS);
+        self->level_size[k] = n;
+        self->levels[k] = calloc(n, sizeof(int64_t));
+        if (self->levels[k] == NULL) {
+            goto out;
+        }
+        n /= SUM_TREE_BRANCHING;
+        k++;
+    } while (n > 1);
+    self->num_levels = k;
+    /* Pending changes are stored for the blocks of values in level 1. */
+    n = self->level_size[0] / SUM_TREE_BRANCHING;
+    self->pending = calloc(n, sizeof(int64_t));
+    self->is_dirty = calloc(n, sizeof(uint8_t));
+    self->dirty = malloc(n * sizeof(size_t));
+    self->num_dirty = 0;
+    if (self->pending == NULL || self->is_dirty == NULL || self->dirty == NULL) {
+        goto out;
+    }
+    ret = 0;
+out:
+    return ret;
+}
+
+/* Propagates any pending changes in the values up the tree. */
+static void
+sum_tree_flush(sum_tree_t *self)
+{
+    size_t j, k, b;
+    int64_t delta;
+
+    for (j = 0; j < self->num_dirty; j++) {
+        b = self->dirty[j];
+        delta = self->pending[b];
+        self->pending[b] = 0;
+        self->is_dirty[b] = 0;
+        for (k = 1; k < self->num_levels; k++) {
+            self->levels[k][b] += delta;
+            b /= SUM_TREE_BRANCHING;
+        }
+    }
+    self->num_dirty = 0;
+}
+
+int WARN_UNUSED
+sum_tree_alloc(sum_tree_t *self, size_t initial_size)
+{
+    memset(self, 0, sizeof(sum_tree_t));
+    self->size = initial_size;
+    return sum_tree_alloc_buffers(self);
+}
+
+int WARN_UNUSED
+sum_tree_expand(sum_tree_t *self, size_t increment)
+{
+    int ret = 0;
+    size_t j, k, b;
+    size_t old_size = self->size;
+    int64_t *values = self->levels[0];
+    int64_t *level;
+
+    /* Keep the values, and rebuild the rest of the tree from them */
+    self->levels[0] = NULL;
+    sum_tree_free_buffers(self);
+    self->size += increment;
+    ret = sum_tree_alloc_buffers(self);
+    if (ret != 0) {
+        goto out;
+    }
+    memcpy(self->levels[0], values, (old_size + 1) * sizeof(int64_t));
+    for (k = 1; k < self->num_levels; k++) {
+        level = self->levels[k - 1];
+        for (j = 0; j < self->level_size[k - 1]; j++) {
+            b = j / SUM_TREE_BRANCHING;
+            self->levels[k][b] += level[j];
+        }
+    }
+out:
+    free(values);
+    return ret;
+}
+
+int
+sum_tree_free(sum_tree_t *self)
+{
+    sum_tree_free_buffers(self);
+    return 0;
+}
+
+size_t
+sum_tree_get_size(sum_tree_t *self)
+{
+    return self->size;
+}
+
+int64_t
+sum_tree_get_total(sum_tree_t *self)
+{
+    int64_t ret = 0;
+    size_t j;
+    int64_t *top;
+
+    sum_tree_flush(self);
+    /* The top level is a single block */
+    top = self->levels[self->num_levels - 1];
+    for (j = 0; j < SUM_TREE_BRANCHING; j++) {
+        ret += top[j];
+    }
+    return ret;
+}
+
+void
+sum_tree_increment(sum_tree_t *self, size_t index, int64_t value)
+{
+    size_t b = index / SUM_TREE_BRANCHING;
+
+    assert(0 < index && index <= self->size);
+    self->levels[0][index] += value;
+    if (self->num_levels > 1) {
+        if (!self->is_dirty[b]) {
+            self->is_dirty[b] = 1;
+            self->dirty[self->num_dirty] = b;
+            self->num_dirty++;
+        }
+        self->pending[b] += value;
+    }
+}
+
+void
+sum_tree_set_value(sum_tree_t *self, size_t index, int64_t value)
+{
+    int64_t v = value - self->levels[0][index];
+
+    sum_tree_increment(self, index, v);
+}
+
+int64_t
+sum_tree_get_value(sum_tree_t *self, size_t index)
+{
+    assert(0 < index && index <= self->size);
+    return self->levels[0][index];
+}
+
+int64_t
+sum_tree_get_cumulative_sum(sum_tree_t *self, size_t index)
+{
+    int64_t ret;
+    size_t j, k, u;
+
+    assert(0 < index && index <= self->size);
+    sum_tree_flush(self);
+    /* At each level, add in the entries in the same block that precede
+     * the ancestor of index, and then move up a level. */
+    ret = self->levels[0][index];
+    u = index;
+    for (k = 0; k < self->num_levels; k++) {
+        for (j = SUM_TREE_BRANCHING * (u / SUM_TREE_BRANCHING); j < u; j++) {
+            ret += self->levels[k][j];
+        }
+        u /= SUM_TREE_BRANCHING;
+    }
+    return ret;
+}
+
+/* Returns the smallest index such that the cumulative sum up to and
+ * including it is >= sum, and stores this cumulative sum. */
+size_t
+sum_tree_find_with_sum(sum_tree_t *self, int64_t sum, int64_t *cumulative_sum)
+{
+    size_t j, k, end;
+    int64_t s = sum;
+    int64_t *level;
+
+    sum_tree_flush(self);
+    j = 0;
+    k = self->num_levels;
+    while (k > 0) {
+        k--;
+        level = self->levels[k];
+        end = j + SUM_TREE_BRANCHING - 1;
+        while (j < end && s > level[j]) {
+            s -= level[j];
+            j++;
+        }
+        if (k > 0) {
+            j *= SUM_TREE_BRANCHING;
+        }
+    }
+    assert(j > 0 && j <= self->size);
+    *cumulative_sum = sum - s + self->levels[0][j];
+    return j;
+}
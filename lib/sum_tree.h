@@ -0,0 +1,59 @@
+/*
+** Copyright (C) 2017 University of Oxford
+**
+** This file is part of msprime.
+**
+** msprime is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** msprime is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with msprime.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __SUM_TREE_H__
+#define __SUM_TREE_H__
+
+#include <stdlib.h>
+#include <inttypes.h>
+
+#define SUM_TREE_BRANCHING 8
+#define SUM_TREE_MAX_LEVELS 24
+
+/* The sum tree has the same interface as the Fenwick tree, with values
+ * indexed from 1 to size.
+ */
+typedef struct {
+    size_t size;
+    size_t num_levels;
+    /* levels[0] holds the values, and each entry in levels[k] is the sum of
+     * SUM_TREE_BRANCHING consecutive entries in levels[k - 1]. Each level
+     * is padded with zeros to a multiple of SUM_TREE_BRANCHING. */
+    int64_t *levels[SUM_TREE_MAX_LEVELS];
+    size_t level_size[SUM_TREE_MAX_LEVELS];
+    /* Changes to the values are propagated up the tree lazily, so that
+     * several changes within the same block cost one update. */
+    int64_t *pending;
+    uint8_t *is_dirty;
+    size_t *dirty;
+    size_t num_dirty;
+} sum_tree_t;
+
+int sum_tree_alloc(sum_tree_t *, size_t);
+int sum_tree_expand(sum_tree_t *, size_t);
+int sum_tree_free(sum_tree_t *);
+int64_t sum_tree_get_total(sum_tree_t *);
+void sum_tree_increment(sum_tree_t *, size_t, int64_t);
+void sum_tree_set_value(sum_tree_t *, size_t, int64_t);
+int64_t sum_tree_get_cumulative_sum(sum_tree_t *, size_t);
+int64_t sum_tree_get_value(sum_tree_t *, size_t);
+size_t sum_tree_find_with_sum(sum_tree_t *, int64_t, int64_t *);
+size_t sum_tree_get_size(sum_tree_t *);
+
+#endif /*__SUM_TREE_H__*/
@@ -118,6 +118,22 @@ out:
     return ret;
 }
 
+/* Ensures that the table has space for the specified number of rows and
+ * total name length, so that the columns can be written directly. */
+int
+node_table_expand(node_table_t *self, size_t max_rows, size_t max_total_name_length)
+{
+    int ret = 0;
+
+    ret = node_table_expand_fixed_columns(self, max_rows);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = node_table_expand_name(self, max_total_name_length);
+out:
+    return ret;
+}
+
 int
 node_table_set_columns(node_table_t *self, size_t num_rows, uint32_t *flags, double *time,
         population_id_t *population, char *name, uint32_t *name_length)
@@ -319,6 +335,23 @@ out:
     return ret;
 }
 
+/* Ensures that the table has space for the specified number of rows and
+ * total children length, so that the columns can be written directly. */
+int
+edgeset_table_expand(edgeset_table_t *self, size_t max_rows,
+        size_t max_total_children_length)
+{
+    int ret = 0;
+
+    ret = edgeset_table_expand_main_columns(self, max_rows);
+    if (ret != 0) {
+        goto out;
+    }
+    ret = edgeset_table_expand_children(self, max_total_children_length);
+out:
+    return ret;
+}
+
 int
 edgeset_table_add_row(edgeset_table_t *self, double left, double right,
         node_id_t parent, node_id_t *children, list_len_t children_length)
@@ -388,7 +421,7 @@ edgeset_table_set_columns(edgeset_table_t *self,
     memcpy(self->children, children, total_children_length * sizeof(node_id_t));
     memcpy(self->children_length, children_length, num_rows * sizeof(list_len_t));
     self->num_rows = num_rows;
-    self->total_children_length += total_children_length;
+    self->total_children_length = total_children_length;
 out:
     return ret;
 }
@@ -853,7 +886,7 @@ out:
     return ret;
 }
 
-static int
+int
 migration_table_expand(migration_table_t *self, size_t new_size)
 {
     int ret = 0;
@@ -489,6 +489,87 @@ verify_hapgen(tree_sequence_t *ts)
     CU_ASSERT_EQUAL_FATAL(ret, 0);
 }
 
+static void
+verify_vargen_packed(tree_sequence_t *ts)
+{
+    int ret;
+    vargen_t vargen, reference;
+    site_t *site;
+    size_t n = tree_sequence_get_sample_size(ts);
+    size_t num_sites = tree_sequence_get_num_sites(ts);
+    size_t block_sizes[] = {1, 3, 8, 13, num_sites + 1};
+    int options[] = {0, MSP_GENOTYPES_2BIT, MSP_GENOTYPES_SAMPLE_MAJOR,
+        MSP_GENOTYPES_2BIT|MSP_GENOTYPES_SAMPLE_MAJOR};
+    char *genotypes = malloc(GSL_MAX(n, 1) * sizeof(char));
+    uint8_t *matrix;
+    size_t i, j, k, l, bits, row_size, bit, total, num_block_sites, max_sites;
+    size_t num_errors;
+    uint8_t value;
+
+    CU_ASSERT_FATAL(genotypes != NULL);
+    for (i = 0; i < sizeof(options) / sizeof(int); i++) {
+        bits = options[i] & MSP_GENOTYPES_2BIT? 2: 1;
+        for (j = 0; j < sizeof(block_sizes) / sizeof(size_t); j++) {
+            max_sites = block_sizes[j];
+            if (options[i] & MSP_GENOTYPES_SAMPLE_MAJOR) {
+                row_size = (max_sites * bits + 7) / 8;
+                matrix = malloc(GSL_MAX(n * row_size, 1));
+            } else {
+                row_size = (n * bits + 7) / 8;
+                matrix = malloc(GSL_MAX(max_sites * row_size, 1));
+            }
+            CU_ASSERT_FATAL(matrix != NULL);
+            ret = vargen_alloc(&vargen, ts, MSP_GENOTYPES_AS_CHAR);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            ret = vargen_alloc(&reference, ts, 0);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            total = 0;
+            do {
+                ret = vargen_next_packed(&vargen, max_sites, options[i], matrix,
+                        &num_block_sites);
+                CU_ASSERT_EQUAL_FATAL(ret, 0);
+                CU_ASSERT_FATAL(num_block_sites <= max_sites);
+                for (k = 0; k < num_block_sites; k++) {
+                    ret = vargen_next(&reference, &site, genotypes);
+                    CU_ASSERT_EQUAL_FATAL(ret, 1);
+                    CU_ASSERT_EQUAL(site->id, total + k);
+                    num_errors = 0;
+                    for (l = 0; l < n; l++) {
+                        if (options[i] & MSP_GENOTYPES_SAMPLE_MAJOR) {
+                            bit = k * bits;
+                            value = matrix[l * row_size + bit / 8];
+                        } else {
+                            bit = l * bits;
+                            value = matrix[k * row_size + bit / 8];
+                        }
+                        value = (uint8_t) ((value >> (bit % 8)) & ((1 << bits) - 1));
+                        num_errors += value != genotypes[l];
+                    }
+                    CU_ASSERT_EQUAL_FATAL(num_errors, 0);
+                    /* Trailing bits are zero */
+                    if (!(options[i] & MSP_GENOTYPES_SAMPLE_MAJOR)
+                            && (n * bits) % 8 != 0) {
+                        CU_ASSERT_EQUAL(matrix[k * row_size + row_size - 1]
+                                >> ((n * bits) % 8), 0);
+                    }
+                }
+                total += num_block_sites;
+            } while (num_block_sites > 0);
+            CU_ASSERT_EQUAL(total, num_sites);
+            ret = vargen_next(&reference, &site, genotypes);
+            CU_ASSERT_EQUAL(ret, 0);
+            ret = vargen_next_packed(&vargen, max_sites, options[i], matrix,
+                    &num_block_sites);
+            CU_ASSERT_EQUAL(ret, 0);
+            CU_ASSERT_EQUAL(num_block_sites, 0);
+            vargen_free(&vargen);
+            vargen_free(&reference);
+            free(matrix);
+        }
+    }
+    free(genotypes);
+}
+
 static void
 verify_vargen(tree_sequence_t *ts)
 {
@@ -541,6 +622,7 @@ verify_vargen(tree_sequence_t *ts)
     CU_ASSERT_EQUAL_FATAL(ret, 0);
 
     free(genotypes);
+    verify_vargen_packed(ts);
 }
 
 static void
@@ -1173,6 +1255,199 @@ test_fenwick(void)
     }
 }
 
+/* Tests the sum tree against the Fenwick tree. */
+static void
+test_sum_tree(void)
+{
+    sum_tree_t t;
+    fenwick_t f;
+    int64_t s, cs, fcs;
+    size_t j, k, n;
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+
+    CU_ASSERT_FATAL(rng != NULL);
+    for (n = 1; n < 300; n += 7) {
+        s = 0;
+        CU_ASSERT_FATAL(sum_tree_alloc(&t, n) == 0);
+        CU_ASSERT_FATAL(fenwick_alloc(&f, n) == 0);
+        CU_ASSERT_EQUAL(sum_tree_get_size(&t), n);
+        CU_ASSERT_EQUAL(sum_tree_get_total(&t), 0);
+        for (j = 1; j <= n; j++) {
+            sum_tree_increment(&t, j, (int64_t) j);
+            s = s + (int64_t) j;
+            CU_ASSERT(sum_tree_get_value(&t, j) == (int64_t) j);
+            CU_ASSERT(sum_tree_get_cumulative_sum(&t, j) == s);
+            CU_ASSERT(sum_tree_get_total(&t) == s);
+            CU_ASSERT(sum_tree_find_with_sum(&t, s, &cs) == j);
+            CU_ASSERT(cs == s);
+            sum_tree_set_value(&t, j, 0);
+            CU_ASSERT(sum_tree_get_value(&t, j) == 0);
+            CU_ASSERT(sum_tree_get_cumulative_sum(&t, j) == s - (int64_t) j);
+            sum_tree_set_value(&t, j, (int64_t) j);
+            CU_ASSERT(sum_tree_get_value(&t, j) == (int64_t) j);
+            fenwick_set_value(&f, j, (int64_t) j);
+        }
+        /* Batches of random updates, some of them left unflushed across
+         * an expand. */
+        for (k = 0; k < 20; k++) {
+            for (j = 0; j < 10; j++) {
+                size_t index = 1 + gsl_rng_uniform_int(rng, (unsigned long) n);
+                int64_t v = (int64_t) gsl_rng_uniform_int(rng, 10);
+                sum_tree_set_value(&t, index, v);
+                fenwick_set_value(&f, index, v);
+            }
+            if (k % 5 == 4) {
+                CU_ASSERT_FATAL(sum_tree_expand(&t, 3) == 0);
+                CU_ASSERT_FATAL(fenwick_expand(&f, 3) == 0);
+                n += 3;
+                CU_ASSERT_EQUAL(sum_tree_get_size(&t), n);
+            }
+            s = fenwick_get_total(&f);
+            CU_ASSERT_EQUAL_FATAL(sum_tree_get_total(&t), s);
+            for (j = 1; j <= n; j++) {
+                CU_ASSERT(sum_tree_get_cumulative_sum(&t, j)
+                        == fenwick_get_cumulative_sum(&f, j));
+            }
+            for (cs = 1; cs <= s; cs++) {
+                CU_ASSERT(sum_tree_find_with_sum(&t, cs, &fcs)
+                        == fenwick_find(&f, cs));
+                CU_ASSERT(fcs == fenwick_get_cumulative_sum(&f,
+                            fenwick_find(&f, cs)));
+            }
+        }
+        CU_ASSERT(sum_tree_free(&t) == 0);
+        CU_ASSERT(fenwick_free(&f) == 0);
+    }
+    gsl_rng_free(rng);
+}
+
+/* Checks the contents of the specified locus_map against the values in
+ * an array, where loci not present in the map have the value UINT32_MAX. */
+static void
+verify_locus_map(locus_map_t *map, uint32_t *values, uint32_t num_loci)
+{
+    int more;
+    uint32_t j, v;
+    uint32_t *p;
+    size_t size = 0;
+    locus_map_cursor_t cursor;
+
+    more = locus_map_first(map, &cursor);
+    for (j = 0; j < num_loci; j++) {
+        p = locus_map_get(map, j);
+        if (values[j] == UINT32_MAX) {
+            CU_ASSERT_EQUAL_FATAL(p, NULL);
+        } else {
+            size++;
+            CU_ASSERT_FATAL(p != NULL);
+            CU_ASSERT_EQUAL_FATAL(*p, values[j]);
+            CU_ASSERT_FATAL(more);
+            CU_ASSERT_EQUAL_FATAL(cursor.key, j);
+            CU_ASSERT_EQUAL_FATAL(*cursor.value, values[j]);
+            more = locus_map_next(map, &cursor);
+        }
+        if (size == 0) {
+            CU_ASSERT_EQUAL(locus_map_get_floor(map, j, &v), MSP_ERR_OUT_OF_BOUNDS);
+            CU_ASSERT_FALSE(locus_map_seek(map, j, &cursor));
+        }
+    }
+    CU_ASSERT_FALSE(more);
+    CU_ASSERT_EQUAL(locus_map_get_size(map), size);
+}
+
+/* Tests the locus_map against a simple array implementation. */
+static void
+test_locus_map(void)
+{
+    int ret;
+    uint32_t num_loci = 2000;
+    uint32_t j, k, left, right, key, last;
+    uint32_t *values = malloc(num_loci * sizeof(uint32_t));
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+    locus_map_cursor_t cursor;
+    locus_map_t map;
+
+    CU_ASSERT_FATAL(values != NULL);
+    CU_ASSERT_FATAL(rng != NULL);
+    ret = locus_map_alloc(&map);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    for (j = 0; j < num_loci; j++) {
+        values[j] = UINT32_MAX;
+    }
+    verify_locus_map(&map, values, num_loci);
+    CU_ASSERT_EQUAL(locus_map_first(&map, &cursor), 0);
+    for (k = 0; k < 3; k++) {
+        /* Insert a few thousand random keys with a small number of values,
+         * and then compress random ranges. */
+        for (j = 0; j < 3000; j++) {
+            key = (uint32_t) gsl_rng_uniform_int(rng, num_loci);
+            values[key] = (uint32_t) gsl_rng_uniform_int(rng, 3);
+            ret = locus_map_insert(&map, key, values[key]);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+        }
+        verify_locus_map(&map, values, num_loci);
+        for (key = 0; key < num_loci; key++) {
+            if (locus_map_seek(&map, key, &cursor)) {
+                j = key;
+                while (values[j] == UINT32_MAX) {
+                    j--;
+                }
+                CU_ASSERT_EQUAL_FATAL(cursor.key, j);
+                ret = locus_map_get_floor(&map, key, &last);
+                CU_ASSERT_EQUAL_FATAL(ret, 0);
+                CU_ASSERT_EQUAL_FATAL(last, values[j]);
+            }
+        }
+        for (j = 0; j < 200; j++) {
+            left = (uint32_t) gsl_rng_uniform_int(rng, num_loci);
+            right = left + (uint32_t) gsl_rng_uniform_int(rng, 100);
+            locus_map_compress(&map, left, right);
+            last = UINT32_MAX;
+            for (key = 0; key < num_loci; key++) {
+                if (values[key] != UINT32_MAX) {
+                    if (key >= left && key <= right && values[key] == last) {
+                        values[key] = UINT32_MAX;
+                    } else {
+                        last = values[key];
+                    }
+                }
+            }
+            verify_locus_map(&map, values, num_loci);
+        }
+        locus_map_compress(&map, 0, num_loci);
+        last = UINT32_MAX;
+        for (key = 0; key < num_loci; key++) {
+            if (values[key] != UINT32_MAX) {
+                if (values[key] == last) {
+                    values[key] = UINT32_MAX;
+                } else {
+                    last = values[key];
+                }
+            }
+        }
+        verify_locus_map(&map, values, num_loci);
+    }
+    locus_map_clear(&map);
+    for (j = 0; j < num_loci; j++) {
+        values[j] = UINT32_MAX;
+    }
+    verify_locus_map(&map, values, num_loci);
+    for (j = num_loci; j > 0; j--) {
+        values[j - 1] = j;
+        ret = locus_map_insert(&map, j - 1, j);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+    }
+    verify_locus_map(&map, values, num_loci);
+    CU_ASSERT_EQUAL(locus_map_get_total_memory(&map),
+            map.max_blocks * (sizeof(uint32_t) + sizeof(locus_map_block_t *))
+            + map.num_allocated_blocks * sizeof(locus_map_block_t));
+    locus_map_print_state(&map, _devnull);
+
+    locus_map_free(&map);
+    gsl_rng_free(rng);
+    free(values);
+}
+
 static void
 verify_vcf_converter(tree_sequence_t *ts, unsigned int ploidy)
 {
@@ -1524,6 +1799,78 @@ test_single_locus_many_populations(void)
     gsl_rng_free(rng);
 }
 
+static void
+test_stepping_stone_migration(void)
+{
+    int ret;
+    msp_t msp;
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+    uint32_t N = 20;
+    uint32_t n = 2 * N;
+    uint32_t j, k;
+    sample_t *samples = malloc(n * sizeof(sample_t));
+    double *migration_matrix = calloc(N * N, sizeof(double));
+    size_t *migration_events = malloc(N * N * sizeof(size_t));
+    size_t total_migration_events, num_events;
+
+    CU_ASSERT_FATAL(rng != NULL);
+    CU_ASSERT_FATAL(samples != NULL);
+    CU_ASSERT_FATAL(migration_matrix != NULL);
+    CU_ASSERT_FATAL(migration_events != NULL);
+    gsl_rng_set(rng, 5);
+    /* A circular stepping stone model with a higher rate in one direction */
+    for (j = 0; j < N; j++) {
+        samples[2 * j].population_id = (population_id_t) j;
+        samples[2 * j].time = 0;
+        samples[2 * j + 1].population_id = (population_id_t) j;
+        samples[2 * j + 1].time = 0;
+        migration_matrix[j * N + (j + 1) % N] = 1.0;
+        migration_matrix[j * N + (j + N - 1) % N] = 0.25;
+    }
+    ret = msp_alloc(&msp, n, samples, rng);
+    CU_ASSERT_EQUAL(ret, 0);
+    ret = msp_set_num_populations(&msp, N);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = msp_set_migration_matrix(&msp, N * N, migration_matrix);
+    CU_ASSERT_EQUAL(ret, 0);
+    ret = msp_set_store_migrations(&msp, true);
+    CU_ASSERT_EQUAL(ret, 0);
+    /* Switch off migration in one direction after a while */
+    ret = msp_add_migration_rate_change(&msp, 1.0, 1, 0.0);
+    CU_ASSERT_EQUAL(ret, 0);
+    ret = msp_initialise(&msp);
+    CU_ASSERT_EQUAL(ret, 0);
+
+    num_events = 0;
+    while ((ret = msp_run(&msp, DBL_MAX, 1)) == 1) {
+        msp_verify(&msp);
+        num_events++;
+    }
+    CU_ASSERT_EQUAL(ret, 0);
+    msp_verify(&msp);
+    ret = msp_get_num_migration_events(&msp, migration_events);
+    CU_ASSERT_EQUAL(ret, 0);
+    total_migration_events = 0;
+    for (j = 0; j < N; j++) {
+        for (k = 0; k < N; k++) {
+            if (k != (j + 1) % N && k != (j + N - 1) % N) {
+                CU_ASSERT_EQUAL(migration_events[j * N + k], 0);
+            }
+            total_migration_events += migration_events[j * N + k];
+        }
+    }
+    CU_ASSERT_TRUE(total_migration_events > 0);
+    CU_ASSERT_EQUAL(total_migration_events, msp_get_num_migrations(&msp));
+    CU_ASSERT_EQUAL(msp_get_num_common_ancestor_events(&msp), n - 1);
+
+    ret = msp_free(&msp);
+    CU_ASSERT_EQUAL(ret, 0);
+    gsl_rng_free(rng);
+    free(samples);
+    free(migration_matrix);
+    free(migration_events);
+}
+
 static void
 test_single_locus_historical_sample(void)
 {
@@ -1751,6 +2098,21 @@ test_simulator_model_errors(void)
         CU_ASSERT_EQUAL(msp_free(&msp), 0);
     }
 
+    CU_ASSERT_EQUAL(msp_alloc(&msp, n, samples, rng), 0);
+    CU_ASSERT_EQUAL(msp_set_simulation_model_dtwf(&msp, 0, 10), MSP_ERR_BAD_PARAM_VALUE);
+    CU_ASSERT_EQUAL(msp_set_simulation_model_dtwf(&msp, -1, 10), MSP_ERR_BAD_PARAM_VALUE);
+    CU_ASSERT_EQUAL(msp_set_simulation_model_dtwf(&msp, 10, -1), MSP_ERR_BAD_PARAM_VALUE);
+    CU_ASSERT_EQUAL(msp_get_model(&msp)->type, MSP_MODEL_HUDSON);
+    CU_ASSERT_EQUAL(msp_set_simulation_model_dtwf(&msp, 10, 10), 0);
+    CU_ASSERT_EQUAL(msp_get_model(&msp)->type, MSP_MODEL_DTWF);
+    CU_ASSERT_EQUAL(msp_add_simple_bottleneck(&msp, 1, 0, 1), 0);
+    CU_ASSERT_EQUAL(msp_add_instantaneous_bottleneck(&msp, 1, 0, 1), 0);
+    CU_ASSERT_EQUAL(msp_set_simulation_model_dtwf(&msp, 10, 10),
+            MSP_ERR_UNSUPPORTED_OPERATION);
+    CU_ASSERT_EQUAL(msp_initialise(&msp), 0);
+    CU_ASSERT_EQUAL(msp_run(&msp, DBL_MAX, ULONG_MAX), 0);
+    CU_ASSERT_EQUAL(msp_free(&msp), 0);
+
     free(samples);
     gsl_rng_free(rng);
 }
@@ -1954,6 +2316,57 @@ test_single_locus_simulation(void)
     free(samples);
 }
 
+static void
+test_simulation_locus_map_memory(void)
+{
+    int ret;
+    uint32_t n = 10;
+    sample_t *samples = calloc(n, sizeof(sample_t));
+    msp_t *msp = malloc(sizeof(msp_t));
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+    size_t block_size = 100000;
+    size_t used_memory, map_memory, num_blocks[4];
+
+    CU_ASSERT_FATAL(msp != NULL && samples != NULL && rng != NULL);
+    ret = msp_alloc(msp, n, samples, rng);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    /* Make the heap blocks large enough that only the locus maps grow */
+    CU_ASSERT_EQUAL_FATAL(msp_set_avl_node_block_size(msp, block_size), 0);
+    CU_ASSERT_EQUAL_FATAL(msp_set_node_mapping_block_size(msp, block_size), 0);
+    CU_ASSERT_EQUAL_FATAL(msp_set_segment_block_size(msp, block_size), 0);
+    CU_ASSERT_EQUAL_FATAL(msp_set_coalescence_record_block_size(msp, block_size), 0);
+    CU_ASSERT_EQUAL_FATAL(msp_set_num_loci(msp, 1000000), 0);
+    CU_ASSERT_EQUAL_FATAL(msp_set_scaled_recombination_rate(msp, 0.001), 0);
+    ret = msp_initialise(msp);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    used_memory = msp_get_used_memory(msp);
+    map_memory = locus_map_get_total_memory(&msp->breakpoints)
+        + locus_map_get_total_memory(&msp->overlap_counts);
+    num_blocks[0] = msp_get_num_avl_node_blocks(msp);
+    num_blocks[1] = msp_get_num_node_mapping_blocks(msp);
+    num_blocks[2] = msp_get_num_segment_blocks(msp);
+    num_blocks[3] = msp_get_num_coalescence_record_blocks(msp);
+
+    ret = msp_run(msp, DBL_MAX, ULONG_MAX);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_EQUAL_FATAL(num_blocks[0], msp_get_num_avl_node_blocks(msp));
+    CU_ASSERT_EQUAL_FATAL(num_blocks[1], msp_get_num_node_mapping_blocks(msp));
+    CU_ASSERT_EQUAL_FATAL(num_blocks[2], msp_get_num_segment_blocks(msp));
+    CU_ASSERT_EQUAL_FATAL(num_blocks[3], msp_get_num_coalescence_record_blocks(msp));
+    CU_ASSERT_TRUE(locus_map_get_size(&msp->breakpoints) > 4 * LOCUS_MAP_BLOCK_SIZE);
+    CU_ASSERT_TRUE(locus_map_get_total_memory(&msp->breakpoints)
+            + locus_map_get_total_memory(&msp->overlap_counts) > map_memory);
+    CU_ASSERT_EQUAL(msp_get_used_memory(msp) - used_memory,
+            locus_map_get_total_memory(&msp->breakpoints)
+            + locus_map_get_total_memory(&msp->overlap_counts) - map_memory);
+
+    ret = msp_free(msp);
+    CU_ASSERT_EQUAL(ret, 0);
+    gsl_rng_free(rng);
+    free(msp);
+    free(samples);
+}
+
 static void
 test_simulation_memory_limit(void)
 {
@@ -2096,6 +2509,133 @@ test_multi_locus_simulation(void)
     }
 }
 
+/* Checks that every event is accounted for when constant rate and time
+ * rescaled common ancestor events are mixed. */
+static void
+test_mixed_growth_rate_simulation(void)
+{
+    int ret;
+    uint32_t j, num_events;
+    uint32_t n = 50;
+    sample_t *samples = malloc(n * sizeof(sample_t));
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+    double migration_matrix[] = {0, 1, 0.5, 2, 0, 0.25, 1, 1, 0};
+    size_t migration_events[9];
+    msp_t msp;
+
+    CU_ASSERT_FATAL(samples != NULL);
+    CU_ASSERT_FATAL(rng != NULL);
+    gsl_rng_set(rng, 3);
+    for (j = 0; j < n; j++) {
+        samples[j].time = 0;
+        samples[j].population_id = j % 3;
+    }
+    ret = msp_alloc(&msp, n, samples, rng);
+    CU_ASSERT_EQUAL(ret, 0);
+    ret = msp_set_num_populations(&msp, 3);
+    CU_ASSERT_EQUAL(ret, 0);
+    ret = msp_set_population_configuration(&msp, 0, 1, 0);
+    CU_ASSERT_EQUAL(ret, 0);
+    ret = msp_set_population_configuration(&msp, 1, 0.5, 2);
+    CU_ASSERT_EQUAL(ret, 0);
+    ret = msp_set_population_configuration(&msp, 2, 2, -0.5);
+    CU_ASSERT_EQUAL(ret, 0);
+    ret = msp_set_migration_matrix(&msp, 9, migration_matrix);
+    CU_ASSERT_EQUAL(ret, 0);
+    ret = msp_set_num_loci(&msp, 100);
+    CU_ASSERT_EQUAL(ret, 0);
+    ret = msp_set_scaled_recombination_rate(&msp, 0.1);
+    CU_ASSERT_EQUAL(ret, 0);
+    /* Stop population 2 from shrinking after some time */
+    ret = msp_add_population_parameters_change(&msp, 0.5, 2, GSL_NAN, 0);
+    CU_ASSERT_EQUAL(ret, 0);
+    ret = msp_initialise(&msp);
+    CU_ASSERT_EQUAL(ret, 0);
+
+    num_events = 0;
+    while ((ret = msp_run(&msp, DBL_MAX, 1)) == 1) {
+        msp_verify(&msp);
+        num_events++;
+    }
+    CU_ASSERT_EQUAL(ret, 0);
+    msp_verify(&msp);
+    ret = msp_get_num_migration_events(&msp, migration_events);
+    CU_ASSERT_EQUAL(ret, 0);
+    for (j = 0; j < 3; j++) {
+        CU_ASSERT_EQUAL(migration_events[j * 3 + j], 0);
+    }
+    CU_ASSERT_EQUAL(num_events,
+            migration_events[1] + migration_events[2] + migration_events[3]
+            + migration_events[5] + migration_events[6] + migration_events[7]
+            + msp_get_num_recombination_events(&msp)
+            + msp_get_num_common_ancestor_events(&msp));
+
+    free(samples);
+    ret = msp_free(&msp);
+    CU_ASSERT_EQUAL(ret, 0);
+    gsl_rng_free(rng);
+}
+
+/* Checks that the choice of links index does not affect the simulation. */
+static void
+test_links_index_simulation(void)
+{
+    int ret;
+    uint32_t j, n = 20;
+    size_t k, num_records[2];
+    int links_index[] = {MSP_LINKS_FENWICK, MSP_LINKS_SUM_TREE};
+    sample_t *samples = calloc(n, sizeof(sample_t));
+    coalescence_record_t *records[2];
+    gsl_rng *rng[2];
+    msp_t msp[2];
+
+    CU_ASSERT_FATAL(samples != NULL);
+    for (j = 0; j < 2; j++) {
+        rng[j] = gsl_rng_alloc(gsl_rng_default);
+        CU_ASSERT_FATAL(rng[j] != NULL);
+        gsl_rng_set(rng[j], 5);
+        ret = msp_alloc(&msp[j], n, samples, rng[j]);
+        CU_ASSERT_EQUAL(ret, 0);
+        ret = msp_set_links_index(&msp[j], links_index[j]);
+        CU_ASSERT_EQUAL(ret, 0);
+        ret = msp_set_num_loci(&msp[j], 1000);
+        CU_ASSERT_EQUAL(ret, 0);
+        ret = msp_set_scaled_recombination_rate(&msp[j], 0.1);
+        CU_ASSERT_EQUAL(ret, 0);
+        /* Provoke the expansion of the links index */
+        ret = msp_set_segment_block_size(&msp[j], 1);
+        CU_ASSERT_EQUAL(ret, 0);
+        CU_ASSERT_EQUAL(msp_set_links_index(&msp[j], -1), MSP_ERR_BAD_PARAM_VALUE);
+        ret = msp_initialise(&msp[j]);
+        CU_ASSERT_EQUAL(ret, 0);
+        CU_ASSERT_EQUAL(msp_set_links_index(&msp[j], MSP_LINKS_FENWICK),
+                MSP_ERR_BAD_STATE);
+        while ((ret = msp_run(&msp[j], DBL_MAX, 1)) == 1) {
+            msp_verify(&msp[j]);
+        }
+        CU_ASSERT_EQUAL(ret, 0);
+        num_records[j] = msp_get_num_coalescence_records(&msp[j]);
+        ret = msp_get_coalescence_records(&msp[j], &records[j]);
+        CU_ASSERT_EQUAL(ret, 0);
+    }
+    CU_ASSERT_EQUAL(msp_get_num_recombination_events(&msp[0]),
+            msp_get_num_recombination_events(&msp[1]));
+    CU_ASSERT_EQUAL(msp[0].time, msp[1].time);
+    CU_ASSERT_EQUAL_FATAL(num_records[0], num_records[1]);
+    for (k = 0; k < num_records[0]; k++) {
+        CU_ASSERT_EQUAL(records[0][k].left, records[1][k].left);
+        CU_ASSERT_EQUAL(records[0][k].right, records[1][k].right);
+        CU_ASSERT_EQUAL(records[0][k].node, records[1][k].node);
+        CU_ASSERT_EQUAL(records[0][k].time, records[1][k].time);
+    }
+    for (j = 0; j < 2; j++) {
+        ret = msp_free(&msp[j]);
+        CU_ASSERT_EQUAL(ret, 0);
+        gsl_rng_free(rng[j]);
+    }
+    free(samples);
+}
+
 static void
 test_simulation_replicates(void)
 {
@@ -2107,6 +2647,8 @@ test_simulation_replicates(void)
     long seed = 10;
     double migration_matrix[] = {0, 1, 1, 0};
     size_t j;
+    double first_time = 0;
+    size_t first_num_ca_events = 0;
     sample_t *samples = malloc(n * sizeof(sample_t));
     gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
     msp_t msp;
@@ -2171,14 +2713,24 @@ test_simulation_replicates(void)
         CU_ASSERT_EQUAL(ret, 0);
         msp_verify(&msp);
         CU_ASSERT_EQUAL_FATAL(ret, 0);
+        if (j == 0) {
+            first_time = msp.time;
+            first_num_ca_events = msp_get_num_common_ancestor_events(&msp);
+        }
         ret = msp_populate_tables(&msp, 0.25, NULL, &nodes, &edgesets, &migrations);
         CU_ASSERT_EQUAL_FATAL(ret, 0);
         ret = mutgen_generate_tables_tmp(&mutgen, &nodes, &edgesets);
         CU_ASSERT_EQUAL_FATAL(ret, 0);
         ret = mutgen_populate_tables(&mutgen, &sites, &mutations);
         CU_ASSERT_EQUAL_FATAL(ret, 0);
-        ret = tree_sequence_load_tables_tmp(&ts, &nodes, &edgesets, &migrations,
-                &sites, &mutations, 0, NULL);
+        /* Alternate between copying and taking the table columns */
+        if (j % 2 == 0) {
+            ret = tree_sequence_load_tables_tmp(&ts, &nodes, &edgesets, &migrations,
+                    &sites, &mutations, 0, NULL);
+        } else {
+            ret = tree_sequence_take_tables_tmp(&ts, &nodes, &edgesets, &migrations,
+                    &sites, &mutations, 0, NULL);
+        }
         CU_ASSERT_EQUAL_FATAL(ret, 0);
         verify_simulator_tree_sequence_equality(&msp, &ts, &mutgen, 1.0);
         tree_sequence_print_state(&ts, _devnull);
@@ -2188,6 +2740,12 @@ test_simulation_replicates(void)
         CU_ASSERT_EQUAL_FATAL(ret, 0);
 
     }
+    /* A reset simulator with the original seed must repeat the first replicate */
+    gsl_rng_set(rng, seed);
+    ret = msp_run(&msp, DBL_MAX, SIZE_MAX);
+    CU_ASSERT_EQUAL(ret, 0);
+    CU_ASSERT_EQUAL(msp.time, first_time);
+    CU_ASSERT_EQUAL(msp_get_num_common_ancestor_events(&msp), first_num_ca_events);
     ret = msp_free(&msp);
     CU_ASSERT_EQUAL(ret, 0);
     ret = mutgen_free(&mutgen);
@@ -2420,29 +2978,124 @@ test_multiple_mergers_simulation(void)
 }
 
 static void
-test_node_names(void)
+test_dtwf_simulation(void)
 {
-    const char *nodes =
-        "1  0   0   n1\n"
-        "1  0   0   n2\n"
-        "0  1   0   A_much_longer_name\n"
-        "0  1   0\n"
-        "0  1   0   n4";
-    const char *edgesets =
-        "0  1   2   0,1\n";
-    tree_sequence_t ts;
     int ret;
-    node_t node;
-
-    tree_sequence_from_text(&ts, nodes, edgesets, NULL, NULL, NULL, NULL);
-    CU_ASSERT_EQUAL(tree_sequence_get_sample_size(&ts), 2);
-    CU_ASSERT_EQUAL(tree_sequence_get_num_nodes(&ts), 5);
+    uint32_t j, k;
+    uint32_t n = 100;
+    double Ne = 50;
+    double dt = 1.0 / (4 * Ne);
+    /* Run the DTWF model for the whole simulation, and then switch to
+     * Hudson after a few generations. */
+    double num_generations[] = {DBL_MAX, 20};
+    double migration_matrix[] = {0, 10, 5, 0};
+    size_t migration_events[4];
+    sample_t *samples = malloc(n * sizeof(sample_t));
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+    coalescence_record_t *records;
+    msp_t msp;
+    bool non_binary;
 
-    ret = tree_sequence_get_node(&ts, 0, &node);
-    CU_ASSERT_EQUAL_FATAL(ret, 0);
-    CU_ASSERT_STRING_EQUAL(node.name, "n1");
+    CU_ASSERT_FATAL(samples != NULL);
+    CU_ASSERT_FATAL(rng != NULL);
+    for (j = 0; j < n; j++) {
+        samples[j].population_id = (population_id_t) (j % 2);
+        samples[j].time = j < n - 10 ? 0 : 0.1;
+    }
+    for (k = 0; k < 2; k++) {
+        gsl_rng_set(rng, 5);
+        ret = msp_alloc(&msp, n, samples, rng);
+        CU_ASSERT_EQUAL(ret, 0);
+        ret = msp_set_simulation_model_dtwf(&msp, Ne, num_generations[k]);
+        CU_ASSERT_EQUAL(ret, 0);
+        CU_ASSERT_STRING_EQUAL(msp_get_model_name(&msp), "dtwf");
+        ret = msp_set_num_populations(&msp, 2);
+        CU_ASSERT_EQUAL(ret, 0);
+        ret = msp_set_population_configuration(&msp, 1, 0.5, 1.0);
+        CU_ASSERT_EQUAL(ret, 0);
+        ret = msp_set_migration_matrix(&msp, 4, migration_matrix);
+        CU_ASSERT_EQUAL(ret, 0);
+        ret = msp_set_store_migrations(&msp, true);
+        CU_ASSERT_EQUAL(ret, 0);
+        ret = msp_set_num_loci(&msp, 1000);
+        CU_ASSERT_EQUAL(ret, 0);
+        ret = msp_set_scaled_recombination_rate(&msp, 0.1);
+        CU_ASSERT_EQUAL(ret, 0);
+        ret = msp_set_segment_block_size(&msp, 1);
+        CU_ASSERT_EQUAL(ret, 0);
+        ret = msp_add_mass_migration(&msp, 0.05, 1, 0, 0.5);
+        CU_ASSERT_EQUAL(ret, 0);
+        ret = msp_initialise(&msp);
+        CU_ASSERT_EQUAL(ret, 0);
+        msp_print_state(&msp, _devnull);
 
-    ret = tree_sequence_get_node(&ts, 1, &node);
+        /* Each event in the DTWF phase is one generation */
+        ret = msp_run(&msp, DBL_MAX, 1);
+        CU_ASSERT_EQUAL(ret, 1);
+        CU_ASSERT_DOUBLE_EQUAL(msp.time, dt, 1e-12);
+        while ((ret = msp_run(&msp, DBL_MAX, 1)) == 1) {
+            msp_verify(&msp);
+        }
+        CU_ASSERT_EQUAL(ret, 0);
+        CU_ASSERT_TRUE(msp_is_completed(&msp));
+        msp_verify(&msp);
+        CU_ASSERT(msp_get_num_recombination_events(&msp) > 0);
+        ret = msp_get_num_migration_events(&msp, migration_events);
+        CU_ASSERT_EQUAL(ret, 0);
+        CU_ASSERT(migration_events[1] > 0);
+        CU_ASSERT(migration_events[2] > 0);
+        CU_ASSERT(msp_get_num_migrations(&msp) > 0);
+        ret = msp_get_coalescence_records(&msp, &records);
+        CU_ASSERT_EQUAL(ret, 0);
+        non_binary = false;
+        for (j = 0; j < msp_get_num_coalescence_records(&msp); j++) {
+            non_binary |= records[j].num_children > 2;
+            if (j > 0) {
+                CU_ASSERT(records[j].time >= records[j - 1].time);
+            }
+            if (k == 0) {
+                /* All coalescences happen on generation boundaries */
+                CU_ASSERT_DOUBLE_EQUAL(records[j].time / dt,
+                        round(records[j].time / dt), 1e-6);
+            }
+        }
+        if (k == 0) {
+            /* With n close to Ne we should see multiple mergers */
+            CU_ASSERT_TRUE(non_binary);
+        } else {
+            CU_ASSERT_TRUE(msp.time > num_generations[k] * dt);
+        }
+        ret = msp_free(&msp);
+        CU_ASSERT_EQUAL(ret, 0);
+    }
+    gsl_rng_free(rng);
+    free(samples);
+}
+
+static void
+test_node_names(void)
+{
+    const char *nodes =
+        "1  0   0   n1\n"
+        "1  0   0   n2\n"
+        "0  1   0   A_much_longer_name\n"
+        "0  1   0\n"
+        "0  1   0   n4";
+    const char *edgesets =
+        "0  1   2   0,1\n";
+    tree_sequence_t ts;
+    int ret;
+    node_t node;
+
+    tree_sequence_from_text(&ts, nodes, edgesets, NULL, NULL, NULL, NULL);
+    CU_ASSERT_EQUAL(tree_sequence_get_sample_size(&ts), 2);
+    CU_ASSERT_EQUAL(tree_sequence_get_num_nodes(&ts), 5);
+
+    ret = tree_sequence_get_node(&ts, 0, &node);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_STRING_EQUAL(node.name, "n1");
+
+    ret = tree_sequence_get_node(&ts, 1, &node);
     CU_ASSERT_EQUAL_FATAL(ret, 0);
     CU_ASSERT_STRING_EQUAL(node.name, "n2");
 
@@ -3962,6 +4615,9 @@ test_single_tree_inconsistent_mutations(void)
     site_t *site;
     vargen_t vargen;
     hapgen_t hapgen;
+    int options[] = {0, MSP_GENOTYPES_SAMPLE_MAJOR};
+    uint8_t matrix[4];
+    size_t j, num_sites;
     int ret;
 
     tree_sequence_from_text(&ts, single_tree_ex_nodes, single_tree_ex_edgesets, NULL,
@@ -3979,8 +4635,21 @@ test_single_tree_inconsistent_mutations(void)
     CU_ASSERT_EQUAL_FATAL(ret, 1);
     ret = vargen_next(&vargen, &site, genotypes);
     CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_INCONSISTENT_MUTATIONS);
+    /* The failing site is not skipped on the next call. */
+    ret = vargen_next(&vargen, &site, genotypes);
+    CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_INCONSISTENT_MUTATIONS);
     ret = vargen_free(&vargen);
 
+    for (j = 0; j < 2; j++) {
+        ret = vargen_alloc(&vargen, &ts, 0);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        ret = vargen_next_packed(&vargen, 3, options[j], matrix, &num_sites);
+        CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_INCONSISTENT_MUTATIONS);
+        ret = vargen_next_packed(&vargen, 3, options[j], matrix, &num_sites);
+        CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_INCONSISTENT_MUTATIONS);
+        ret = vargen_free(&vargen);
+    }
+
     tree_sequence_free(&ts);
 }
 
@@ -5262,19 +5931,19 @@ verify_ld(tree_sequence_t *ts)
     if (num_sites > 0) {
         /* Some checks in the forward direction */
         ret = ld_calc_get_r2_array(&ld_calc, 0, MSP_DIR_FORWARD,
-                num_sites, DBL_MAX, r2, &num_r2_values);
+                num_sites, DBL_MAX, MSP_LD_STAT_R2, r2, &num_r2_values);
         CU_ASSERT_EQUAL_FATAL(ret, 0);
         CU_ASSERT_EQUAL_FATAL(num_r2_values, num_sites - 1);
         ld_calc_print_state(&ld_calc, _devnull);
 
         ret = ld_calc_get_r2_array(&ld_calc, num_sites - 2, MSP_DIR_FORWARD,
-                num_sites, DBL_MAX, r2_prime, &num_r2_values);
+                num_sites, DBL_MAX, MSP_LD_STAT_R2, r2_prime, &num_r2_values);
         CU_ASSERT_EQUAL_FATAL(ret, 0);
         CU_ASSERT_EQUAL_FATAL(num_r2_values, 1);
         ld_calc_print_state(&ld_calc, _devnull);
 
         ret = ld_calc_get_r2_array(&ld_calc, 0, MSP_DIR_FORWARD,
-                num_sites, DBL_MAX, r2_prime, &num_r2_values);
+                num_sites, DBL_MAX, MSP_LD_STAT_R2, r2_prime, &num_r2_values);
         CU_ASSERT_EQUAL_FATAL(ret, 0);
         CU_ASSERT_EQUAL_FATAL(num_r2_values, num_sites - 1);
         ld_calc_print_state(&ld_calc, _devnull);
@@ -5288,20 +5957,20 @@ verify_ld(tree_sequence_t *ts)
 
         /* Some checks in the reverse direction */
         ret = ld_calc_get_r2_array(&ld_calc, num_sites - 1,
-                MSP_DIR_REVERSE, num_sites, DBL_MAX,
+                MSP_DIR_REVERSE, num_sites, DBL_MAX, MSP_LD_STAT_R2,
                 r2, &num_r2_values);
         CU_ASSERT_EQUAL_FATAL(ret, 0);
         CU_ASSERT_EQUAL_FATAL(num_r2_values, num_sites - 1);
         ld_calc_print_state(&ld_calc, _devnull);
 
         ret = ld_calc_get_r2_array(&ld_calc, 1, MSP_DIR_REVERSE,
-                num_sites, DBL_MAX, r2_prime, &num_r2_values);
+                num_sites, DBL_MAX, MSP_LD_STAT_R2, r2_prime, &num_r2_values);
         CU_ASSERT_EQUAL_FATAL(ret, 0);
         CU_ASSERT_EQUAL_FATAL(num_r2_values, 1);
         ld_calc_print_state(&ld_calc, _devnull);
 
         ret = ld_calc_get_r2_array(&ld_calc, num_sites - 1,
-                MSP_DIR_REVERSE, num_sites, DBL_MAX,
+                MSP_DIR_REVERSE, num_sites, DBL_MAX, MSP_LD_STAT_R2,
                 r2_prime, &num_r2_values);
         CU_ASSERT_EQUAL_FATAL(ret, 0);
         CU_ASSERT_EQUAL_FATAL(num_r2_values, num_sites - 1);
@@ -5317,7 +5986,13 @@ verify_ld(tree_sequence_t *ts)
 
         /* Check some error conditions */
         ret = ld_calc_get_r2_array(&ld_calc, 0, 0, num_sites, DBL_MAX,
-            r2, &num_r2_values);
+            MSP_LD_STAT_R2, r2, &num_r2_values);
+        CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+        ret = ld_calc_get_r2_array(&ld_calc, 0, MSP_DIR_FORWARD, num_sites, DBL_MAX,
+            -1, r2, &num_r2_values);
+        CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+        ret = ld_calc_get_r2_array(&ld_calc, 0, MSP_DIR_FORWARD, num_sites, DBL_MAX,
+            MSP_LD_STAT_R2_MULTIALLELIC + 1, r2, &num_r2_values);
         CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
     }
 
@@ -5326,13 +6001,13 @@ verify_ld(tree_sequence_t *ts)
         j = num_sites / 2;
         x = sites[j + 1].position - sites[j].position;
         ret = ld_calc_get_r2_array(&ld_calc, j, MSP_DIR_FORWARD, num_sites,
-                x, r2, &num_r2_values);
+                x, MSP_LD_STAT_R2, r2, &num_r2_values);
         CU_ASSERT_EQUAL_FATAL(ret, 0);
         CU_ASSERT_EQUAL_FATAL(num_r2_values, 1);
 
         x = sites[j].position - sites[j - 1].position;
         ret = ld_calc_get_r2_array(&ld_calc, j, MSP_DIR_REVERSE, num_sites,
-                x, r2, &num_r2_values);
+                x, MSP_LD_STAT_R2, r2, &num_r2_values);
         CU_ASSERT_EQUAL_FATAL(ret, 0);
         CU_ASSERT_EQUAL_FATAL(num_r2_values, 1);
     }
@@ -5340,7 +6015,7 @@ verify_ld(tree_sequence_t *ts)
     /* Check some error conditions */
     for (j = num_sites; j < num_sites + 2; j++) {
         ret = ld_calc_get_r2_array(&ld_calc, j, MSP_DIR_FORWARD,
-                num_sites, DBL_MAX, r2, &num_r2_values);
+                num_sites, DBL_MAX, MSP_LD_STAT_R2, r2, &num_r2_values);
         CU_ASSERT_EQUAL(ret, MSP_ERR_OUT_OF_BOUNDS);
         ret = ld_calc_get_r2(&ld_calc, j, 0, r2);
         CU_ASSERT_EQUAL(ret, MSP_ERR_OUT_OF_BOUNDS);
@@ -5354,6 +6029,494 @@ verify_ld(tree_sequence_t *ts)
     free(sites);
 }
 
+/* Checks that the bitset and tree based calculations agree for windows
+ * of various sizes. */
+static void
+verify_ld_bitsets(tree_sequence_t *ts)
+{
+    int ret;
+    size_t m = tree_sequence_get_num_sites(ts);
+    size_t max_bitset_sites[] = {1, 2, 5, 64, MSP_LD_DEFAULT_MAX_BITSET_SITES};
+    size_t max_sites[] = {1, 3, 10, 100};
+    int directions[] = {MSP_DIR_FORWARD, MSP_DIR_REVERSE};
+    int statistics[] = {MSP_LD_STAT_R2, MSP_LD_STAT_D, MSP_LD_STAT_D_PRIME,
+        MSP_LD_STAT_R, MSP_LD_STAT_R2_MULTIALLELIC};
+    ld_calc_t tree_calc, bitset_calc;
+    double *r2 = malloc(GSL_MAX(m, 1) * sizeof(double));
+    double *r2_bitset = malloc(GSL_MAX(m, 1) * sizeof(double));
+    double L = tree_sequence_get_sequence_length(ts);
+    double max_distance;
+    size_t j, k, l, a, num_r2, num_r2_bitset;
+    int d, stat;
+
+    CU_ASSERT_FATAL(r2 != NULL && r2_bitset != NULL);
+    ret = ld_calc_alloc(&tree_calc, ts);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = ld_calc_set_max_bitset_sites(&tree_calc, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = ld_calc_alloc(&bitset_calc, ts);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+
+    for (j = 0; j < sizeof(max_bitset_sites) / sizeof(size_t); j++) {
+        ret = ld_calc_set_max_bitset_sites(&bitset_calc, max_bitset_sites[j]);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        for (k = 0; k < sizeof(max_sites) / sizeof(size_t); k++) {
+            max_distance = k % 2 == 0? DBL_MAX: L / 10;
+            for (l = 0; l < 2; l++) {
+                d = directions[l];
+                stat = statistics[(j + k + l) % 5];
+                /* Skip sites so that the cache sees some big jumps */
+                for (a = 0; a < m; a += 1 + (a % 7)) {
+                    ret = ld_calc_get_r2_array(&tree_calc, a, d, max_sites[k],
+                            max_distance, stat, r2, &num_r2);
+                    CU_ASSERT_EQUAL_FATAL(ret, 0);
+                    ret = ld_calc_get_r2_array(&bitset_calc, a, d, max_sites[k],
+                            max_distance, stat, r2_bitset, &num_r2_bitset);
+                    CU_ASSERT_EQUAL_FATAL(ret, 0);
+                    CU_ASSERT_EQUAL_FATAL(num_r2, num_r2_bitset);
+                    CU_ASSERT_EQUAL(memcmp(r2, r2_bitset, num_r2 * sizeof(double)), 0);
+                }
+            }
+        }
+    }
+    ld_calc_print_state(&bitset_calc, _devnull);
+    ld_calc_free(&tree_calc);
+    ld_calc_free(&bitset_calc);
+    free(r2);
+    free(r2_bitset);
+}
+
+/* Checks the LD statistics against values computed directly from the
+ * genotypes of the first few sites. */
+static void
+verify_ld_statistics(tree_sequence_t *ts)
+{
+    int ret;
+    size_t n = tree_sequence_get_sample_size(ts);
+    size_t m = GSL_MIN(tree_sequence_get_num_sites(ts), 50);
+    int statistics[] = {MSP_LD_STAT_R2, MSP_LD_STAT_D, MSP_LD_STAT_D_PRIME,
+        MSP_LD_STAT_R, MSP_LD_STAT_R2_MULTIALLELIC};
+    size_t max_bitset_sites[] = {0, MSP_LD_DEFAULT_MAX_BITSET_SITES};
+    char *genotypes = malloc(GSL_MAX(m * n, 1) * sizeof(char));
+    double *values = malloc(GSL_MAX(m, 1) * sizeof(double));
+    ld_calc_t ld_calc;
+    vargen_t vargen;
+    site_t *site;
+    size_t a, b, j, k, l, num_values;
+    double fA, fB, fAB, D, D_max, x, y;
+
+    CU_ASSERT_FATAL(genotypes != NULL && values != NULL);
+    ret = vargen_alloc(&vargen, ts, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    for (j = 0; j < m; j++) {
+        ret = vargen_next(&vargen, &site, genotypes + j * n);
+        CU_ASSERT_EQUAL_FATAL(ret, 1);
+    }
+    vargen_free(&vargen);
+    ret = ld_calc_alloc(&ld_calc, ts);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+
+    for (l = 0; l < sizeof(max_bitset_sites) / sizeof(size_t); l++) {
+        ret = ld_calc_set_max_bitset_sites(&ld_calc, max_bitset_sites[l]);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        for (j = 0; j < sizeof(statistics) / sizeof(int); j++) {
+            for (a = 0; a < m; a++) {
+                ret = ld_calc_get_r2_array(&ld_calc, a, MSP_DIR_FORWARD, m - a - 1,
+                        DBL_MAX, statistics[j], values, &num_values);
+                CU_ASSERT_EQUAL_FATAL(ret, 0);
+                CU_ASSERT_EQUAL_FATAL(num_values, m - a - 1);
+                for (b = a + 1; b < m; b++) {
+                    fA = 0;
+                    fB = 0;
+                    fAB = 0;
+                    for (k = 0; k < n; k++) {
+                        fA += genotypes[a * n + k];
+                        fB += genotypes[b * n + k];
+                        fAB += genotypes[a * n + k] && genotypes[b * n + k];
+                    }
+                    fA /= (double) n;
+                    fB /= (double) n;
+                    fAB /= (double) n;
+                    D = fAB - fA * fB;
+                    y = D * D / (fA * fB * (1 - fA) * (1 - fB));
+                    if (statistics[j] == MSP_LD_STAT_D) {
+                        y = D;
+                    } else if (statistics[j] == MSP_LD_STAT_D_PRIME) {
+                        D_max = D >= 0? GSL_MIN(fA * (1 - fB), (1 - fA) * fB)
+                            : GSL_MIN(fA * fB, (1 - fA) * (1 - fB));
+                        y = D / D_max;
+                    } else if (statistics[j] == MSP_LD_STAT_R) {
+                        y = D / sqrt(fA * fB * (1 - fA) * (1 - fB));
+                    }
+                    x = values[b - a - 1];
+                    if (isnan(y)) {
+                        CU_ASSERT_FATAL(isnan(x));
+                    } else {
+                        CU_ASSERT_DOUBLE_EQUAL_FATAL(x, y, 1e-9);
+                    }
+                }
+            }
+        }
+    }
+    ld_calc_free(&ld_calc);
+    free(genotypes);
+    free(values);
+}
+
+static void
+test_single_tree_ld_statistics(void)
+{
+    int ret;
+    const char *sites =
+        "0.1    A\n"
+        "0.2    A\n"
+        "0.3    A\n"
+        "0.4    A\n";
+    const char *mutations =
+        "0    4     T\n"
+        "1    0     T\n"
+        "2    4     G\n"  /* Three alleles */
+        "2    2     T\n"
+        "3    5     T\n"
+        "3    3     A\n";  /* Back mutation */
+    int statistics[] = {MSP_LD_STAT_R2, MSP_LD_STAT_D, MSP_LD_STAT_D_PRIME,
+        MSP_LD_STAT_R, MSP_LD_STAT_R2_MULTIALLELIC};
+    /* The values of each statistic for the pairs (0, 1), (0, 2), (0, 3),
+     * (1, 2), (1, 3) and (2, 3) */
+    double s3 = sqrt(3);
+    double expected[5][6] = {
+        {1.0 / 3, 1.0 / 3, 1.0 / 3, 1.0 / 9, 1.0 / 9, 1.0 / 9},
+        {0.125, 0.125, -0.125, 0.0625, -0.0625, 0.0625},
+        {1, 1, -1, 1, -1, 1},
+        {1 / s3, 1 / s3, -1 / s3, 1.0 / 3, -1.0 / 3, 1.0 / 3},
+        {1.0 / 3, 1, 1.0 / 3, 1.0 / 3, 1.0 / 9, 1}};
+    size_t max_bitset_sites[] = {0, MSP_LD_DEFAULT_MAX_BITSET_SITES};
+    double values[4];
+    size_t a, b, j, k, l, num_values;
+    double x;
+    tree_sequence_t ts;
+    ld_calc_t ld_calc;
+
+    tree_sequence_from_text(&ts, single_tree_ex_nodes, single_tree_ex_edgesets, NULL,
+            sites, mutations, NULL);
+    ret = ld_calc_alloc(&ld_calc, &ts);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    for (l = 0; l < 2; l++) {
+        ret = ld_calc_set_max_bitset_sites(&ld_calc, max_bitset_sites[l]);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        for (j = 0; j < 5; j++) {
+            /* Pair (a, b) with a < b is stored at index k */
+            k = 0;
+            for (a = 0; a < 4; a++) {
+                ret = ld_calc_get_r2_array(&ld_calc, a, MSP_DIR_FORWARD, 4, DBL_MAX,
+                        statistics[j], values, &num_values);
+                CU_ASSERT_EQUAL_FATAL(ret, 0);
+                CU_ASSERT_EQUAL_FATAL(num_values, 3 - a);
+                for (b = 0; b < num_values; b++) {
+                    CU_ASSERT_DOUBLE_EQUAL(values[b], expected[j][k], 1e-9);
+                    k++;
+                }
+            }
+            ret = ld_calc_get_r2_array(&ld_calc, 3, MSP_DIR_REVERSE, 4, DBL_MAX,
+                    statistics[j], values, &num_values);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            CU_ASSERT_EQUAL_FATAL(num_values, 3);
+            CU_ASSERT_DOUBLE_EQUAL(values[0], expected[j][5], 1e-9);
+            CU_ASSERT_DOUBLE_EQUAL(values[1], expected[j][4], 1e-9);
+            CU_ASSERT_DOUBLE_EQUAL(values[2], expected[j][2], 1e-9);
+        }
+    }
+    ret = ld_calc_get_r2(&ld_calc, 2, 1, &x);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_DOUBLE_EQUAL(x, 1.0 / 9, 1e-9);
+    ret = ld_calc_get_r2(&ld_calc, 2, 2, &x);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_DOUBLE_EQUAL(x, 1.0, 1e-9);
+
+    ld_calc_free(&ld_calc);
+    tree_sequence_free(&ts);
+}
+
+typedef struct {
+    size_t num_sites;
+    int flags;
+    double threshold;
+    double *result;
+    int *row_counts;
+    size_t num_entries;
+} ld_matrix_test_params_t;
+
+static int
+ld_matrix_test_func(ld_tile_t *tile, void *params)
+{
+    ld_matrix_test_params_t *self = (ld_matrix_test_params_t *) params;
+    size_t m = self->num_sites;
+    size_t j, k, a, b;
+    double x;
+
+    /* CUnit isn't thread safe, so we report problems via the return value */
+    if (tile->num_columns != m || tile->row_start + tile->num_rows > m) {
+        return MSP_ERR_GENERIC;
+    }
+    for (j = 0; j < tile->num_rows; j++) {
+        self->row_counts[tile->row_start + j]++;
+    }
+    if (self->flags & MSP_LD_SPARSE) {
+        for (j = 0; j < tile->num_entries; j++) {
+            a = (size_t) tile->rows[j];
+            b = (size_t) tile->columns[j];
+            if (a < tile->row_start || a >= tile->row_start + tile->num_rows
+                    || b <= a || b >= m) {
+                return MSP_ERR_GENERIC;
+            }
+            if (self->flags & MSP_LD_FLOAT32) {
+                /* Values just above the threshold may round down to it */
+                x = ((float *) tile->values)[j];
+                if (x < (float) self->threshold) {
+                    return MSP_ERR_GENERIC;
+                }
+            } else {
+                x = ((double *) tile->values)[j];
+                if (x <= self->threshold) {
+                    return MSP_ERR_GENERIC;
+                }
+            }
+            self->result[a * m + b] = x;
+        }
+        self->num_entries += tile->num_entries;
+    } else {
+        for (j = 0; j < tile->num_rows; j++) {
+            a = tile->row_start + j;
+            for (k = a; k < m; k++) {
+                if (self->flags & MSP_LD_FLOAT32) {
+                    x = ((float *) tile->values)[j * m + k];
+                } else {
+                    x = ((double *) tile->values)[j * m + k];
+                }
+                self->result[a * m + k] = x;
+            }
+        }
+    }
+    return 0;
+}
+
+static int
+ld_matrix_error_func(ld_tile_t *tile, void *params)
+{
+    return MSP_ERR_GENERIC;
+}
+
+static void
+verify_ld_matrix(tree_sequence_t *ts)
+{
+    int ret;
+    size_t m = tree_sequence_get_num_sites(ts);
+    ld_calc_t ld_calc;
+    ld_matrix_test_params_t params;
+    size_t tile_sizes[] = {1, 3, GSL_MAX(m, 1)};
+    int flags[] = {0, MSP_LD_FLOAT32, MSP_LD_SPARSE, MSP_LD_SPARSE|MSP_LD_FLOAT32};
+    double threshold = 0.25;
+    double *r2 = malloc(GSL_MAX(m, 1) * sizeof(double));
+    double *expected = calloc(GSL_MAX(m * m, 1), sizeof(double));
+    size_t j, k, l, a, b, num_r2_values, num_threads, num_entries;
+    double x, eps;
+
+    memset(&params, 0, sizeof(params));
+    params.num_sites = m;
+    params.threshold = threshold;
+    params.result = malloc(GSL_MAX(m * m, 1) * sizeof(double));
+    params.row_counts = malloc(GSL_MAX(m, 1) * sizeof(int));
+    CU_ASSERT_FATAL(r2 != NULL && expected != NULL && params.result != NULL
+            && params.row_counts != NULL);
+    ret = ld_calc_alloc(&ld_calc, ts);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+
+    num_entries = 0;
+    for (a = 0; a < m; a++) {
+        expected[a * m + a] = 1;
+        ret = ld_calc_get_r2_array(&ld_calc, a, MSP_DIR_FORWARD, m, DBL_MAX,
+                MSP_LD_STAT_R2, r2, &num_r2_values);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        CU_ASSERT_EQUAL_FATAL(num_r2_values, m - a - 1);
+        for (b = a + 1; b < m; b++) {
+            expected[a * m + b] = r2[b - a - 1];
+            num_entries += r2[b - a - 1] > threshold;
+        }
+    }
+
+    for (j = 0; j < sizeof(flags) / sizeof(int); j++) {
+        params.flags = flags[j];
+        eps = flags[j] & MSP_LD_FLOAT32? 1e-6: 0;
+        for (k = 0; k < sizeof(tile_sizes) / sizeof(size_t); k++) {
+            for (num_threads = 1; num_threads <= 3; num_threads++) {
+                /* The workers use the bitset setting of ld_calc */
+                ret = ld_calc_set_max_bitset_sites(&ld_calc,
+                        num_threads == 2? 0: MSP_LD_DEFAULT_MAX_BITSET_SITES);
+                CU_ASSERT_EQUAL_FATAL(ret, 0);
+                memset(params.result, 0, GSL_MAX(m * m, 1) * sizeof(double));
+                memset(params.row_counts, 0, GSL_MAX(m, 1) * sizeof(int));
+                params.num_entries = 0;
+                ret = ld_calc_get_r2_matrix(&ld_calc, tile_sizes[k], num_threads,
+                        flags[j], threshold, ld_matrix_test_func, &params);
+                CU_ASSERT_EQUAL_FATAL(ret, 0);
+                for (a = 0; a < m; a++) {
+                    CU_ASSERT_EQUAL(params.row_counts[a], 1);
+                    for (b = a + (flags[j] & MSP_LD_SPARSE? 1: 0); b < m; b++) {
+                        x = expected[a * m + b];
+                        if ((flags[j] & MSP_LD_SPARSE) && x <= threshold) {
+                            x = 0;
+                        }
+                        CU_ASSERT_DOUBLE_EQUAL(params.result[a * m + b], x, eps);
+                    }
+                }
+                if (flags[j] & MSP_LD_SPARSE) {
+                    CU_ASSERT_EQUAL(params.num_entries, num_entries);
+                }
+            }
+        }
+    }
+
+    /* Errors from the tile function are propagated */
+    for (l = 1; l <= 2; l++) {
+        ret = ld_calc_get_r2_matrix(&ld_calc, 1, l, 0, 0, ld_matrix_error_func, NULL);
+        CU_ASSERT_EQUAL(ret, m == 0? 0: MSP_ERR_GENERIC);
+    }
+    ret = ld_calc_get_r2_matrix(&ld_calc, 0, 1, 0, 0, ld_matrix_test_func, &params);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = ld_calc_get_r2_matrix(&ld_calc, 1, 0, 0, 0, ld_matrix_test_func, &params);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = ld_calc_get_r2_matrix(&ld_calc, 1, 1, 0, 0, NULL, &params);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+
+    ld_calc_free(&ld_calc);
+    free(r2);
+    free(expected);
+    free(params.result);
+    free(params.row_counts);
+}
+
+static size_t
+naive_find_bin(double *breaks, size_t num_bins, double x)
+{
+    size_t j;
+
+    for (j = 0; j < num_bins; j++) {
+        if (breaks[j] <= x && (x < breaks[j + 1]
+                    || (j == num_bins - 1 && x == breaks[j + 1]))) {
+            break;
+        }
+    }
+    return j;
+}
+
+static void
+verify_ld_decay(tree_sequence_t *ts)
+{
+    int ret;
+    size_t n = tree_sequence_get_sample_size(ts);
+    size_t m = tree_sequence_get_num_sites(ts);
+    double L = tree_sequence_get_sequence_length(ts);
+    double distance_breaks[] = {0, L / 20, L / 5, L / 2};
+    double frequency_breaks[] = {0, 0.1, 0.25, 0.5};
+    size_t D = sizeof(distance_breaks) / sizeof(double) - 1;
+    size_t F = sizeof(frequency_breaks) / sizeof(double) - 1;
+    size_t max_sites[] = {GSL_MAX(m, 1), 5};
+    double bad_breaks[] = {0, 1, 1};
+    double negative_breaks[] = {-1, 1};
+    char *genotypes = malloc(n * sizeof(char));
+    size_t *frequency_bin = malloc(GSL_MAX(m, 1) * sizeof(size_t));
+    double *r2 = malloc(GSL_MAX(m, 1) * sizeof(double));
+    double r2_sum[F * D], expected_sum[F * D];
+    uint64_t num_pairs[F * D], expected_pairs[F * D];
+    double *position = ts->sites.position;
+    ld_calc_t ld_calc;
+    vargen_t vargen;
+    site_t *site;
+    size_t a, b, j, k, l, f, num_frequency_bins, num_threads, num_r2_values;
+    double count;
+
+    CU_ASSERT_FATAL(genotypes != NULL && frequency_bin != NULL && r2 != NULL);
+    ret = vargen_alloc(&vargen, ts, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    for (j = 0; j < m; j++) {
+        ret = vargen_next(&vargen, &site, genotypes);
+        CU_ASSERT_EQUAL_FATAL(ret, 1);
+        count = 0;
+        for (k = 0; k < n; k++) {
+            count += genotypes[k] != 0;
+        }
+        count /= (double) n;
+        frequency_bin[j] = naive_find_bin(frequency_breaks, F,
+                GSL_MIN(count, 1 - count));
+    }
+    vargen_free(&vargen);
+    ret = ld_calc_alloc(&ld_calc, ts);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+
+    for (j = 0; j < sizeof(max_sites) / sizeof(size_t); j++) {
+        for (num_frequency_bins = 0; num_frequency_bins <= F;
+                num_frequency_bins += F) {
+            f = GSL_MAX(num_frequency_bins, 1);
+            memset(expected_sum, 0, sizeof(expected_sum));
+            memset(expected_pairs, 0, sizeof(expected_pairs));
+            for (a = 0; a < m; a++) {
+                ret = ld_calc_get_r2_array(&ld_calc, a, MSP_DIR_FORWARD,
+                        max_sites[j], distance_breaks[D], MSP_LD_STAT_R2, r2,
+                        &num_r2_values);
+                CU_ASSERT_EQUAL_FATAL(ret, 0);
+                for (k = 0; k < num_r2_values; k++) {
+                    b = a + k + 1;
+                    l = 0;
+                    if (num_frequency_bins > 0) {
+                        l = GSL_MIN(frequency_bin[a], frequency_bin[b]);
+                        if (frequency_bin[a] == F || frequency_bin[b] == F) {
+                            continue;
+                        }
+                    }
+                    l = l * D + naive_find_bin(distance_breaks, D,
+                            position[b] - position[a]);
+                    if (!isnan(r2[k])) {
+                        expected_sum[l] += r2[k];
+                        expected_pairs[l]++;
+                    }
+                }
+            }
+            for (num_threads = 1; num_threads <= 3; num_threads++) {
+                ret = ld_calc_get_r2_decay(&ld_calc, D, distance_breaks,
+                        num_frequency_bins, frequency_breaks, max_sites[j],
+                        num_threads, r2_sum, num_pairs);
+                CU_ASSERT_EQUAL_FATAL(ret, 0);
+                for (k = 0; k < f * D; k++) {
+                    CU_ASSERT_EQUAL(num_pairs[k], expected_pairs[k]);
+                    CU_ASSERT_DOUBLE_EQUAL(r2_sum[k], expected_sum[k],
+                            1e-9 * GSL_MAX(expected_sum[k], 1));
+                }
+            }
+        }
+    }
+
+    ret = ld_calc_get_r2_decay(&ld_calc, 0, distance_breaks, 0, NULL, 1, 1,
+            r2_sum, num_pairs);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = ld_calc_get_r2_decay(&ld_calc, 2, bad_breaks, 0, NULL, 1, 1,
+            r2_sum, num_pairs);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = ld_calc_get_r2_decay(&ld_calc, 1, negative_breaks, 0, NULL, 1, 1,
+            r2_sum, num_pairs);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = ld_calc_get_r2_decay(&ld_calc, 1, distance_breaks, 2, bad_breaks, 1, 1,
+            r2_sum, num_pairs);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = ld_calc_get_r2_decay(&ld_calc, 1, distance_breaks, 0, NULL, 1, 0,
+            r2_sum, num_pairs);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+
+    ld_calc_free(&ld_calc);
+    free(genotypes);
+    free(frequency_bin);
+    free(r2);
+}
+
 static void
 test_ld_from_examples(void)
 {
@@ -5362,10 +6525,13 @@ test_ld_from_examples(void)
 
     CU_ASSERT_FATAL(examples != NULL);
     for (j = 0; examples[j] != NULL; j++) {
-        /* j = 4 corresponds to the recurrent mutation case where we
-         * trigger an assert */
-        if (j != 4) {
-            verify_ld(examples[j]);
+        verify_ld(examples[j]);
+        verify_ld_bitsets(examples[j]);
+        verify_ld_statistics(examples[j]);
+        /* The full matrix is quadratic in the number of sites */
+        if (tree_sequence_get_num_sites(examples[j]) < 2000) {
+            verify_ld_matrix(examples[j]);
+            verify_ld_decay(examples[j]);
         }
         tree_sequence_free(examples[j]);
         free(examples[j]);
@@ -5415,49 +6581,1224 @@ test_stats_from_examples(void)
     free(examples);
 }
 
-static void
-verify_simplify_errors(tree_sequence_t *ts)
+/* Weight function for testing the generic branch stats engine. With sets
+ * {a}, {b} and C, the outputs are the divergence between a and b, the
+ * heterozygosity of C and the total branch length. */
+static int
+branch_stat_test_weights(size_t num_rows, size_t num_sample_sets, double *counts,
+        size_t num_outputs, double *weights, void *params)
 {
-    int ret;
-    node_id_t *s;
-    node_id_t u;
-    tree_sequence_t subset;
-    node_id_t sample[2] = {};
-
-    ret = tree_sequence_get_samples(ts, &s);
-    CU_ASSERT_EQUAL_FATAL(ret, 0);
-    memcpy(sample, s, 2 * sizeof(node_id_t));
+    size_t j;
+    double *x;
+    double n = *((double *) params);
 
-    ret = tree_sequence_simplify(ts, sample, 0, 0, &subset);
-    CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_BAD_PARAM_VALUE);
-    ret = tree_sequence_simplify(ts, sample, 1, 0, &subset);
-    CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_BAD_PARAM_VALUE);
-    for (u = 0; u < (node_id_t) tree_sequence_get_num_nodes(ts); u++) {
-        if (! tree_sequence_is_sample(ts, u)) {
-            sample[1] = u;
-            ret = tree_sequence_simplify(ts, sample, 2, 0, &subset);
-            CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_BAD_SAMPLES);
-        }
+    CU_ASSERT_FATAL(num_sample_sets == 3);
+    CU_ASSERT_FATAL(num_outputs == 3);
+    for (j = 0; j < num_rows; j++) {
+        x = counts + j * num_sample_sets;
+        weights[3 * j] = fabs(x[0] - x[1]);
+        weights[3 * j + 1] = x[2] * (n - x[2]);
+        weights[3 * j + 2] = 1.0;
     }
-    sample[0] = -1;
-    ret = tree_sequence_simplify(ts, sample, 2, 0, &subset);
-    CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_OUT_OF_BOUNDS);
-    sample[0] = s[0];
-    sample[1] = s[0];
-    ret = tree_sequence_simplify(ts, sample, 2, 0, &subset);
-    CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_DUPLICATE_SAMPLE);
+    return 0;
 }
 
-static void
-test_simplify_from_examples(void)
+static int
+branch_stat_error_weights(size_t num_rows, size_t num_sample_sets, double *counts,
+        size_t num_outputs, double *weights, void *params)
 {
-    tree_sequence_t **examples = get_example_tree_sequences(1);
-    uint32_t j;
+    return MSP_ERR_GENERIC;
+}
 
-    CU_ASSERT_FATAL(examples != NULL);
-    for (j = 0; examples[j] != NULL; j++) {
-        verify_simplify(examples[j]);
-        verify_simplify_errors(examples[j]);
+/* Computes the branch stats by iterating over every node in every tree. */
+static void
+get_naive_branch_stats(tree_sequence_t *ts, size_t num_sample_sets,
+        size_t *sample_set_sizes, node_id_t *sample_sets, size_t num_windows,
+        double *windows, size_t num_outputs, branch_stat_weight_func_t weight_func,
+        void *params, double *result)
+{
+    int ret;
+    size_t num_nodes = tree_sequence_get_num_nodes(ts);
+    double *counts = malloc(num_nodes * num_sample_sets * sizeof(double));
+    double *weights = malloc(num_nodes * num_outputs * sizeof(double));
+    sparse_tree_t tree;
+    size_t j, k, m, w, offset;
+    node_id_t u, v;
+    double left, right, length;
+
+    CU_ASSERT_FATAL(counts != NULL && weights != NULL);
+    memset(result, 0, num_windows * num_outputs * sizeof(double));
+    ret = sparse_tree_alloc(&tree, ts, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    for (ret = sparse_tree_first(&tree); ret == 1; ret = sparse_tree_next(&tree)) {
+        memset(counts, 0, num_nodes * num_sample_sets * sizeof(double));
+        offset = 0;
+        for (k = 0; k < num_sample_sets; k++) {
+            for (j = 0; j < sample_set_sizes[k]; j++) {
+                for (u = sample_sets[offset + j]; u != MSP_NULL_NODE;
+                        u = tree.parent[u]) {
+                    counts[(size_t) u * num_sample_sets + k]++;
+                }
+            }
+            offset += sample_set_sizes[k];
+        }
+        ret = weight_func(num_nodes, num_sample_sets, counts, num_outputs, weights,
+                params);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        for (w = 0; w < num_windows; w++) {
+            left = GSL_MAX(tree.left, windows[w]);
+            right = GSL_MIN(tree.right, windows[w + 1]);
+            if (right <= left) {
+                continue;
+            }
+            for (u = 0; u < (node_id_t) num_nodes; u++) {
+                v = tree.parent[u];
+                if (v != MSP_NULL_NODE) {
+                    length = tree.time[v] - tree.time[u];
+                    for (m = 0; m < num_outputs; m++) {
+                        result[w * num_outputs + m] += (right - left) * length
+                            * weights[(size_t) u * num_outputs + m];
+                    }
+                }
+            }
+        }
+    }
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    for (w = 0; w < num_windows; w++) {
+        for (m = 0; m < num_outputs; m++) {
+            result[w * num_outputs + m] /= windows[w + 1] - windows[w];
+        }
+    }
+    sparse_tree_free(&tree);
+    free(counts);
+    free(weights);
+}
+
+static void
+verify_branch_stats(tree_sequence_t *ts)
+{
+    int ret;
+    size_t n = tree_sequence_get_sample_size(ts);
+    double L = tree_sequence_get_sequence_length(ts);
+    double windows[] = {0, L / 5, L / 3, L / 2, 3 * L / 4, L};
+    double bad_windows[] = {0, L / 2, L / 2, L};
+    size_t num_windows[] = {1, 5, 1};
+    double *window_arrays[] = {NULL, windows, NULL};
+    double tree_windows[] = {0, 0, L};
+    size_t sample_set_sizes[3];
+    node_id_t *sample_sets = malloc((n + 2) * sizeof(node_id_t));
+    node_id_t *samples;
+    double result[15], naive[15], result2[15];
+    double full_window[] = {0, L};
+    double params = (double) (n / 2);
+    uint32_t set_indexes[4];
+    size_t j, k, m;
+    sparse_tree_t tree;
+
+    CU_ASSERT_FATAL(sample_sets != NULL);
+    ret = tree_sequence_get_samples(ts, &samples);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    /* Sets {s0}, {s1} and the first half of the samples */
+    sample_set_sizes[0] = 1;
+    sample_set_sizes[1] = 1;
+    sample_set_sizes[2] = n / 2;
+    sample_sets[0] = samples[0];
+    sample_sets[1] = samples[1];
+    memcpy(sample_sets + 2, samples, (n / 2) * sizeof(node_id_t));
+
+    /* Windows at the first breakpoint */
+    ret = sparse_tree_alloc(&tree, ts, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = sparse_tree_first(&tree);
+    CU_ASSERT_EQUAL_FATAL(ret, 1);
+    tree_windows[1] = tree.right;
+    num_windows[2] = tree.right < L? 2: 1;
+    sparse_tree_free(&tree);
+    window_arrays[0] = full_window;
+    window_arrays[2] = num_windows[2] == 2? tree_windows: full_window;
+
+    for (j = 0; j < 3; j++) {
+        ret = tree_sequence_get_branch_stats(ts, 3, sample_set_sizes, sample_sets,
+                num_windows[j], window_arrays[j], 3, branch_stat_test_weights,
+                &params, result);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        get_naive_branch_stats(ts, 3, sample_set_sizes, sample_sets,
+                num_windows[j], window_arrays[j], 3, branch_stat_test_weights,
+                &params, naive);
+        for (k = 0; k < 3 * num_windows[j]; k++) {
+            CU_ASSERT_DOUBLE_EQUAL(result[k], naive[k], 1e-6 * GSL_MAX(1, naive[k]));
+        }
+        /* Divergence between singletons is the first output */
+        set_indexes[0] = 0;
+        set_indexes[1] = 1;
+        ret = tree_sequence_get_branch_stat(ts, MSP_STAT_DIVERGENCE, 3,
+                sample_set_sizes, sample_sets, 1, set_indexes, num_windows[j],
+                window_arrays[j], result2);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        for (k = 0; k < num_windows[j]; k++) {
+            CU_ASSERT_DOUBLE_EQUAL(result2[k], naive[3 * k],
+                    1e-6 * GSL_MAX(1, naive[3 * k]));
+        }
+        /* So is F2, and diversity within {s0, s1} */
+        ret = tree_sequence_get_branch_stat(ts, MSP_STAT_F2, 3,
+                sample_set_sizes, sample_sets, 1, set_indexes, num_windows[j],
+                window_arrays[j], result2);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        for (k = 0; k < num_windows[j]; k++) {
+            CU_ASSERT_DOUBLE_EQUAL(result2[k], naive[3 * k],
+                    1e-6 * GSL_MAX(1, naive[3 * k]));
+        }
+        if (n >= 4) {
+            set_indexes[0] = 2;
+            ret = tree_sequence_get_branch_stat(ts, MSP_STAT_DIVERSITY, 3,
+                    sample_set_sizes, sample_sets, 1, set_indexes, num_windows[j],
+                    window_arrays[j], result2);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            for (k = 0; k < num_windows[j]; k++) {
+                m = n / 2;
+                CU_ASSERT_DOUBLE_EQUAL(result2[k],
+                        2 * naive[3 * k + 1] / (double) (m * (m - 1)),
+                        1e-6 * GSL_MAX(1, result2[k]));
+            }
+        }
+    }
+
+    if (n >= 4) {
+        /* Sets {s0}, {s1}, {s2}, {s3}, {s0, s1} */
+        sample_set_sizes[0] = 1;
+        memcpy(sample_sets, samples, 4 * sizeof(node_id_t));
+        memcpy(sample_sets + 4, samples, 2 * sizeof(node_id_t));
+        {
+            size_t sizes[] = {1, 1, 1, 1, 2};
+            uint32_t diversity_indexes[] = {4};
+            uint32_t f3_indexes[] = {0, 1, 2};
+            uint32_t f4_indexes[] = {0, 1, 0, 2};
+            uint32_t y2_indexes[] = {2, 4};
+            uint32_t y3_indexes[] = {2, 0, 1};
+            uint32_t pair_indexes[] = {0, 1};
+
+            ret = tree_sequence_get_branch_stat(ts, MSP_STAT_DIVERSITY, 5, sizes,
+                    sample_sets, 1, diversity_indexes, 5, windows, result);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            ret = tree_sequence_get_branch_stat(ts, MSP_STAT_DIVERGENCE, 5, sizes,
+                    sample_sets, 1, pair_indexes, 5, windows, result2);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            for (k = 0; k < 5; k++) {
+                CU_ASSERT_DOUBLE_EQUAL(result[k], result2[k],
+                        1e-6 * GSL_MAX(1, result[k]));
+            }
+            ret = tree_sequence_get_branch_stat(ts, MSP_STAT_F3, 5, sizes,
+                    sample_sets, 1, f3_indexes, 5, windows, result);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            ret = tree_sequence_get_branch_stat(ts, MSP_STAT_F4, 5, sizes,
+                    sample_sets, 1, f4_indexes, 5, windows, result2);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            for (k = 0; k < 5; k++) {
+                CU_ASSERT_DOUBLE_EQUAL(result[k], result2[k],
+                        1e-6 * GSL_MAX(1, fabs(result[k])));
+            }
+            ret = tree_sequence_get_branch_stat(ts, MSP_STAT_Y2, 5, sizes,
+                    sample_sets, 1, y2_indexes, 5, windows, result);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            ret = tree_sequence_get_branch_stat(ts, MSP_STAT_Y3, 5, sizes,
+                    sample_sets, 1, y3_indexes, 5, windows, result2);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            for (k = 0; k < 5; k++) {
+                CU_ASSERT_DOUBLE_EQUAL(result[k], result2[k],
+                        1e-6 * GSL_MAX(1, result[k]));
+            }
+            /* Y2 needs two samples in the second set */
+            y2_indexes[1] = 0;
+            ret = tree_sequence_get_branch_stat(ts, MSP_STAT_Y2, 5, sizes,
+                    sample_sets, 1, y2_indexes, 5, windows, result);
+            CU_ASSERT_EQUAL(ret, MSP_ERR_INSUFFICIENT_SAMPLES);
+        }
+        sample_set_sizes[0] = 1;
+        sample_set_sizes[1] = 1;
+        sample_set_sizes[2] = n / 2;
+        sample_sets[0] = samples[0];
+        sample_sets[1] = samples[1];
+        memcpy(sample_sets + 2, samples, (n / 2) * sizeof(node_id_t));
+    }
+
+    /* Errors */
+    ret = tree_sequence_get_branch_stats(ts, 3, sample_set_sizes, sample_sets,
+            0, windows, 3, branch_stat_test_weights, &params, result);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_WINDOWS);
+    ret = tree_sequence_get_branch_stats(ts, 3, sample_set_sizes, sample_sets,
+            3, bad_windows, 3, branch_stat_test_weights, &params, result);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_WINDOWS);
+    ret = tree_sequence_get_branch_stats(ts, 3, sample_set_sizes, sample_sets,
+            4, windows, 3, branch_stat_test_weights, &params, result);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_WINDOWS);
+    ret = tree_sequence_get_branch_stats(ts, 3, sample_set_sizes, sample_sets,
+            4, windows + 1, 3, branch_stat_test_weights, &params, result);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_WINDOWS);
+    ret = tree_sequence_get_branch_stats(ts, 0, sample_set_sizes, sample_sets,
+            5, windows, 3, branch_stat_test_weights, &params, result);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = tree_sequence_get_branch_stats(ts, 3, sample_set_sizes, sample_sets,
+            5, windows, 0, branch_stat_test_weights, &params, result);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = tree_sequence_get_branch_stats(ts, 3, sample_set_sizes, sample_sets,
+            5, windows, 3, branch_stat_error_weights, &params, result);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_GENERIC);
+    sample_sets[1] = (node_id_t) tree_sequence_get_num_nodes(ts);
+    ret = tree_sequence_get_branch_stats(ts, 3, sample_set_sizes, sample_sets,
+            5, windows, 3, branch_stat_test_weights, &params, result);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_OUT_OF_BOUNDS);
+    sample_sets[1] = samples[1];
+    if (n >= 4) {
+        sample_sets[3] = sample_sets[2];
+        ret = tree_sequence_get_branch_stats(ts, 3, sample_set_sizes, sample_sets,
+                5, windows, 3, branch_stat_test_weights, &params, result);
+        CU_ASSERT_EQUAL(ret, MSP_ERR_DUPLICATE_SAMPLE);
+        sample_sets[3] = samples[1];
+    }
+    set_indexes[0] = 0;
+    set_indexes[1] = 1;
+    ret = tree_sequence_get_branch_stat(ts, -1, 3, sample_set_sizes, sample_sets,
+            1, set_indexes, 5, windows, result);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    set_indexes[1] = 3;
+    ret = tree_sequence_get_branch_stat(ts, MSP_STAT_DIVERGENCE, 3,
+            sample_set_sizes, sample_sets, 1, set_indexes, 5, windows, result);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_OUT_OF_BOUNDS);
+    ret = tree_sequence_get_branch_stat(ts, MSP_STAT_DIVERSITY, 3,
+            sample_set_sizes, sample_sets, 1, set_indexes, 5, windows, result);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_INSUFFICIENT_SAMPLES);
+    CU_ASSERT_EQUAL(branch_stat_get_arity(MSP_STAT_F4), 4);
+    CU_ASSERT_EQUAL(branch_stat_get_arity(-1), 0);
+
+    free(sample_sets);
+}
+
+static void
+test_branch_stats_from_examples(void)
+{
+    tree_sequence_t **examples = get_example_tree_sequences(1);
+    uint32_t j;
+
+    CU_ASSERT_FATAL(examples != NULL);
+    for (j = 0; examples[j] != NULL; j++) {
+        verify_branch_stats(examples[j]);
+        tree_sequence_free(examples[j]);
+        free(examples[j]);
+    }
+    free(examples);
+}
+
+static void
+verify_tracked_sample_sets(tree_sequence_t *ts)
+{
+    int ret;
+    size_t n = tree_sequence_get_sample_size(ts);
+    size_t num_nodes = tree_sequence_get_num_nodes(ts);
+    node_id_t *samples;
+    node_id_t *sets = malloc(2 * n * sizeof(node_id_t));
+    size_t set_sizes[2];
+    sparse_tree_t tree;
+    node_id_t u;
+
+    CU_ASSERT_FATAL(sets != NULL);
+    ret = tree_sequence_get_samples(ts, &samples);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    /* The first half of the samples and all samples */
+    set_sizes[0] = n / 2;
+    set_sizes[1] = n;
+    memcpy(sets, samples, (n / 2) * sizeof(node_id_t));
+    memcpy(sets + n / 2, samples, n * sizeof(node_id_t));
+
+    ret = sparse_tree_alloc(&tree, ts, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = sparse_tree_set_tracked_sample_sets(&tree, 2, set_sizes, sets);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_UNSUPPORTED_OPERATION);
+    sparse_tree_free(&tree);
+
+    ret = sparse_tree_alloc(&tree, ts, MSP_LEAF_COUNTS);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = sparse_tree_set_tracked_sample_sets(&tree, 0, set_sizes, sets);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    sets[n / 2] = (node_id_t) num_nodes;
+    ret = sparse_tree_set_tracked_sample_sets(&tree, 2, set_sizes, sets);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_OUT_OF_BOUNDS);
+    sets[n / 2] = sets[n / 2 + 1];
+    ret = sparse_tree_set_tracked_sample_sets(&tree, 2, set_sizes, sets);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_DUPLICATE_SAMPLE);
+    sets[n / 2] = samples[0];
+    if (num_nodes > n) {
+        /* Samples come first, so the last node is not a sample */
+        sets[n / 2] = (node_id_t) num_nodes - 1;
+        if (!tree_sequence_is_sample(ts, sets[n / 2])) {
+            ret = sparse_tree_set_tracked_sample_sets(&tree, 2, set_sizes, sets);
+            CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_SAMPLES);
+        }
+        sets[n / 2] = samples[0];
+    }
+
+    ret = sparse_tree_set_tracked_leaves(&tree, n / 2, samples);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = sparse_tree_set_tracked_sample_sets(&tree, 2, set_sizes, sets);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_EQUAL(tree.num_tracked_sets, 2);
+    for (ret = sparse_tree_first(&tree); ret == 1; ret = sparse_tree_next(&tree)) {
+        for (u = 0; u < (node_id_t) num_nodes; u++) {
+            CU_ASSERT_EQUAL(tree.tracked_set_counts[2 * u], tree.num_tracked_leaves[u]);
+            CU_ASSERT_EQUAL(tree.tracked_set_counts[2 * u + 1], tree.num_leaves[u]);
+        }
+    }
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    for (ret = sparse_tree_last(&tree); ret == 1; ret = sparse_tree_prev(&tree)) {
+        for (u = 0; u < (node_id_t) num_nodes; u++) {
+            CU_ASSERT_EQUAL(tree.tracked_set_counts[2 * u], tree.num_tracked_leaves[u]);
+            CU_ASSERT_EQUAL(tree.tracked_set_counts[2 * u + 1], tree.num_leaves[u]);
+        }
+    }
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    sparse_tree_free(&tree);
+    free(sets);
+}
+
+static void
+verify_site_stats(tree_sequence_t *ts)
+{
+    int ret;
+    size_t n = tree_sequence_get_sample_size(ts);
+    double L = tree_sequence_get_sequence_length(ts);
+    double windows[] = {0, L / 4, L / 2, L};
+    size_t W = 3;
+    size_t K = 3;
+    size_t sfs_width = n + 1;
+    int stats[] = {MSP_SITE_STAT_TAJIMAS_D, MSP_SITE_STAT_DIVERSITY,
+        MSP_SITE_STAT_SEGREGATING_SITES};
+    size_t set_sizes[3];
+    node_id_t *sets = malloc(3 * n * sizeof(node_id_t));
+    int *membership = malloc(n * K * sizeof(int));
+    char *genotypes = malloc(n * sizeof(char));
+    double *result = malloc(W * 3 * K * sizeof(double));
+    double *divergence = malloc(W * K * K * sizeof(double));
+    double *sfs = malloc(W * K * sfs_width * sizeof(double));
+    double *pi = calloc(W * K, sizeof(double));
+    double *segsites = calloc(W * K, sizeof(double));
+    double *naive_divergence = calloc(W * K * K, sizeof(double));
+    double *naive_sfs = calloc(W * K * sfs_width, sizeof(double));
+    double counts[3][2], site_pi[3], x;
+    node_id_t *samples;
+    vargen_t vargen;
+    site_t *site;
+    size_t j, k, l, w, offset;
+    list_len_t m;
+    char ancestral, derived_present;
+
+    CU_ASSERT_FATAL(sets != NULL && membership != NULL && genotypes != NULL
+            && result != NULL && divergence != NULL && sfs != NULL && pi != NULL
+            && segsites != NULL && naive_divergence != NULL && naive_sfs != NULL);
+    ret = tree_sequence_get_samples(ts, &samples);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    /* All samples, the second half and those with even index */
+    memset(membership, 0, n * K * sizeof(int));
+    offset = 0;
+    set_sizes[0] = n;
+    set_sizes[1] = n - n / 2;
+    set_sizes[2] = (n + 1) / 2;
+    for (j = 0; j < n; j++) {
+        sets[offset++] = samples[j];
+        membership[j * K] = 1;
+    }
+    for (j = n / 2; j < n; j++) {
+        sets[offset++] = samples[j];
+        membership[j * K + 1] = 1;
+    }
+    for (j = 0; j < n; j += 2) {
+        sets[offset++] = samples[j];
+        membership[j * K + 2] = 1;
+    }
+
+    ret = tree_sequence_get_site_stats(ts, K, set_sizes, sets, W, windows, 3, stats,
+            1, result, divergence, sfs);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+
+    ret = vargen_alloc(&vargen, ts, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    w = 0;
+    while ((ret = vargen_next(&vargen, &site, genotypes)) == 1) {
+        while (site->position >= windows[w + 1]) {
+            w++;
+        }
+        ancestral = (char) (site->ancestral_state[0] - '0');
+        derived_present = 0;
+        for (m = 0; m < site->mutations_length; m++) {
+            if (site->mutations[m].derived_state[0] - '0' != ancestral) {
+                derived_present = 1;
+            }
+        }
+        memset(counts, 0, sizeof(counts));
+        for (j = 0; j < n; j++) {
+            for (k = 0; k < K; k++) {
+                counts[k][(int) genotypes[j]] += membership[j * K + k];
+            }
+        }
+        for (k = 0; k < K; k++) {
+            x = (double) set_sizes[k];
+            site_pi[k] = 0;
+            if (x > 1) {
+                site_pi[k] = 2 * counts[k][0] * counts[k][1] / (x * (x - 1));
+            }
+            pi[w * K + k] += site_pi[k];
+            segsites[w * K + k] += counts[k][0] > 0 && counts[k][1] > 0;
+            if (derived_present) {
+                naive_sfs[(w * K + k) * sfs_width
+                    + (size_t) counts[k][1 - (int) ancestral]] += 1;
+            }
+            for (l = 0; l < K; l++) {
+                if (k == l) {
+                    naive_divergence[(w * K + k) * K + l] += site_pi[k];
+                } else {
+                    naive_divergence[(w * K + k) * K + l] +=
+                        (counts[k][0] * counts[l][1] + counts[k][1] * counts[l][0])
+                        / (x * (double) set_sizes[l]);
+                }
+            }
+        }
+    }
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    vargen_free(&vargen);
+
+    for (w = 0; w < W; w++) {
+        for (k = 0; k < K; k++) {
+            CU_ASSERT_DOUBLE_EQUAL(result[(w * 3 + 1) * K + k], pi[w * K + k],
+                    1e-9 * GSL_MAX(fabs(pi[w * K + k]), 1));
+            CU_ASSERT_EQUAL(result[(w * 3 + 2) * K + k], segsites[w * K + k]);
+            x = result[(w * 3) * K + k];
+            if (set_sizes[k] < 3 || segsites[w * K + k] == 0) {
+                CU_ASSERT(gsl_isnan(x));
+            } else {
+                CU_ASSERT(!gsl_isnan(x));
+            }
+            for (l = 0; l < K; l++) {
+                CU_ASSERT_DOUBLE_EQUAL(divergence[(w * K + k) * K + l],
+                        naive_divergence[(w * K + k) * K + l],
+                        1e-9 * GSL_MAX(fabs(naive_divergence[(w * K + k) * K + l]), 1));
+            }
+            for (j = 0; j < sfs_width; j++) {
+                CU_ASSERT_EQUAL(sfs[(w * K + k) * sfs_width + j],
+                        naive_sfs[(w * K + k) * sfs_width + j]);
+            }
+        }
+    }
+    /* The single window totals match the existing pairwise diversity. */
+    if (n > 1) {
+        ret = tree_sequence_get_pairwise_diversity(ts, samples, n, &x);
+        if (ret == 0) {
+            CU_ASSERT_DOUBLE_EQUAL(x, pi[0] + pi[K] + pi[2 * K],
+                    1e-9 * GSL_MAX(fabs(x), 1));
+        } else {
+            CU_ASSERT_EQUAL(ret, MSP_ERR_UNSUPPORTED_OPERATION);
+        }
+    }
+    /* Without the optional outputs */
+    ret = tree_sequence_get_site_stats(ts, K, set_sizes, sets, W, windows, 1,
+            stats + 1, 1, result, NULL, NULL);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    for (w = 0; w < W; w++) {
+        for (k = 0; k < K; k++) {
+            CU_ASSERT_DOUBLE_EQUAL(result[w * K + k], pi[w * K + k],
+                    1e-9 * GSL_MAX(fabs(pi[w * K + k]), 1));
+        }
+    }
+    /* The results don't depend on the number of threads */
+    for (j = 2; j <= 16; j *= 2) {
+        ret = tree_sequence_get_site_stats(ts, K, set_sizes, sets, W, windows, 3,
+                stats, j, result, divergence, sfs);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        for (w = 0; w < W; w++) {
+            for (k = 0; k < K; k++) {
+                CU_ASSERT_DOUBLE_EQUAL(result[(w * 3 + 1) * K + k], pi[w * K + k],
+                        1e-9 * GSL_MAX(fabs(pi[w * K + k]), 1));
+                CU_ASSERT_EQUAL(result[(w * 3 + 2) * K + k], segsites[w * K + k]);
+                for (l = 0; l < K; l++) {
+                    CU_ASSERT_DOUBLE_EQUAL(divergence[(w * K + k) * K + l],
+                            naive_divergence[(w * K + k) * K + l],
+                            1e-9 * GSL_MAX(fabs(naive_divergence[(w * K + k) * K + l]), 1));
+                }
+            }
+        }
+        for (l = 0; l < W * K * sfs_width; l++) {
+            CU_ASSERT_EQUAL(sfs[l], naive_sfs[l]);
+        }
+    }
+
+    /* Errors */
+    ret = tree_sequence_get_site_stats(ts, 0, set_sizes, sets, W, windows, 3, stats,
+            1, result, NULL, NULL);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = tree_sequence_get_site_stats(ts, K, set_sizes, sets, 0, windows, 3, stats,
+            1, result, NULL, NULL);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_WINDOWS);
+    ret = tree_sequence_get_site_stats(ts, K, set_sizes, sets, W - 1, windows, 3,
+            stats, 1, result, NULL, NULL);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_WINDOWS);
+    ret = tree_sequence_get_site_stats(ts, K, set_sizes, sets, W, windows, 3,
+            stats, 0, result, NULL, NULL);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    stats[0] = -1;
+    ret = tree_sequence_get_site_stats(ts, K, set_sizes, sets, W, windows, 3, stats,
+            1, result, NULL, NULL);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    stats[0] = MSP_SITE_STAT_TAJIMAS_D;
+    set_sizes[1] = 0;
+    ret = tree_sequence_get_site_stats(ts, K, set_sizes, sets, W, windows, 3, stats,
+            1, result, NULL, NULL);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    set_sizes[1] = n - n / 2;
+    sets[0] = sets[1];
+    ret = tree_sequence_get_site_stats(ts, K, set_sizes, sets, W, windows, 3, stats,
+            1, result, NULL, NULL);
+    CU_ASSERT_EQUAL(ret, n > 1? MSP_ERR_DUPLICATE_SAMPLE: 0);
+
+    free(sets);
+    free(membership);
+    free(genotypes);
+    free(result);
+    free(divergence);
+    free(sfs);
+    free(pi);
+    free(segsites);
+    free(naive_divergence);
+    free(naive_sfs);
+}
+
+static void
+verify_sfs(tree_sequence_t *ts)
+{
+    int ret;
+    size_t n = tree_sequence_get_sample_size(ts);
+    double L = tree_sequence_get_sequence_length(ts);
+    double windows[] = {0, L / 3, L};
+    size_t W = 2;
+    size_t set_sizes[2];
+    size_t size, total, j, k, w, index;
+    int flags;
+    char *genotypes = malloc(n * sizeof(char));
+    node_id_t *samples;
+    double *sfs, *naive_sfs;
+    double counts[2];
+    bool fold;
+    vargen_t vargen;
+    site_t *site;
+    list_len_t m;
+    char ancestral, derived_present;
+
+    CU_ASSERT_FATAL(genotypes != NULL);
+    ret = tree_sequence_get_samples(ts, &samples);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    /* The first n / 2 samples and the remainder. */
+    set_sizes[0] = GSL_MAX(1, n / 2);
+    set_sizes[1] = n - set_sizes[0];
+    size = tree_sequence_get_sfs_size(2, set_sizes);
+    CU_ASSERT_EQUAL(size, (set_sizes[0] + 1) * (set_sizes[1] + 1));
+    CU_ASSERT_EQUAL(tree_sequence_get_sfs_size(1, &n), n + 1);
+    sfs = malloc(W * size * sizeof(double));
+    naive_sfs = malloc(W * size * sizeof(double));
+    CU_ASSERT_FATAL(sfs != NULL && naive_sfs != NULL);
+
+    for (flags = 0; flags <= MSP_SFS_FOLDED; flags += MSP_SFS_FOLDED) {
+        /* The joint SFS, with the one-way SFS of all samples in the
+         * second pass. */
+        for (k = 2; k >= 1; k--) {
+            if (k == 2 && set_sizes[1] == 0) {
+                continue;
+            }
+            if (k == 1) {
+                set_sizes[0] = n;
+                size = n + 1;
+            }
+            ret = tree_sequence_get_sfs(ts, k, set_sizes, samples, W, windows, flags,
+                    sfs);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+
+            memset(naive_sfs, 0, W * size * sizeof(double));
+            ret = vargen_alloc(&vargen, ts, 0);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            w = 0;
+            while ((ret = vargen_next(&vargen, &site, genotypes)) == 1) {
+                while (site->position >= windows[w + 1]) {
+                    w++;
+                }
+                ancestral = (char) (site->ancestral_state[0] - '0');
+                derived_present = 0;
+                for (m = 0; m < site->mutations_length; m++) {
+                    if (site->mutations[m].derived_state[0] - '0' != ancestral) {
+                        derived_present = 1;
+                    }
+                }
+                if (!derived_present) {
+                    continue;
+                }
+                counts[0] = 0;
+                counts[1] = 0;
+                for (j = 0; j < n; j++) {
+                    counts[j < set_sizes[0]? 0: 1] += genotypes[j] != ancestral;
+                }
+                fold = flags && 2 * (counts[0] + counts[1]) > (double) n;
+                index = 0;
+                for (j = 0; j < k; j++) {
+                    if (fold) {
+                        counts[j] = (double) set_sizes[j] - counts[j];
+                    }
+                    index = index * (set_sizes[j] + 1) + (size_t) counts[j];
+                }
+                naive_sfs[w * size + index] += 1;
+            }
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            vargen_free(&vargen);
+            for (j = 0; j < W * size; j++) {
+                CU_ASSERT_EQUAL(sfs[j], naive_sfs[j]);
+            }
+            total = 0;
+            for (j = 0; j < W * size; j++) {
+                total += (size_t) sfs[j];
+            }
+            CU_ASSERT(total <= tree_sequence_get_num_mutations(ts));
+        }
+        set_sizes[0] = GSL_MAX(1, n / 2);
+        size = tree_sequence_get_sfs_size(2, set_sizes);
+    }
+
+    /* Errors */
+    ret = tree_sequence_get_sfs(ts, 0, set_sizes, samples, W, windows, 0, sfs);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = tree_sequence_get_sfs(ts, 1, set_sizes, samples, 0, windows, 0, sfs);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_WINDOWS);
+    windows[1] = L;
+    ret = tree_sequence_get_sfs(ts, 1, set_sizes, samples, W, windows, 0, sfs);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_WINDOWS);
+    set_sizes[0] = 0;
+    ret = tree_sequence_get_sfs(ts, 1, set_sizes, samples, 1, windows, 0, sfs);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+
+    free(genotypes);
+    free(sfs);
+    free(naive_sfs);
+}
+
+static void
+verify_branch_length_counts(sparse_tree_t *tree, double *expected)
+{
+    tree_sequence_t *ts = tree->tree_sequence;
+    size_t n = tree->sample_size;
+    double total = 0;
+    double length;
+    node_id_t u, v;
+    size_t k;
+
+    memset(expected, 0, (n + 1) * sizeof(double));
+    for (u = 0; u < (node_id_t) tree->num_nodes; u++) {
+        v = tree->parent[u];
+        if (v != MSP_NULL_NODE) {
+            length = ts->nodes.time[v] - ts->nodes.time[u];
+            expected[tree->num_leaves[u]] += length;
+            total += length;
+        }
+    }
+    for (k = 0; k <= n; k++) {
+        CU_ASSERT_DOUBLE_EQUAL(tree->branch_length_by_count[k], expected[k], 1e-9);
+    }
+    CU_ASSERT_DOUBLE_EQUAL(tree->total_branch_length, total, 1e-9);
+}
+
+static void
+verify_branch_sfs(tree_sequence_t *ts)
+{
+    int ret;
+    size_t n = tree_sequence_get_sample_size(ts);
+    double L = tree_sequence_get_sequence_length(ts);
+    double windows[] = {0, L / 5, L / 2, L};
+    size_t W = 3;
+    size_t k, w;
+    double left, right, pi;
+    double *expected = malloc((n + 1) * sizeof(double));
+    double *sfs = malloc(W * (n + 1) * sizeof(double));
+    double *naive_sfs = calloc(W * (n + 1), sizeof(double));
+    double *diversity = malloc(W * sizeof(double));
+    node_id_t *samples;
+    uint32_t set_index = 0;
+    sparse_tree_t tree;
+
+    CU_ASSERT_FATAL(expected != NULL && sfs != NULL && naive_sfs != NULL
+            && diversity != NULL);
+    ret = sparse_tree_alloc(&tree, ts, MSP_BRANCH_LENGTHS);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    sparse_tree_free(&tree);
+
+    ret = sparse_tree_alloc(&tree, ts, MSP_LEAF_COUNTS|MSP_BRANCH_LENGTHS);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    for (ret = sparse_tree_first(&tree); ret == 1; ret = sparse_tree_next(&tree)) {
+        verify_branch_length_counts(&tree, expected);
+        for (w = 0; w < W; w++) {
+            left = GSL_MAX(tree.left, windows[w]);
+            right = GSL_MIN(tree.right, windows[w + 1]);
+            if (right > left) {
+                for (k = 0; k <= n; k++) {
+                    naive_sfs[w * (n + 1) + k] += expected[k] * (right - left)
+                        / (windows[w + 1] - windows[w]);
+                }
+            }
+        }
+    }
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    for (ret = sparse_tree_last(&tree); ret == 1; ret = sparse_tree_prev(&tree)) {
+        verify_branch_length_counts(&tree, expected);
+    }
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    sparse_tree_free(&tree);
+
+    ret = tree_sequence_get_branch_sfs(ts, W, windows, sfs);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    for (k = 0; k < W * (n + 1); k++) {
+        CU_ASSERT_DOUBLE_EQUAL(sfs[k], naive_sfs[k], 1e-9);
+    }
+    /* The branch diversity of all samples is a weighted sum of the SFS. */
+    if (n > 1) {
+        ret = tree_sequence_get_samples(ts, &samples);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        ret = tree_sequence_get_branch_stat(ts, MSP_STAT_DIVERSITY, 1, &n, samples,
+                1, &set_index, W, windows, diversity);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        for (w = 0; w < W; w++) {
+            pi = 0;
+            for (k = 0; k <= n; k++) {
+                pi += sfs[w * (n + 1) + k] * 2.0 * (double) k * (double) (n - k)
+                    / (double) (n * (n - 1));
+            }
+            CU_ASSERT_DOUBLE_EQUAL(pi, diversity[w], 1e-9);
+        }
+    }
+
+    ret = tree_sequence_get_branch_sfs(ts, 0, windows, sfs);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_WINDOWS);
+    windows[1] = 0;
+    ret = tree_sequence_get_branch_sfs(ts, W, windows, sfs);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_WINDOWS);
+
+    free(expected);
+    free(sfs);
+    free(naive_sfs);
+    free(diversity);
+}
+
+static void
+verify_sparse_tree_seek(tree_sequence_t *ts)
+{
+    int ret;
+    int flags = MSP_LEAF_COUNTS|MSP_BRANCH_LENGTHS;
+    size_t n = tree_sequence_get_sample_size(ts);
+    size_t num_nodes = tree_sequence_get_num_nodes(ts);
+    double L = tree_sequence_get_sequence_length(ts);
+    double x[3];
+    sparse_tree_t tree, other, prev;
+    size_t j, k;
+    bool have_prev = false;
+
+    ret = sparse_tree_alloc(&tree, ts, flags);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = sparse_tree_alloc(&other, ts, flags);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = sparse_tree_alloc(&prev, ts, flags);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+
+    ret = sparse_tree_seek(&other, -1);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_OUT_OF_BOUNDS);
+    ret = sparse_tree_seek(&other, L);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_OUT_OF_BOUNDS);
+
+    for (ret = sparse_tree_first(&tree); ret == 1; ret = sparse_tree_next(&tree)) {
+        x[0] = tree.left;
+        x[1] = (tree.left + tree.right) / 2;
+        x[2] = nextafter(tree.right, 0);
+        for (j = 0; j < 3; j++) {
+            ret = sparse_tree_seek(&other, x[j]);
+            CU_ASSERT_EQUAL_FATAL(ret, 1);
+            CU_ASSERT_EQUAL(sparse_tree_equal(&tree, &other), 0);
+            CU_ASSERT_EQUAL(other.index, tree.index);
+            CU_ASSERT_EQUAL(other.left, tree.left);
+            CU_ASSERT_EQUAL(other.right, tree.right);
+            CU_ASSERT_EQUAL(other.root, tree.root);
+            CU_ASSERT_EQUAL(other.sites_length, tree.sites_length);
+            CU_ASSERT_EQUAL(other.sites, tree.sites);
+            for (k = 0; k < num_nodes; k++) {
+                CU_ASSERT_EQUAL(other.num_leaves[k], tree.num_leaves[k]);
+            }
+            for (k = 0; k <= n; k++) {
+                CU_ASSERT_DOUBLE_EQUAL(other.branch_length_by_count[k],
+                        tree.branch_length_by_count[k], 1e-9);
+            }
+        }
+        /* We can move from a seeked tree in both directions */
+        ret = sparse_tree_prev(&other);
+        CU_ASSERT_EQUAL_FATAL(ret, have_prev? 1: 0);
+        if (have_prev) {
+            CU_ASSERT_EQUAL(sparse_tree_equal(&other, &prev), 0);
+            CU_ASSERT_EQUAL(other.index, prev.index);
+            CU_ASSERT_EQUAL(other.left, prev.left);
+            CU_ASSERT_EQUAL(other.right, prev.right);
+            for (k = 0; k < num_nodes; k++) {
+                CU_ASSERT_EQUAL(other.num_leaves[k], prev.num_leaves[k]);
+            }
+        }
+        ret = sparse_tree_seek(&other, x[1]);
+        CU_ASSERT_EQUAL_FATAL(ret, 1);
+        ret = sparse_tree_copy(&prev, &tree);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        have_prev = true;
+        ret = sparse_tree_next(&tree);
+        CU_ASSERT_FATAL(ret >= 0);
+        CU_ASSERT_EQUAL_FATAL(sparse_tree_next(&other), ret);
+        if (ret == 0) {
+            break;
+        }
+        CU_ASSERT_EQUAL(sparse_tree_equal(&tree, &other), 0);
+        CU_ASSERT_EQUAL(other.index, tree.index);
+        CU_ASSERT_EQUAL(other.left, tree.left);
+        CU_ASSERT_EQUAL(other.right, tree.right);
+        for (k = 0; k < num_nodes; k++) {
+            CU_ASSERT_EQUAL(other.num_leaves[k], tree.num_leaves[k]);
+        }
+        ret = sparse_tree_prev(&tree);
+        CU_ASSERT_EQUAL_FATAL(ret, 1);
+    }
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+
+    sparse_tree_free(&tree);
+    sparse_tree_free(&other);
+    sparse_tree_free(&prev);
+}
+
+typedef struct {
+    size_t num_trees;
+    int *tree_counts;
+    double *chunk_lengths;
+    size_t *chunk_trees;
+    int error;
+} chunk_test_params_t;
+
+static int
+chunk_test_func(sparse_tree_t *tree, double start, double end, size_t chunk,
+        void *params)
+{
+    int ret;
+    chunk_test_params_t *self = (chunk_test_params_t *) params;
+
+    if (self->error != 0) {
+        return self->error;
+    }
+    for (ret = sparse_tree_seek(tree, start); ret == 1 && tree->left < end;
+            ret = sparse_tree_next(tree)) {
+        /* CUnit isn't thread safe, so we report problems via the return value */
+        if (tree->index >= self->num_trees || tree->right > end) {
+            return MSP_ERR_GENERIC;
+        }
+        self->tree_counts[tree->index]++;
+        self->chunk_lengths[chunk] += tree->right - tree->left;
+        self->chunk_trees[chunk]++;
+    }
+    return ret < 0? ret: 0;
+}
+
+static void
+verify_run_chunks(tree_sequence_t *ts)
+{
+    int ret;
+    size_t num_trees = tree_sequence_get_num_trees(ts);
+    double L = tree_sequence_get_sequence_length(ts);
+    size_t max_chunks = GSL_MAX(7, 2 * num_trees + 1);
+    size_t chunk_counts[] = {1, 2, 3, 7, num_trees, max_chunks};
+    size_t num_chunks, num_threads, j, k, total_trees;
+    double total_length;
+    chunk_test_params_t params;
+
+    params.num_trees = num_trees;
+    params.tree_counts = malloc(num_trees * sizeof(int));
+    params.chunk_lengths = malloc(max_chunks * sizeof(double));
+    params.chunk_trees = malloc(max_chunks * sizeof(size_t));
+    CU_ASSERT_FATAL(params.tree_counts != NULL && params.chunk_lengths != NULL
+            && params.chunk_trees != NULL);
+
+    for (k = 0; k < sizeof(chunk_counts) / sizeof(size_t); k++) {
+        num_chunks = chunk_counts[k];
+        for (num_threads = 1; num_threads <= 4; num_threads++) {
+            params.error = 0;
+            memset(params.tree_counts, 0, num_trees * sizeof(int));
+            memset(params.chunk_lengths, 0, max_chunks * sizeof(double));
+            memset(params.chunk_trees, 0, max_chunks * sizeof(size_t));
+            ret = tree_sequence_run_chunks(ts, num_chunks, num_threads,
+                    MSP_LEAF_COUNTS, chunk_test_func, &params);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            /* Every tree is visited exactly once */
+            for (j = 0; j < num_trees; j++) {
+                CU_ASSERT_EQUAL(params.tree_counts[j], 1);
+            }
+            total_length = 0;
+            total_trees = 0;
+            for (j = 0; j < num_chunks; j++) {
+                total_length += params.chunk_lengths[j];
+                total_trees += params.chunk_trees[j];
+            }
+            CU_ASSERT_DOUBLE_EQUAL(total_length, L, 1e-9);
+            CU_ASSERT_EQUAL(total_trees, num_trees);
+        }
+    }
+    params.error = MSP_ERR_GENERIC;
+    ret = tree_sequence_run_chunks(ts, 4, 2, 0, chunk_test_func, &params);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_GENERIC);
+    ret = tree_sequence_run_chunks(ts, 0, 1, 0, chunk_test_func, &params);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = tree_sequence_run_chunks(ts, 1, 0, 0, chunk_test_func, &params);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = tree_sequence_run_chunks(ts, 1, 1, 0, NULL, &params);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+
+    free(params.tree_counts);
+    free(params.chunk_lengths);
+    free(params.chunk_trees);
+}
+
+/* Checks that every per-node array in the specified trees is identical. */
+static void
+verify_sparse_tree_state_equal(sparse_tree_t *self, sparse_tree_t *other)
+{
+    size_t u;
+    leaf_list_node_t *w1, *w2;
+
+    CU_ASSERT_EQUAL(self->index, other->index);
+    CU_ASSERT_EQUAL(self->left, other->left);
+    CU_ASSERT_EQUAL(self->right, other->right);
+    CU_ASSERT_EQUAL(self->root, other->root);
+    for (u = 0; u < self->num_nodes; u++) {
+        CU_ASSERT_EQUAL(self->parent[u], other->parent[u]);
+        CU_ASSERT_EQUAL(self->time[u], other->time[u]);
+        CU_ASSERT_EQUAL(self->population[u], other->population[u]);
+        CU_ASSERT_EQUAL(self->num_children[u], other->num_children[u]);
+        CU_ASSERT_EQUAL(self->children[u], other->children[u]);
+        CU_ASSERT_EQUAL(self->num_leaves[u], other->num_leaves[u]);
+        CU_ASSERT_EQUAL(self->num_tracked_leaves[u], other->num_tracked_leaves[u]);
+        w1 = self->leaf_list_head[u];
+        w2 = other->leaf_list_head[u];
+        while (w1 != NULL && w2 != NULL && w1 != self->leaf_list_tail[u]) {
+            CU_ASSERT_EQUAL(w1->node, w2->node);
+            w1 = w1->next;
+            w2 = w2->next;
+        }
+        CU_ASSERT_EQUAL(w1 == NULL, w2 == NULL);
+        if (w1 != NULL && w2 != NULL) {
+            CU_ASSERT_EQUAL(w1->node, w2->node);
+            CU_ASSERT_EQUAL(w2, other->leaf_list_tail[u]);
+        }
+    }
+}
+
+/* Partially iterates over the trees, and then checks that first(), last()
+ * and seek() give the same state as a freshly allocated tree. */
+static void
+verify_sparse_tree_reset(tree_sequence_t *ts)
+{
+    int ret;
+    int flags = MSP_LEAF_COUNTS|MSP_LEAF_LISTS;
+    size_t num_trees = tree_sequence_get_num_trees(ts);
+    size_t n = tree_sequence_get_sample_size(ts);
+    double L = tree_sequence_get_sequence_length(ts);
+    size_t stops[] = {0, num_trees / 2, num_trees - 1};
+    node_id_t *samples;
+    sparse_tree_t tree, fresh;
+    size_t j, k;
+
+    ret = tree_sequence_get_samples(ts, &samples);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = sparse_tree_alloc(&tree, ts, flags);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = sparse_tree_set_tracked_leaves(&tree, n / 2, samples);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+
+    for (j = 0; j < sizeof(stops) / sizeof(size_t); j++) {
+        ret = sparse_tree_first(&tree);
+        CU_ASSERT_EQUAL_FATAL(ret, 1);
+        for (k = 0; k < stops[j]; k++) {
+            ret = sparse_tree_next(&tree);
+            CU_ASSERT_EQUAL_FATAL(ret, 1);
+        }
+
+        ret = sparse_tree_alloc(&fresh, ts, flags);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        ret = sparse_tree_set_tracked_leaves(&fresh, n / 2, samples);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        ret = sparse_tree_last(&tree);
+        CU_ASSERT_EQUAL_FATAL(ret, 1);
+        ret = sparse_tree_last(&fresh);
+        CU_ASSERT_EQUAL_FATAL(ret, 1);
+        verify_sparse_tree_state_equal(&tree, &fresh);
+        sparse_tree_free(&fresh);
+
+        ret = sparse_tree_alloc(&fresh, ts, flags);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        ret = sparse_tree_set_tracked_leaves(&fresh, n / 2, samples);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        ret = sparse_tree_first(&tree);
+        CU_ASSERT_EQUAL_FATAL(ret, 1);
+        ret = sparse_tree_first(&fresh);
+        CU_ASSERT_EQUAL_FATAL(ret, 1);
+        verify_sparse_tree_state_equal(&tree, &fresh);
+        sparse_tree_free(&fresh);
+        CU_ASSERT_TRUE(tree.num_touched_nodes <= tree.num_nodes);
+
+        for (k = 0; k < stops[j]; k++) {
+            ret = sparse_tree_next(&tree);
+            CU_ASSERT_EQUAL_FATAL(ret, 1);
+        }
+        ret = sparse_tree_alloc(&fresh, ts, flags);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        ret = sparse_tree_set_tracked_leaves(&fresh, n / 2, samples);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        ret = sparse_tree_seek(&fresh, L / 2);
+        CU_ASSERT_EQUAL_FATAL(ret, 1);
+        ret = sparse_tree_seek(&tree, L / 2);
+        CU_ASSERT_EQUAL_FATAL(ret, 1);
+        verify_sparse_tree_state_equal(&tree, &fresh);
+        sparse_tree_free(&fresh);
+    }
+    sparse_tree_free(&tree);
+}
+
+static void
+test_sparse_tree_seek_from_examples(void)
+{
+    tree_sequence_t **examples = get_example_tree_sequences(1);
+    uint32_t j;
+
+    CU_ASSERT_FATAL(examples != NULL);
+    for (j = 0; examples[j] != NULL; j++) {
+        verify_sparse_tree_seek(examples[j]);
+        verify_run_chunks(examples[j]);
+        verify_sparse_tree_reset(examples[j]);
+        tree_sequence_free(examples[j]);
+        free(examples[j]);
+    }
+    free(examples);
+}
+
+static void
+test_site_stats_from_examples(void)
+{
+    tree_sequence_t **examples = get_example_tree_sequences(1);
+    uint32_t j;
+
+    CU_ASSERT_FATAL(examples != NULL);
+    for (j = 0; examples[j] != NULL; j++) {
+        verify_tracked_sample_sets(examples[j]);
+        verify_site_stats(examples[j]);
+        verify_sfs(examples[j]);
+        verify_branch_sfs(examples[j]);
+        tree_sequence_free(examples[j]);
+        free(examples[j]);
+    }
+    free(examples);
+}
+
+static void
+test_site_stats_tajimas_d(void)
+{
+    int ret;
+    const char *nodes =
+        "1  0   0\n"
+        "1  0   0\n"
+        "1  0   0\n"
+        "1  0   0\n"
+        "0  1   0\n"
+        "0  2   0\n"
+        "0  3   0\n";
+    const char *edgesets =
+        "0  1   4   0,1\n"
+        "0  1   5   2,3\n"
+        "0  1   6   4,5\n";
+    const char *sites =
+        "0.1  0\n"
+        "0.2  0\n"
+        "0.3  0\n";
+    const char *mutations =
+        "0  0   1\n"
+        "1  4   1\n"
+        "2  5   1\n";
+    tree_sequence_t ts;
+    node_id_t samples[] = {0, 1, 2, 3};
+    size_t set_size = 4;
+    double windows[] = {0, 1};
+    int stats[] = {MSP_SITE_STAT_DIVERSITY, MSP_SITE_STAT_SEGREGATING_SITES,
+        MSP_SITE_STAT_TAJIMAS_D};
+    double result[3];
+    double a1 = 1 + 1.0 / 2 + 1.0 / 3;
+    double a2 = 1 + 1.0 / 4 + 1.0 / 9;
+    double b1 = 5.0 / 9;
+    double b2 = 2.0 * 23 / 108;
+    double c1 = b1 - 1 / a1;
+    double c2 = b2 - 6 / (4 * a1) + a2 / (a1 * a1);
+    double e1 = c1 / a1;
+    double e2 = c2 / (a1 * a1 + a2);
+    /* pi = (3 + 4 + 4) / 6, S = 3 */
+    double pi = 11.0 / 6;
+    double D = (pi - 3 / a1) / sqrt(e1 * 3 + e2 * 3 * 2);
+
+    tree_sequence_from_text(&ts, nodes, edgesets, NULL, sites, mutations, NULL);
+    ret = tree_sequence_get_site_stats(&ts, 1, &set_size, samples, 1, windows, 3,
+            stats, 1, result, NULL, NULL);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_DOUBLE_EQUAL(result[0], pi, 1e-12);
+    CU_ASSERT_EQUAL(result[1], 3);
+    CU_ASSERT_DOUBLE_EQUAL(result[2], D, 1e-12);
+    tree_sequence_free(&ts);
+}
+
+static void
+verify_simplify_errors(tree_sequence_t *ts)
+{
+    int ret;
+    node_id_t *s;
+    node_id_t u;
+    tree_sequence_t subset;
+    node_id_t sample[2] = {};
+
+    ret = tree_sequence_get_samples(ts, &s);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    memcpy(sample, s, 2 * sizeof(node_id_t));
+
+    ret = tree_sequence_simplify(ts, sample, 0, 0, &subset);
+    CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = tree_sequence_simplify(ts, sample, 1, 0, &subset);
+    CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    for (u = 0; u < (node_id_t) tree_sequence_get_num_nodes(ts); u++) {
+        if (! tree_sequence_is_sample(ts, u)) {
+            sample[1] = u;
+            ret = tree_sequence_simplify(ts, sample, 2, 0, &subset);
+            CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_BAD_SAMPLES);
+        }
+    }
+    sample[0] = -1;
+    ret = tree_sequence_simplify(ts, sample, 2, 0, &subset);
+    CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_OUT_OF_BOUNDS);
+    sample[0] = s[0];
+    sample[1] = s[0];
+    ret = tree_sequence_simplify(ts, sample, 2, 0, &subset);
+    CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_DUPLICATE_SAMPLE);
+}
+
+static void
+test_simplify_from_examples(void)
+{
+    tree_sequence_t **examples = get_example_tree_sequences(1);
+    uint32_t j;
+
+    CU_ASSERT_FATAL(examples != NULL);
+    for (j = 0; examples[j] != NULL; j++) {
+        verify_simplify(examples[j]);
+        verify_simplify_errors(examples[j]);
         tree_sequence_free(examples[j]);
         free(examples[j]);
     }
@@ -5635,6 +7976,354 @@ verify_tree_sequences_equal(tree_sequence_t *ts1, tree_sequence_t *ts2,
     sparse_tree_free(&t2);
 }
 
+static void
+verify_simplify_engines_equal(tree_sequence_t *ts)
+{
+    int ret;
+    uint32_t n = tree_sequence_get_sample_size(ts);
+    uint32_t sample_sizes[] = {2, 3, n / 2, n - 1, n};
+    int flags[] = {0, MSP_FILTER_INVARIANT_SITES};
+    size_t j, k;
+    node_id_t *sample;
+    tree_sequence_t subset1, subset2;
+
+    ret = tree_sequence_get_samples(ts, &sample);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    for (j = 0; j < sizeof(sample_sizes) / sizeof(uint32_t); j++) {
+        if (sample_sizes[j] <= 1 || sample_sizes[j] > n) {
+            continue;
+        }
+        for (k = 0; k < sizeof(flags) / sizeof(int); k++) {
+            ret = tree_sequence_initialise(&subset1);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            ret = tree_sequence_initialise(&subset2);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            ret = tree_sequence_simplify(ts, sample, sample_sizes[j], flags[k],
+                    &subset1);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            ret = tree_sequence_simplify(ts, sample, sample_sizes[j],
+                    flags[k] | MSP_SIMPLIFY_TREE_DIFFS, &subset2);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            verify_tree_sequences_equal(&subset1, &subset2, true, true, false);
+            tree_sequence_free(&subset1);
+            tree_sequence_free(&subset2);
+        }
+    }
+}
+
+static void
+test_simplify_engines_from_examples(void)
+{
+    tree_sequence_t **examples = get_example_tree_sequences(1);
+    uint32_t j;
+
+    CU_ASSERT_FATAL(examples != NULL);
+    for (j = 0; examples[j] != NULL; j++) {
+        verify_simplify_engines_equal(examples[j]);
+        tree_sequence_free(examples[j]);
+        free(examples[j]);
+    }
+    free(examples);
+}
+
+static void
+test_simplify_interleaved_parents(void)
+{
+    const char *nodes =
+        "1  0   0\n"
+        "1  0   0\n"
+        "1  0   0\n"
+        "1  0   0\n"
+        "0  1   0\n"
+        "0  1   0\n"
+        "0  2   0\n";
+    const char *edgesets =
+        "0    0.5  4   0,1\n"
+        "0    0.5  5   2,3\n"
+        "0.5  1    4   0,2\n"
+        "0.5  1    5   1,3\n"
+        "0    1    6   4,5\n";
+    const char *sites =
+        "0.25  0\n"
+        "0.75  0\n";
+    const char *mutations =
+        "0    4     1\n"
+        "1    5     1\n";
+    tree_sequence_t ts;
+
+    tree_sequence_from_text(&ts, nodes, edgesets, NULL, sites, mutations, NULL);
+    CU_ASSERT_EQUAL(tree_sequence_get_num_trees(&ts), 2);
+    verify_simplify_engines_equal(&ts);
+    verify_simplify(&ts);
+    tree_sequence_free(&ts);
+}
+
+static void
+verify_simplifier_reuse(simplifier_t *simplifier, tree_sequence_t *ts)
+{
+    int ret;
+    uint32_t n = tree_sequence_get_sample_size(ts);
+    uint32_t num_samples = n > 2 ? n - 1 : n;
+    node_id_t *samples;
+    simplify_segment_t *segments;
+    simplify_record_t *records;
+    size_t max_segments, max_records, max_record_children;
+    tree_sequence_t subset1, subset2;
+
+    ret = tree_sequence_get_samples(ts, &samples);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = tree_sequence_initialise(&subset1);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = tree_sequence_initialise(&subset2);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = tree_sequence_simplify(ts, samples, num_samples, simplifier->flags,
+            &subset1);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+
+    ret = simplifier_run(simplifier, ts, samples, num_samples, &subset2);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    verify_tree_sequences_equal(&subset1, &subset2, true, true, false);
+    simplifier_print_state(simplifier, _devnull);
+    segments = simplifier->segments;
+    records = simplifier->records;
+    max_segments = simplifier->max_segments;
+    max_records = simplifier->max_records;
+    max_record_children = simplifier->max_record_children;
+
+    /* Running again on the same input must not need any more memory. */
+    ret = simplifier_run(simplifier, ts, samples, num_samples, &subset2);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    verify_tree_sequences_equal(&subset1, &subset2, true, true, false);
+    CU_ASSERT_EQUAL(simplifier->segments, segments);
+    CU_ASSERT_EQUAL(simplifier->records, records);
+    CU_ASSERT_EQUAL(simplifier->max_segments, max_segments);
+    CU_ASSERT_EQUAL(simplifier->max_records, max_records);
+    CU_ASSERT_EQUAL(simplifier->max_record_children, max_record_children);
+
+    ret = simplifier_run(simplifier, ts, samples, 1, &subset2);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = simplifier_reset(simplifier);
+    CU_ASSERT_EQUAL(ret, 0);
+    CU_ASSERT_EQUAL(simplifier->num_records, 0);
+    CU_ASSERT_EQUAL(simplifier->max_records, max_records);
+
+    tree_sequence_free(&subset1);
+    tree_sequence_free(&subset2);
+}
+
+static void
+test_simplifier_reuse(void)
+{
+    int ret;
+    tree_sequence_t **examples = get_example_tree_sequences(1);
+    simplifier_t simplifier;
+    uint32_t j;
+
+    CU_ASSERT_FATAL(examples != NULL);
+    ret = simplifier_alloc(&simplifier, MSP_FILTER_INVARIANT_SITES);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    for (j = 0; examples[j] != NULL; j++) {
+        verify_simplifier_reuse(&simplifier, examples[j]);
+        tree_sequence_free(examples[j]);
+        free(examples[j]);
+    }
+    simplifier_free(&simplifier);
+    free(examples);
+}
+
+static void
+verify_node_tables_equal(node_table_t *n1, node_table_t *n2)
+{
+    CU_ASSERT_FATAL(n1->num_rows == n2->num_rows);
+    CU_ASSERT(memcmp(n1->flags, n2->flags, n1->num_rows * sizeof(uint32_t)) == 0);
+    CU_ASSERT(memcmp(n1->time, n2->time, n1->num_rows * sizeof(double)) == 0);
+    CU_ASSERT(memcmp(n1->population, n2->population,
+                n1->num_rows * sizeof(population_id_t)) == 0);
+}
+
+static void
+verify_edgeset_tables_equal(edgeset_table_t *e1, edgeset_table_t *e2)
+{
+    CU_ASSERT_FATAL(e1->num_rows == e2->num_rows);
+    CU_ASSERT_FATAL(e1->total_children_length == e2->total_children_length);
+    CU_ASSERT(memcmp(e1->left, e2->left, e1->num_rows * sizeof(double)) == 0);
+    CU_ASSERT(memcmp(e1->right, e2->right, e1->num_rows * sizeof(double)) == 0);
+    CU_ASSERT(memcmp(e1->parent, e2->parent, e1->num_rows * sizeof(node_id_t)) == 0);
+    CU_ASSERT(memcmp(e1->children_length, e2->children_length,
+                e1->num_rows * sizeof(list_len_t)) == 0);
+    CU_ASSERT(memcmp(e1->children, e2->children,
+                e1->total_children_length * sizeof(node_id_t)) == 0);
+}
+
+/* Runs a haploid Wright-Fisher simulation in which each individual
+ * survives to the next generation with the specified probability,
+ * simplifying incrementally at the specified interval. The result must be
+ * the same as simplifying the full history. */
+static void
+verify_simplifier_forward_time(size_t N, uint32_t num_generations,
+        uint32_t simplify_interval, double survival)
+{
+    int ret;
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_default);
+    simplifier_t simplifier, reference;
+    node_table_t nodes, full_nodes, ref_nodes;
+    edgeset_table_t edgesets, full_edgesets, ref_edgesets;
+    node_id_t *alive = malloc(N * sizeof(node_id_t));
+    node_id_t *parents = malloc(N * sizeof(node_id_t));
+    node_id_t *full_alive = malloc(N * sizeof(node_id_t));
+    node_id_t *full_parents = malloc(N * sizeof(node_id_t));
+    node_id_t *node_map = NULL;
+    node_id_t u, full_u;
+    size_t j, a, b;
+    uint32_t g;
+    double x, time;
+
+    CU_ASSERT_FATAL(rng != NULL);
+    CU_ASSERT_FATAL(alive != NULL && parents != NULL);
+    CU_ASSERT_FATAL(full_alive != NULL && full_parents != NULL);
+    gsl_rng_set(rng, 5);
+    ret = simplifier_alloc(&simplifier, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = simplifier_alloc(&reference, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = node_table_alloc(&nodes, 1, 1);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = node_table_alloc(&full_nodes, 1, 1);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = node_table_alloc(&ref_nodes, 1, 1);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = edgeset_table_alloc(&edgesets, 1, 1);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = edgeset_table_alloc(&full_edgesets, 1, 1);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = edgeset_table_alloc(&ref_edgesets, 1, 1);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+
+    /* Give every node a distinct time so that the output order does not
+     * depend on the input node IDs. */
+    for (j = 0; j < N; j++) {
+        time = num_generations + ((double) j) / (2.0 * N);
+        ret = node_table_add_row(&nodes, MSP_NODE_IS_SAMPLE, time, 0, "");
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        ret = node_table_add_row(&full_nodes, MSP_NODE_IS_SAMPLE, time, 0, "");
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        alive[j] = (node_id_t) j;
+        full_alive[j] = (node_id_t) j;
+    }
+    for (g = 1; g <= num_generations; g++) {
+        memcpy(parents, alive, N * sizeof(node_id_t));
+        memcpy(full_parents, full_alive, N * sizeof(node_id_t));
+        for (j = 0; j < N; j++) {
+            if (gsl_rng_uniform(rng) < survival) {
+                continue;
+            }
+            time = num_generations - g - ((double) j) / (2.0 * N);
+            u = (node_id_t) nodes.num_rows;
+            full_u = (node_id_t) full_nodes.num_rows;
+            ret = node_table_add_row(&nodes, MSP_NODE_IS_SAMPLE, time, 0, "");
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            ret = node_table_add_row(&full_nodes, MSP_NODE_IS_SAMPLE, time, 0, "");
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            a = gsl_rng_uniform_int(rng, N);
+            b = gsl_rng_uniform_int(rng, N);
+            x = a == b ? 1.0 : gsl_rng_uniform_pos(rng);
+            ret = edgeset_table_add_row(&edgesets, 0, x, parents[a], &u, 1);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            ret = edgeset_table_add_row(&full_edgesets, 0, x, full_parents[a],
+                    &full_u, 1);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            if (x < 1.0) {
+                ret = edgeset_table_add_row(&edgesets, x, 1, parents[b], &u, 1);
+                CU_ASSERT_EQUAL_FATAL(ret, 0);
+                ret = edgeset_table_add_row(&full_edgesets, x, 1, full_parents[b],
+                        &full_u, 1);
+                CU_ASSERT_EQUAL_FATAL(ret, 0);
+            }
+            alive[j] = u;
+            full_alive[j] = full_u;
+        }
+        if (g % simplify_interval != 0 && g != num_generations) {
+            continue;
+        }
+        node_map = realloc(node_map, nodes.num_rows * sizeof(node_id_t));
+        CU_ASSERT_FATAL(node_map != NULL);
+        ret = simplifier_simplify_tables(&simplifier, alive, N, 1.0, &nodes,
+                &edgesets, node_map);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        for (j = 0; j < N; j++) {
+            CU_ASSERT_EQUAL_FATAL(node_map[alive[j]], (node_id_t) j);
+            alive[j] = node_map[alive[j]];
+        }
+
+        ret = node_table_set_columns(&ref_nodes, full_nodes.num_rows, full_nodes.flags,
+                full_nodes.time, full_nodes.population, NULL, NULL);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        ret = edgeset_table_set_columns(&ref_edgesets, full_edgesets.num_rows,
+                full_edgesets.left, full_edgesets.right, full_edgesets.parent,
+                full_edgesets.children, full_edgesets.children_length);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        ret = simplifier_reset(&reference);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        ret = simplifier_simplify_tables(&reference, full_alive, N, 1.0, &ref_nodes,
+                &ref_edgesets, NULL);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        verify_node_tables_equal(&nodes, &ref_nodes);
+        verify_edgeset_tables_equal(&edgesets, &ref_edgesets);
+    }
+    simplifier_print_state(&simplifier, _devnull);
+
+    /* The retained rows must be unchanged and the new rows are checked.
+     * After an error, the tables are treated as entirely new. */
+    CU_ASSERT_FATAL(simplifier.num_retained_edgesets > 0);
+    ret = simplifier_simplify_tables(&simplifier, alive, N, 2.0, &nodes,
+            &edgesets, NULL);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    CU_ASSERT_EQUAL(simplifier.num_retained_edgesets, 0);
+    ret = simplifier_simplify_tables(&simplifier, alive, N, 1.0, &nodes,
+            &edgesets, NULL);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    verify_edgeset_tables_equal(&edgesets, &ref_edgesets);
+    ret = edgeset_table_add_row(&edgesets, 0, 1, alive[0], &alive[0], 1);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = simplifier_simplify_tables(&simplifier, alive, N, 1.0, &nodes,
+            &edgesets, NULL);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_NODE_TIME_ORDERING);
+    ret = simplifier_simplify_tables(&simplifier, alive, N, 1.0, &nodes,
+            &ref_edgesets, NULL);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = edgeset_table_reset(&edgesets);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = simplifier_simplify_tables(&simplifier, alive, N, 1.0, &nodes,
+            &edgesets, NULL);
+    CU_ASSERT_EQUAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+
+    simplifier_free(&simplifier);
+    simplifier_free(&reference);
+    node_table_free(&nodes);
+    node_table_free(&full_nodes);
+    node_table_free(&ref_nodes);
+    edgeset_table_free(&edgesets);
+    edgeset_table_free(&full_edgesets);
+    edgeset_table_free(&ref_edgesets);
+    gsl_rng_free(rng);
+    free(alive);
+    free(parents);
+    free(full_alive);
+    free(full_parents);
+    free(node_map);
+}
+
+static void
+test_simplifier_forward_time(void)
+{
+    verify_simplifier_forward_time(10, 50, 1, 0);
+    verify_simplifier_forward_time(10, 50, 7, 0);
+    verify_simplifier_forward_time(20, 100, 10, 0);
+    verify_simplifier_forward_time(10, 50, 1, 0.5);
+    verify_simplifier_forward_time(10, 50, 3, 0.5);
+    verify_simplifier_forward_time(20, 100, 5, 0.8);
+}
+
 static void
 verify_empty_tree_sequence(tree_sequence_t *ts)
 {
@@ -5647,6 +8336,8 @@ verify_empty_tree_sequence(tree_sequence_t *ts)
     CU_ASSERT_EQUAL(tree_sequence_get_num_trees(ts), 0);
     verify_trees_consistent(ts);
     verify_ld(ts);
+    verify_ld_bitsets(ts);
+    verify_ld_matrix(ts);
     verify_stats(ts);
     verify_hapgen(ts);
     verify_vargen(ts);
@@ -5804,6 +8495,153 @@ test_dump_tables(void)
     mutation_table_free(&mutations);
 }
 
+static void
+test_take_tables(void)
+{
+    int ret;
+    tree_sequence_t **examples = get_example_tree_sequences(1);
+    tree_sequence_t ts2;
+    tree_sequence_t *ts1;
+    size_t j, k, num_provenance_strings;
+    char **provenance_strings;
+    node_table_t nodes;
+    edgeset_table_t edgesets;
+    migration_table_t migrations;
+    site_table_t sites;
+    mutation_table_t mutations;
+
+    ret = node_table_alloc(&nodes, 1, 1);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = edgeset_table_alloc(&edgesets, 1, 1);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = migration_table_alloc(&migrations, 1);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = site_table_alloc(&sites, 1, 1);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = mutation_table_alloc(&mutations, 1, 1);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    ret = tree_sequence_initialise(&ts2);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_FATAL(examples != NULL);
+
+    ret = tree_sequence_take_tables_tmp(&ts2, NULL, &edgesets,
+            &migrations, &sites, &mutations, 0, NULL);
+    CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+    ret = tree_sequence_take_tables_tmp(&ts2, &nodes, NULL,
+            &migrations, &sites, &mutations, 0, NULL);
+    CU_ASSERT_EQUAL_FATAL(ret, MSP_ERR_BAD_PARAM_VALUE);
+
+    /* The same tables and tree sequence are used throughout, so that the
+     * buffers are exchanged between them many times. */
+    for (j = 0; examples[j] != NULL; j++) {
+        ts1 = examples[j];
+        for (k = 0; k < 2; k++) {
+            ret = tree_sequence_dump_tables_tmp(ts1, &nodes, &edgesets,
+                    &migrations, &sites, &mutations, &num_provenance_strings,
+                    &provenance_strings);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            ret = tree_sequence_take_tables_tmp(&ts2, &nodes, &edgesets,
+                    &migrations, &sites, &mutations, num_provenance_strings,
+                    provenance_strings);
+            CU_ASSERT_EQUAL_FATAL(ret, 0);
+            CU_ASSERT_EQUAL(nodes.num_rows, 0);
+            CU_ASSERT_EQUAL(edgesets.num_rows, 0);
+            CU_ASSERT_EQUAL(edgesets.total_children_length, 0);
+            CU_ASSERT_EQUAL(migrations.num_rows, 0);
+            verify_tree_sequences_equal(ts1, &ts2, true, true, true);
+            tree_sequence_print_state(&ts2, _devnull);
+        }
+        ret = tree_sequence_dump_tables_tmp(ts1, &nodes, &edgesets,
+                NULL, &sites, &mutations, &num_provenance_strings,
+                &provenance_strings);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        ret = tree_sequence_take_tables_tmp(&ts2, &nodes, &edgesets,
+                NULL, &sites, &mutations, num_provenance_strings,
+                provenance_strings);
+        CU_ASSERT_EQUAL_FATAL(ret, 0);
+        verify_tree_sequences_equal(ts1, &ts2, false, true, true);
+        CU_ASSERT_EQUAL(tree_sequence_get_num_migrations(&ts2), 0);
+        tree_sequence_free(ts1);
+        free(ts1);
+    }
+    tree_sequence_free(&ts2);
+    free(examples);
+    node_table_free(&nodes);
+    edgeset_table_free(&edgesets);
+    migration_table_free(&migrations);
+    site_table_free(&sites);
+    mutation_table_free(&mutations);
+}
+
+static void
+verify_build_indexes(tree_sequence_t *ts)
+{
+    int ret;
+    size_t n = tree_sequence_get_num_edgesets(ts);
+    node_id_t *insertion_order = malloc((n + 1) * sizeof(node_id_t));
+    node_id_t *removal_order = malloc((n + 1) * sizeof(node_id_t));
+
+    CU_ASSERT_FATAL(insertion_order != NULL);
+    CU_ASSERT_FATAL(removal_order != NULL);
+    memcpy(insertion_order, ts->edgesets.indexes.insertion_order, n * sizeof(node_id_t));
+    memcpy(removal_order, ts->edgesets.indexes.removal_order, n * sizeof(node_id_t));
+    ret = tree_sequence_build_indexes(ts, MSP_INDEX_QSORT);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_EQUAL(memcmp(insertion_order, ts->edgesets.indexes.insertion_order,
+                n * sizeof(node_id_t)), 0);
+    CU_ASSERT_EQUAL(memcmp(removal_order, ts->edgesets.indexes.removal_order,
+                n * sizeof(node_id_t)), 0);
+    ret = tree_sequence_build_indexes(ts, 0);
+    CU_ASSERT_EQUAL_FATAL(ret, 0);
+    CU_ASSERT_EQUAL(memcmp(insertion_order, ts->edgesets.indexes.insertion_order,
+                n * sizeof(node_id_t)), 0);
+    CU_ASSERT_EQUAL(memcmp(removal_order, ts->edgesets.indexes.removal_order,
+                n * sizeof(node_id_t)), 0);
+    free(insertion_order);
+    free(removal_order);
+}
+
+static void
+test_build_indexes(void)
+{
+    const char *nodes =
+        "1  0   0\n"
+        "1  0   0\n"
+        "1  0   0\n"
+        "1  0   0\n"
+        "0  1   0\n"
+        "0  2   0\n"
+        "0  3   0";
+    /* Ties must be broken by record index, and -0 is equal to 0 */
+    const char *edgesets =
+        "-0 5   4   0,1\n"
+        "5  10  4   2,3\n"
+        "-0 5   5   2,3\n"
+        "5  10  5   0,1\n"
+        "0  10  6   4,5\n";
+    node_id_t insertion_order[] = {0, 2, 4, 1, 3};
+    node_id_t removal_order[] = {2, 0, 4, 3, 1};
+    tree_sequence_t ts;
+    tree_sequence_t **examples = get_example_tree_sequences(1);
+    size_t j;
+
+    tree_sequence_from_text(&ts, nodes, edgesets, NULL, NULL, NULL, NULL);
+    for (j = 0; j < 5; j++) {
+        CU_ASSERT_EQUAL(ts.edgesets.indexes.insertion_order[j], insertion_order[j]);
+        CU_ASSERT_EQUAL(ts.edgesets.indexes.removal_order[j], removal_order[j]);
+    }
+    verify_build_indexes(&ts);
+    tree_sequence_free(&ts);
+
+    CU_ASSERT_FATAL(examples != NULL);
+    for (j = 0; examples[j] != NULL; j++) {
+        verify_build_indexes(examples[j]);
+        tree_sequence_free(examples[j]);
+        free(examples[j]);
+    }
+    free(examples);
+}
+
 static void
 test_dump_tables_hdf5(void)
 {
@@ -6446,6 +9284,8 @@ main(int argc, char **argv)
     CU_pSuite suite;
     CU_TestInfo tests[] = {
         {"test_fenwick_tree", test_fenwick},
+        {"test_sum_tree", test_sum_tree},
+        {"test_locus_map", test_locus_map},
         {"test_vcf", test_vcf},
         {"test_vcf_no_mutations", test_vcf_no_mutations},
         {"test_simple_recombination_map", test_simple_recomb_map},
@@ -6504,24 +9344,40 @@ main(int argc, char **argv)
         {"test_vargen_from_examples", test_vargen_from_examples},
         {"test_newick_from_examples", test_newick_from_examples},
         {"test_stats_from_examples", test_stats_from_examples},
+        {"test_branch_stats_from_examples", test_branch_stats_from_examples},
+        {"test_sparse_tree_seek_from_examples", test_sparse_tree_seek_from_examples},
+        {"test_site_stats_from_examples", test_site_stats_from_examples},
+        {"test_site_stats_tajimas_d", test_site_stats_tajimas_d},
+        {"test_single_tree_ld_statistics", test_single_tree_ld_statistics},
         {"test_ld_from_examples", test_ld_from_examples},
         {"test_simplify_from_examples", test_simplify_from_examples},
+        {"test_simplify_engines_from_examples", test_simplify_engines_from_examples},
+        {"test_simplify_interleaved_parents", test_simplify_interleaved_parents},
+        {"test_simplifier_reuse", test_simplifier_reuse},
+        {"test_simplifier_forward_time", test_simplifier_forward_time},
         {"test_save_empty_hdf5", test_save_empty_hdf5},
         {"test_save_hdf5", test_save_hdf5},
         {"test_dump_tables", test_dump_tables},
+        {"test_take_tables", test_take_tables},
+        {"test_build_indexes", test_build_indexes},
         {"test_dump_tables_hdf5", test_dump_tables_hdf5},
         {"test_single_locus_two_populations", test_single_locus_two_populations},
         {"test_many_populations", test_single_locus_many_populations},
+        {"test_stepping_stone_migration", test_stepping_stone_migration},
         {"test_historical_samples", test_single_locus_historical_sample},
         {"test_simulator_getters/setters", test_simulator_getters_setters},
         {"test_model_errors", test_simulator_model_errors},
         {"test_demographic_events", test_simulator_demographic_events},
         {"test_single_locus_simulation", test_single_locus_simulation},
         {"test_simulation_memory_limit", test_simulation_memory_limit},
+        {"test_simulation_locus_map_memory", test_simulation_locus_map_memory},
         {"test_multi_locus_simulation", test_multi_locus_simulation},
+        {"test_mixed_growth_rate_simulation", test_mixed_growth_rate_simulation},
+        {"test_links_index_simulation", test_links_index_simulation},
         {"test_simulation_replicates", test_simulation_replicates},
         {"test_bottleneck_simulation", test_bottleneck_simulation},
         {"test_multiple_mergers_simulation", test_multiple_mergers_simulation},
+        {"test_dtwf_simulation", test_dtwf_simulation},
         {"test_large_bottleneck_simulation", test_large_bottleneck_simulation},
         {"test_error_messages", test_strerror},
         {"test_node_table", test_node_table},
@@ -20,6 +20,7 @@
 #include <string.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include <hdf5.h>
 
@@ -508,8 +509,8 @@ tree_sequence_initialise(tree_sequence_t *self)
     return 0;
 }
 
-int
-tree_sequence_free(tree_sequence_t *self)
+static void
+tree_sequence_free_provenance_strings(tree_sequence_t *self)
 {
     size_t j;
 
@@ -519,6 +520,13 @@ tree_sequence_free(tree_sequence_t *self)
         }
         msp_safe_free(self->provenance_strings);
     }
+    self->num_provenance_strings = 0;
+}
+
+int
+tree_sequence_free(tree_sequence_t *self)
+{
+    tree_sequence_free_provenance_strings(self);
     msp_safe_free(self->samples);
     msp_safe_free(self->nodes.flags);
     msp_safe_free(self->nodes.population);
@@ -1058,7 +1066,7 @@ tree_sequence_load_records(tree_sequence_t *self,
     /* site_table_print_state(site_table, stdout); */
     /* mutation_table_print_state(mutation_table, stdout); */
 
-    ret = tree_sequence_load_tables_tmp(self, node_table, edgeset_table,
+    ret = tree_sequence_take_tables_tmp(self, node_table, edgeset_table,
             NULL, site_table, mutation_table, 0, NULL);
 
 out:
@@ -1082,7 +1090,7 @@ out:
 }
 
 static int WARN_UNUSED
-tree_sequence_build_indexes(tree_sequence_t *self)
+tree_sequence_build_indexes_qsort(tree_sequence_t *self)
 {
     int ret = MSP_ERR_GENERIC;
     size_t j;
@@ -1134,13 +1142,210 @@ out:
     return ret;
 }
 
+/* Maps a coordinate to an unsigned integer with the same ordering, so that
+ * coordinates can be radix sorted. Negative zero is mapped to the same
+ * value as zero, since these compare equal.
+ */
+static inline uint64_t
+get_coordinate_sort_key(double x)
+{
+    uint64_t key;
+    const uint64_t sign = 1ULL << 63;
+
+    if (x == 0) {
+        x = 0;
+    }
+    memcpy(&key, &x, sizeof(key));
+    return (key & sign) ? ~key : key | sign;
+}
+
+/* Writes the indexes of the specified coordinates to order, sorted by
+ * coordinate, with ties in increasing order of index, or decreasing order
+ * if reverse is true. This is a stable least significant digit radix sort
+ * on the bytes of the sort keys, in which bytes that are the same for all
+ * keys are skipped; since coordinates are often drawn from a small set of
+ * values, many of the passes can usually be skipped. The keys and
+ * index_buff arrays must have space for 2 * n and n values.
+ */
+static void
+radix_sort_coordinates(size_t n, double *coordinate, bool reverse,
+        uint64_t *keys, node_id_t *index_buff, node_id_t *order)
+{
+    size_t j, b, digit, pos, sum, tmp;
+    size_t count[8][256];
+    uint64_t key;
+    uint64_t *src_keys = keys;
+    uint64_t *dest_keys = keys + n;
+    node_id_t *src_index = order;
+    node_id_t *dest_index = index_buff;
+    void *swap;
+
+    if (n == 0) {
+        return;
+    }
+    memset(count, 0, sizeof(count));
+    for (j = 0; j < n; j++) {
+        src_index[j] = (node_id_t) (reverse ? n - j - 1 : j);
+        key = get_coordinate_sort_key(coordinate[src_index[j]]);
+        src_keys[j] = key;
+        for (digit = 0; digit < 8; digit++) {
+            count[digit][(key >> (8 * digit)) & 0xff]++;
+        }
+    }
+    for (digit = 0; digit < 8; digit++) {
+        if (count[digit][(src_keys[0] >> (8 * digit)) & 0xff] == n) {
+            continue;
+        }
+        sum = 0;
+        for (b = 0; b < 256; b++) {
+            tmp = count[digit][b];
+            count[digit][b] = sum;
+            sum += tmp;
+        }
+        for (j = 0; j < n; j++) {
+            key = src_keys[j];
+            pos = count[digit][(key >> (8 * digit)) & 0xff]++;
+            dest_keys[pos] = key;
+            dest_index[pos] = src_index[j];
+        }
+        swap = src_keys;
+        src_keys = dest_keys;
+        dest_keys = swap;
+        swap = src_index;
+        src_index = dest_index;
+        dest_index = swap;
+    }
+    if (src_index != order) {
+        memcpy(order, src_index, n * sizeof(node_id_t));
+    }
+}
+
+/* Builds the insertion and removal orders for the edgesets. Records are
+ * inserted in increasing order of left coordinate, and removed in increasing
+ * order of right coordinate. Since we require that records are provided in
+ * the order in which they happened, ties are broken by index: increasing
+ * for insertion and decreasing for removal.
+ */
 int WARN_UNUSED
-tree_sequence_load_tables_tmp(tree_sequence_t *self,
+tree_sequence_build_indexes(tree_sequence_t *self, int flags)
+{
+    int ret = 0;
+    size_t n = self->edgesets.num_records;
+    uint64_t *keys = NULL;
+    node_id_t *index_buff = NULL;
+
+    if (flags & MSP_INDEX_QSORT) {
+        ret = tree_sequence_build_indexes_qsort(self);
+        goto out;
+    }
+    keys = malloc(2 * GSL_MAX(1, n) * sizeof(uint64_t));
+    index_buff = malloc(GSL_MAX(1, n) * sizeof(node_id_t));
+    if (keys == NULL || index_buff == NULL) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    radix_sort_coordinates(n, self->edgesets.left, false, keys, index_buff,
+            self->edgesets.indexes.insertion_order);
+    radix_sort_coordinates(n, self->edgesets.right, true, keys, index_buff,
+            self->edgesets.indexes.removal_order);
+out:
+    msp_safe_free(keys);
+    msp_safe_free(index_buff);
+    return ret;
+}
+
+static void
+swap_columns(void **a, void **b)
+{
+    void *tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/* Exchanges the fixed-width node, edgeset and migration columns with
+ * those in the specified tables. The tree sequence takes ownership of
+ * the table data, and the tables are given the buffers previously held
+ * by the tree sequence, which are reused when the tables are refilled.
+ * Since columns are always allocated with exactly max_num_records
+ * entries, the table capacities are set from these values.
+ */
+static int WARN_UNUSED
+tree_sequence_take_columns(tree_sequence_t *self, node_table_t *nodes,
+        edgeset_table_t *edgesets, migration_table_t *migrations)
+{
+    int ret = 0;
+    size_t size;
+
+    swap_columns((void **) &self->nodes.flags, (void **) &nodes->flags);
+    swap_columns((void **) &self->nodes.time, (void **) &nodes->time);
+    swap_columns((void **) &self->nodes.population, (void **) &nodes->population);
+    swap_columns((void **) &self->nodes.name_length, (void **) &nodes->name_length);
+    size = nodes->max_rows;
+    nodes->max_rows = self->nodes.max_num_records;
+    if (size > self->nodes.max_num_records) {
+        msp_safe_free(self->nodes.name);
+        msp_safe_free(self->nodes.sample_index_map);
+        self->nodes.name = malloc(size * sizeof(char *));
+        self->nodes.sample_index_map = malloc(size * sizeof(node_id_t));
+        if (self->nodes.name == NULL || self->nodes.sample_index_map == NULL) {
+            self->nodes.max_num_records = 0;
+            ret = MSP_ERR_NO_MEMORY;
+            goto out;
+        }
+    }
+    self->nodes.max_num_records = size;
+
+    swap_columns((void **) &self->edgesets.left, (void **) &edgesets->left);
+    swap_columns((void **) &self->edgesets.right, (void **) &edgesets->right);
+    swap_columns((void **) &self->edgesets.parent, (void **) &edgesets->parent);
+    swap_columns((void **) &self->edgesets.children_length,
+            (void **) &edgesets->children_length);
+    swap_columns((void **) &self->edgesets.children_mem, (void **) &edgesets->children);
+    size = edgesets->max_total_children_length;
+    edgesets->max_total_children_length = self->edgesets.max_total_children_length;
+    self->edgesets.max_total_children_length = size;
+    size = edgesets->max_rows;
+    edgesets->max_rows = self->edgesets.max_num_records;
+    if (size > self->edgesets.max_num_records) {
+        msp_safe_free(self->edgesets.children);
+        msp_safe_free(self->edgesets.indexes.insertion_order);
+        msp_safe_free(self->edgesets.indexes.removal_order);
+        self->edgesets.children = malloc(size * sizeof(node_id_t *));
+        self->edgesets.indexes.insertion_order = malloc(size * sizeof(node_id_t));
+        self->edgesets.indexes.removal_order = malloc(size * sizeof(node_id_t));
+        if (self->edgesets.children == NULL
+                || self->edgesets.indexes.insertion_order == NULL
+                || self->edgesets.indexes.removal_order == NULL) {
+            self->edgesets.max_num_records = 0;
+            ret = MSP_ERR_NO_MEMORY;
+            goto out;
+        }
+    }
+    self->edgesets.max_num_records = size;
+
+    if (migrations != NULL) {
+        swap_columns((void **) &self->migrations.left, (void **) &migrations->left);
+        swap_columns((void **) &self->migrations.right, (void **) &migrations->right);
+        swap_columns((void **) &self->migrations.node, (void **) &migrations->node);
+        swap_columns((void **) &self->migrations.source, (void **) &migrations->source);
+        swap_columns((void **) &self->migrations.dest, (void **) &migrations->dest);
+        swap_columns((void **) &self->migrations.time, (void **) &migrations->time);
+        size = migrations->max_rows;
+        migrations->max_rows = self->migrations.max_num_records;
+        self->migrations.max_num_records = size;
+    }
+out:
+    return ret;
+}
+
+static int WARN_UNUSED
+tree_sequence_load_tables_internal(tree_sequence_t *self,
     node_table_t *nodes, edgeset_table_t *edgesets, migration_table_t *migrations,
     site_table_t *sites, mutation_table_t *mutations,
-    size_t num_provenance_strings, char **provenance_strings)
+    size_t num_provenance_strings, char **provenance_strings, bool take_columns)
 {
     int ret = 0;
+    bool columns_taken = false;
 
     /* TODO need to do a lot of input validation here. What do we allow to be
      * null? What are the size restrictions on the tables? */
@@ -1150,6 +1355,7 @@ tree_sequence_load_tables_tmp(tree_sequence_t *self,
         goto out;
     }
 
+    tree_sequence_free_provenance_strings(self);
     self->num_provenance_strings = num_provenance_strings;
     self->nodes.num_records = nodes->num_rows;
     /* name_mem here contains terminal NULLs, so we need more space */
@@ -1179,6 +1385,13 @@ tree_sequence_load_tables_tmp(tree_sequence_t *self,
     if (migrations != NULL) {
         self->migrations.num_records = migrations->num_rows;
     }
+    if (take_columns) {
+        columns_taken = true;
+        ret = tree_sequence_take_columns(self, nodes, edgesets, migrations);
+        if (ret != 0) {
+            goto out;
+        }
+    }
     ret = tree_sequence_alloc(self);
     if (ret != 0) {
         goto out;
@@ -1188,12 +1401,15 @@ tree_sequence_load_tables_tmp(tree_sequence_t *self,
     if (ret != 0) {
         goto out;
     }
-    memcpy(self->nodes.time, nodes->time, nodes->num_rows * sizeof(double));
-    memcpy(self->nodes.flags, nodes->flags, nodes->num_rows * sizeof(uint32_t));
-    memcpy(self->nodes.population, nodes->population,
-            nodes->num_rows * sizeof(population_id_t));
-    memcpy(self->nodes.name_length, nodes->name_length, nodes->num_rows * sizeof(uint32_t));
-    ret = init_string_column(nodes->num_rows, nodes->name, nodes->name_length,
+    if (!take_columns) {
+        memcpy(self->nodes.time, nodes->time, nodes->num_rows * sizeof(double));
+        memcpy(self->nodes.flags, nodes->flags, nodes->num_rows * sizeof(uint32_t));
+        memcpy(self->nodes.population, nodes->population,
+                nodes->num_rows * sizeof(population_id_t));
+        memcpy(self->nodes.name_length, nodes->name_length,
+                nodes->num_rows * sizeof(uint32_t));
+    }
+    ret = init_string_column(nodes->num_rows, nodes->name, self->nodes.name_length,
             self->nodes.name, self->nodes.name_mem);
     if (ret != 0) {
         goto out;
@@ -1204,18 +1420,22 @@ tree_sequence_load_tables_tmp(tree_sequence_t *self,
     }
 
     /* Setup the edgesets */
-    memcpy(self->edgesets.left, edgesets->left, edgesets->num_rows * sizeof(double));
-    memcpy(self->edgesets.right, edgesets->right, edgesets->num_rows * sizeof(double));
-    memcpy(self->edgesets.parent, edgesets->parent, edgesets->num_rows * sizeof(node_id_t));
-    memcpy(self->edgesets.children_length, edgesets->children_length,
-            edgesets->num_rows * sizeof(list_len_t));
-    memcpy(self->edgesets.children_mem, edgesets->children,
-            edgesets->total_children_length * sizeof(node_id_t));
+    if (!take_columns) {
+        memcpy(self->edgesets.left, edgesets->left, edgesets->num_rows * sizeof(double));
+        memcpy(self->edgesets.right, edgesets->right,
+                edgesets->num_rows * sizeof(double));
+        memcpy(self->edgesets.parent, edgesets->parent,
+                edgesets->num_rows * sizeof(node_id_t));
+        memcpy(self->edgesets.children_length, edgesets->children_length,
+                edgesets->num_rows * sizeof(list_len_t));
+        memcpy(self->edgesets.children_mem, edgesets->children,
+                edgesets->total_children_length * sizeof(node_id_t));
+    }
     ret = tree_sequence_init_edgesets(self);
     if (ret != 0) {
         goto out;
     }
-    ret = tree_sequence_build_indexes(self);
+    ret = tree_sequence_build_indexes(self, 0);
     if (ret != 0) {
         goto out;
     }
@@ -1249,7 +1469,7 @@ tree_sequence_load_tables_tmp(tree_sequence_t *self,
     if (ret != 0) {
         goto out;
     }
-    if (migrations != NULL) {
+    if (migrations != NULL && !take_columns) {
         /* Set up the migrations */
         memcpy(self->migrations.left, migrations->left, migrations->num_rows * sizeof(double));
         memcpy(self->migrations.right, migrations->right, migrations->num_rows * sizeof(double));
@@ -1269,9 +1489,42 @@ tree_sequence_load_tables_tmp(tree_sequence_t *self,
         goto out;
     }
 out:
+    if (columns_taken) {
+        /* The data in the tables now belongs to the tree sequence */
+        node_table_reset(nodes);
+        edgeset_table_reset(edgesets);
+        if (migrations != NULL) {
+            migration_table_reset(migrations);
+        }
+    }
     return ret;
 }
 
+int WARN_UNUSED
+tree_sequence_load_tables_tmp(tree_sequence_t *self,
+    node_table_t *nodes, edgeset_table_t *edgesets, migration_table_t *migrations,
+    site_table_t *sites, mutation_table_t *mutations,
+    size_t num_provenance_strings, char **provenance_strings)
+{
+    return tree_sequence_load_tables_internal(self, nodes, edgesets, migrations,
+            sites, mutations, num_provenance_strings, provenance_strings, false);
+}
+
+/* As tree_sequence_load_tables_tmp, but the node, edgeset and migration
+ * columns are moved into the tree sequence rather than copied. The node,
+ * edgeset and migration tables are reset, and recycle the memory
+ * previously used by the tree sequence.
+ */
+int WARN_UNUSED
+tree_sequence_take_tables_tmp(tree_sequence_t *self,
+    node_table_t *nodes, edgeset_table_t *edgesets, migration_table_t *migrations,
+    site_table_t *sites, mutation_table_t *mutations,
+    size_t num_provenance_strings, char **provenance_strings)
+{
+    return tree_sequence_load_tables_internal(self, nodes, edgesets, migrations,
+            sites, mutations, num_provenance_strings, provenance_strings, true);
+}
+
 
 int WARN_UNUSED
 tree_sequence_dump_tables_tmp(tree_sequence_t *self,
@@ -2103,7 +2356,11 @@ tree_sequence_write_hdf5_data(tree_sequence_t *self, hid_t file_id, int flags)
                     goto out;
                 }
             }
-            if (flags & MSP_DUMP_ZLIB_COMPRESSION) {
+            /* HDF5 >= 1.10 refuses to apply filters to variable length
+             * strings, so the provenance dataset is stored unfiltered. */
+            if (fields[j].memory_type == memtype_str) {
+                /* no filters */
+            } else if (flags & MSP_DUMP_ZLIB_COMPRESSION) {
                 /* Turn on byte shuffling to improve compression */
                 status = H5Pset_shuffle(plist_id);
                 if (status < 0) {
@@ -2115,10 +2372,12 @@ tree_sequence_write_hdf5_data(tree_sequence_t *self, hid_t file_id, int flags)
                     goto out;
                 }
             }
-            /* Turn on Fletcher32 checksums for integrity checks */
-            status = H5Pset_fletcher32(plist_id);
-            if (status < 0) {
-                goto out;
+            if (fields[j].memory_type != memtype_str) {
+                /* Turn on Fletcher32 checksums for integrity checks */
+                status = H5Pset_fletcher32(plist_id);
+                if (status < 0) {
+                    goto out;
+                }
             }
             dataset_id = H5Dcreate2(file_id, fields[j].name,
                     fields[j].storage_type, dataspace_id, H5P_DEFAULT,
@@ -2394,114 +2653,1160 @@ out:
     return ret;
 }
 
-int WARN_UNUSED
-tree_sequence_get_node(tree_sequence_t *self, node_id_t index, node_t *node)
+/* ======================================================== *
+ * Branch statistics
+ * ======================================================== */
+
+/* Windows must be strictly increasing and cover the whole sequence. */
+static int WARN_UNUSED
+tree_sequence_check_windows(tree_sequence_t *self, size_t num_windows,
+        double *windows)
 {
-    int ret = 0;
+    int ret = MSP_ERR_BAD_WINDOWS;
+    size_t w;
 
-    if (index < 0 || index >= (node_id_t) self->nodes.num_records) {
-        ret = MSP_ERR_OUT_OF_BOUNDS;
+    if (num_windows < 1 || windows[0] != 0.0
+            || windows[num_windows] != self->sequence_length) {
         goto out;
     }
-    node->time = self->nodes.time[index];
-    node->population = self->nodes.population[index];
-    node->flags = self->nodes.flags[index];
-    node->name = self->nodes.name[index];
+    for (w = 0; w < num_windows; w++) {
+        if (windows[w] >= windows[w + 1]) {
+            goto out;
+        }
+    }
+    ret = 0;
 out:
     return ret;
 }
 
-int WARN_UNUSED
-tree_sequence_get_edgeset(tree_sequence_t *self, size_t index, edgeset_t *edgeset)
+/* The state of a branch statistic calculation. We maintain the number of
+ * members of each sample set below every node as edgesets are inserted and
+ * removed, along with the current weights of every node and the total
+ * (branch length x weight) over all branches in the current tree. Nodes
+ * whose parent or counts change while moving to the next tree are marked
+ * dirty, and their weights are recomputed with one call to the weight
+ * function per tree.
+ */
+typedef struct {
+    size_t num_sample_sets;
+    size_t num_outputs;
+    branch_stat_weight_func_t weight_func;
+    void *params;
+    double *time;
+    node_id_t *parent;
+    double *counts;
+    double *weights;
+    double *total;
+    double *delta;
+    bool *dirty;
+    size_t num_dirty;
+    node_id_t *dirty_nodes;
+    double *dirty_counts;
+    double *dirty_weights;
+} branch_stat_state_t;
+
+static void
+branch_stat_state_add_branch(branch_stat_state_t *self, node_id_t u, double sign)
 {
-    int ret = 0;
+    size_t j;
+    size_t M = self->num_outputs;
+    double length;
+    node_id_t v = self->parent[u];
 
-    if (index >= self->edgesets.num_records) {
-        ret = MSP_ERR_OUT_OF_BOUNDS;
-        goto out;
+    if (v != MSP_NULL_NODE) {
+        length = sign * (self->time[v] - self->time[u]);
+        for (j = 0; j < M; j++) {
+            self->total[j] += length * self->weights[(size_t) u * M + j];
+        }
     }
-    edgeset->left = self->edgesets.left[index];
-    edgeset->right = self->edgesets.right[index];
-    edgeset->parent = self->edgesets.parent[index];
-    edgeset->children_length = (size_t) self->edgesets.children_length[index];
-    edgeset->children = self->edgesets.children[index];
-out:
-    return ret;
 }
 
-int WARN_UNUSED
-tree_sequence_get_migration(tree_sequence_t *self, size_t index, migration_t *record)
+/* Removes the contribution of u's branch from the total, if this has not
+ * already been done for the current tree. */
+static inline void
+branch_stat_state_mark_dirty(branch_stat_state_t *self, node_id_t u)
 {
-    int ret = 0;
+    if (!self->dirty[u]) {
+        self->dirty[u] = true;
+        branch_stat_state_add_branch(self, u, -1);
+        self->dirty_nodes[self->num_dirty] = u;
+        self->num_dirty++;
+    }
+}
 
-    if (index >= self->migrations.num_records) {
-        ret = MSP_ERR_OUT_OF_BOUNDS;
-        goto out;
+static void
+branch_stat_state_update_path(branch_stat_state_t *self, node_id_t u, double sign)
+{
+    size_t k;
+    size_t K = self->num_sample_sets;
+    node_id_t v;
+    double *x;
+
+    for (v = u; v != MSP_NULL_NODE; v = self->parent[v]) {
+        branch_stat_state_mark_dirty(self, v);
+        x = self->counts + (size_t) v * K;
+        for (k = 0; k < K; k++) {
+            x[k] += sign * self->delta[k];
+        }
     }
-    record->node = self->migrations.node[index];
-    record->source = self->migrations.source[index];
-    record->dest = self->migrations.dest[index];
-    record->left = self->migrations.left[index];
-    record->right = self->migrations.right[index];
-    record->time = self->migrations.time[index];
-out:
-    return ret;
 }
 
-int WARN_UNUSED
-tree_sequence_get_mutation(tree_sequence_t *self, mutation_id_t id, mutation_t *record)
+static void
+branch_stat_state_set_delta(branch_stat_state_t *self, list_len_t num_children,
+        node_id_t *children)
+{
+    size_t k;
+    list_len_t j;
+    size_t K = self->num_sample_sets;
+
+    memset(self->delta, 0, K * sizeof(double));
+    for (j = 0; j < num_children; j++) {
+        for (k = 0; k < K; k++) {
+            self->delta[k] += self->counts[(size_t) children[j] * K + k];
+        }
+    }
+}
+
+/* Recomputes the weights of the dirty nodes and adds their branches back
+ * into the total. */
+static int WARN_UNUSED
+branch_stat_state_update_weights(branch_stat_state_t *self)
 {
     int ret = 0;
+    size_t j;
+    size_t K = self->num_sample_sets;
+    size_t M = self->num_outputs;
+    node_id_t u;
 
-    if (id < 0 || id >= (mutation_id_t) self->mutations.num_records) {
-        ret = MSP_ERR_OUT_OF_BOUNDS;
+    if (self->num_dirty == 0) {
         goto out;
     }
-    record->id = id;
-    record->index = (size_t) id; // TODO what is this for?
-    record->site = self->mutations.site[id];
-    record->node = self->mutations.node[id];
-    record->derived_state = self->mutations.derived_state[id];
-    record->derived_state_length = self->mutations.derived_state_length[id];
+    for (j = 0; j < self->num_dirty; j++) {
+        u = self->dirty_nodes[j];
+        memcpy(self->dirty_counts + j * K, self->counts + (size_t) u * K,
+                K * sizeof(double));
+    }
+    ret = self->weight_func(self->num_dirty, K, self->dirty_counts, M,
+            self->dirty_weights, self->params);
+    if (ret != 0) {
+        goto out;
+    }
+    for (j = 0; j < self->num_dirty; j++) {
+        u = self->dirty_nodes[j];
+        memcpy(self->weights + (size_t) u * M, self->dirty_weights + j * M,
+                M * sizeof(double));
+        branch_stat_state_add_branch(self, u, +1);
+        self->dirty[u] = false;
+    }
+    self->num_dirty = 0;
 out:
     return ret;
 }
 
+/* Computes the average over each window of the total branch length in each
+ * tree weighted by weight_func, which is called with the sample set counts
+ * below each node. The results for window j are stored in
+ * result[j * num_outputs + k] for k = 0, ..., num_outputs - 1.
+ */
 int WARN_UNUSED
-tree_sequence_get_site(tree_sequence_t *self, site_id_t id, site_t *record)
+tree_sequence_get_branch_stats(tree_sequence_t *self,
+        size_t num_sample_sets, size_t *sample_set_sizes, node_id_t *sample_sets,
+        size_t num_windows, double *windows, size_t num_outputs,
+        branch_stat_weight_func_t weight_func, void *params, double *result)
 {
     int ret = 0;
+    size_t N = self->nodes.num_records;
+    size_t R = self->edgesets.num_records;
+    size_t K = num_sample_sets;
+    size_t M = num_outputs;
+    double L = self->sequence_length;
+    node_id_t *I = self->edgesets.indexes.insertion_order;
+    node_id_t *O = self->edgesets.indexes.removal_order;
+    size_t j, k, m, w, offset;
+    list_len_t c;
+    node_id_t u, e;
+    double tree_left, tree_right, left, right;
+    branch_stat_state_t state;
 
-    if (id < 0 || id >= (site_id_t) self->sites.num_records) {
-        ret = MSP_ERR_OUT_OF_BOUNDS;
+    memset(&state, 0, sizeof(state));
+    if (num_sample_sets < 1 || num_outputs < 1 || weight_func == NULL) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
         goto out;
     }
-    record->id = id;
-    record->ancestral_state = self->sites.ancestral_state[id];
-    record->ancestral_state_length = self->sites.ancestral_state_length[id];
-    record->position = self->sites.position[id];
-    record->mutations = self->sites.site_mutations[id];
-    record->mutations_length = self->sites.site_mutations_length[id];
+    ret = tree_sequence_check_windows(self, num_windows, windows);
+    if (ret != 0) {
+        goto out;
+    }
+    state.num_sample_sets = K;
+    state.num_outputs = M;
+    state.weight_func = weight_func;
+    state.params = params;
+    state.time = self->nodes.time;
+    state.parent = malloc(N * sizeof(node_id_t));
+    state.counts = calloc(N * K, sizeof(double));
+    state.weights = malloc(N * M * sizeof(double));
+    state.total = calloc(M, sizeof(double));
+    state.delta = malloc(K * sizeof(double));
+    state.dirty = calloc(N, sizeof(bool));
+    state.dirty_nodes = malloc(N * sizeof(node_id_t));
+    state.dirty_counts = malloc(N * K * sizeof(double));
+    state.dirty_weights = malloc(N * M * sizeof(double));
+    if (state.parent == NULL || state.counts == NULL || state.weights == NULL
+            || state.total == NULL || state.delta == NULL || state.dirty == NULL
+            || state.dirty_nodes == NULL || state.dirty_counts == NULL
+            || state.dirty_weights == NULL) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    offset = 0;
+    for (k = 0; k < K; k++) {
+        for (j = 0; j < sample_set_sizes[k]; j++) {
+            u = sample_sets[offset + j];
+            if (u < 0 || u >= (node_id_t) N) {
+                ret = MSP_ERR_OUT_OF_BOUNDS;
+                goto out;
+            }
+            if (state.counts[(size_t) u * K + k] != 0) {
+                ret = MSP_ERR_DUPLICATE_SAMPLE;
+                goto out;
+            }
+            state.counts[(size_t) u * K + k] = 1;
+        }
+        offset += sample_set_sizes[k];
+    }
+    for (j = 0; j < N; j++) {
+        state.parent[j] = MSP_NULL_NODE;
+    }
+    ret = weight_func(N, K, state.counts, M, state.weights, params);
+    if (ret != 0) {
+        goto out;
+    }
+    memset(result, 0, num_windows * M * sizeof(double));
+
+    j = 0;
+    k = 0;
+    w = 0;
+    tree_left = 0;
+    while (tree_left < L) {
+        while (k < R && self->edgesets.right[O[k]] == tree_left) {
+            e = O[k];
+            branch_stat_state_set_delta(&state, self->edgesets.children_length[e],
+                    self->edgesets.children[e]);
+            for (c = 0; c < self->edgesets.children_length[e]; c++) {
+                u = self->edgesets.children[e][c];
+                branch_stat_state_mark_dirty(&state, u);
+                state.parent[u] = MSP_NULL_NODE;
+            }
+            branch_stat_state_update_path(&state, self->edgesets.parent[e], -1);
+            k++;
+        }
+        while (j < R && self->edgesets.left[I[j]] == tree_left) {
+            e = I[j];
+            branch_stat_state_set_delta(&state, self->edgesets.children_length[e],
+                    self->edgesets.children[e]);
+            branch_stat_state_update_path(&state, self->edgesets.parent[e], +1);
+            for (c = 0; c < self->edgesets.children_length[e]; c++) {
+                u = self->edgesets.children[e][c];
+                branch_stat_state_mark_dirty(&state, u);
+                state.parent[u] = self->edgesets.parent[e];
+            }
+            j++;
+        }
+        ret = branch_stat_state_update_weights(&state);
+        if (ret != 0) {
+            goto out;
+        }
+        tree_right = L;
+        if (j < R) {
+            tree_right = GSL_MIN(tree_right, self->edgesets.left[I[j]]);
+        }
+        if (k < R) {
+            tree_right = GSL_MIN(tree_right, self->edgesets.right[O[k]]);
+        }
+        assert(tree_right > tree_left);
+        /* Add the contribution of this tree to all the windows it overlaps */
+        while (w < num_windows) {
+            left = GSL_MAX(tree_left, windows[w]);
+            right = GSL_MIN(tree_right, windows[w + 1]);
+            for (m = 0; m < M; m++) {
+                result[w * M + m] += state.total[m] * (right - left);
+            }
+            if (windows[w + 1] > tree_right) {
+                break;
+            }
+            w++;
+        }
+        tree_left = tree_right;
+    }
+    for (w = 0; w < num_windows; w++) {
+        for (m = 0; m < M; m++) {
+            result[w * M + m] /= windows[w + 1] - windows[w];
+        }
+    }
 out:
+    msp_safe_free(state.parent);
+    msp_safe_free(state.counts);
+    msp_safe_free(state.weights);
+    msp_safe_free(state.total);
+    msp_safe_free(state.delta);
+    msp_safe_free(state.dirty);
+    msp_safe_free(state.dirty_nodes);
+    msp_safe_free(state.dirty_counts);
+    msp_safe_free(state.dirty_weights);
     return ret;
 }
 
-int WARN_UNUSED
-tree_sequence_get_samples(tree_sequence_t *self, node_id_t **samples)
+typedef struct {
+    int stat_type;
+    size_t arity;
+    uint32_t *set_indexes;
+    size_t *set_sizes;
+} branch_stat_params_t;
+
+size_t
+branch_stat_get_arity(int stat_type)
 {
-    *samples = self->samples;
-    return 0;
+    size_t ret = 0;
+
+    switch (stat_type) {
+        case MSP_STAT_DIVERSITY:
+            ret = 1;
+            break;
+        case MSP_STAT_DIVERGENCE:
+        case MSP_STAT_Y2:
+        case MSP_STAT_F2:
+            ret = 2;
+            break;
+        case MSP_STAT_Y3:
+        case MSP_STAT_F3:
+            ret = 3;
+            break;
+        case MSP_STAT_F4:
+            ret = 4;
+            break;
+    }
+    return ret;
 }
 
-int WARN_UNUSED
-tree_sequence_get_sample_index_map(tree_sequence_t *self, node_id_t **sample_index_map)
+static int
+branch_stat_weights(size_t num_rows, size_t num_sample_sets, double *counts,
+        size_t num_outputs, double *weights, void *params)
 {
-    *sample_index_map = self->nodes.sample_index_map;
-    return 0;
-}
+    branch_stat_params_t *p = (branch_stat_params_t *) params;
+    size_t j, k, l;
+    uint32_t *s;
+    double *x;
+    double n[4], y[4];
 
-/* Compress the node space in the specified set of records and mutations.
- */
+    for (j = 0; j < num_rows; j++) {
+        x = counts + j * num_sample_sets;
+        for (k = 0; k < num_outputs; k++) {
+            s = p->set_indexes + k * p->arity;
+            for (l = 0; l < p->arity; l++) {
+                n[l] = (double) p->set_sizes[s[l]];
+                y[l] = x[s[l]];
+            }
+            switch (p->stat_type) {
+                case MSP_STAT_DIVERSITY:
+                    weights[k] = 2 * y[0] * (n[0] - y[0]) / (n[0] * (n[0] - 1));
+                    break;
+                case MSP_STAT_DIVERGENCE:
+                    weights[k] = (y[0] * (n[1] - y[1]) + (n[0] - y[0]) * y[1])
+                        / (n[0] * n[1]);
+                    break;
+                case MSP_STAT_Y2:
+                    weights[k] = (y[0] * (n[1] - y[1]) * (n[1] - y[1] - 1)
+                            + (n[0] - y[0]) * y[1] * (y[1] - 1))
+                        / (n[0] * n[1] * (n[1] - 1));
+                    break;
+                case MSP_STAT_Y3:
+                    weights[k] = (y[0] * (n[1] - y[1]) * (n[2] - y[2])
+                            + (n[0] - y[0]) * y[1] * y[2])
+                        / (n[0] * n[1] * n[2]);
+                    break;
+                case MSP_STAT_F2:
+                    weights[k] = (y[0] / n[0] - y[1] / n[1])
+                        * (y[0] / n[0] - y[1] / n[1]);
+                    break;
+                case MSP_STAT_F3:
+                    weights[k] = (y[0] / n[0] - y[1] / n[1])
+                        * (y[0] / n[0] - y[2] / n[2]);
+                    break;
+                case MSP_STAT_F4:
+                    weights[k] = (y[0] / n[0] - y[1] / n[1])
+                        * (y[2] / n[2] - y[3] / n[3]);
+                    break;
+            }
+        }
+        weights += num_outputs;
+    }
+    return 0;
+}
+
+/* Computes one of the built-in branch statistics for each of the num_outputs
+ * tuples of sample set indexes in set_indexes, which holds arity consecutive
+ * indexes per output.
+ */
+int WARN_UNUSED
+tree_sequence_get_branch_stat(tree_sequence_t *self, int stat_type,
+        size_t num_sample_sets, size_t *sample_set_sizes, node_id_t *sample_sets,
+        size_t num_outputs, uint32_t *set_indexes, size_t num_windows,
+        double *windows, double *result)
+{
+    int ret = 0;
+    size_t j, k, min_size;
+    branch_stat_params_t params;
+
+    params.stat_type = stat_type;
+    params.arity = branch_stat_get_arity(stat_type);
+    params.set_indexes = set_indexes;
+    params.set_sizes = sample_set_sizes;
+    if (params.arity == 0) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
+        goto out;
+    }
+    for (j = 0; j < num_outputs; j++) {
+        for (k = 0; k < params.arity; k++) {
+            if (set_indexes[j * params.arity + k] >= num_sample_sets) {
+                ret = MSP_ERR_OUT_OF_BOUNDS;
+                goto out;
+            }
+            /* Diversity is within the first set and Y2 picks two samples
+             * from the second. */
+            min_size = 1;
+            if ((stat_type == MSP_STAT_DIVERSITY && k == 0)
+                    || (stat_type == MSP_STAT_Y2 && k == 1)) {
+                min_size = 2;
+            }
+            if (sample_set_sizes[set_indexes[j * params.arity + k]] < min_size) {
+                ret = MSP_ERR_INSUFFICIENT_SAMPLES;
+                goto out;
+            }
+        }
+    }
+    ret = tree_sequence_get_branch_stats(self, num_sample_sets, sample_set_sizes,
+            sample_sets, num_windows, windows, num_outputs, branch_stat_weights,
+            &params, result);
+out:
+    return ret;
+}
+
+/* ======================================================== *
+ * Parallel chunked traversal
+ * ======================================================== */
+
+typedef struct {
+    tree_sequence_t *tree_sequence;
+    int tree_flags;
+    tree_chunk_func_t func;
+    void *params;
+    double *boundaries;
+    size_t num_chunks;
+    size_t next_chunk;
+    int error;
+    pthread_mutex_t mutex;
+} tree_chunk_queue_t;
+
+static void
+tree_chunk_queue_set_error(tree_chunk_queue_t *self, int err)
+{
+    pthread_mutex_lock(&self->mutex);
+    if (self->error == 0) {
+        self->error = err;
+    }
+    pthread_mutex_unlock(&self->mutex);
+}
+
+/* Takes chunks from the queue until it is empty, processing each with a
+ * single sparse tree. */
+static void *
+tree_chunk_worker(void *arg)
+{
+    int ret = 0;
+    tree_chunk_queue_t *self = (tree_chunk_queue_t *) arg;
+    sparse_tree_t tree;
+    size_t chunk;
+
+    ret = sparse_tree_alloc(&tree, self->tree_sequence, self->tree_flags);
+    if (ret != 0) {
+        goto out;
+    }
+    while (true) {
+        pthread_mutex_lock(&self->mutex);
+        chunk = self->next_chunk;
+        self->next_chunk++;
+        if (self->error != 0) {
+            chunk = self->num_chunks;
+        }
+        pthread_mutex_unlock(&self->mutex);
+        if (chunk >= self->num_chunks) {
+            break;
+        }
+        if (self->boundaries[chunk] < self->boundaries[chunk + 1]) {
+            ret = self->func(&tree, self->boundaries[chunk],
+                    self->boundaries[chunk + 1], chunk, self->params);
+            if (ret != 0) {
+                goto out;
+            }
+        }
+    }
+out:
+    if (ret != 0) {
+        tree_chunk_queue_set_error(self, ret);
+    }
+    sparse_tree_free(&tree);
+    return NULL;
+}
+
+/* Splits the sequence into num_chunks intervals at tree boundaries, so that
+ * each contains roughly the same number of edgesets, and calls func for
+ * each chunk using num_threads worker threads. Each thread has its own
+ * sparse tree, allocated with the specified flags, which func should
+ * position using sparse_tree_seek(). Each tree is processed by exactly one
+ * chunk; chunks that contain no trees are skipped. func must only write
+ * to the part of params belonging to its chunk.
+ */
+int WARN_UNUSED
+tree_sequence_run_chunks(tree_sequence_t *self, size_t num_chunks,
+        size_t num_threads, int tree_flags, tree_chunk_func_t func, void *params)
+{
+    int ret = 0;
+    size_t R = self->edgesets.num_records;
+    node_id_t *I = self->edgesets.indexes.insertion_order;
+    tree_chunk_queue_t queue;
+    pthread_t *threads = NULL;
+    size_t j, num_started;
+    bool mutex_initialised = false;
+
+    memset(&queue, 0, sizeof(queue));
+    if (num_chunks < 1 || num_threads < 1 || func == NULL) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
+        goto out;
+    }
+    if (R == 0) {
+        goto out;
+    }
+    num_threads = GSL_MIN(num_threads, num_chunks);
+    queue.boundaries = malloc((num_chunks + 1) * sizeof(double));
+    threads = malloc(num_threads * sizeof(pthread_t));
+    if (queue.boundaries == NULL || threads == NULL) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    queue.boundaries[0] = 0;
+    for (j = 1; j < num_chunks; j++) {
+        queue.boundaries[j] = self->edgesets.left[I[(j * R) / num_chunks]];
+    }
+    queue.boundaries[num_chunks] = self->sequence_length;
+    queue.tree_sequence = self;
+    queue.tree_flags = tree_flags;
+    queue.func = func;
+    queue.params = params;
+    queue.num_chunks = num_chunks;
+    if (pthread_mutex_init(&queue.mutex, NULL) != 0) {
+        ret = MSP_ERR_THREAD;
+        goto out;
+    }
+    mutex_initialised = true;
+    if (num_threads == 1) {
+        tree_chunk_worker(&queue);
+    } else {
+        for (num_started = 0; num_started < num_threads; num_started++) {
+            if (pthread_create(&threads[num_started], NULL, tree_chunk_worker,
+                        &queue) != 0) {
+                tree_chunk_queue_set_error(&queue, MSP_ERR_THREAD);
+                break;
+            }
+        }
+        for (j = 0; j < num_started; j++) {
+            if (pthread_join(threads[j], NULL) != 0) {
+                tree_chunk_queue_set_error(&queue, MSP_ERR_THREAD);
+            }
+        }
+    }
+    ret = queue.error;
+out:
+    if (mutex_initialised) {
+        pthread_mutex_destroy(&queue.mutex);
+    }
+    msp_safe_free(queue.boundaries);
+    msp_safe_free(threads);
+    return ret;
+}
+
+/* ======================================================== *
+ * Site statistics
+ * ======================================================== */
+
+static double
+tajimas_d(double n, double pi, double S)
+{
+    double a1 = 0;
+    double a2 = 0;
+    double b1, b2, c1, c2, e1, e2;
+    double j;
+
+    if (n < 3 || S == 0) {
+        return GSL_NAN;
+    }
+    for (j = 1; j < n; j++) {
+        a1 += 1 / j;
+        a2 += 1 / (j * j);
+    }
+    b1 = (n + 1) / (3 * (n - 1));
+    b2 = 2 * (n * n + n + 3) / (9 * n * (n - 1));
+    c1 = b1 - 1 / a1;
+    c2 = b2 - (n + 2) / (a1 * n) + a2 / (a1 * a1);
+    e1 = c1 / a1;
+    e2 = c2 / (a1 * a1 + a2);
+    return (pi - S / a1) / sqrt(e1 * S + e2 * S * (S - 1));
+}
+
+typedef struct {
+    size_t num_sample_sets;
+    size_t *sample_set_sizes;
+    node_id_t *sample_sets;
+    size_t num_windows;
+    double *windows;
+    size_t max_mutations;
+    size_t sfs_width;
+    bool compute_divergence;
+    bool compute_sfs;
+    /* Per chunk sums */
+    double *pi;
+    double *segsites;
+    double *divergence;
+    double *sfs;
+} site_stats_t;
+
+/* Accumulates the site statistics for the trees in [start, end) into the
+ * sums for the specified chunk. */
+static int WARN_UNUSED
+site_stats_process_chunk(sparse_tree_t *tree, double start, double end,
+        size_t chunk, void *params)
+{
+    int ret = 0;
+    site_stats_t *self = (site_stats_t *) params;
+    size_t K = self->num_sample_sets;
+    size_t W = self->num_windows;
+    size_t sfs_width = self->sfs_width;
+    double *windows = self->windows;
+    double *pi = self->pi + chunk * W * K;
+    double *segsites = self->segsites + chunk * W * K;
+    double *divergence = self->divergence + chunk * W * K * K;
+    double *sfs = self->sfs + chunk * W * K * sfs_width;
+    size_t k, l, w;
+    list_len_t a, t, num_sites, num_alleles;
+    double n, m, c, sum_squares, num_present;
+    double *site_pi = NULL;
+    double *allele_counts = NULL;
+    const char **allele_states = NULL;
+    list_len_t *allele_state_lengths = NULL;
+    site_t *sites;
+
+    site_pi = malloc(K * sizeof(double));
+    allele_counts = malloc((self->max_mutations + 1) * K * sizeof(double));
+    allele_states = malloc((self->max_mutations + 1) * sizeof(char *));
+    allele_state_lengths = malloc((self->max_mutations + 1) * sizeof(list_len_t));
+    if (site_pi == NULL || allele_counts == NULL || allele_states == NULL
+            || allele_state_lengths == NULL) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    ret = sparse_tree_set_tracked_sample_sets(tree, K, self->sample_set_sizes,
+            self->sample_sets);
+    if (ret != 0) {
+        goto out;
+    }
+    w = 0;
+    for (ret = sparse_tree_seek(tree, start); ret == 1 && tree->left < end;
+            ret = sparse_tree_next(tree)) {
+        ret = sparse_tree_get_sites(tree, &sites, &num_sites);
+        if (ret != 0) {
+            goto out;
+        }
+        for (t = 0; t < num_sites; t++) {
+            while (sites[t].position >= windows[w + 1]) {
+                w++;
+            }
+            ret = sparse_tree_get_allele_counts(tree, &sites[t],
+                    self->sample_set_sizes, allele_counts, allele_states,
+                    allele_state_lengths, &num_alleles);
+            if (ret != 0) {
+                goto out;
+            }
+            for (k = 0; k < K; k++) {
+                n = (double) self->sample_set_sizes[k];
+                sum_squares = 0;
+                num_present = 0;
+                for (a = 0; a < num_alleles; a++) {
+                    c = allele_counts[a * K + k];
+                    sum_squares += c * c;
+                    num_present += c > 0;
+                    if (self->compute_sfs && a > 0) {
+                        sfs[(w * K + k) * sfs_width + (size_t) c] += 1;
+                    }
+                }
+                site_pi[k] = 0;
+                if (n > 1) {
+                    site_pi[k] = (n * n - sum_squares) / (n * (n - 1));
+                }
+                pi[w * K + k] += site_pi[k];
+                segsites[w * K + k] += num_present > 1;
+            }
+            if (self->compute_divergence) {
+                for (k = 0; k < K; k++) {
+                    for (l = 0; l < K; l++) {
+                        if (k == l) {
+                            c = site_pi[k];
+                        } else {
+                            n = (double) self->sample_set_sizes[k];
+                            m = (double) self->sample_set_sizes[l];
+                            c = n * m;
+                            for (a = 0; a < num_alleles; a++) {
+                                c -= allele_counts[a * K + k] * allele_counts[a * K + l];
+                            }
+                            c /= n * m;
+                        }
+                        divergence[(w * K + k) * K + l] += c;
+                    }
+                }
+            }
+        }
+    }
+    if (ret < 0) {
+        goto out;
+    }
+    ret = 0;
+out:
+    msp_safe_free(site_pi);
+    msp_safe_free(allele_counts);
+    msp_safe_free(allele_states);
+    msp_safe_free(allele_state_lengths);
+    return ret;
+}
+
+/* Computes site statistics for each of the sample sets in each window in
+ * a single pass over the trees. Diversity and the number of segregating
+ * sites are summed over the sites in each window. The statistic s for set
+ * k in window w is stored in result[(w * num_stats + s) * num_sample_sets + k].
+ *
+ * If divergence is not NULL, the summed divergence between sets j and k is
+ * stored in divergence[(w * num_sample_sets + j) * num_sample_sets + k];
+ * the diagonal holds the diversity. If sfs is not NULL, the number of
+ * derived alleles carried by c members of set k is stored in
+ * sfs[(w * num_sample_sets + k) * (max_set_size + 1) + c].
+ *
+ * The sequence is split into num_threads chunks which are processed in
+ * parallel, each by its own thread.
+ */
+int WARN_UNUSED
+tree_sequence_get_site_stats(tree_sequence_t *self,
+        size_t num_sample_sets, size_t *sample_set_sizes, node_id_t *sample_sets,
+        size_t num_windows, double *windows, size_t num_stats, int *stats,
+        size_t num_threads, double *result, double *divergence, double *sfs)
+{
+    int ret = 0;
+    size_t K = num_sample_sets;
+    size_t W = num_windows;
+    size_t C = num_threads;
+    size_t j, k, w, chunk, max_set_size;
+    double c;
+    site_stats_t params;
+
+    memset(&params, 0, sizeof(params));
+    if (K < 1 || num_threads < 1) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
+        goto out;
+    }
+    ret = tree_sequence_check_windows(self, W, windows);
+    if (ret != 0) {
+        goto out;
+    }
+    for (j = 0; j < num_stats; j++) {
+        if (stats[j] != MSP_SITE_STAT_DIVERSITY
+                && stats[j] != MSP_SITE_STAT_SEGREGATING_SITES
+                && stats[j] != MSP_SITE_STAT_TAJIMAS_D) {
+            ret = MSP_ERR_BAD_PARAM_VALUE;
+            goto out;
+        }
+    }
+    max_set_size = 0;
+    for (k = 0; k < K; k++) {
+        if (sample_set_sizes[k] < 1) {
+            ret = MSP_ERR_BAD_PARAM_VALUE;
+            goto out;
+        }
+        max_set_size = GSL_MAX(max_set_size, sample_set_sizes[k]);
+    }
+    params.num_sample_sets = K;
+    params.sample_set_sizes = sample_set_sizes;
+    params.sample_sets = sample_sets;
+    params.num_windows = W;
+    params.windows = windows;
+    params.sfs_width = max_set_size + 1;
+    params.compute_divergence = divergence != NULL;
+    params.compute_sfs = sfs != NULL;
+    for (j = 0; j < self->sites.num_records; j++) {
+        params.max_mutations = GSL_MAX(params.max_mutations,
+                self->sites.site_mutations_length[j]);
+    }
+    params.pi = calloc(C * W * K, sizeof(double));
+    params.segsites = calloc(C * W * K, sizeof(double));
+    params.divergence = calloc(divergence == NULL? 1: C * W * K * K, sizeof(double));
+    params.sfs = calloc(sfs == NULL? 1: C * W * K * params.sfs_width, sizeof(double));
+    if (params.pi == NULL || params.segsites == NULL || params.divergence == NULL
+            || params.sfs == NULL) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    ret = tree_sequence_run_chunks(self, C, num_threads, MSP_LEAF_COUNTS,
+            site_stats_process_chunk, &params);
+    if (ret != 0) {
+        goto out;
+    }
+    /* Reduce the chunks into the first */
+    for (chunk = 1; chunk < C; chunk++) {
+        for (j = 0; j < W * K; j++) {
+            params.pi[j] += params.pi[chunk * W * K + j];
+            params.segsites[j] += params.segsites[chunk * W * K + j];
+        }
+        if (divergence != NULL) {
+            for (j = 0; j < W * K * K; j++) {
+                params.divergence[j] += params.divergence[chunk * W * K * K + j];
+            }
+        }
+        if (sfs != NULL) {
+            for (j = 0; j < W * K * params.sfs_width; j++) {
+                params.sfs[j] += params.sfs[chunk * W * K * params.sfs_width + j];
+            }
+        }
+    }
+    if (divergence != NULL) {
+        memcpy(divergence, params.divergence, W * K * K * sizeof(double));
+    }
+    if (sfs != NULL) {
+        memcpy(sfs, params.sfs, W * K * params.sfs_width * sizeof(double));
+    }
+    for (w = 0; w < W; w++) {
+        for (j = 0; j < num_stats; j++) {
+            for (k = 0; k < K; k++) {
+                switch (stats[j]) {
+                    case MSP_SITE_STAT_DIVERSITY:
+                        c = params.pi[w * K + k];
+                        break;
+                    case MSP_SITE_STAT_SEGREGATING_SITES:
+                        c = params.segsites[w * K + k];
+                        break;
+                    default:
+                        c = tajimas_d((double) sample_set_sizes[k],
+                                params.pi[w * K + k], params.segsites[w * K + k]);
+                        break;
+                }
+                result[(w * num_stats + j) * K + k] = c;
+            }
+        }
+    }
+out:
+    msp_safe_free(params.pi);
+    msp_safe_free(params.segsites);
+    msp_safe_free(params.divergence);
+    msp_safe_free(params.sfs);
+    return ret;
+}
+
+/* Computes the branch length site frequency spectrum in each window: the
+ * average along the window of the total length of the branches that subtend
+ * exactly k samples, stored in result[w * (sample_size + 1) + k]. The
+ * per-class branch lengths are maintained incrementally by the sparse tree,
+ * so the cost is proportional to the number of edges times the tree depth,
+ * plus the number of windows times the sample size.
+ */
+int WARN_UNUSED
+tree_sequence_get_branch_sfs(tree_sequence_t *self, size_t num_windows,
+        double *windows, double *result)
+{
+    int ret = 0;
+    size_t N = self->sample_size + 1;
+    size_t k, w;
+    double y, area;
+    double *last_area = NULL;
+    sparse_tree_t tree;
+    bool tree_alloced = false;
+
+    ret = tree_sequence_check_windows(self, num_windows, windows);
+    if (ret != 0) {
+        goto out;
+    }
+    last_area = calloc(N, sizeof(double));
+    if (last_area == NULL) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    ret = sparse_tree_alloc(&tree, self, MSP_LEAF_COUNTS|MSP_BRANCH_LENGTHS);
+    if (ret != 0) {
+        goto out;
+    }
+    tree_alloced = true;
+    memset(result, 0, num_windows * N * sizeof(double));
+
+    w = 0;
+    for (ret = sparse_tree_first(&tree); ret == 1; ret = sparse_tree_next(&tree)) {
+        while (w < num_windows && windows[w + 1] <= tree.right) {
+            y = windows[w + 1];
+            for (k = 0; k < N; k++) {
+                area = tree.branch_length_area[k] + tree.branch_length_by_count[k]
+                    * (y - tree.branch_length_position[k]);
+                result[w * N + k] = (area - last_area[k]) / (y - windows[w]);
+                last_area[k] = area;
+            }
+            w++;
+        }
+    }
+out:
+    if (tree_alloced) {
+        sparse_tree_free(&tree);
+    }
+    msp_safe_free(last_area);
+    return ret;
+}
+
+/* Returns the number of entries in the joint site frequency spectrum of the
+ * specified sample sets within a single window. */
+size_t
+tree_sequence_get_sfs_size(size_t num_sample_sets, size_t *sample_set_sizes)
+{
+    size_t k;
+    size_t size = 1;
+
+    for (k = 0; k < num_sample_sets; k++) {
+        size *= sample_set_sizes[k] + 1;
+    }
+    return size;
+}
+
+/* Computes the joint site frequency spectrum of the specified sample sets in
+ * each window. Every derived allele at a site contributes one to the entry
+ * indexed by the number of copies (c_0, ..., c_{K-1}) carried by each set;
+ * entries are stored in row-major order so that window w and counts c map to
+ * result[w * S + (...(c_0 * (n_1 + 1) + c_1) ...) * (n_{K-1} + 1) + c_{K-1}],
+ * where S = tree_sequence_get_sfs_size(). With a single sample set this is
+ * the usual one-way SFS.
+ *
+ * If MSP_SFS_FOLDED is set, alleles carried by more than half of the
+ * combined samples are counted by their complement (n_0 - c_0, ...), so
+ * that the entries for such counts are always zero.
+ */
+int WARN_UNUSED
+tree_sequence_get_sfs(tree_sequence_t *self, size_t num_sample_sets,
+        size_t *sample_set_sizes, node_id_t *sample_sets, size_t num_windows,
+        double *windows, int flags, double *result)
+{
+    int ret = 0;
+    size_t K = num_sample_sets;
+    size_t j, k, w, index, total_size, sfs_size;
+    size_t max_mutations = 0;
+    list_len_t a, t, num_sites, num_alleles;
+    double total_count, c;
+    double *allele_counts = NULL;
+    const char **allele_states = NULL;
+    list_len_t *allele_state_lengths = NULL;
+    site_t *sites;
+    sparse_tree_t tree;
+    bool tree_alloced = false;
+    bool fold;
+
+    if (K < 1) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
+        goto out;
+    }
+    ret = tree_sequence_check_windows(self, num_windows, windows);
+    if (ret != 0) {
+        goto out;
+    }
+    total_size = 0;
+    for (k = 0; k < K; k++) {
+        if (sample_set_sizes[k] < 1) {
+            ret = MSP_ERR_BAD_PARAM_VALUE;
+            goto out;
+        }
+        total_size += sample_set_sizes[k];
+    }
+    sfs_size = tree_sequence_get_sfs_size(K, sample_set_sizes);
+    for (j = 0; j < self->sites.num_records; j++) {
+        max_mutations = GSL_MAX(max_mutations, self->sites.site_mutations_length[j]);
+    }
+    allele_counts = malloc((max_mutations + 1) * K * sizeof(double));
+    allele_states = malloc((max_mutations + 1) * sizeof(char *));
+    allele_state_lengths = malloc((max_mutations + 1) * sizeof(list_len_t));
+    if (allele_counts == NULL || allele_states == NULL
+            || allele_state_lengths == NULL) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    ret = sparse_tree_alloc(&tree, self, MSP_LEAF_COUNTS);
+    if (ret != 0) {
+        goto out;
+    }
+    tree_alloced = true;
+    ret = sparse_tree_set_tracked_sample_sets(&tree, K, sample_set_sizes,
+            sample_sets);
+    if (ret != 0) {
+        goto out;
+    }
+    memset(result, 0, num_windows * sfs_size * sizeof(double));
+
+    w = 0;
+    for (ret = sparse_tree_first(&tree); ret == 1; ret = sparse_tree_next(&tree)) {
+        ret = sparse_tree_get_sites(&tree, &sites, &num_sites);
+        if (ret != 0) {
+            goto out;
+        }
+        for (t = 0; t < num_sites; t++) {
+            while (sites[t].position >= windows[w + 1]) {
+                w++;
+            }
+            ret = sparse_tree_get_allele_counts(&tree, &sites[t], sample_set_sizes,
+                    allele_counts, allele_states, allele_state_lengths, &num_alleles);
+            if (ret != 0) {
+                goto out;
+            }
+            for (a = 1; a < num_alleles; a++) {
+                total_count = 0;
+                for (k = 0; k < K; k++) {
+                    total_count += allele_counts[a * K + k];
+                }
+                fold = (flags & MSP_SFS_FOLDED) && 2 * total_count > (double) total_size;
+                index = 0;
+                for (k = 0; k < K; k++) {
+                    c = allele_counts[a * K + k];
+                    if (fold) {
+                        c = (double) sample_set_sizes[k] - c;
+                    }
+                    index = index * (sample_set_sizes[k] + 1) + (size_t) c;
+                }
+                result[w * sfs_size + index] += 1;
+            }
+        }
+    }
+out:
+    if (tree_alloced) {
+        sparse_tree_free(&tree);
+    }
+    msp_safe_free(allele_counts);
+    msp_safe_free(allele_states);
+    msp_safe_free(allele_state_lengths);
+    return ret;
+}
+
+int WARN_UNUSED
+tree_sequence_get_node(tree_sequence_t *self, node_id_t index, node_t *node)
+{
+    int ret = 0;
+
+    if (index < 0 || index >= (node_id_t) self->nodes.num_records) {
+        ret = MSP_ERR_OUT_OF_BOUNDS;
+        goto out;
+    }
+    node->time = self->nodes.time[index];
+    node->population = self->nodes.population[index];
+    node->flags = self->nodes.flags[index];
+    node->name = self->nodes.name[index];
+out:
+    return ret;
+}
+
+int WARN_UNUSED
+tree_sequence_get_edgeset(tree_sequence_t *self, size_t index, edgeset_t *edgeset)
+{
+    int ret = 0;
+
+    if (index >= self->edgesets.num_records) {
+        ret = MSP_ERR_OUT_OF_BOUNDS;
+        goto out;
+    }
+    edgeset->left = self->edgesets.left[index];
+    edgeset->right = self->edgesets.right[index];
+    edgeset->parent = self->edgesets.parent[index];
+    edgeset->children_length = (size_t) self->edgesets.children_length[index];
+    edgeset->children = self->edgesets.children[index];
+out:
+    return ret;
+}
+
+int WARN_UNUSED
+tree_sequence_get_migration(tree_sequence_t *self, size_t index, migration_t *record)
+{
+    int ret = 0;
+
+    if (index >= self->migrations.num_records) {
+        ret = MSP_ERR_OUT_OF_BOUNDS;
+        goto out;
+    }
+    record->node = self->migrations.node[index];
+    record->source = self->migrations.source[index];
+    record->dest = self->migrations.dest[index];
+    record->left = self->migrations.left[index];
+    record->right = self->migrations.right[index];
+    record->time = self->migrations.time[index];
+out:
+    return ret;
+}
+
+int WARN_UNUSED
+tree_sequence_get_mutation(tree_sequence_t *self, mutation_id_t id, mutation_t *record)
+{
+    int ret = 0;
+
+    if (id < 0 || id >= (mutation_id_t) self->mutations.num_records) {
+        ret = MSP_ERR_OUT_OF_BOUNDS;
+        goto out;
+    }
+    record->id = id;
+    record->index = (size_t) id; // TODO what is this for?
+    record->site = self->mutations.site[id];
+    record->node = self->mutations.node[id];
+    record->derived_state = self->mutations.derived_state[id];
+    record->derived_state_length = self->mutations.derived_state_length[id];
+out:
+    return ret;
+}
+
+int WARN_UNUSED
+tree_sequence_get_site(tree_sequence_t *self, site_id_t id, site_t *record)
+{
+    int ret = 0;
+
+    if (id < 0 || id >= (site_id_t) self->sites.num_records) {
+        ret = MSP_ERR_OUT_OF_BOUNDS;
+        goto out;
+    }
+    record->id = id;
+    record->ancestral_state = self->sites.ancestral_state[id];
+    record->ancestral_state_length = self->sites.ancestral_state_length[id];
+    record->position = self->sites.position[id];
+    record->mutations = self->sites.site_mutations[id];
+    record->mutations_length = self->sites.site_mutations_length[id];
+out:
+    return ret;
+}
+
+int WARN_UNUSED
+tree_sequence_get_samples(tree_sequence_t *self, node_id_t **samples)
+{
+    *samples = self->samples;
+    return 0;
+}
+
+int WARN_UNUSED
+tree_sequence_get_sample_index_map(tree_sequence_t *self, node_id_t **sample_index_map)
+{
+    *sample_index_map = self->nodes.sample_index_map;
+    return 0;
+}
+
+/* Compress the node space in the specified set of records and mutations.
+ */
 static int WARN_UNUSED
 tree_sequence_compress_nodes(tree_sequence_t *self, node_id_t *samples, size_t num_samples,
         coalescence_record_t *records, size_t num_records, mutation_t *mutations,
@@ -2584,18 +3889,111 @@ tree_sequence_compress_sites(tree_sequence_t *self,
     return ret;
 }
 
-/* TODO this needs to be updated to use the new tables/edgesets API. We currently
+/* Checks the samples passed to simplify and sets mapping[u] = u for each
+ * sample u. All values in mapping must be MSP_NULL_NODE on entry.
+ */
+static int WARN_UNUSED
+tree_sequence_map_simplify_samples(tree_sequence_t *self, node_id_t *samples,
+        size_t num_samples, node_id_t *mapping)
+{
+    int ret = 0;
+    size_t j;
+    node_id_t u;
+
+    if (num_samples < 2) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
+        goto out;
+    }
+    for (j = 0; j < num_samples; j++) {
+        u = samples[j];
+        if (u < 0 || u >= (node_id_t) self->nodes.num_records) {
+            ret = MSP_ERR_OUT_OF_BOUNDS;
+            goto out;
+        }
+        if (!(self->nodes.flags[u] & MSP_NODE_IS_SAMPLE)) {
+            ret = MSP_ERR_BAD_SAMPLES;
+            goto out;
+        }
+        if (mapping[u] != MSP_NULL_NODE) {
+            ret = MSP_ERR_DUPLICATE_SAMPLE;
+            goto out;
+        }
+        mapping[u] = u;
+    }
+out:
+    return ret;
+}
+
+/* Sorts and compresses the records, sites and mutations produced by
+ * simplify and loads them into the output tree sequence.
+ */
+static int WARN_UNUSED
+tree_sequence_load_simplified(tree_sequence_t *self, node_id_t *samples,
+        size_t num_samples, int flags, coalescence_record_t *records,
+        size_t num_records, site_t *sites, mutation_t *mutations,
+        size_t num_mutations, tree_sequence_t *output)
+{
+    int ret = 0;
+    size_t j, num_sites;
+    sample_t *sample_objects = NULL;
+
+    if (num_records == 0) {
+        ret = MSP_ERR_CANNOT_SIMPLIFY;
+        goto out;
+    }
+    sample_objects = malloc(num_samples * sizeof(sample_t));
+    if (sample_objects == NULL) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    for (j = 0; j < num_samples; j++) {
+        sample_objects[j].population_id = self->nodes.population[samples[j]];
+        sample_objects[j].time = self->nodes.time[samples[j]];
+    }
+    /* Sort the records by time and left coordinate */
+    qsort(records, num_records, sizeof(coalescence_record_t), cmp_record_time_left);
+    ret = tree_sequence_compress_nodes(self, samples, num_samples,
+            records, num_records, mutations, num_mutations);
+    if (ret != 0) {
+        goto out;
+    }
+    num_sites = self->sites.num_records;
+    if (flags & MSP_FILTER_INVARIANT_SITES) {
+        ret = tree_sequence_compress_sites(self, mutations, num_mutations,
+                sites, &num_sites);
+        if (ret != 0) {
+            goto out;
+        }
+    }
+    ret = tree_sequence_load_records(output, num_samples, sample_objects,
+            num_records, records, num_sites, sites, num_mutations, mutations);
+    if (ret != 0) {
+        tree_sequence_free(output);
+        goto out;
+    }
+out:
+    if (sample_objects != NULL) {
+        free(sample_objects);
+    }
+    return ret;
+}
+
+/* The original simplify algorithm, which walks along the sequence applying
+ * the edgeset diffs for each tree in turn and tracks the records for the
+ * nodes in the subset tree as they are created and destroyed.
+ *
+ * TODO this needs to be updated to use the new tables/edgesets API. We currently
  * use coalescence_records because it makes it simpler for sorting records by time.
  * This should really be spun into its own class, as this function is far too long.
  */
-int WARN_UNUSED
-tree_sequence_simplify(tree_sequence_t *self, node_id_t *samples,
+static int WARN_UNUSED
+tree_sequence_simplify_tree_diffs(tree_sequence_t *self, node_id_t *samples,
         size_t num_samples, int flags, tree_sequence_t *output)
 {
     typedef struct {
         bool active;
         double left;
-        node_id_t *mapped_children;
+        size_t mapped_children_offset;
         uint32_t num_mapped_children;
     } active_record_t;
 
@@ -2606,17 +4004,19 @@ tree_sequence_simplify(tree_sequence_t *self, node_id_t *samples,
     node_id_t *mapping = NULL;
     node_id_t *mapped_children = NULL;
     node_id_t *mapped_children_mem = NULL;
-    sample_t *sample_objects = NULL;
     active_record_t *active_records = NULL;
     coalescence_record_t *output_records = NULL;
+    size_t *output_record_children = NULL;
     mutation_t *output_mutations = NULL;
     site_t *output_sites = NULL;
     node_id_t *I = self->edgesets.indexes.insertion_order;
     node_id_t *O = self->edgesets.indexes.removal_order;
     size_t M = self->edgesets.num_records;
     size_t j, k, next_avl_node, mapped_children_mem_offset, num_output_records,
-           num_output_mutations, max_num_child_nodes, max_num_records,
-           num_output_sites;
+           num_output_mutations;
+    size_t max_num_child_nodes = 0;
+    size_t max_num_records = 0;
+    size_t max_num_record_children = 0;
     node_id_t u, v, w, h;
     list_len_t c;
     size_t num_mapped_children, l;
@@ -2628,36 +4028,21 @@ tree_sequence_simplify(tree_sequence_t *self, node_id_t *samples,
     coalescence_record_t *cr;
     bool equal, activate_record;
     double right, x;
-    bool filter_invariant_sites = flags & MSP_FILTER_INVARIANT_SITES;
 
-    if (num_samples < 2) {
-        ret = MSP_ERR_BAD_PARAM_VALUE;
-        goto out;
-    }
     parent = malloc(self->nodes.num_records * sizeof(node_id_t));
     children = malloc(self->nodes.num_records * sizeof(node_id_t *));
     children_length = malloc(self->nodes.num_records * sizeof(node_id_t));
     mapping = malloc(self->nodes.num_records * sizeof(node_id_t));
-    sample_objects = malloc(num_samples * sizeof(sample_t));
     avl_node_mem = malloc(self->nodes.num_records * sizeof(avl_node_t));
     avl_node_value_mem = malloc(self->nodes.num_records * sizeof(node_id_t));
     active_records = malloc(self->nodes.num_records * sizeof(active_record_t));
     mapped_children = malloc(self->nodes.num_records * sizeof(node_id_t));
-    /* TODO these bounds aren't safe, as we can always construct pathological
-     * examples that will exceed them. When we're refactoring this into an
-     * class, we should replace this with a stack that can grow.
-     */
-    max_num_child_nodes = 4 * self->edgesets.total_children_length;
-    max_num_records = 2 * self->edgesets.num_records;
-    mapped_children_mem = malloc(max_num_child_nodes * sizeof(node_id_t));
-    output_records = malloc(max_num_records * sizeof(coalescence_record_t));
     output_sites = malloc(self->sites.num_records * sizeof(site_t));
     output_mutations = malloc(self->mutations.num_records * sizeof(mutation_t));
     if (parent == NULL || children == NULL || children_length == NULL
-            || mapping == NULL || sample_objects == NULL
+            || mapping == NULL
             || avl_node_mem == NULL || avl_node_value_mem == NULL
             || mapped_children == NULL || active_records == NULL
-            || mapped_children_mem == NULL || output_records == NULL
             || output_mutations == NULL || output_sites == NULL) {
         ret = MSP_ERR_NO_MEMORY;
         goto out;
@@ -2672,24 +4057,10 @@ tree_sequence_simplify(tree_sequence_t *self, node_id_t *samples,
         avl_node_mem[u].item = avl_node_value_mem + u;
         active_records[u].active = false;
     }
-    for (j = 0; j < num_samples; j++) {
-        u = samples[j];
-        if (u < 0 || u >= (node_id_t) self->nodes.num_records) {
-            ret = MSP_ERR_OUT_OF_BOUNDS;
-            goto out;
-        }
-        if (!(self->nodes.flags[u] & MSP_NODE_IS_SAMPLE)) {
-            ret = MSP_ERR_BAD_SAMPLES;
-            goto out;
-        }
-        if (mapping[u] != MSP_NULL_NODE) {
-            ret = MSP_ERR_DUPLICATE_SAMPLE;
-            goto out;
-        }
-        mapping[u] = u;
-        sample_objects[j].population_id = self->nodes.population[u];
-        sample_objects[j].time = self->nodes.time[u];
-    }
+    ret = tree_sequence_map_simplify_samples(self, samples, num_samples, mapping);
+    if (ret != 0) {
+        goto out;
+    }
     avl_init_tree(&visited_nodes, cmp_node_id_t, NULL);
     mapped_children_mem_offset = 0;
     num_output_records = 0;
@@ -2791,19 +4162,30 @@ tree_sequence_simplify(tree_sequence_t *self, node_id_t *samples,
                 if (num_mapped_children == ar->num_mapped_children) {
                     qsort(mapped_children, num_mapped_children, sizeof(node_id_t),
                             cmp_node_id_t);
-                    equal = memcmp(ar->mapped_children, mapped_children,
+                    equal = memcmp(mapped_children_mem + ar->mapped_children_offset,
+                            mapped_children,
                             num_mapped_children * sizeof(node_id_t)) == 0;
                 }
                 if (!equal) {
                     ar->active = false;
-                    assert(num_output_records < max_num_records);
+                    ret = msp_expand_array(output_records, &max_num_records,
+                            num_output_records + 1);
+                    if (ret != 0) {
+                        goto out;
+                    }
+                    ret = msp_expand_array(output_record_children,
+                            &max_num_record_children, num_output_records + 1);
+                    if (ret != 0) {
+                        goto out;
+                    }
+                    output_record_children[num_output_records] =
+                        ar->mapped_children_offset;
                     cr = &output_records[num_output_records];
                     num_output_records++;
                     cr->left = ar->left;
                     cr->right = x;
                     cr->node = u;
                     cr->num_children = ar->num_mapped_children;
-                    cr->children = ar->mapped_children;
                     cr->time = self->nodes.time[u];
                     cr->population_id = self->nodes.population[u];
                     if (u == mapping[u]) {
@@ -2819,18 +4201,22 @@ tree_sequence_simplify(tree_sequence_t *self, node_id_t *samples,
                 ar->active = true;
                 ar->left = x;
                 ar->num_mapped_children = 0;
-                ar->mapped_children = mapped_children_mem + mapped_children_mem_offset;
+                ar->mapped_children_offset = mapped_children_mem_offset;
+                ret = msp_expand_array(mapped_children_mem, &max_num_child_nodes,
+                        mapped_children_mem_offset + children_length[u]);
+                if (ret != 0) {
+                    goto out;
+                }
                 for (c = 0; c < children_length[u]; c++) {
                     v = children[u][c];
                     if (mapping[v] != MSP_NULL_NODE) {
-                        assert(mapped_children_mem_offset < max_num_child_nodes);
+                        mapped_children_mem[mapped_children_mem_offset] = mapping[v];
                         mapped_children_mem_offset++;
-                        ar->mapped_children[ar->num_mapped_children] = mapping[v];
                         ar->num_mapped_children++;
                     }
                 }
-                qsort(ar->mapped_children, ar->num_mapped_children, sizeof(node_id_t),
-                        cmp_node_id_t);
+                qsort(mapped_children_mem + ar->mapped_children_offset,
+                        ar->num_mapped_children, sizeof(node_id_t), cmp_node_id_t);
             }
         }
 
@@ -2878,7 +4264,17 @@ tree_sequence_simplify(tree_sequence_t *self, node_id_t *samples,
     for (u = 0; u < (node_id_t) self->nodes.num_records; u++) {
         ar = &active_records[u];
         if (ar->active) {
-            assert(num_output_records < max_num_records);
+            ret = msp_expand_array(output_records, &max_num_records,
+                    num_output_records + 1);
+            if (ret != 0) {
+                goto out;
+            }
+            ret = msp_expand_array(output_record_children,
+                    &max_num_record_children, num_output_records + 1);
+            if (ret != 0) {
+                goto out;
+            }
+            output_record_children[num_output_records] = ar->mapped_children_offset;
             cr = &output_records[num_output_records];
             num_output_records++;
             cr->left = ar->left;
@@ -2887,40 +4283,16 @@ tree_sequence_simplify(tree_sequence_t *self, node_id_t *samples,
             cr->time = self->nodes.time[u];
             cr->population_id = self->nodes.population[u];
             cr->num_children = (uint32_t) ar->num_mapped_children;
-            cr->children = ar->mapped_children;
-        }
-    }
-
-    if (num_output_records == 0) {
-        ret = MSP_ERR_CANNOT_SIMPLIFY;
-        goto out;
-    }
-    /* Sort the records by time and left coordinate */
-    qsort(output_records, num_output_records, sizeof(coalescence_record_t),
-            cmp_record_time_left);
-    ret = tree_sequence_compress_nodes(self, samples, num_samples,
-            output_records, num_output_records, output_mutations,
-            num_output_mutations);
-    if (ret != 0) {
-        goto out;
-    }
-    num_output_sites = self->sites.num_records;
-    if (filter_invariant_sites) {
-        ret = tree_sequence_compress_sites(self, output_mutations, num_output_mutations,
-                output_sites, &num_output_sites);
-        if (ret != 0) {
-            goto out;
         }
     }
-    /* Alloc a new tree sequence for these records. */
-    ret = tree_sequence_load_records(output, num_samples, sample_objects,
-            num_output_records, output_records,
-            num_output_sites, output_sites,
-            num_output_mutations, output_mutations);
-    if (ret != 0) {
-        tree_sequence_free(output);
-        goto out;
+    /* The children memory may have moved as it grew, so we can only point
+     * the records at it once we're finished. */
+    for (j = 0; j < num_output_records; j++) {
+        output_records[j].children = mapped_children_mem + output_record_children[j];
     }
+    ret = tree_sequence_load_simplified(self, samples, num_samples, flags,
+            output_records, num_output_records, output_sites,
+            output_mutations, num_output_mutations, output);
 out:
     if (parent != NULL) {
         free(parent);
@@ -2934,9 +4306,6 @@ out:
     if (mapping != NULL) {
         free(mapping);
     }
-    if (sample_objects != NULL) {
-        free(sample_objects);
-    }
     if (avl_node_value_mem != NULL) {
         free(avl_node_value_mem);
     }
@@ -2955,6 +4324,9 @@ out:
     if (output_records != NULL) {
         free(output_records);
     }
+    if (output_record_children != NULL) {
+        free(output_record_children);
+    }
     if (output_mutations != NULL) {
         free(output_mutations);
     }
@@ -2964,6 +4336,29 @@ out:
     return ret;
 }
 
+int WARN_UNUSED
+tree_sequence_simplify(tree_sequence_t *self, node_id_t *samples,
+        size_t num_samples, int flags, tree_sequence_t *output)
+{
+    int ret;
+    simplifier_t simplifier;
+
+    memset(&simplifier, 0, sizeof(simplifier));
+    if (flags & MSP_SIMPLIFY_TREE_DIFFS) {
+        ret = tree_sequence_simplify_tree_diffs(self, samples, num_samples, flags,
+                output);
+    } else {
+        ret = simplifier_alloc(&simplifier, flags);
+        if (ret != 0) {
+            goto out;
+        }
+        ret = simplifier_run(&simplifier, self, samples, num_samples, output);
+    }
+out:
+    simplifier_free(&simplifier);
+    return ret;
+}
+
 /* ======================================================== *
  * Tree diff iterator.
  * ======================================================== */
@@ -3098,60 +4493,82 @@ tree_diff_iterator_next(tree_diff_iterator_t *self, double *length,
  * sparse tree
  * ======================================================== */
 
+/* Returns node u to its state in the cleared tree. */
+static void
+sparse_tree_reset_node(sparse_tree_t *self, node_id_t u)
+{
+    tree_sequence_t *s = self->tree_sequence;
+    const bool is_sample = !!(s->nodes.flags[u] & MSP_NODE_IS_SAMPLE);
+    leaf_list_node_t *w;
+
+    self->parent[u] = MSP_NULL_NODE;
+    self->num_children[u] = 0;
+    self->children[u] = NULL;
+    if (is_sample) {
+        self->population[u] = s->nodes.population[u];
+        self->time[u] = s->nodes.time[u];
+    } else {
+        self->population[u] = MSP_NULL_POPULATION_ID;
+        self->time[u] = 0;
+    }
+    if (self->flags & MSP_LEAF_COUNTS) {
+        self->num_leaves[u] = is_sample;
+        self->marked[u] = 0;
+        /* The tracked counts of samples are retained across clears. */
+        if (! is_sample) {
+            self->num_tracked_leaves[u] = 0;
+            if (self->num_tracked_sets > 0) {
+                memset(self->tracked_set_counts + (size_t) u * self->num_tracked_sets,
+                        0, self->num_tracked_sets * sizeof(node_id_t));
+            }
+        }
+    }
+    if (self->flags & MSP_LEAF_LISTS) {
+        w = NULL;
+        if (is_sample) {
+            w = &self->leaf_list_node_mem[s->nodes.sample_index_map[u]];
+            w->next = NULL;
+            w->node = u;
+        }
+        self->leaf_list_head[u] = w;
+        self->leaf_list_tail[u] = w;
+    }
+}
+
+static inline void
+sparse_tree_touch_node(sparse_tree_t *self, node_id_t u)
+{
+    if (! self->touched[u]) {
+        self->touched[u] = true;
+        self->touched_nodes[self->num_touched_nodes] = u;
+        self->num_touched_nodes++;
+    }
+}
+
 static int WARN_UNUSED
 sparse_tree_clear(sparse_tree_t *self)
 {
     int ret = 0;
-    size_t N = self->num_nodes;
     size_t j;
     node_id_t u;
-    leaf_list_node_t *w;
 
     self->left = 0;
     self->right = 0;
     self->root = 0;
     self->index = (size_t) -1;
-    /* TODO we should profile this method to see if just doing a single loop over
-     * the nodes would be more efficient than multiple memsets.
-     */
-    memset(self->parent, 0xff, N * sizeof(node_id_t));
-    memset(self->population, 0xff, N * sizeof(population_id_t));
-    memset(self->time, 0, N * sizeof(double));
-    memset(self->num_children, 0, N * sizeof(node_id_t));
-    memset(self->children, 0, N * sizeof(node_id_t *));
-    if (self->flags & MSP_LEAF_COUNTS) {
-        memset(self->num_leaves, 0, N * sizeof(node_id_t));
-        memset(self->marked, 0, N * sizeof(uint8_t));
-        /* We can't reset the tracked leaves via memset because we don't
-         * know where the tracked samples are.
-         */
-        for (j = 0; j < self->num_nodes; j++) {
-            if (! tree_sequence_is_sample(self->tree_sequence, (node_id_t) j)) {
-                self->num_tracked_leaves[j] = 0;
-            }
-        }
-    }
-    if (self->flags & MSP_LEAF_LISTS) {
-        memset(self->leaf_list_head, 0, N * sizeof(leaf_list_node_t *));
-        memset(self->leaf_list_tail, 0, N * sizeof(leaf_list_node_t *));
-    }
-    /* Set the sample attributes */
-    for (j = 0; j < self->sample_size; j++) {
-        u = self->samples[j];
-        self->population[u] = self->tree_sequence->nodes.population[u];
-        self->time[u] = self->tree_sequence->nodes.time[u];
-        self->children[u] = NULL;
-        self->num_children[u] = 0;
-        if (self->flags & MSP_LEAF_COUNTS) {
-            self->num_leaves[u] = 1;
-        }
-        if (self->flags & MSP_LEAF_LISTS) {
-            w = &self->leaf_list_node_mem[j];
-            w->next = NULL;
-            w->node = (node_id_t) u;
-            self->leaf_list_head[u] = w;
-            self->leaf_list_tail[u] = w;
-        }
+    for (j = 0; j < self->num_touched_nodes; j++) {
+        u = self->touched_nodes[j];
+        sparse_tree_reset_node(self, u);
+        self->touched[u] = false;
+    }
+    self->num_touched_nodes = 0;
+    if (self->flags & MSP_BRANCH_LENGTHS) {
+        self->total_branch_length = 0;
+        memset(self->branch_length_by_count, 0,
+                (self->sample_size + 1) * sizeof(double));
+        memset(self->branch_length_area, 0, (self->sample_size + 1) * sizeof(double));
+        memset(self->branch_length_position, 0,
+                (self->sample_size + 1) * sizeof(double));
     }
     return ret;
 }
@@ -3160,7 +4577,7 @@ int WARN_UNUSED
 sparse_tree_alloc(sparse_tree_t *self, tree_sequence_t *tree_sequence, int flags)
 {
     int ret = MSP_ERR_NO_MEMORY;
-    size_t sample_size;
+    size_t j, sample_size;
     size_t num_nodes;
 
     memset(self, 0, sizeof(sparse_tree_t));
@@ -3180,8 +4597,11 @@ sparse_tree_alloc(sparse_tree_t *self, tree_sequence_t *tree_sequence, int flags
     self->time = malloc(num_nodes * sizeof(double));
     self->num_children = malloc(num_nodes * sizeof(node_id_t));
     self->children = malloc(num_nodes * sizeof(node_id_t *));
+    self->touched_nodes = malloc(num_nodes * sizeof(node_id_t));
+    self->touched = malloc(num_nodes * sizeof(bool));
     if (self->time == NULL || self->parent == NULL || self->children == NULL
-            || self->num_children == NULL || self->population == NULL) {
+            || self->num_children == NULL || self->population == NULL
+            || self->touched_nodes == NULL || self->touched == NULL) {
         goto out;
     }
     /* the maximum possible height of the tree is num_nodes + 1, including
@@ -3200,6 +4620,19 @@ sparse_tree_alloc(sparse_tree_t *self, tree_sequence_t *tree_sequence, int flags
             goto out;
         }
     }
+    if (self->flags & MSP_BRANCH_LENGTHS) {
+        if (!(self->flags & MSP_LEAF_COUNTS)) {
+            ret = MSP_ERR_BAD_PARAM_VALUE;
+            goto out;
+        }
+        self->branch_length_by_count = calloc(sample_size + 1, sizeof(double));
+        self->branch_length_area = calloc(sample_size + 1, sizeof(double));
+        self->branch_length_position = calloc(sample_size + 1, sizeof(double));
+        if (self->branch_length_by_count == NULL || self->branch_length_area == NULL
+                || self->branch_length_position == NULL) {
+            goto out;
+        }
+    }
     if (self->flags & MSP_LEAF_LISTS) {
         self->leaf_list_head = calloc(num_nodes, sizeof(leaf_list_node_t *));
         self->leaf_list_tail = calloc(num_nodes, sizeof(leaf_list_node_t *));
@@ -3209,6 +4642,12 @@ sparse_tree_alloc(sparse_tree_t *self, tree_sequence_t *tree_sequence, int flags
             goto out;
         }
     }
+    /* Every node must be initialised on the first clear. */
+    for (j = 0; j < num_nodes; j++) {
+        self->touched_nodes[j] = (node_id_t) j;
+        self->touched[j] = true;
+    }
+    self->num_touched_nodes = num_nodes;
     ret = sparse_tree_clear(self);
 out:
     return ret;
@@ -3247,6 +4686,13 @@ sparse_tree_free(sparse_tree_t *self)
     if (self->marked != NULL) {
         free(self->marked);
     }
+    msp_safe_free(self->touched_nodes);
+    msp_safe_free(self->touched);
+    msp_safe_free(self->tracked_set_counts);
+    msp_safe_free(self->tracked_set_diff);
+    msp_safe_free(self->branch_length_by_count);
+    msp_safe_free(self->branch_length_area);
+    msp_safe_free(self->branch_length_position);
     if (self->leaf_list_head != NULL) {
         free(self->leaf_list_head);
     }
@@ -3313,6 +4759,65 @@ out:
     return ret;
 }
 
+/* Tracks the number of leaves from each of num_sets sets of samples below
+ * every node. Set j consists of set_sizes[j] consecutive elements of sets.
+ */
+int WARN_UNUSED
+sparse_tree_set_tracked_sample_sets(sparse_tree_t *self, size_t num_sets,
+        size_t *set_sizes, node_id_t *sets)
+{
+    int ret = 0;
+    size_t j, k, offset;
+    node_id_t u;
+    node_id_t *counts;
+
+    if (!(self->flags & MSP_LEAF_COUNTS)) {
+        ret = MSP_ERR_UNSUPPORTED_OPERATION;
+        goto out;
+    }
+    if (num_sets < 1) {
+        ret = MSP_ERR_BAD_PARAM_VALUE;
+        goto out;
+    }
+    msp_safe_free(self->tracked_set_counts);
+    msp_safe_free(self->tracked_set_diff);
+    self->num_tracked_sets = 0;
+    self->tracked_set_counts = calloc(self->num_nodes * num_sets, sizeof(node_id_t));
+    self->tracked_set_diff = malloc(num_sets * sizeof(node_id_t));
+    if (self->tracked_set_counts == NULL || self->tracked_set_diff == NULL) {
+        ret = MSP_ERR_NO_MEMORY;
+        goto out;
+    }
+    self->num_tracked_sets = num_sets;
+    counts = self->tracked_set_counts;
+    offset = 0;
+    for (k = 0; k < num_sets; k++) {
+        for (j = 0; j < set_sizes[k]; j++) {
+            u = sets[offset + j];
+            if (u < 0 || u >= (node_id_t) self->num_nodes) {
+                ret = MSP_ERR_OUT_OF_BOUNDS;
+                goto out;
+            }
+            if (! tree_sequence_is_sample(self->tree_sequence, u)) {
+                ret = MSP_ERR_BAD_SAMPLES;
+                goto out;
+            }
+            if (counts[(size_t) u * num_sets + k] != 0) {
+                ret = MSP_ERR_DUPLICATE_SAMPLE;
+                goto out;
+            }
+            /* Propagate this upwards */
+            while (u != MSP_NULL_NODE) {
+                counts[(size_t) u * num_sets + k] += 1;
+                u = self->parent[u];
+            }
+        }
+        offset += set_sizes[k];
+    }
+out:
+    return ret;
+}
+
 int WARN_UNUSED
 sparse_tree_set_tracked_leaves_from_leaf_list(sparse_tree_t *self,
         leaf_list_node_t *head, leaf_list_node_t *tail)
@@ -3354,6 +4859,7 @@ sparse_tree_copy(sparse_tree_t *self, sparse_tree_t *source)
 {
     int ret = MSP_ERR_GENERIC;
     size_t N = self->num_nodes;
+    size_t j;
 
     if (self == source) {
         ret = MSP_ERR_BAD_PARAM_VALUE;
@@ -3375,6 +4881,10 @@ sparse_tree_copy(sparse_tree_t *self, sparse_tree_t *source)
     memcpy(self->time, source->time, N * sizeof(double));
     memcpy(self->num_children, source->num_children, N * sizeof(node_id_t));
     memcpy(self->children, source->children, N * sizeof(node_id_t *));
+    /* Nodes touched by either tree may now differ from the cleared state. */
+    for (j = 0; j < source->num_touched_nodes; j++) {
+        sparse_tree_touch_node(self, source->touched_nodes[j]);
+    }
     if (self->flags & MSP_LEAF_COUNTS) {
         if (! (source->flags & MSP_LEAF_COUNTS)) {
             ret = MSP_ERR_UNSUPPORTED_OPERATION;
@@ -3382,6 +4892,19 @@ sparse_tree_copy(sparse_tree_t *self, sparse_tree_t *source)
         }
         memcpy(self->num_leaves, source->num_leaves, N * sizeof(node_id_t));
     }
+    if (self->flags & MSP_BRANCH_LENGTHS) {
+        if (! (source->flags & MSP_BRANCH_LENGTHS)) {
+            ret = MSP_ERR_UNSUPPORTED_OPERATION;
+            goto out;
+        }
+        self->total_branch_length = source->total_branch_length;
+        memcpy(self->branch_length_by_count, source->branch_length_by_count,
+                (self->sample_size + 1) * sizeof(double));
+        memcpy(self->branch_length_area, source->branch_length_area,
+                (self->sample_size + 1) * sizeof(double));
+        memcpy(self->branch_length_position, source->branch_length_position,
+                (self->sample_size + 1) * sizeof(double));
+    }
     if (self->flags & MSP_LEAF_LISTS) {
         ret = MSP_ERR_UNSUPPORTED_OPERATION;
         goto out;
@@ -3550,6 +5073,20 @@ out:
     return ret;
 }
 
+int WARN_UNUSED
+sparse_tree_get_total_branch_length(sparse_tree_t *self, double *length)
+{
+    int ret = 0;
+
+    if (! (self->flags & MSP_BRANCH_LENGTHS)) {
+        ret = MSP_ERR_UNSUPPORTED_OPERATION;
+        goto out;
+    }
+    *length = self->total_branch_length;
+out:
+    return ret;
+}
+
 int WARN_UNUSED
 sparse_tree_get_leaf_list(sparse_tree_t *self, node_id_t u,
         leaf_list_node_t **head, leaf_list_node_t **tail)
@@ -3630,6 +5167,100 @@ sparse_tree_get_sites(sparse_tree_t *self, site_t **sites, list_len_t *sites_len
     return 0;
 }
 
+/* Returns true if u is v or one of its descendants. */
+static bool
+sparse_tree_is_descendant(sparse_tree_t *self, node_id_t u, node_id_t v)
+{
+    while (u != MSP_NULL_NODE && u != v) {
+        u = self->parent[u];
+    }
+    return u == v;
+}
+
+/* Counts the members of each tracked sample set carrying each allele at the
+ * specified site. Mutations are applied in order, so that a mutation
+ * overrides any earlier mutations above it. Allele 0 is the ancestral state,
+ * and the counts for allele j are stored at allele_counts[j * num_sets];
+ * the buffers must have space for mutations_length + 1 alleles.
+ */
+int WARN_UNUSED
+sparse_tree_get_allele_counts(sparse_tree_t *self, site_t *site,
+        size_t *set_sizes, double *allele_counts, const char **allele_states,
+        list_len_t *allele_state_lengths, list_len_t *num_alleles)
+{
+    int ret = 0;
+    size_t k;
+    size_t K = self->num_tracked_sets;
+    list_len_t j, l, m, a;
+    list_len_t M = site->mutations_length;
+    mutation_t *mut = site->mutations;
+    node_id_t u, v, w;
+    node_id_t *counts = self->tracked_set_counts;
+    double count;
+    bool covered, maximal;
+
+    if (K == 0) {
+        ret = MSP_ERR_UNSUPPORTED_OPERATION;
+        goto out;
+    }
+    allele_states[0] = site->ancestral_state;
+    allele_state_lengths[0] = site->ancestral_state_length;
+    *num_alleles = 1;
+    for (k = 0; k < K; k++) {
+        allele_counts[k] = (double) set_sizes[k];
+    }
+    for (j = 0; j < M; j++) {
+        for (a = 0; a < *num_alleles; a++) {
+            if (allele_state_lengths[a] == mut[j].derived_state_length
+                    && memcmp(allele_states[a], mut[j].derived_state,
+                        allele_state_lengths[a]) == 0) {
+                break;
+            }
+        }
+        if (a == *num_alleles) {
+            allele_states[a] = mut[j].derived_state;
+            allele_state_lengths[a] = mut[j].derived_state_length;
+            memset(allele_counts + a * K, 0, K * sizeof(double));
+            (*num_alleles)++;
+        }
+        u = mut[j].node;
+        covered = false;
+        for (l = j + 1; l < M; l++) {
+            covered = covered || sparse_tree_is_descendant(self, u, mut[l].node);
+        }
+        if (covered) {
+            continue;
+        }
+        for (k = 0; k < K; k++) {
+            count = counts[(size_t) u * K + k];
+            /* Remove the topmost later mutations below u */
+            for (l = j + 1; l < M; l++) {
+                v = mut[l].node;
+                if (v == u || !sparse_tree_is_descendant(self, v, u)) {
+                    continue;
+                }
+                maximal = true;
+                for (m = j + 1; m < M; m++) {
+                    w = mut[m].node;
+                    if (w == v) {
+                        maximal = maximal && m >= l;
+                    } else if (w != u) {
+                        maximal = maximal && !(sparse_tree_is_descendant(self, v, w)
+                                && sparse_tree_is_descendant(self, w, u));
+                    }
+                }
+                if (maximal) {
+                    count -= counts[(size_t) v * K + k];
+                }
+            }
+            allele_counts[k] -= count;
+            allele_counts[a * K + k] += count;
+        }
+    }
+out:
+    return ret;
+}
+
 static void
 sparse_tree_check_state(sparse_tree_t *self)
 {
@@ -3637,6 +5268,7 @@ sparse_tree_check_state(sparse_tree_t *self)
     size_t j, k, num_leaves;
     int err, found;
     site_t site;
+    double total;
 
     for (j = 0; j < self->sample_size; j++) {
         u = self->samples[j];
@@ -3661,6 +5293,13 @@ sparse_tree_check_state(sparse_tree_t *self)
         assert(self->left <= site.position);
         assert(site.position < self->right);
     }
+    assert(self->num_touched_nodes <= self->num_nodes);
+    for (u = 0; u < (node_id_t) self->num_nodes; u++) {
+        if (! self->touched[u]) {
+            assert(self->parent[u] == MSP_NULL_NODE);
+            assert(self->num_children[u] == 0);
+        }
+    }
 
     if (self->flags & MSP_LEAF_COUNTS) {
         assert(self->num_leaves != NULL);
@@ -3674,6 +5313,14 @@ sparse_tree_check_state(sparse_tree_t *self)
         assert(self->num_leaves == NULL);
         assert(self->num_tracked_leaves == NULL);
     }
+    if (self->flags & MSP_BRANCH_LENGTHS) {
+        total = 0;
+        for (j = 0; j <= self->sample_size; j++) {
+            total += self->branch_length_by_count[j];
+        }
+        assert(fabs(total - self->total_branch_length)
+                <= 1e-9 * GSL_MAX(1.0, self->total_branch_length));
+    }
     if (self->flags & MSP_LEAF_LISTS) {
         assert(self->leaf_list_tail != NULL);
         assert(self->leaf_list_head != NULL);
@@ -3742,18 +5389,68 @@ sparse_tree_print_state(sparse_tree_t *self, FILE *out)
 
 /* Methods for positioning the tree along the sequence */
 
+/* Adds delta to the length of the branches subtending num_leaves leaves,
+ * first accumulating the area swept out by the class since it last changed.
+ */
+static inline void
+sparse_tree_update_branch_length(sparse_tree_t *self, node_id_t num_leaves,
+        double delta)
+{
+    const size_t k = (size_t) num_leaves;
+    const double x = self->branch_length_x;
+
+    self->branch_length_area[k] += self->branch_length_by_count[k]
+        * fabs(x - self->branch_length_position[k]);
+    self->branch_length_position[k] = x;
+    self->branch_length_by_count[k] += delta;
+    self->total_branch_length += delta;
+}
+
+/* Moves the branch above v from the class of its current leaf count to
+ * that of the leaf count plus diff. */
+static inline void
+sparse_tree_move_branch_length(sparse_tree_t *self, node_id_t v, node_id_t diff)
+{
+    const node_id_t p = self->parent[v];
+    const double *node_time = self->tree_sequence->nodes.time;
+    double length;
+
+    if (p != MSP_NULL_NODE && diff != 0) {
+        length = node_time[p] - node_time[v];
+        sparse_tree_update_branch_length(self, self->num_leaves[v], -length);
+        sparse_tree_update_branch_length(self, self->num_leaves[v] + diff, length);
+    }
+}
+
 static inline void
 sparse_tree_propagate_leaf_count_loss(sparse_tree_t *self, node_id_t u)
 {
     const node_id_t all_leaves_diff = self->num_leaves[u];
     const node_id_t tracked_leaves_diff = self->num_tracked_leaves[u];
     const uint8_t mark = self->mark;
+    const size_t K = self->num_tracked_sets;
+    node_id_t *set_diff = self->tracked_set_diff;
+    node_id_t *set_counts;
     node_id_t v = u;
+    size_t k;
 
+    if (K > 0) {
+        memcpy(set_diff, self->tracked_set_counts + (size_t) u * K,
+                K * sizeof(node_id_t));
+    }
     /* propagate this loss up as far as we can */
     while (v != MSP_NULL_NODE) {
+        if (self->flags & MSP_BRANCH_LENGTHS) {
+            sparse_tree_move_branch_length(self, v, -all_leaves_diff);
+        }
         self->num_leaves[v] -= all_leaves_diff;
         self->num_tracked_leaves[v] -= tracked_leaves_diff;
+        if (K > 0) {
+            set_counts = self->tracked_set_counts + (size_t) v * K;
+            for (k = 0; k < K; k++) {
+                set_counts[k] -= set_diff[k];
+            }
+        }
         self->marked[v] = mark;
         v = self->parent[v];
     }
@@ -3767,18 +5464,40 @@ sparse_tree_propagate_leaf_count_gain(sparse_tree_t *self, node_id_t u)
     node_id_t all_leaves_diff = 0;
     node_id_t tracked_leaves_diff = 0;
     const uint8_t mark = self->mark;
+    const size_t K = self->num_tracked_sets;
+    node_id_t *set_diff = self->tracked_set_diff;
+    node_id_t *set_counts;
+    size_t l;
 
     c = self->children[u];
     k = self->num_children[u];
+    if (K > 0) {
+        memset(set_diff, 0, K * sizeof(node_id_t));
+    }
     for (j = 0; j < k; j++) {
         all_leaves_diff += self->num_leaves[c[j]];
         tracked_leaves_diff += self->num_tracked_leaves[c[j]];
+        if (K > 0) {
+            set_counts = self->tracked_set_counts + (size_t) c[j] * K;
+            for (l = 0; l < K; l++) {
+                set_diff[l] += set_counts[l];
+            }
+        }
     }
     /* propogate this gain up as far as we can */
     v = u;
     while (v != MSP_NULL_NODE) {
+        if (self->flags & MSP_BRANCH_LENGTHS) {
+            sparse_tree_move_branch_length(self, v, all_leaves_diff);
+        }
         self->num_leaves[v] += all_leaves_diff;
         self->num_tracked_leaves[v] += tracked_leaves_diff;
+        if (K > 0) {
+            set_counts = self->tracked_set_counts + (size_t) v * K;
+            for (l = 0; l < K; l++) {
+                set_counts[l] += set_diff[l];
+            }
+        }
         self->marked[v] = mark;
         v = self->parent[v];
     }
@@ -3813,6 +5532,39 @@ sparse_tree_update_leaf_lists(sparse_tree_t *self, node_id_t node)
     }
 }
 
+static inline void
+sparse_tree_insert_edgeset(sparse_tree_t *self, node_id_t k)
+{
+    tree_sequence_t *s = self->tree_sequence;
+    node_id_t u = s->edgesets.parent[k];
+    node_id_t c;
+    list_len_t j;
+
+    sparse_tree_touch_node(self, u);
+    for (j = 0; j < s->edgesets.children_length[k]; j++) {
+        c = s->edgesets.children[k][j];
+        sparse_tree_touch_node(self, c);
+        self->parent[c] = u;
+        if (self->flags & MSP_BRANCH_LENGTHS) {
+            sparse_tree_update_branch_length(self, self->num_leaves[c],
+                    s->nodes.time[u] - s->nodes.time[c]);
+        }
+    }
+    self->num_children[u] = s->edgesets.children_length[k];
+    self->children[u] = s->edgesets.children[k];
+    self->time[u] = s->nodes.time[u];
+    self->population[u] = s->nodes.population[u];
+    if (self->time[u] > self->time[self->root]) {
+        self->root = u;
+    }
+    if (self->flags & MSP_LEAF_COUNTS) {
+        sparse_tree_propagate_leaf_count_gain(self, u);
+    }
+    if (self->flags & MSP_LEAF_LISTS) {
+        sparse_tree_update_leaf_lists(self, u);
+    }
+}
+
 static int
 sparse_tree_advance(sparse_tree_t *self, int direction,
         double *out_breakpoints, node_id_t *out_order, node_id_t *out_index,
@@ -3824,18 +5576,25 @@ sparse_tree_advance(sparse_tree_t *self, int direction,
     node_id_t in = *in_index + direction_change;
     node_id_t out = *out_index + direction_change;
     list_len_t j;
-    node_id_t k, u, oldest_child;
+    node_id_t k, u, c, oldest_child;
     double x = in_breakpoints[in_order[in]];
     double oldest_child_time;
     tree_sequence_t *s = self->tree_sequence;
     node_id_t R = (node_id_t) s->edgesets.num_records;
+    const bool branch_lengths = !!(self->flags & MSP_BRANCH_LENGTHS);
 
+    self->branch_length_x = x;
     while (out_breakpoints[out_order[out]] == x) {
         k = out_order[out];
         u = s->edgesets.parent[k];
         oldest_child_time = -1;
         oldest_child = 0;
         for (j = 0; j < self->num_children[u]; j++) {
+            c = self->children[u][j];
+            if (branch_lengths) {
+                sparse_tree_update_branch_length(self, self->num_leaves[c],
+                        -(s->nodes.time[u] - s->nodes.time[c]));
+            }
             self->parent[self->children[u][j]] = MSP_NULL_NODE;
             if (self->time[self->children[u][j]] > oldest_child_time) {
                 oldest_child = self->children[u][j];
@@ -3859,24 +5618,7 @@ sparse_tree_advance(sparse_tree_t *self, int direction,
     }
 
     while (in >= 0 && in < R && in_breakpoints[in_order[in]] == x) {
-        k = in_order[in];
-        u = s->edgesets.parent[k];
-        for (j = 0; j < s->edgesets.children_length[k]; j++) {
-            self->parent[s->edgesets.children[k][j]] = u;
-        }
-        self->num_children[u] = s->edgesets.children_length[k];
-        self->children[u] = s->edgesets.children[k];
-        self->time[u] = s->nodes.time[u];
-        self->population[u] = s->nodes.population[u];
-        if (self->time[u] > self->time[self->root]) {
-            self->root = u;
-        }
-        if (self->flags & MSP_LEAF_COUNTS) {
-            sparse_tree_propagate_leaf_count_gain(self, u);
-        }
-        if (self->flags & MSP_LEAF_LISTS) {
-            sparse_tree_update_leaf_lists(self, u);
-        }
+        sparse_tree_insert_edgeset(self, in_order[in]);
         in += direction;
     }
     /* In very rare situations, we have to traverse upwards to find the
@@ -3912,10 +5654,6 @@ sparse_tree_first(sparse_tree_t *self)
     tree_sequence_t *s = self->tree_sequence;
 
     if (s->edgesets.num_records > 0) {
-        /* TODO this is redundant if this is the first usage of the tree. We
-         * should add a state machine here so we know what state the tree is
-         * in and can take the appropriate actions.
-         */
         ret = sparse_tree_clear(self);
         if (ret != 0) {
             goto out;
@@ -3940,10 +5678,6 @@ sparse_tree_last(sparse_tree_t *self)
     tree_sequence_t *s = self->tree_sequence;
 
     if (s->edgesets.num_records > 0) {
-        /* TODO this is redundant if this is the first usage of the tree. We
-         * should add a state machine here so we know what state the tree is
-         * in and can take the appropriate actions.
-         */
         ret = sparse_tree_clear(self);
         if (ret != 0) {
             goto out;
@@ -3962,6 +5696,69 @@ out:
     return ret;
 }
 
+/* Positions the tree at the one covering the specified coordinate, building
+ * it directly from the edgesets that overlap x rather than applying the
+ * transitions from the first tree. The tree can then be moved with next()
+ * and prev() as usual. Returns 1 on success, as for sparse_tree_first().
+ */
+int WARN_UNUSED
+sparse_tree_seek(sparse_tree_t *self, double x)
+{
+    int ret = 0;
+    tree_sequence_t *s = self->tree_sequence;
+    node_id_t R = (node_id_t) s->edgesets.num_records;
+    node_id_t *I = s->edgesets.indexes.insertion_order;
+    node_id_t *O = s->edgesets.indexes.removal_order;
+    double *edge_left = s->edgesets.left;
+    double *edge_right = s->edgesets.right;
+    double left = 0;
+    size_t num_left = 0;
+    node_id_t j, k;
+
+    if (x < 0 || x >= s->sequence_length) {
+        ret = MSP_ERR_OUT_OF_BOUNDS;
+        goto out;
+    }
+    if (R == 0) {
+        goto out;
+    }
+    ret = sparse_tree_clear(self);
+    if (ret != 0) {
+        goto out;
+    }
+    /* The trees start at the distinct left coordinates of the edgesets. */
+    for (j = 0; j < R && edge_left[I[j]] <= x; j++) {
+        if (j == 0 || edge_left[I[j]] != left) {
+            left = edge_left[I[j]];
+            num_left++;
+        }
+    }
+    for (k = 0; k < R && edge_right[O[k]] <= x; k++);
+    assert(num_left > 0 && k < R);
+    self->branch_length_x = left;
+    for (j = 0; j < R && edge_left[I[j]] <= x; j++) {
+        if (edge_right[I[j]] > x) {
+            sparse_tree_insert_edgeset(self, I[j]);
+        }
+    }
+    while (self->parent[self->root] != MSP_NULL_NODE) {
+        self->root = self->parent[self->root];
+    }
+    self->left = left;
+    self->right = edge_right[O[k]];
+    self->direction = MSP_DIR_FORWARD;
+    self->left_index = j;
+    self->right_index = k;
+    self->index = num_left - 1;
+    if (s->sites.num_records > 0) {
+        self->sites = s->sites.tree_sites[self->index];
+        self->sites_length = s->sites.tree_sites_length[self->index];
+    }
+    ret = 1;
+out:
+    return ret;
+}
+
 int WARN_UNUSED
 sparse_tree_next(sparse_tree_t *self)
 {
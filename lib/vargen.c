@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <gsl/gsl_math.h>
 
 #include "err.h"
 #include "object_heap.h"
@@ -93,6 +94,7 @@ int
 vargen_free(vargen_t *self)
 {
     sparse_tree_free(&self->tree);
+    msp_safe_free(self->packed_genotypes);
     return 0;
 }
 
@@ -134,18 +136,16 @@ out:
     return ret;
 }
 
-int
-vargen_next(vargen_t *self, site_t **site, char *genotypes)
+/* Finds the next site, moving to the next tree if necessary, and returns 1
+ * if there is one and 0 if all sites have been visited. The site is not
+ * consumed: callers increment tree_site_index once it has been applied, so
+ * that a site which fails is not skipped on the next call. */
+static int
+vargen_next_site(vargen_t *self, site_t **site)
 {
     int ret = 0;
-
     bool not_done = true;
-    site_t *s;
-    char offset = 0;
 
-    if (! (self->flags & MSP_GENOTYPES_AS_CHAR)) {
-       offset = '0';
-    }
     if (!self->finished) {
         while (not_done && self->tree_site_index == self->tree.sites_length) {
             ret = vargen_next_tree(self);
@@ -155,16 +155,179 @@ vargen_next(vargen_t *self, site_t **site, char *genotypes)
             not_done = ret == 1;
         }
         if (not_done) {
-            s = &self->tree.sites[self->tree_site_index];
-            ret = vargen_apply_tree_site(self, s, genotypes, offset);
+            *site = &self->tree.sites[self->tree_site_index];
+            ret = 1;
+        }
+    }
+out:
+    return ret;
+}
+
+int
+vargen_next(vargen_t *self, site_t **site, char *genotypes)
+{
+    int ret = 0;
+    site_t *s;
+    char offset = 0;
+
+    if (! (self->flags & MSP_GENOTYPES_AS_CHAR)) {
+       offset = '0';
+    }
+    ret = vargen_next_site(self, &s);
+    if (ret == 1) {
+        ret = vargen_apply_tree_site(self, s, genotypes, offset);
+        if (ret != 0) {
+            goto out;
+        }
+        self->tree_site_index++;
+        *site = s;
+        ret = 1;
+    }
+out:
+    return ret;
+}
+
+/* Writes the genotypes for a site into a row of bits bits per sample,
+ * setting the bits for the samples under each mutation directly rather
+ * than going through a byte per sample. */
+static int
+vargen_pack_site(vargen_t *self, site_t *site, unsigned int bits, uint8_t *row,
+        size_t row_size)
+{
+    int ret = 0;
+    leaf_list_node_t *w, *tail;
+    node_id_t sample_index;
+    bool not_done;
+    list_len_t j;
+    size_t bit;
+    uint8_t mask = (uint8_t) ((1 << bits) - 1);
+    uint8_t ancestral = (uint8_t) (site->ancestral_state[0] - '0');
+    uint8_t derived, shift;
+    size_t num_pad_bits = (row_size * 8) - self->sample_size * bits;
+
+    assert(ancestral <= mask);
+    memset(row, bits == 1? ancestral * 0xff: ancestral * 0x55, row_size);
+    for (j = 0; j < site->mutations_length; j++) {
+        derived = (uint8_t) (site->mutations[j].derived_state[0] - '0');
+        assert(derived <= mask);
+        ret = sparse_tree_get_leaf_list(&self->tree, site->mutations[j].node, &w, &tail);
+        if (ret != 0) {
+            goto out;
+        }
+        if (w != NULL) {
+            not_done = true;
+            while (not_done) {
+                assert(w != NULL);
+                sample_index = self->sample_index_map[w->node];
+                assert(sample_index >= 0);
+                bit = (size_t) sample_index * bits;
+                shift = (uint8_t) (bit % 8);
+                if (((row[bit / 8] >> shift) & mask) == derived) {
+                    ret = MSP_ERR_INCONSISTENT_MUTATIONS;
+                    goto out;
+                }
+                row[bit / 8] = (uint8_t) ((row[bit / 8] & ~(mask << shift))
+                        | (derived << shift));
+                not_done = w != tail;
+                w = w->next;
+            }
+        }
+    }
+    if (num_pad_bits > 0) {
+        row[row_size - 1] &= (uint8_t) (0xff >> num_pad_bits);
+    }
+out:
+    return ret;
+}
+
+/* Writes the genotypes of the next (up to) max_sites sites into matrix,
+ * packed into 1 bit per genotype, or 2 bits if MSP_GENOTYPES_2BIT is set.
+ * By default rows are sites, each of ceil(n * bits / 8) bytes in which the
+ * genotype of sample k is at bit k * bits (least significant bit first),
+ * with any trailing bits zero. If MSP_GENOTYPES_SAMPLE_MAJOR is set, rows
+ * are samples, each of ceil(max_sites * bits / 8) bytes in which the
+ * genotype at the j-th site of the block is at bit j * bits; only the first
+ * ceil(num_sites * bits / 8) bytes of each row are written. The number of
+ * sites written is returned in num_sites, which is zero once all sites
+ * have been visited. Genotypes are always numeric, regardless of
+ * MSP_GENOTYPES_AS_CHAR.
+ */
+int WARN_UNUSED
+vargen_next_packed(vargen_t *self, size_t max_sites, int options, uint8_t *matrix,
+        size_t *num_sites)
+{
+    int ret = 0;
+    size_t n = self->sample_size;
+    unsigned int bits = options & MSP_GENOTYPES_2BIT? 2: 1;
+    size_t sites_per_byte = 8 / bits;
+    size_t row_size, num_group_sites, max_group_sites, j, k, l;
+    site_t *site;
+    uint8_t byte;
+
+    *num_sites = 0;
+    if (!(options & MSP_GENOTYPES_SAMPLE_MAJOR)) {
+        row_size = (n * bits + 7) / 8;
+        for (j = 0; j < max_sites; j++) {
+            ret = vargen_next_site(self, &site);
+            if (ret < 0) {
+                goto out;
+            }
+            if (ret == 0) {
+                break;
+            }
+            ret = vargen_pack_site(self, site, bits, matrix + j * row_size, row_size);
             if (ret != 0) {
                 goto out;
             }
             self->tree_site_index++;
-            *site = s;
-            ret = 1;
+            (*num_sites)++;
+        }
+    } else {
+        /* Decode the sites filling each column of bytes and then transpose
+         * them, so that each row is visited once per byte rather than once
+         * per site. */
+        row_size = (max_sites * bits + 7) / 8;
+        if (self->packed_genotypes == NULL) {
+            self->packed_genotypes = malloc(8 * GSL_MAX(n, 1) * sizeof(char));
+            if (self->packed_genotypes == NULL) {
+                ret = MSP_ERR_NO_MEMORY;
+                goto out;
+            }
+        }
+        for (j = 0; j < row_size; j++) {
+            max_group_sites = GSL_MIN(sites_per_byte, max_sites - *num_sites);
+            num_group_sites = 0;
+            while (num_group_sites < max_group_sites) {
+                ret = vargen_next_site(self, &site);
+                if (ret < 0) {
+                    goto out;
+                }
+                if (ret == 0) {
+                    break;
+                }
+                ret = vargen_apply_tree_site(self, site,
+                        self->packed_genotypes + num_group_sites * n, '0');
+                if (ret != 0) {
+                    goto out;
+                }
+                self->tree_site_index++;
+                num_group_sites++;
+                (*num_sites)++;
+            }
+            if (num_group_sites == 0) {
+                break;
+            }
+            for (k = 0; k < n; k++) {
+                byte = 0;
+                for (l = 0; l < num_group_sites; l++) {
+                    byte = (uint8_t) (byte
+                            | self->packed_genotypes[l * n + k] << (l * bits));
+                }
+                matrix[k * row_size + j] = byte;
+            }
         }
     }
+    ret = 0;
 out:
     return ret;
 }
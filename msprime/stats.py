@@ -34,6 +34,14 @@ except ImportError:
 
 import _msprime
 
+_ld_stat_codes = {
+    "r2": _msprime.LD_STAT_R2,
+    "D": _msprime.LD_STAT_D,
+    "D_prime": _msprime.LD_STAT_D_PRIME,
+    "r": _msprime.LD_STAT_R,
+    "r2_multiallelic": _msprime.LD_STAT_R2_MULTIALLELIC,
+}
+
 
 def check_numpy():
     if not _numpy_imported:
@@ -87,7 +95,8 @@ class LdCalculator(object):
             return self._ll_ld_calculator.get_r2(a, b)
 
     def get_r2_array(
-            self, a, direction=1, max_mutations=None, max_distance=None):
+            self, a, direction=1, max_mutations=None, max_distance=None,
+            statistic="r2"):
         """
         Returns the value of the :math:`r^2` statistic between the focal
         mutation at index :math:`a` and a set of other mutations. The method
@@ -118,6 +127,15 @@ class LdCalculator(object):
         :param float max_distance: The maximum absolute distance between
             the focal mutation and those for which :math:`r^2` values
             are returned.
+        :param str statistic: The statistic to compute instead of
+            :math:`r^2`. One of ``"r2"``, ``"D"``, ``"D_prime"`` (the
+            signed :math:`D'`), ``"r"`` or ``"r2_multiallelic"``. All but
+            the last treat each site as having two alleles: the ancestral
+            state and any other state. ``"r2_multiallelic"`` is
+            :math:`\\sum_{ij} D_{ij}^2 / (p_i q_j)` over all pairs of alleles,
+            divided by one less than the smaller number of alleles, and is
+            equal to :math:`r^2` for sites with two alleles. Values are NaN
+            for sites where all samples have the same allele.
         :return: An array of double precision floating point values
             representing the :math:`r^2` values for mutations in the
             specified direction.
@@ -132,26 +150,88 @@ class LdCalculator(object):
             max_mutations = -1
         if max_distance is None:
             max_distance = sys.float_info.max
+        if statistic not in _ld_stat_codes:
+            raise ValueError("Unknown statistic '{}'".format(statistic))
         with self._instance_lock:
             num_values = self._ll_ld_calculator.get_r2_array(
                 self._buffer, a, direction=direction,
-                max_mutations=max_mutations, max_distance=max_distance)
+                max_mutations=max_mutations, max_distance=max_distance,
+                statistic=_ld_stat_codes[statistic])
         return np.frombuffer(self._buffer, "d", num_values)
 
-    def get_r2_matrix(self):
+    def get_r2_matrix(self, num_threads=1, float32=False):
         """
         Returns the complete :math:`m \\times m` matrix of pairwise
         :math:`r^2` values in a tree sequence with :math:`m` mutations.
-
-        :return: An 2 dimensional square array of double precision
-            floating point values representing the :math:`r^2` values for
-            all pairs of mutations.
+        The matrix is computed in blocks of rows, which are shared among
+        ``num_threads`` threads.
+
+        :param int num_threads: The number of threads to use.
+        :param bool float32: If True, return single precision values,
+            halving the memory required.
+        :return: An 2 dimensional square array of floating point values
+            representing the :math:`r^2` values for all pairs of mutations.
         :rtype: numpy.ndarray
         """
-        m = self._tree_sequence.get_num_mutations()
-        A = np.ones((m, m), dtype=float)
-        for j in range(m - 1):
-            a = self.get_r2_array(j)
-            A[j, j + 1:] = a
-            A[j + 1:, j] = a
-        return A
+        return self._ll_ld_calculator.get_r2_matrix(
+            num_threads=num_threads, float32=float32)
+
+    def get_r2_pairs(self, threshold, num_threads=1, float32=False):
+        """
+        Returns the pairs of mutations :math:`a < b` for which :math:`r^2`
+        is greater than the specified threshold, without storing the
+        complete matrix. The pairs are returned as three arrays ``(rows,
+        columns, values)`` of the same length, in no particular order.
+
+        :param float threshold: The value which :math:`r^2` must exceed
+            for a pair to be returned.
+        :param int num_threads: The number of threads to use.
+        :param bool float32: If True, return single precision values.
+        :return: The indexes of the first and second mutations in each
+            pair, and the corresponding :math:`r^2` values.
+        :rtype: tuple
+        """
+        return self._ll_ld_calculator.get_r2_matrix(
+            num_threads=num_threads, float32=float32, sparse=True,
+            threshold=threshold)
+
+    def get_r2_decay(
+            self, distance_breaks, maf_breaks=None, max_mutations=None,
+            num_threads=1):
+        """
+        Returns the mean :math:`r^2` between pairs of mutations :math:`a < b`
+        in bins of the distance between them, without storing the pairwise
+        values. Bin :math:`j` contains the distances :math:`d` with
+        ``distance_breaks[j] <= d < distance_breaks[j + 1]``, and the last
+        bin also contains its upper break, as for :func:`numpy.histogram`.
+        Pairs further apart than the last break are not considered, and
+        each mutation is compared with at most ``max_mutations`` following
+        mutations. If ``maf_breaks`` is specified, pairs are also binned in
+        the same way by the smaller of the minor allele frequencies of the
+        two mutations. Pairs for which :math:`r^2` is undefined are not
+        counted. The work is shared among ``num_threads`` threads.
+
+        :param distance_breaks: The increasing, non-negative edges of the
+            distance bins.
+        :param maf_breaks: The increasing edges of the minor allele
+            frequency bins, or None.
+        :param int max_mutations: The maximum number of following mutations
+            to compare each mutation with. Defaults to all mutations.
+        :param int num_threads: The number of threads to use.
+        :return: The mean :math:`r^2` in each bin, which is NaN for empty
+            bins, and the number of pairs in each bin. These have one value
+            per distance bin, or one row per frequency bin if ``maf_breaks``
+            is specified.
+        :rtype: tuple
+        """
+        if max_mutations is None:
+            max_mutations = -1
+        r2_sum, num_pairs = self._ll_ld_calculator.get_r2_decay(
+            distance_breaks, frequency_breaks=maf_breaks,
+            max_mutations=max_mutations, num_threads=num_threads)
+        with np.errstate(invalid="ignore", divide="ignore"):
+            mean = r2_sum / num_pairs
+        if maf_breaks is None:
+            mean = mean[0]
+            num_pairs = num_pairs[0]
+        return mean, num_pairs
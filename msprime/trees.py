@@ -28,6 +28,7 @@ import json
 import math
 import random
 import sys
+import threading
 
 try:
     import svgwrite
@@ -54,6 +55,12 @@ NULL_NODE = -1
 
 NULL_POPULATION = -1
 
+_site_stat_codes = {
+    "diversity": _msprime.SITE_STAT_DIVERSITY,
+    "segregating_sites": _msprime.SITE_STAT_SEGREGATING_SITES,
+    "tajimas_d": _msprime.SITE_STAT_TAJIMAS_D,
+}
+
 
 def check_numpy():
     if not _numpy_imported:
@@ -410,12 +417,34 @@ class SparseTree(object):
         >>>    tree.get_branch_length(u) for u in tree.nodes()
         >>>    if u != tree.get_root())
 
+        If the tree was obtained with ``branch_lengths=True`` this is
+        maintained incrementally as the trees change and returned in
+        constant time.
+
         :return: The sum of all the branch lengths in this tree.
         """
+        if self._ll_sparse_tree.get_flags() & _msprime.BRANCH_LENGTHS:
+            return self._ll_sparse_tree.get_total_branch_length()
         root = self.get_root()
         return sum(
             self.get_branch_length(u) for u in self.nodes() if u != root)
 
+    def get_branch_length_by_count(self):
+        """
+        Returns a numpy array whose kth entry is the total length of the
+        branches in this tree that subtend exactly k samples.
+
+        :rtype: numpy.ndarray
+        :raises RuntimeError: if the :meth:`.TreeSequence.trees`
+            method is not called with ``branch_lengths=True``.
+        """
+        check_numpy()
+        if not (self._ll_sparse_tree.get_flags() & _msprime.BRANCH_LENGTHS):
+            raise RuntimeError(
+                "The get_branch_length_by_count method is only supported "
+                "when branch_lengths=True.")
+        return self._ll_sparse_tree.get_branch_length_by_count()
+
     def mrca(self, u, v):
         return self.get_mrca(u, v)
 
@@ -863,10 +892,13 @@ def _check_population_configurations(population_configurations):
 
 
 def _replicate_generator(
-        sim, mutation_generator, num_replicates, provenance_dict):
+        sim, mutation_generator, num_replicates, provenance_dict, seeds=None,
+        mutation_seeds=None):
     """
     Generator function for the many-replicates case of the simulate
-    function.
+    function. If seeds is not None, the simulator's random generator is
+    reseeded with the corresponding value before each replicate; likewise
+    for the mutation generator's random generator and mutation_seeds.
     """
     # TODO like in the single replicate case, we need to encode the
     # simulation parameters so that particular simulations can be
@@ -876,6 +908,10 @@ def _replicate_generator(
     # Should use range here, but Python 2 makes this awkward...
     j = 0
     while j < num_replicates:
+        if seeds is not None:
+            sim.get_random_generator().set_seed(seeds[j])
+        if mutation_seeds is not None:
+            mutation_generator.get_random_generator().set_seed(mutation_seeds[j])
         j += 1
         sim.run()
         tree_sequence = sim.get_tree_sequence(mutation_generator, provenance)
@@ -883,6 +919,83 @@ def _replicate_generator(
         sim.reset()
 
 
+def _threaded_replicate_generator(
+        simulators, mutation_generators, seeds, provenance_dict,
+        mutation_seeds=None):
+    """
+    Generator function for the many-replicates case of the simulate
+    function when more than one thread is used. Each thread owns a
+    simulator and mutation generator, whose random generators are
+    reseeded for each replicate using the corresponding values in seeds
+    and, if the mutation generator has its own random generator,
+    mutation_seeds.
+    Replicates are yielded in order, and at most two per thread are held
+    in memory at once.
+    """
+    provenance = [json.dumps(provenance_dict).encode()]
+    num_replicates = len(seeds)
+    num_threads = len(simulators)
+    max_pending = 2 * num_threads
+    condition = threading.Condition()
+    state = {"next_replicate": 0, "next_yield": 0, "error": None, "closed": False}
+    results = {}
+
+    def worker(sim, mutation_generator):
+        while True:
+            with condition:
+                j = state["next_replicate"]
+                state["next_replicate"] += 1
+                while (
+                        j < num_replicates and
+                        j >= state["next_yield"] + max_pending and
+                        state["error"] is None and not state["closed"]):
+                    condition.wait()
+                if j >= num_replicates or state["error"] is not None or \
+                        state["closed"]:
+                    return
+            try:
+                sim.get_random_generator().set_seed(seeds[j])
+                if mutation_seeds is not None:
+                    mutation_generator.get_random_generator().set_seed(
+                        mutation_seeds[j])
+                sim.reset()
+                sim.run()
+                tree_sequence = sim.get_tree_sequence(mutation_generator, provenance)
+            except Exception as e:
+                with condition:
+                    if state["error"] is None:
+                        state["error"] = e
+                    condition.notify_all()
+                return
+            with condition:
+                results[j] = tree_sequence
+                condition.notify_all()
+
+    threads = [
+        threading.Thread(target=worker, args=(sim, mutation_generator))
+        for sim, mutation_generator in zip(simulators, mutation_generators)]
+    for thread in threads:
+        thread.daemon = True
+        thread.start()
+    try:
+        for j in range(num_replicates):
+            with condition:
+                while j not in results and state["error"] is None:
+                    condition.wait()
+                if state["error"] is not None:
+                    raise state["error"]
+                tree_sequence = results.pop(j)
+                state["next_yield"] = j + 1
+                condition.notify_all()
+            yield tree_sequence
+    finally:
+        with condition:
+            state["closed"] = True
+            condition.notify_all()
+        for thread in threads:
+            thread.join()
+
+
 def simulator_factory(
         sample_size=None,
         Ne=1,
@@ -984,7 +1097,8 @@ def simulate(
         record_migrations=False,
         random_seed=None,
         mutation_generator=None,
-        num_replicates=None):
+        num_replicates=None,
+        num_threads=None):
     """
     Simulates the coalescent with recombination under the specified model
     parameters and returns the resulting :class:`.TreeSequence`.
@@ -1051,6 +1165,17 @@ def simulate(
         of the simulation if no replication is performed, or an
         iterator over the independent replicates simulated if the
         :obj:`num_replicates` parameter has been used.
+    :param int num_threads: The number of threads used to simulate
+        replicates. If this is not specified, None or 1, replicates are
+        simulated sequentially. Otherwise, each thread runs an independent
+        simulator and replicates are returned in order. In either case,
+        each replicate is seeded with a value derived from ``random_seed``,
+        so that the results do not depend on the number of threads. The
+        random generator of a supplied ``mutation_generator`` is likewise
+        reseeded for each replicate. Note that replicates therefore differ
+        from those produced by earlier versions for the same
+        ``random_seed``. This parameter
+        requires ``num_replicates``.
     :rtype: :class:`.TreeSequence` or an iterator over
         :class:`.TreeSequence` replicates.
     :warning: If using replication, do not store the results of the
@@ -1061,16 +1186,22 @@ def simulate(
     seed = random_seed
     if random_seed is None:
         seed = _get_random_seed()
+    if num_threads is None:
+        num_threads = 1
+    if num_threads < 1:
+        raise ValueError("num_threads must be >= 1")
+    if num_threads > 1 and num_replicates is None:
+        raise ValueError("num_threads requires num_replicates")
     rng = RandomGenerator(seed)
-    sim = simulator_factory(
-        sample_size=sample_size, random_generator=rng,
-        Ne=Ne, length=length,
+    simulator_args = dict(
+        sample_size=sample_size, Ne=Ne, length=length,
         recombination_rate=recombination_rate,
         recombination_map=recombination_map,
         population_configurations=population_configurations,
         migration_matrix=migration_matrix,
         demographic_events=demographic_events,
         samples=samples, model=model, record_migrations=record_migrations)
+    sim = simulator_factory(random_generator=rng, **simulator_args)
     # The provenance API is very tentative, and only included now as a
     # pre-alpha feature.
     parameters = {"TODO": "encode simulation parameters"}
@@ -1084,8 +1215,36 @@ def simulate(
                 "Cannot specify both mutation_rate and mutation_generator")
     if num_replicates is None:
         return next(_replicate_generator(sim, mutation_generator, 1, provenance))
-    else:
-        return _replicate_generator(sim, mutation_generator, num_replicates, provenance)
+    # Each replicate gets its own seed derived from the random seed, so
+    # that the replicates do not depend on the number of threads. A
+    # mutation generator with its own random generator is reseeded from
+    # a second sequence of seeds.
+    seed_rng = random.Random(seed)
+    seeds = [seed_rng.randint(1, 2**32 - 1) for _ in range(num_replicates)]
+    shared_rng = mutation_generator.get_random_generator() is rng
+    mutation_seeds = None
+    if not shared_rng:
+        mutation_seeds = [
+            seed_rng.randint(1, 2**32 - 1) for _ in range(num_replicates)]
+    if num_threads > 1 and num_replicates > 1:
+        # Each thread needs its own random generators, so we make copies
+        # of the simulator and mutation generator. The first thread uses
+        # the originals.
+        mu = mutation_generator.get_mutation_rate()
+        simulators = [sim]
+        mutation_generators = [mutation_generator]
+        for _ in range(min(num_threads, num_replicates) - 1):
+            thread_rng = RandomGenerator(seed)
+            simulators.append(
+                simulator_factory(random_generator=thread_rng, **simulator_args))
+            if not shared_rng:
+                thread_rng = RandomGenerator(seed)
+            mutation_generators.append(MutationGenerator(thread_rng, mu))
+        return _threaded_replicate_generator(
+            simulators, mutation_generators, seeds, provenance, mutation_seeds)
+    return _replicate_generator(
+        sim, mutation_generator, num_replicates, provenance, seeds,
+        mutation_seeds)
 
 
 def load(path):
@@ -1522,7 +1681,8 @@ class TreeSimulator(object):
         model_map = {
             "hudson": StandardCoalescent(),
             "smc": SmcApproxCoalescent(),
-            "smc_prime": SmcPrimeApproxCoalescent()
+            "smc_prime": SmcPrimeApproxCoalescent(),
+            "dtwf": DiscreteTimeWrightFisher()
         }
         if model is None:
             model_instance = StandardCoalescent()
@@ -1569,7 +1729,7 @@ class TreeSimulator(object):
         ll_demographic_events = [
             event.get_ll_representation(d, Ne)
             for event in self._demographic_events]
-        ll_simulation_model = self._model.get_ll_representation()
+        ll_simulation_model = self._model.get_ll_representation(Ne)
         ll_recombination_rate = self.get_per_locus_scaled_recombination_rate()
         ll_samples = [(pop, time / (4 * Ne)) for pop, time in self._samples]
         ll_sim = _msprime.Simulator(
@@ -1614,10 +1774,12 @@ class TreeSimulator(object):
                 self.node_table, self.edgeset_table, self.mutation_type_table,
                 self.mutation_table)
         ll_tree_sequence = _msprime.TreeSequence()
+        # The tables are only used to pass data to the tree sequence, so
+        # it can take their columns rather than copying them.
         ll_tree_sequence.load_tables(
             self.node_table, self.edgeset_table, self.migration_table,
             self.mutation_type_table, self.mutation_table,
-            provenance_strings=provenance_strings)
+            provenance_strings=provenance_strings, take_tables=True)
         return TreeSequence(ll_tree_sequence)
 
     def reset(self):
@@ -2048,7 +2210,9 @@ class TreeSequence(object):
         for t in self.trees():
             yield t.get_interval()[1]
 
-    def trees(self, tracked_leaves=None, leaf_counts=True, leaf_lists=False):
+    def trees(
+            self, tracked_leaves=None, leaf_counts=True, leaf_lists=False,
+            branch_lengths=False):
         """
         Returns an iterator over the trees in this tree sequence. Each value
         returned in this iterator is an instance of
@@ -2081,9 +2245,41 @@ class TreeSequence(object):
         :param bool leaf_lists: If True, provide more efficient access
             to the leaves beneath a give node using the
             :meth:`.SparseTree.leaves` method.
+        :param bool branch_lengths: If True, maintain the total branch
+            length and the branch length subtending each number of leaves
+            as the trees change; see
+            :meth:`.SparseTree.get_branch_length_by_count`. Requires
+            ``leaf_counts``.
         :return: An iterator over the sparse trees in this tree sequence.
         :rtype: iter
         """
+        ll_sparse_tree = self._make_ll_sparse_tree(
+            tracked_leaves, leaf_counts, leaf_lists, branch_lengths)
+        iterator = _msprime.SparseTreeIterator(ll_sparse_tree)
+        sparse_tree = SparseTree(ll_sparse_tree)
+        for _ in iterator:
+            yield sparse_tree
+
+    def at(
+            self, position, tracked_leaves=None, leaf_counts=True,
+            leaf_lists=False, branch_lengths=False):
+        """
+        Returns the tree covering the specified position. The tree is
+        built directly from the edgesets overlapping the position, without
+        iterating over the preceding trees. The remaining parameters are
+        as for :meth:`.trees`.
+
+        :param float position: A coordinate in the sequence.
+        :return: The tree covering the specified position.
+        :rtype: :class:`.SparseTree`
+        """
+        ll_sparse_tree = self._make_ll_sparse_tree(
+            tracked_leaves, leaf_counts, leaf_lists, branch_lengths)
+        ll_sparse_tree.seek(position)
+        return SparseTree(ll_sparse_tree)
+
+    def _make_ll_sparse_tree(
+            self, tracked_leaves, leaf_counts, leaf_lists, branch_lengths):
         flags = 0
         if leaf_counts:
             flags |= _msprime.LEAF_COUNTS
@@ -2091,14 +2287,15 @@ class TreeSequence(object):
             raise ValueError("Cannot set tracked_leaves without leaf_counts")
         if leaf_lists:
             flags |= _msprime.LEAF_LISTS
+        if branch_lengths:
+            if not leaf_counts:
+                raise ValueError(
+                    "Cannot set branch_lengths without leaf_counts")
+            flags |= _msprime.BRANCH_LENGTHS
         kwargs = {"flags": flags}
         if tracked_leaves is not None:
             kwargs["tracked_leaves"] = tracked_leaves
-        ll_sparse_tree = _msprime.SparseTree(self._ll_tree_sequence, **kwargs)
-        iterator = _msprime.SparseTreeIterator(ll_sparse_tree)
-        sparse_tree = SparseTree(ll_sparse_tree)
-        for _ in iterator:
-            yield sparse_tree
+        return _msprime.SparseTree(self._ll_tree_sequence, **kwargs)
 
     def haplotypes(self):
         """
@@ -2177,6 +2374,52 @@ class TreeSequence(object):
                     mutations=[Mutation(*mutation) for mutation in mutations])
                 yield Variant(position=pos, site=site, index=index, genotypes=g)
 
+    def packed_genotypes(self, block_size=1024, bits=1, sample_major=False):
+        """
+        Returns an iterator over the genotypes of blocks of up to
+        ``block_size`` consecutive sites, packed into ``bits`` bits per
+        genotype (least significant bits first) in a numpy array of 1 byte
+        unsigned integers. By default, each block has one row per site in
+        which the genotype of sample :math:`k` is in bits :math:`k b` to
+        :math:`k b + b - 1`, where :math:`b` is ``bits``. If
+        ``sample_major`` is True, each block instead has one row per sample
+        in which the genotype at the :math:`j` th site of the block is in
+        bits :math:`j b` to :math:`j b + b - 1`. Any trailing bits in a
+        row are zero. With ``bits=1`` and ``sample_major=False`` a block
+        ``B`` is equal to ``numpy.packbits(G, axis=1, bitorder="little")``,
+        where ``G`` is the matrix of genotypes for the sites in the block.
+        The genotypes are computed without holding the GIL.
+
+        :param int block_size: The maximum number of sites in each block.
+        :param int bits: The number of bits per genotype; either 1 or 2.
+        :param bool sample_major: If True, return one row per sample
+            rather than one row per site.
+        :return: An iterator over the packed genotypes of each block.
+        :rtype: iter(numpy.ndarray)
+        """
+        check_numpy()
+        if bits not in (1, 2):
+            raise ValueError("bits must be 1 or 2")
+        if block_size < 1:
+            raise ValueError("block_size must be >= 1")
+        n = self.get_sample_size()
+        iterator = _msprime.VariantGenerator(
+            self._ll_tree_sequence, bytearray(n))
+        num_sites = block_size
+        while num_sites == block_size:
+            if sample_major:
+                block = np.empty((n, (block_size * bits + 7) // 8), np.uint8)
+            else:
+                block = np.empty((block_size, (n * bits + 7) // 8), np.uint8)
+            num_sites = iterator.next_packed(
+                block, block_size, two_bit=bits == 2,
+                sample_major=sample_major)
+            if num_sites > 0:
+                if sample_major:
+                    yield block[:, :(num_sites * bits + 7) // 8]
+                else:
+                    yield block[:num_sites]
+
     def pairwise_diversity(self, samples=None):
         return self.get_pairwise_diversity(samples)
 
@@ -2225,7 +2468,8 @@ class TreeSequence(object):
         assert len(out[0]) == 1
         return [x[0] for x in out]
 
-    def branch_stats_vector(self, leaf_sets, weight_fun, windows=None):
+    def branch_stats_vector(self, leaf_sets, weight_fun, windows=None,
+                            vectorised=False):
         '''
         Here leaf_sets is a list of lists of leaves, and weight_fun is a function
         whose argument is a list of integers of the same length as leaf_sets
@@ -2236,27 +2480,44 @@ class TreeSequence(object):
 
         It does this separately for each window [windows[i], windows[i+1])
         and returns the values in a vector.
+
+        If vectorised is True, weight_fun is instead called with a numpy
+        array whose rows are the counts for a batch of branches, and must
+        return an array with one row of weights per branch; this requires
+        numpy. Without numpy, the statistic is computed in Python.
         '''
-        if windows is None:
-            windows = (0, self.sequence_length)
+        if vectorised:
+            check_numpy()
+        windows = self._check_windows(windows)
         for U in leaf_sets:
             if len(U) != len(set(U)):
                 raise ValueError(
                     "elements of leaf_sets cannot contain repeated elements.")
+        if not _numpy_imported:
+            return self._python_branch_stats_vector(leaf_sets, weight_fun, windows)
+        num_leaf_sets = len(leaf_sets)
+        if vectorised:
+            n_out = np.array(weight_fun(np.zeros((1, num_leaf_sets)))).shape[1]
+            vector_weight_fun = weight_fun
+        else:
+            n_out = len(weight_fun([0 for a in range(num_leaf_sets)]))
+
+            def vector_weight_fun(X):
+                return [weight_fun(row) for row in X.astype(int).tolist()]
+
+        S = self._ll_tree_sequence.get_branch_stats(
+            sample_sets=leaf_sets, windows=windows, num_outputs=n_out,
+            weight_function=vector_weight_fun)
+        return S.tolist()
+
+    def _python_branch_stats_vector(self, leaf_sets, weight_fun, windows):
+        """
+        Pure Python implementation of branch_stats_vector, used when numpy
+        is not available.
+        """
         num_windows = len(windows) - 1
-        if windows[0] != 0.0:
-            raise ValueError(
-                "Windows must start at the start of the sequence (at 0.0).")
-        if windows[-1] != self.sequence_length:
-            raise ValueError("Windows must extend to the end of the sequence.")
-        for k in range(num_windows):
-            if windows[k + 1] <= windows[k]:
-                raise ValueError("Windows must be increasing.")
-        # initialize
         num_leaf_sets = len(leaf_sets)
         n_out = len(weight_fun([0 for a in range(num_leaf_sets)]))
-        # print("leaf_sets:", leaf_sets)
-        # print("n_out:",n_out)
         S = [[0.0 for j in range(n_out)] for _ in range(num_windows)]
         L = [0.0 for j in range(n_out)]
         N = self.num_nodes
@@ -2271,8 +2532,6 @@ class TreeSequence(object):
         for length, records_out, records_in in self.diffs():
             for sign, records in ((-1, records_out), (+1, records_in)):
                 for node, children, time in records:
-                    # print("Record (",sign,"):",node,children,time)
-                    # print("\t",X, "-->", L)
                     if sign == +1:
                         node_time[node] = time
                     dx = [0 for k in range(num_leaf_sets)]
@@ -2285,8 +2544,6 @@ class TreeSequence(object):
                         dt = (node_time[pi[child]] - node_time[child])
                         for j in range(n_out):
                             L[j] += sign * dt * w[j]
-                        # print("\t\tchild:",child,"+=",sign,"*",weight_fun(X[child]),
-                        #    "*(",node_time[pi[child]],"-",node_time[child],")","-->",L)
                         if sign == -1:
                             pi[child] = -1
                     old_w = weight_fun(X[node])
@@ -2297,8 +2554,6 @@ class TreeSequence(object):
                         dt = (node_time[pi[node]] - node_time[node])
                         for j in range(n_out):
                             L[j] += dt * (w[j]-old_w[j])
-                        # print("\t\tnode:",node,"+=",dt,"*(",weight_fun(X[node]),"-",
-                        #   old_w,") -->",L)
                     # propagate change up the tree
                     u = pi[node]
                     if u != -1:
@@ -2314,12 +2569,8 @@ class TreeSequence(object):
                                 dt = (node_time[pi[u]] - node_time[u])
                                 for j in range(n_out):
                                     L[j] += dt*(w[j] - old_w[j])
-                                # print("\t\tanc:",u,"+=",dt,"*(",weight_fun(X[u]),"-",
-                                #    old_w,") -->",L)
                             u = next_u
                             next_u = pi[next_u]
-                    # print("\t",X, "-->", L)
-            # print("next tree:",L,length)
             while chrom_pos + length >= windows[window_num + 1]:
                 # wrap up the last window
                 this_length = windows[window_num + 1] - chrom_pos
@@ -2341,6 +2592,202 @@ class TreeSequence(object):
                 chrom_pos += length
         return S
 
+    def _check_windows(self, windows):
+        if windows is None:
+            windows = (0, self.sequence_length)
+        num_windows = len(windows) - 1
+        if windows[0] != 0.0:
+            raise ValueError(
+                "Windows must start at the start of the sequence (at 0.0).")
+        if windows[-1] != self.sequence_length:
+            raise ValueError("Windows must extend to the end of the sequence.")
+        for k in range(num_windows):
+            if windows[k + 1] <= windows[k]:
+                raise ValueError("Windows must be increasing.")
+        return windows
+
+    def _branch_stat(self, statistic, arity, sample_sets, indexes, windows):
+        check_numpy()
+        windows = self._check_windows(windows)
+        if indexes is None:
+            if len(sample_sets) != arity:
+                raise ValueError(
+                    "Must specify indexes unless there are exactly {} "
+                    "sample sets".format(arity))
+            indexes = [list(range(arity))]
+        return self._ll_tree_sequence.get_branch_stat(
+            statistic=statistic, sample_sets=sample_sets, indexes=indexes,
+            windows=windows)
+
+    def branch_diversity(self, sample_sets, windows=None):
+        """
+        Returns the branch length diversity within each of the specified
+        sets of samples: the average over pairs of distinct samples of the
+        total branch length separating them. The result is a numpy array
+        with one row per window and one column per sample set.
+
+        :param list sample_sets: A list of lists of sample IDs.
+        :param iterable windows: The breakpoints of the windows; if None,
+            the whole sequence is a single window.
+        :rtype: numpy.ndarray
+        """
+        indexes = [[j] for j in range(len(sample_sets))]
+        return self._branch_stat(
+            _msprime.STAT_DIVERSITY, 1, sample_sets, indexes, windows)
+
+    def branch_divergence(self, sample_sets, indexes=None, windows=None):
+        """
+        Returns the average branch length separating a sample from
+        ``sample_sets[i]`` and one from ``sample_sets[j]`` for each pair
+        ``(i, j)`` in ``indexes``. If there are two sample sets, ``indexes``
+        may be omitted.
+
+        :rtype: numpy.ndarray
+        """
+        return self._branch_stat(
+            _msprime.STAT_DIVERGENCE, 2, sample_sets, indexes, windows)
+
+    def branch_Y2(self, sample_sets, indexes=None, windows=None):
+        """
+        Returns the branch length Y2 statistic for each pair ``(a, b)``
+        of sample set indexes: the average length of the branches separating
+        one sample from ``a`` from two distinct samples from ``b``.
+
+        :rtype: numpy.ndarray
+        """
+        return self._branch_stat(
+            _msprime.STAT_Y2, 2, sample_sets, indexes, windows)
+
+    def branch_Y3(self, sample_sets, indexes=None, windows=None):
+        """
+        Returns the branch length Y3 statistic for each triple ``(a, b, c)``
+        of sample set indexes: the average length of the branches separating
+        a sample from ``a`` from samples from ``b`` and ``c``.
+
+        :rtype: numpy.ndarray
+        """
+        return self._branch_stat(
+            _msprime.STAT_Y3, 3, sample_sets, indexes, windows)
+
+    def branch_f2(self, sample_sets, indexes=None, windows=None):
+        """
+        Returns the branch length f2 statistic for each pair ``(a, b)`` of
+        sample set indexes, where each branch is weighted by
+        ``(p_a - p_b) ** 2`` and ``p_a`` is the fraction of ``a`` below it.
+
+        :rtype: numpy.ndarray
+        """
+        return self._branch_stat(
+            _msprime.STAT_F2, 2, sample_sets, indexes, windows)
+
+    def branch_f3(self, sample_sets, indexes=None, windows=None):
+        """
+        Returns the branch length f3 statistic for each triple ``(a, b, c)``
+        of sample set indexes, where each branch is weighted by
+        ``(p_a - p_b) * (p_a - p_c)``.
+
+        :rtype: numpy.ndarray
+        """
+        return self._branch_stat(
+            _msprime.STAT_F3, 3, sample_sets, indexes, windows)
+
+    def branch_f4(self, sample_sets, indexes=None, windows=None):
+        """
+        Returns the branch length f4 statistic for each tuple
+        ``(a, b, c, d)`` of sample set indexes, where each branch is weighted
+        by ``(p_a - p_b) * (p_c - p_d)``.
+
+        :rtype: numpy.ndarray
+        """
+        return self._branch_stat(
+            _msprime.STAT_F4, 4, sample_sets, indexes, windows)
+
+    def site_stats(
+            self, sample_sets, statistics=("diversity",), windows=None,
+            num_threads=1):
+        """
+        Returns site statistics within each of the specified sets of samples,
+        computed in a single pass over the trees. The available statistics
+        are "diversity" (the sum over sites of the mean number of pairwise
+        differences), "segregating_sites" and "tajimas_d". The result is a
+        numpy array indexed by (window, statistic, sample set).
+
+        :param list sample_sets: A list of lists of sample IDs.
+        :param iterable statistics: The names of the statistics to compute.
+        :param iterable windows: The breakpoints of the windows; if None,
+            the whole sequence is a single window.
+        :param int num_threads: The number of threads to use; the sequence
+            is split into this many chunks which are processed in parallel.
+        :rtype: numpy.ndarray
+        """
+        check_numpy()
+        windows = self._check_windows(windows)
+        codes = []
+        for name in statistics:
+            if name not in _site_stat_codes:
+                raise ValueError("Unknown statistic '{}'".format(name))
+            codes.append(_site_stat_codes[name])
+        result, _, _ = self._ll_tree_sequence.get_site_stats(
+            sample_sets=sample_sets, windows=windows, statistics=codes,
+            num_threads=num_threads)
+        return result
+
+    def site_divergence(self, sample_sets, windows=None):
+        """
+        Returns the sum over sites of the probability that a sample from
+        ``sample_sets[i]`` and one from ``sample_sets[j]`` differ, for all
+        pairs of sample sets. The diagonal holds the diversity within each
+        set. The result is a numpy array indexed by (window, i, j).
+
+        :rtype: numpy.ndarray
+        """
+        check_numpy()
+        windows = self._check_windows(windows)
+        _, divergence, _ = self._ll_tree_sequence.get_site_stats(
+            sample_sets=sample_sets, windows=windows, statistics=[],
+            divergence=True)
+        return divergence
+
+    def branch_sfs(self, windows=None):
+        """
+        Returns the branch length site frequency spectrum: entry ``[w, k]``
+        is the average along window ``w`` of the total length of the branches
+        that subtend exactly ``k`` samples. This is the expected SFS per
+        unit of mutation rate, and is computed without reference to the
+        mutations.
+
+        :param iterable windows: The breakpoints of the windows; if None,
+            the whole sequence is a single window.
+        :rtype: numpy.ndarray
+        """
+        check_numpy()
+        windows = self._check_windows(windows)
+        return self._ll_tree_sequence.get_branch_sfs(windows=windows)
+
+    def site_frequency_spectrum(
+            self, sample_sets=None, windows=None, folded=False):
+        """
+        Returns the site frequency spectrum in each window. Entry
+        ``[w, c_1, ..., c_K]`` is the number of derived alleles in window
+        ``w`` carried by ``c_j`` members of ``sample_sets[j]``, so that a
+        single sample set gives the one-way SFS and two or three sets give
+        the joint SFS. If ``folded`` is True, alleles carried by more than
+        half of the combined samples are counted by their complement.
+
+        :param list sample_sets: A list of lists of sample IDs; if None,
+            the SFS of all samples is returned.
+        :param iterable windows: The breakpoints of the windows; if None,
+            the whole sequence is a single window.
+        :param bool folded: Whether to return the folded spectrum.
+        :rtype: numpy.ndarray
+        """
+        check_numpy()
+        windows = self._check_windows(windows)
+        if sample_sets is None:
+            sample_sets = [list(self.samples())]
+        return self._ll_tree_sequence.get_sfs(
+            sample_sets=sample_sets, windows=windows, folded=folded)
+
     def node(self, u):
         flags, time, population, name = self._ll_tree_sequence.get_node(u)
         return Node(
@@ -2806,7 +3253,7 @@ class SimulationModel(object):
     """
     name = None
 
-    def get_ll_representation(self):
+    def get_ll_representation(self, Ne=1):
         return {"name": self.name}
 
 
@@ -2831,8 +3278,8 @@ class ParametricSimulationModel(SimulationModel):
     """
     The superclass of simulation models that require parameters.
     """
-    def get_ll_representation(self):
-        d = super(ParametricSimulationModel, self).get_ll_representation()
+    def get_ll_representation(self, Ne=1):
+        d = super(ParametricSimulationModel, self).get_ll_representation(Ne)
         d.update(self.__dict__)
         return d
 
@@ -2860,6 +3307,27 @@ class DiracCoalescent(ParametricSimulationModel):
         self.c = c
 
 
+class DiscreteTimeWrightFisher(ParametricSimulationModel):
+    """
+    The discrete time Wright-Fisher model, in which each generation of a
+    diploid population of size Ne is simulated explicitly. This is more
+    accurate than the coalescent when the sample size is close to Ne. If
+    num_generations is specified, we switch to Hudson's algorithm after
+    this many generations.
+    """
+    name = "dtwf"
+
+    def __init__(self, num_generations=None):
+        if num_generations is None:
+            num_generations = sys.float_info.max
+        self.num_generations = num_generations
+
+    def get_ll_representation(self, Ne=1):
+        d = super(DiscreteTimeWrightFisher, self).get_ll_representation(Ne)
+        d["population_size"] = Ne
+        return d
+
+
 class Population(object):
     """
     Simple class to represent the state of a population in terms of its
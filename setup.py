@@ -155,9 +155,10 @@ class DefineMacros(object):
 
 configurator = PathConfigurator()
 source_files = [
-    "msprime.c", "fenwick.c", "avl.c", "tree_sequence.c",
-    "object_heap.c", "newick.c", "hapgen.c", "recomb_map.c", "mutgen.c",
-    "vargen.c", "vcf.c", "ld.c", "table.c"]
+    "msprime.c", "fenwick.c", "sum_tree.c", "locus_map.c", "avl.c",
+    "tree_sequence.c", "object_heap.c", "newick.c", "hapgen.c",
+    "recomb_map.c", "mutgen.c", "vargen.c", "vcf.c", "ld.c", "table.c",
+    "simplifier.c"]
 libdir = "lib"
 _msprime_module = Extension(
     '_msprime',
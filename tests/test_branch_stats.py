@@ -26,9 +26,11 @@ from __future__ import division
 import unittest
 import random
 
+import numpy as np
 import six
 
 import msprime
+import _msprime
 
 ##
 # This tests implementation of the algorithm described in branch-lengths-methods.md
@@ -605,3 +607,168 @@ class BranchStatsTestCase(unittest.TestCase):
         # Windows must be increasing.
         self.assertRaises(
             ValueError, ts.branch_stats_vector, [[1, 2]], f, [0, 1, 1])
+
+
+class BuiltinBranchStatsTestCase(unittest.TestCase):
+    """
+    Tests the built-in branch statistics and the vectorised interface
+    against the reference implementations above.
+    """
+    random_seed = 5
+
+    def get_tree_sequence(self):
+        return msprime.simulate(
+            10, random_seed=self.random_seed, recombination_rate=10)
+
+    def get_windows(self, ts):
+        breakpoints = list(ts.breakpoints())
+        return [
+            None,
+            [0, ts.sequence_length / 3, ts.sequence_length],
+            [0, breakpoints[1], ts.sequence_length / 2, ts.sequence_length]]
+
+    def assertArrayAlmostEqual(self, x, y):
+        self.assertEqual(len(x), len(y))
+        for a, b in zip(x, y):
+            self.assertAlmostEqual(a, b)
+
+    def test_diversity(self):
+        ts = self.get_tree_sequence()
+        A = [[0, 1, 2], [3, 4, 5, 6, 7]]
+        for windows in self.get_windows(ts):
+            pi = ts.branch_diversity(A, windows)
+            W = windows if windows is not None else [0, ts.sequence_length]
+            for j, a in enumerate(A):
+                n = len(a)
+                reference = branch_length_diversity_window(ts, a, a, W)
+                self.assertArrayAlmostEqual(
+                    pi[:, j], [x * n * n / (n * (n - 1)) for x in reference])
+
+    def test_divergence(self):
+        ts = self.get_tree_sequence()
+        A = [[0, 1], [2, 3, 4], [5]]
+        for windows in self.get_windows(ts):
+            W = windows if windows is not None else [0, ts.sequence_length]
+            d = ts.branch_divergence(A, [[0, 1], [1, 2], [0, 2]], windows)
+            self.assertEqual(d.shape, (len(W) - 1, 3))
+            for k, (i, j) in enumerate([(0, 1), (1, 2), (0, 2)]):
+                self.assertArrayAlmostEqual(
+                    d[:, k], branch_length_diversity_window(ts, A[i], A[j], W))
+        d = ts.branch_divergence([[0], [1]])
+        self.assertAlmostEqual(d[0, 0], branch_length_diversity(ts, [0], [1]))
+
+    def test_Y(self):
+        ts = self.get_tree_sequence()
+        y2 = ts.branch_Y2([[0], [1, 2]])
+        y3 = ts.branch_Y3([[0], [1], [2]])
+        self.assertAlmostEqual(y2[0, 0], branch_length_Y(ts, 0, 1, 2))
+        self.assertAlmostEqual(y3[0, 0], branch_length_Y(ts, 0, 1, 2))
+        A = [[0, 1], [2, 3, 4], [5, 6]]
+        n = [len(a) for a in A]
+
+        def f(x):
+            return (
+                x[0] * (n[1] - x[1]) * (n[2] - x[2])
+                + (n[0] - x[0]) * x[1] * x[2]) / (n[0] * n[1] * n[2])
+
+        self.assertAlmostEqual(
+            ts.branch_Y3(A)[0, 0], branch_stats_node_iter(ts, A, f))
+
+    def test_f_stats(self):
+        ts = self.get_tree_sequence()
+        A = [[0, 1], [2, 3, 4], [5, 6], [7, 8, 9]]
+        n = [len(a) for a in A]
+
+        def f4(x):
+            return (
+                (x[0] / n[0] - x[1] / n[1]) * (x[2] / n[2] - x[3] / n[3]))
+
+        self.assertAlmostEqual(
+            ts.branch_f4(A)[0, 0], branch_length_f4(ts, *A))
+        self.assertAlmostEqual(
+            ts.branch_f4(A)[0, 0], branch_stats_node_iter(ts, A, f4))
+        self.assertAlmostEqual(
+            ts.branch_f3(A, [[0, 1, 2]])[0, 0],
+            ts.branch_f4(A, [[0, 1, 0, 2]])[0, 0])
+        self.assertAlmostEqual(
+            ts.branch_f2(A, [[1, 3]])[0, 0],
+            ts.branch_f4(A, [[1, 3, 1, 3]])[0, 0])
+
+    def test_vectorised(self):
+        ts = self.get_tree_sequence()
+        A = [[0, 1, 2], [3, 4, 5, 6]]
+        n = [len(a) for a in A]
+
+        def f(x):
+            return [
+                (x[0] * (n[1] - x[1]) + (n[0] - x[0]) * x[1]) / (n[0] * n[1]),
+                float(x[0] > 0)]
+
+        def vf(X):
+            return np.array([
+                (X[:, 0] * (n[1] - X[:, 1]) + (n[0] - X[:, 0]) * X[:, 1])
+                / (n[0] * n[1]), X[:, 0] > 0]).T
+
+        for windows in self.get_windows(ts):
+            S1 = ts.branch_stats_vector(A, f, windows)
+            S2 = ts.branch_stats_vector(A, vf, windows, vectorised=True)
+            self.assertEqual(len(S1), len(S2))
+            for x, y in zip(S1, S2):
+                self.assertArrayAlmostEqual(x, y)
+            d = ts.branch_divergence(A, windows=windows)
+            self.assertArrayAlmostEqual(d[:, 0], [x[0] for x in S1])
+
+    def test_without_numpy(self):
+        ts = self.get_tree_sequence()
+        A = [[0, 1, 2], [3, 4, 5, 6]]
+
+        def f(x):
+            return [float(x[0] > 0), float(x[0] * x[1])]
+
+        for windows in self.get_windows(ts):
+            S1 = ts.branch_stats_vector(A, f, windows)
+            msprime.trees._numpy_imported = False
+            try:
+                S2 = ts.branch_stats_vector(A, f, windows)
+                self.assertRaises(
+                    RuntimeError, ts.branch_stats_vector, A, f, windows,
+                    vectorised=True)
+            finally:
+                msprime.trees._numpy_imported = True
+            self.assertEqual(len(S1), len(S2))
+            for x, y in zip(S1, S2):
+                self.assertArrayAlmostEqual(x, y)
+
+    def test_errors(self):
+        ts = self.get_tree_sequence()
+        A = [[0, 1], [2, 3]]
+        self.assertRaises(ValueError, ts.branch_f4, A)
+        self.assertRaises(ValueError, ts.branch_divergence, A, [[0, 1, 1]])
+        self.assertRaises(ValueError, ts.branch_divergence, A, [0, 1])
+        self.assertRaises(ValueError, ts.branch_divergence, A, windows=[0, 0.5])
+        self.assertRaises(IndexError, ts.branch_divergence, A, [[0, 2]])
+        self.assertRaises(
+            _msprime.LibraryError, ts.branch_divergence, [[0, 0], [1]])
+        self.assertRaises(
+            _msprime.LibraryError, ts.branch_diversity, [[0], [1, 2]])
+        self.assertRaises(
+            IndexError, ts.branch_divergence, [[0], [ts.num_nodes]])
+        self.assertRaises(
+            ValueError, ts.branch_stats_vector, A, lambda X: np.zeros((1, 2)),
+            vectorised=True)
+
+        def bad_weights(X):
+            raise ZeroDivisionError()
+
+        self.assertRaises(
+            ZeroDivisionError, ts.branch_stats_vector, A, bad_weights,
+            vectorised=True)
+        ll_ts = ts.get_ll_tree_sequence()
+        windows = [0, ts.sequence_length]
+        self.assertRaises(
+            ValueError, ll_ts.get_branch_stat, -1, A, [[0, 1]], windows)
+        self.assertRaises(
+            ValueError, ll_ts.get_branch_stat, _msprime.STAT_DIVERGENCE, [],
+            [[0, 1]], windows)
+        self.assertRaises(
+            TypeError, ll_ts.get_branch_stats, A, windows, 1, None)
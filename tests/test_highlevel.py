@@ -738,6 +738,67 @@ class TestVariantGenerator(HighLevelTestCase):
             ts_new = ts.copy(sites=[site])
             self.assertRaises(_msprime.LibraryError, list, ts_new.variants())
 
+    def verify_packed_genotypes(self, ts):
+        n = ts.get_sample_size()
+        m = ts.get_num_sites()
+        G = np.array(
+            [v.genotypes.copy() for v in ts.variants()], dtype=np.uint8)
+        G = G.reshape((m, n))
+        for block_size in [1, 3, 8, 13, m + 1]:
+            for bits in [1, 2]:
+                for sample_major in [False, True]:
+                    blocks = list(ts.packed_genotypes(
+                        block_size=block_size, bits=bits,
+                        sample_major=sample_major))
+                    self.assertEqual(
+                        len(blocks), (m + block_size - 1) // block_size)
+                    start = 0
+                    for B in blocks:
+                        self.assertEqual(B.dtype, np.uint8)
+                        num_sites = min(block_size, m - start)
+                        X = G[start: start + num_sites]
+                        if sample_major:
+                            X = X.T
+                        # Unpack least significant bits first.
+                        shifts = np.arange(0, 8, bits, dtype=np.uint8)
+                        U = (B[:, :, np.newaxis] >> shifts) & ((1 << bits) - 1)
+                        U = U.reshape((B.shape[0], -1))
+                        self.assertTrue(np.array_equal(U[:, :X.shape[1]], X))
+                        self.assertTrue(np.all(U[:, X.shape[1]:] == 0))
+                        if bits == 1 and not sample_major:
+                            self.assertTrue(np.array_equal(
+                                B, np.packbits(X, axis=1, bitorder="little")))
+                        start += num_sites
+                    self.assertEqual(start, m)
+
+    def test_packed_genotypes(self):
+        ts = self.get_tree_sequence()
+        self.verify_packed_genotypes(ts)
+
+    def test_packed_genotypes_recurrent_mutations(self):
+        ts = msprime.simulate(13, recombination_rate=1, length=13)
+        sites = [
+            msprime.Site(
+                position=j, index=j, ancestral_state="0",
+                mutations=[
+                    msprime.Mutation(site=j, node=j, derived_state="1"),
+                    msprime.Mutation(
+                        site=j, node=(j + 3) % 13,
+                        derived_state="1")][:1 + j % 2])
+            for j in range(13)]
+        self.verify_packed_genotypes(ts.copy(sites))
+
+    def test_packed_genotypes_errors(self):
+        ts = self.get_tree_sequence()
+        for bad_bits in [0, 3, 8]:
+            self.assertRaises(
+                ValueError, list, ts.packed_genotypes(bits=bad_bits))
+        for bad_block_size in [0, -1]:
+            self.assertRaises(
+                ValueError, list,
+                ts.packed_genotypes(block_size=bad_block_size))
+        self.assertEqual(list(msprime.simulate(10).packed_genotypes()), [])
+
 
 class TestHaplotypeGenerator(HighLevelTestCase):
     """
@@ -1617,6 +1678,45 @@ class TestSparseTree(HighLevelTestCase):
             self.assertEqual(t1.get_tmrca(*pair), t1.tmrca(*pair))
 
 
+class TestSeek(HighLevelTestCase):
+    """
+    Tests for obtaining the tree at a given position directly.
+    """
+    def verify(self, ts):
+        for tree in ts.trees():
+            left, right = tree.interval
+            for x in [left, (left + right) / 2, np.nextafter(right, 0)]:
+                other = ts.at(x)
+                self.assertEqual(tree.index, other.index)
+                self.assertEqual(tree.interval, other.interval)
+                self.assertEqual(tree.root, other.root)
+                self.assertEqual(tree.parent_dict, other.parent_dict)
+                self.assertEqual(list(tree.sites()), list(other.sites()))
+                for u in tree.nodes():
+                    self.assertEqual(
+                        tree.get_num_leaves(u), other.get_num_leaves(u))
+            other = ts.at(left, tracked_leaves=[0, 1])
+            for u in tree.nodes():
+                self.assertEqual(
+                    other.get_num_tracked_leaves(u),
+                    len(set(tree.leaves(u)) & {0, 1}))
+
+    def test_single_tree(self):
+        ts = msprime.simulate(10, random_seed=1, mutation_rate=1)
+        self.verify(ts)
+
+    def test_many_trees(self):
+        ts = msprime.simulate(
+            10, random_seed=2, mutation_rate=2, recombination_rate=3)
+        self.assertGreater(ts.num_trees, 3)
+        self.verify(ts)
+
+    def test_bad_positions(self):
+        ts = msprime.simulate(10, random_seed=1)
+        for x in [-1, ts.sequence_length, ts.sequence_length + 1]:
+            self.assertRaises(IndexError, ts.at, x)
+
+
 class TestRecombinationMap(HighLevelTestCase):
     """
     Tests the code for recombination map.
@@ -2044,6 +2144,64 @@ class TestSimulateInterface(unittest.TestCase):
             self.assertEqual(ts.get_num_trees(), 1)
         self.assertEqual(num_replicates, count)
 
+    def test_threaded_replicates(self):
+        n = 10
+        num_replicates = 20
+        results = []
+        for num_threads in [2, 3, 8]:
+            replicates = msprime.simulate(
+                n, recombination_rate=1, mutation_rate=2, random_seed=5,
+                num_replicates=num_replicates, num_threads=num_threads)
+            results.append([
+                (list(ts.edgesets()), list(ts.mutations())) for ts in replicates])
+        self.assertEqual(len(results[0]), num_replicates)
+        for result in results[1:]:
+            self.assertEqual(results[0], result)
+        # Replicates should be distinct.
+        self.assertNotEqual(results[0][0], results[0][1])
+
+    def test_replicates_independent_of_num_threads(self):
+        results = []
+        for num_threads in [1, 4]:
+            replicates = msprime.simulate(
+                10, recombination_rate=1, mutation_rate=2, random_seed=11,
+                num_replicates=8, num_threads=num_threads)
+            results.append([
+                (list(ts.edgesets()), list(ts.mutations())) for ts in replicates])
+        self.assertEqual(len(results[0]), 8)
+        self.assertEqual(results[0], results[1])
+
+    def test_replicates_custom_mutation_generator(self):
+        results = []
+        for num_threads in [1, 4]:
+            mutation_generator = msprime.MutationGenerator(
+                msprime.RandomGenerator(3), 2)
+            replicates = msprime.simulate(
+                10, recombination_rate=1, random_seed=11,
+                mutation_generator=mutation_generator,
+                num_replicates=8, num_threads=num_threads)
+            results.append([
+                (list(ts.edgesets()), list(ts.mutations())) for ts in replicates])
+        self.assertEqual(len(results[0]), 8)
+        self.assertGreater(len(results[0][0][1]), 0)
+        self.assertEqual(results[0], results[1])
+
+    def test_threaded_replicates_early_exit(self):
+        replicates = msprime.simulate(
+            10, num_replicates=100, num_threads=4, random_seed=1)
+        for j, ts in enumerate(replicates):
+            self.assertEqual(ts.get_sample_size(), 10)
+            if j == 5:
+                break
+        replicates.close()
+
+    def test_threaded_replicates_errors(self):
+        self.assertRaises(ValueError, msprime.simulate, 10, num_threads=2)
+        for bad_value in [0, -1]:
+            self.assertRaises(
+                ValueError, msprime.simulate, 10, num_replicates=2,
+                num_threads=bad_value)
+
     def test_mutations(self):
         n = 10
         ts = msprime.simulate(n, mutation_rate=10)
@@ -1213,6 +1213,40 @@ class TestSimulator(LowLevelTestCase):
                 sim = f(model=model)
                 self.assertEqual(sim.get_model(), model)
 
+    def test_dtwf_simulation_model(self):
+
+        def f(sample_size=10, random_seed=1, **kwargs):
+            return _msprime.Simulator(
+                get_samples(sample_size),
+                _msprime.RandomGenerator(random_seed), **kwargs)
+        for bad_type in [None, str, "sdf"]:
+            model = get_simulation_model(
+                "dtwf", population_size=bad_type, num_generations=1)
+            self.assertRaises(TypeError, f, model=model)
+            model = get_simulation_model(
+                "dtwf", population_size=1, num_generations=bad_type)
+            self.assertRaises(TypeError, f, model=model)
+        model = get_simulation_model("dtwf", population_size=1)
+        self.assertRaises(ValueError, f, model=model)
+        model = get_simulation_model("dtwf", num_generations=1)
+        self.assertRaises(ValueError, f, model=model)
+        for bad_size in [-1, 0]:
+            model = get_simulation_model(
+                "dtwf", population_size=bad_size, num_generations=1)
+            self.assertRaises(ValueError, f, model=model)
+        model = get_simulation_model(
+            "dtwf", population_size=10, num_generations=-1)
+        self.assertRaises(ValueError, f, model=model)
+        for population_size in [1, 10, 100]:
+            for num_generations in [0, 10, 1e300]:
+                model = get_simulation_model(
+                    "dtwf", population_size=population_size,
+                    num_generations=num_generations)
+                sim = f(model=model)
+                self.assertEqual(sim.get_model(), model)
+                sim.run()
+                self.assertEqual(sim.get_num_ancestors(), 0)
+
     def test_store_migrations(self):
         def f(sample_size=10, random_seed=1, **kwargs):
             samples = [(j % 2, 0) for j in range(sample_size)]
@@ -2540,6 +2574,49 @@ class TestVariantGenerator(LowLevelTestCase):
         variants = _msprime.VariantGenerator(ts, buff)
         self.verify_iterator(variants)
 
+    def test_next_packed(self):
+        ts = self.get_tree_sequence(num_loci=10)
+        n = ts.get_sample_size()
+        m = ts.get_num_sites()
+        buff = bytearray(n)
+        vg = _msprime.VariantGenerator(ts, buff)
+        genotypes = []
+        for _ in vg:
+            genotypes.append(list(buff))
+        dest = bytearray(m * n)
+        vg = _msprime.VariantGenerator(ts, buff)
+        self.assertRaises(TypeError, vg.next_packed)
+        self.assertRaises(TypeError, vg.next_packed, dest)
+        for bad_type in ["", {}, None]:
+            self.assertRaises(TypeError, vg.next_packed, bad_type, 1)
+            self.assertRaises(TypeError, vg.next_packed, dest, bad_type)
+            self.assertRaises(
+                TypeError, vg.next_packed, dest, 1, two_bit=bad_type)
+            self.assertRaises(
+                TypeError, vg.next_packed, dest, 1, sample_major=bad_type)
+        self.assertRaises(ValueError, vg.next_packed, dest, -1)
+        row_size = (n + 7) // 8
+        self.assertRaises(
+            BufferError, vg.next_packed, bytearray(2 * row_size - 1), 2)
+        self.assertRaises(
+            BufferError, vg.next_packed, bytearray(n - 1), 2,
+            sample_major=True)
+        self.assertRaises(
+            BufferError, vg.next_packed, bytearray(n), 5, sample_major=True,
+            two_bit=True)
+        self.assertEqual(vg.next_packed(dest, 0), 0)
+        self.assertEqual(vg.next_packed(dest, 1), 1)
+        for k in range(n):
+            self.assertEqual((dest[k // 8] >> (k % 8)) & 1, genotypes[0][k])
+        self.assertEqual(vg.next_packed(dest, 2, sample_major=True), 2)
+        for k in range(n):
+            self.assertEqual(dest[k] & 1, genotypes[1][k])
+            self.assertEqual((dest[k] >> 1) & 1, genotypes[2][k])
+        self.assertEqual(vg.next_packed(dest, m), m - 3)
+        self.assertEqual(vg.next_packed(dest, m, two_bit=True), 0)
+        vg = _msprime.VariantGenerator(_msprime.TreeSequence(), bytearray())
+        self.assertEqual(vg.next_packed(bytearray(), 10), 0)
+
 
 class TestSparseTree(LowLevelTestCase):
     """
@@ -3031,6 +3108,33 @@ class TestTablesInterface(LowLevelTestCase):
         self.verify_mutation_table(mutations, ts)
         self.assertEqual(ts.get_provenance_strings(), provenance)
 
+    def test_take_tables(self):
+        ex_ts = self.get_example_migration_tree_sequence()
+        tables = [
+            _msprime.NodeTable(), _msprime.EdgesetTable(),
+            _msprime.MigrationTable(), _msprime.SiteTable(),
+            _msprime.MutationTable()]
+        copies = [
+            _msprime.NodeTable(), _msprime.EdgesetTable(),
+            _msprime.MigrationTable(), _msprime.SiteTable(),
+            _msprime.MutationTable()]
+        ex_ts.dump_tables(*copies)
+        ts = _msprime.TreeSequence()
+        for _ in range(3):
+            ex_ts.dump_tables(*tables)
+            ts.load_tables(*tables, take_tables=True)
+            nodes, edgesets, migrations, sites, mutations = copies
+            self.verify_node_table(nodes, ts)
+            self.verify_edgeset_table(edgesets, ts)
+            self.verify_migration_table(migrations, ts)
+            self.verify_site_table(sites, ts)
+            self.verify_mutation_table(mutations, ts)
+            for table in tables[:3]:
+                self.assertEqual(table.num_rows, 0)
+        for bad_type in ["", {}]:
+            self.assertRaises(
+                TypeError, ts.load_tables, *tables, take_tables=bad_type)
+
     def test_load_tables_errors(self):
         ex_ts = self.get_example_migration_tree_sequence()
         kwargs = {
@@ -3361,6 +3465,24 @@ class TestRandomGenerator(unittest.TestCase):
             rng = _msprime.RandomGenerator(s)
             self.assertEqual(rng.get_seed(), s)
 
+    def test_set_seed(self):
+        rng = _msprime.RandomGenerator(1)
+        for bad_type in ["x", 1.0, {}]:
+            self.assertRaises(TypeError, rng.set_seed, bad_type)
+        for bad_value in [-1, 0, 2**32]:
+            self.assertRaises(ValueError, rng.set_seed, bad_value)
+        sim1 = _msprime.Simulator(
+            get_samples(10), rng, num_loci=100, scaled_recombination_rate=0.1)
+        sim1.run()
+        rng.set_seed(2)
+        self.assertEqual(rng.get_seed(), 2)
+        rng.set_seed(1)
+        sim2 = _msprime.Simulator(
+            get_samples(10), rng, num_loci=100, scaled_recombination_rate=0.1)
+        sim2.run()
+        self.assertEqual(sim1.get_breakpoints(), sim2.get_breakpoints())
+        self.assertEqual(sim1.get_time(), sim2.get_time())
+
 
 class TestMutationGenerator(unittest.TestCase):
     """
@@ -3380,6 +3502,11 @@ class TestMutationGenerator(unittest.TestCase):
             mutgen = _msprime.MutationGenerator(rng, rate)
             self.assertEqual(mutgen.get_mutation_rate(), rate)
 
+    def test_random_generator(self):
+        rng = _msprime.RandomGenerator(1)
+        mutgen = _msprime.MutationGenerator(rng, 1)
+        self.assertIs(mutgen.get_random_generator(), rng)
+
 
 class TestDemographyDebugger(unittest.TestCase):
     """
@@ -3495,6 +3622,13 @@ class TestLdCalculator(LowLevelTestCase):
             self.assertRaises(
                 TypeError, ldc.get_r2_array, self.get_buffer(1), 0,
                 max_distance=bad_type)
+            self.assertRaises(
+                TypeError, ldc.get_r2_array, self.get_buffer(1), 0,
+                statistic=bad_type)
+        for bad_statistic in [-1, 5, 10**6]:
+            self.assertRaises(
+                _msprime.LibraryError, ldc.get_r2_array, self.get_buffer(1),
+                0, statistic=bad_statistic)
         buffers = [b'bytes', bytes()]
         for bad_buff in buffers:
             self.assertRaises(BufferError, ldc.get_r2_array, bad_buff, 0)
@@ -3521,6 +3655,84 @@ class TestLdCalculator(LowLevelTestCase):
                 ValueError, ldc.get_r2_array, self.get_buffer(0), 0,
                 max_distance=bad_distance)
 
+    def test_get_r2_matrix_interface(self):
+        ts = self.get_tree_sequence()
+        ldc = _msprime.LdCalculator(ts)
+        for bad_type in [None, "1", []]:
+            self.assertRaises(
+                TypeError, ldc.get_r2_matrix, num_threads=bad_type)
+            self.assertRaises(TypeError, ldc.get_r2_matrix, tile_size=bad_type)
+            self.assertRaises(TypeError, ldc.get_r2_matrix, threshold=bad_type)
+        for bad_value in [0, -1]:
+            self.assertRaises(
+                ValueError, ldc.get_r2_matrix, num_threads=bad_value)
+            self.assertRaises(
+                ValueError, ldc.get_r2_matrix, tile_size=bad_value)
+        m = ts.get_num_mutations()
+        A = ldc.get_r2_matrix()
+        self.assertEqual(A.shape, (m, m))
+        self.assertEqual(A.dtype.name, "float64")
+        A = ldc.get_r2_matrix(float32=True, num_threads=2, tile_size=1)
+        self.assertEqual(A.shape, (m, m))
+        self.assertEqual(A.dtype.name, "float32")
+        rows, columns, values = ldc.get_r2_matrix(sparse=True, threshold=-1)
+        self.assertEqual(rows.shape, (m * (m - 1) // 2,))
+        self.assertEqual(columns.shape, rows.shape)
+        self.assertEqual(values.shape, rows.shape)
+        self.assertEqual(values.dtype.name, "float64")
+        self.assertEqual(sys.getrefcount(rows), 2)
+        self.assertEqual(sys.getrefcount(columns), 2)
+        self.assertEqual(sys.getrefcount(values), 2)
+
+    def test_get_r2_decay_interface(self):
+        ts = self.get_tree_sequence()
+        ldc = _msprime.LdCalculator(ts)
+        breaks = [0, 1, 10]
+        self.assertRaises(TypeError, ldc.get_r2_decay)
+        for bad_type in [None, "1", []]:
+            self.assertRaises(
+                TypeError, ldc.get_r2_decay, breaks, num_threads=bad_type)
+            self.assertRaises(
+                TypeError, ldc.get_r2_decay, breaks, max_mutations=bad_type)
+        for bad_breaks in [[], [0], [[0, 1]]]:
+            self.assertRaises(ValueError, ldc.get_r2_decay, bad_breaks)
+            self.assertRaises(
+                ValueError, ldc.get_r2_decay, breaks,
+                frequency_breaks=bad_breaks)
+        for bad_breaks in [[1, 0], [0, 0], [-1, 1]]:
+            self.assertRaises(
+                _msprime.LibraryError, ldc.get_r2_decay, bad_breaks)
+        self.assertRaises(
+            _msprime.LibraryError, ldc.get_r2_decay, breaks,
+            frequency_breaks=[0.5, 0])
+        for bad_value in [0, -1]:
+            self.assertRaises(
+                ValueError, ldc.get_r2_decay, breaks, num_threads=bad_value)
+        self.assertRaises(
+            ValueError, ldc.get_r2_decay, breaks, max_mutations=-2)
+        r2_sum, num_pairs = ldc.get_r2_decay(breaks)
+        self.assertEqual(r2_sum.shape, (1, 2))
+        self.assertEqual(r2_sum.dtype.name, "float64")
+        self.assertEqual(num_pairs.shape, (1, 2))
+        self.assertEqual(num_pairs.dtype.name, "uint64")
+        r2_sum, num_pairs = ldc.get_r2_decay(
+            breaks, frequency_breaks=[0, 0.25, 0.5], num_threads=2)
+        self.assertEqual(r2_sum.shape, (2, 2))
+        self.assertEqual(num_pairs.shape, (2, 2))
+        self.assertEqual(sys.getrefcount(r2_sum), 2)
+        self.assertEqual(sys.getrefcount(num_pairs), 2)
+        r2_sum, num_pairs = ldc.get_r2_decay(breaks, max_mutations=0)
+        self.assertEqual(num_pairs.sum(), 0)
+
+    def test_get_r2_matrix_empty_tree_sequence(self):
+        ldc = _msprime.LdCalculator(_msprime.TreeSequence())
+        self.assertEqual(ldc.get_r2_matrix().shape, (0, 0))
+        rows, columns, values = ldc.get_r2_matrix(sparse=True)
+        self.assertEqual(rows.shape, (0,))
+        r2_sum, num_pairs = ldc.get_r2_decay([0, 1])
+        self.assertEqual(r2_sum.shape, (1, 1))
+        self.assertEqual(num_pairs[0, 0], 0)
+
     def test_get_r2_array_from_new(self):
         ts = self.get_tree_sequence()
         self.assertGreater(ts.get_num_trees(), 1)
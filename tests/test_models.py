@@ -115,7 +115,8 @@ class TestModelParsing(unittest.TestCase):
         simulation_models = [
             ("hudson", msprime.StandardCoalescent),
             ("smc", msprime.SmcApproxCoalescent),
-            ("smc_prime", msprime.SmcPrimeApproxCoalescent)
+            ("smc_prime", msprime.SmcPrimeApproxCoalescent),
+            ("dtwf", msprime.DiscreteTimeWrightFisher)
         ]
         for name, model in simulation_models:
             sim = msprime.simulator_factory(sample_size=10, model=name.upper())
@@ -133,6 +134,7 @@ class TestModelParsing(unittest.TestCase):
             msprime.SmcPrimeApproxCoalescent(),
             msprime.BetaCoalescent(),
             msprime.DiracCoalescent(),
+            msprime.DiscreteTimeWrightFisher(),
         ]
         for model in models:
             sim = msprime.simulator_factory(sample_size=10, model=model)
@@ -174,6 +176,18 @@ class TestParametricModels(unittest.TestCase):
                 d = model.get_ll_representation()
                 self.assertEqual(d, {"name": "dirac", "psi": psi, "c": c})
 
+    def test_dtwf_parameters(self):
+        model = msprime.DiscreteTimeWrightFisher()
+        self.assertEqual(model.num_generations, sys.float_info.max)
+        for num_generations in [0, 10, 1e6]:
+            for Ne in [1, 100]:
+                model = msprime.DiscreteTimeWrightFisher(num_generations)
+                self.assertEqual(model.num_generations, num_generations)
+                d = model.get_ll_representation(Ne)
+                self.assertEqual(d, {
+                    "name": "dtwf", "num_generations": num_generations,
+                    "population_size": Ne})
+
 
 class TestMultipleMergerModels(unittest.TestCase):
     """
@@ -219,6 +233,52 @@ class TestMultipleMergerModels(unittest.TestCase):
         self.assertTrue(ts is not None)
 
 
+class TestDiscreteTimeWrightFisher(unittest.TestCase):
+    """
+    Runs tests on the discrete time Wright-Fisher model.
+    """
+    def get_times(self, ts):
+        return [ts.node(u).time for u in range(ts.sample_size, ts.num_nodes)]
+
+    def test_generation_times(self):
+        Ne = 100
+        model = msprime.DiscreteTimeWrightFisher()
+        ts = msprime.simulate(
+            sample_size=50, Ne=Ne, recombination_rate=1e-3, length=100,
+            model=model, random_seed=2)
+        for time in self.get_times(ts):
+            self.assertAlmostEqual(time, round(time))
+
+    def test_multiple_mergers(self):
+        # With a sample size larger than Ne we must see multiple mergers.
+        model = msprime.DiscreteTimeWrightFisher()
+        ts = msprime.simulate(sample_size=100, Ne=10, model=model, random_seed=3)
+        self.assertTrue(any(len(e.children) > 2 for e in ts.edgesets()))
+
+    def test_switch_to_hudson(self):
+        Ne = 100
+        num_generations = 10
+        model = msprime.DiscreteTimeWrightFisher(num_generations)
+        ts = msprime.simulate(
+            sample_size=100, Ne=Ne, model=model, random_seed=4)
+        times = self.get_times(ts)
+        for time in times:
+            if time <= num_generations:
+                self.assertAlmostEqual(time, round(time))
+        self.assertTrue(any(time != round(time) for time in times))
+
+    def test_pairwise_coalescence_time(self):
+        # The mean coalescence time for a pair in a large population is
+        # close to 2 Ne generations.
+        Ne = 100
+        model = msprime.DiscreteTimeWrightFisher()
+        times = [
+            ts.node(2).time for ts in msprime.simulate(
+                sample_size=2, Ne=Ne, model=model, random_seed=5,
+                num_replicates=1000)]
+        self.assertAlmostEqual(sum(times) / len(times) / (2 * Ne), 1, delta=0.1)
+
+
 class TestUnsupportedDemographicEvents(unittest.TestCase):
     """
     Some demographic events are not supported until specific models.
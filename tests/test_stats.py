@@ -27,6 +27,7 @@ import random
 
 import numpy as np
 
+import _msprime
 import msprime
 
 
@@ -73,6 +74,24 @@ class TestLdCalculator(unittest.TestCase):
         self.assertEqual(A.shape, (m, m))
         B = get_r2_matrix(ts)
         self.assertTrue(np.allclose(A, B))
+        for num_threads in [2, 5]:
+            C = ldc.get_r2_matrix(num_threads=num_threads)
+            self.assertTrue(np.array_equal(A, C))
+        C = ldc.get_r2_matrix(float32=True)
+        self.assertEqual(C.dtype, np.float32)
+        self.assertTrue(np.allclose(A, C))
+        for threshold in [-1, 0, 0.5, 1]:
+            for num_threads in [1, 3]:
+                rows, columns, values = ldc.get_r2_pairs(
+                    threshold, num_threads=num_threads)
+                C = np.zeros((m, m))
+                C[rows, columns] = values
+                self.assertTrue(np.all(rows < columns))
+                upper = np.triu(A, 1)
+                upper[upper <= threshold] = 0
+                num_pairs = np.sum(A[np.triu_indices(m, 1)] > threshold)
+                self.assertEqual(num_pairs, len(rows))
+                self.assertTrue(np.allclose(upper, C))
 
         # Now look at each row in turn, and verify it's the same
         # when we use get_r2 directly.
@@ -135,6 +154,110 @@ class TestLdCalculator(unittest.TestCase):
             self.assertEqual(a.shape[0], k)
             self.assertTrue(np.allclose(A[j, j - k: j], a[::-1]))
 
+    def verify_statistics(self, ts):
+        """
+        Verifies the other LD statistics against values computed from the
+        genotypes.
+        """
+        G = np.array(
+            [v.genotypes.copy() for v in ts.variants()], dtype=float)
+        m, n = G.shape
+        f = np.sum(G, axis=1) / n
+        fA = f[:, np.newaxis]
+        fB = f[np.newaxis, :]
+        D = np.dot(G, G.T) / n - fA * fB
+        denom = fA * fB * (1 - fA) * (1 - fB)
+        D_max = np.where(
+            D >= 0, np.minimum(fA * (1 - fB), (1 - fA) * fB),
+            np.minimum(fA * fB, (1 - fA) * (1 - fB)))
+        with np.errstate(divide="ignore", invalid="ignore"):
+            expected = {
+                "r2": D * D / denom, "D": D, "D_prime": D / D_max,
+                "r": D / np.sqrt(denom), "r2_multiallelic": D * D / denom}
+        ldc = msprime.LdCalculator(ts)
+        A = ldc.get_r2_matrix()
+        upper = np.triu_indices(m, 1)
+        self.assertTrue(np.allclose(
+            A[upper], expected["r2"][upper], equal_nan=True))
+        for statistic, A in expected.items():
+            for j in range(m):
+                a = ldc.get_r2_array(j, statistic=statistic)
+                self.assertTrue(np.allclose(a, A[j, j + 1:], equal_nan=True))
+                a = ldc.get_r2_array(
+                    j, statistic=statistic, direction=msprime.REVERSE)
+                self.assertTrue(
+                    np.allclose(a[::-1], A[j, :j], equal_nan=True))
+        for bad_statistic in ["R2", "", "d"]:
+            self.assertRaises(
+                ValueError, ldc.get_r2_array, 0, statistic=bad_statistic)
+
+    def verify_decay(self, ts):
+        """
+        Verifies the binned r2 decay against the full matrix.
+        """
+        G = np.array([v.genotypes.copy() for v in ts.variants()])
+        m, n = G.shape
+        f = np.sum(G, axis=1) / n
+        maf = np.minimum(f, 1 - f)
+        x = np.array([site.position for site in ts.sites()])
+        ldc = msprime.LdCalculator(ts)
+        A = ldc.get_r2_matrix()
+        L = ts.get_sequence_length()
+        distance_breaks = np.array([0, L / 20, L / 5, L / 2])
+        maf_breaks = np.array([0, 0.1, 0.25, 0.5])
+        for max_mutations in [None, 5]:
+            a, b = np.triu_indices(m, 1)
+            if max_mutations is not None:
+                keep = b - a <= max_mutations
+                a, b = a[keep], b[keep]
+            r2 = A[a, b]
+            defined = (~np.isnan(r2)).astype(float)
+            r2 = np.where(np.isnan(r2), 0, r2)
+            r2_sum = np.histogram(
+                x[b] - x[a], distance_breaks, weights=r2)[0]
+            num_pairs = np.histogram(
+                x[b] - x[a], distance_breaks, weights=defined)[0]
+            for num_threads in [1, 3]:
+                mean, count = ldc.get_r2_decay(
+                    distance_breaks, max_mutations=max_mutations,
+                    num_threads=num_threads)
+                self.assertEqual(mean.shape, (3,))
+                self.assertTrue(np.array_equal(count, num_pairs))
+                with np.errstate(invalid="ignore"):
+                    expected = r2_sum / num_pairs
+                self.assertTrue(np.allclose(mean, expected, equal_nan=True))
+            r2_sum, _, _ = np.histogram2d(
+                np.minimum(maf[a], maf[b]), x[b] - x[a],
+                [maf_breaks, distance_breaks], weights=r2)
+            num_pairs, _, _ = np.histogram2d(
+                np.minimum(maf[a], maf[b]), x[b] - x[a],
+                [maf_breaks, distance_breaks], weights=defined)
+            mean, count = ldc.get_r2_decay(
+                distance_breaks, maf_breaks=maf_breaks,
+                max_mutations=max_mutations, num_threads=2)
+            self.assertEqual(mean.shape, (3, 3))
+            self.assertTrue(np.array_equal(count, num_pairs))
+            with np.errstate(invalid="ignore"):
+                expected = r2_sum / num_pairs
+            self.assertTrue(np.allclose(mean, expected, equal_nan=True))
+
+    def test_recurrent_mutations(self):
+        ts = msprime.simulate(
+            self.num_test_sites, recombination_rate=1,
+            length=self.num_test_sites, random_seed=3)
+        sites = [
+            msprime.Site(
+                position=j, index=j, ancestral_state="0",
+                mutations=[
+                    msprime.Mutation(site=j, node=j, derived_state="1"),
+                    msprime.Mutation(
+                        site=j, node=(j + 3) % self.num_test_sites,
+                        derived_state="1")][:1 + j % 2])
+            for j in range(self.num_test_sites)]
+        ts = ts.copy(sites)
+        self.verify_statistics(ts)
+        self.verify_decay(ts)
+
     def test_single_tree_simulated_mutations(self):
         ts = msprime.simulate(20, mutation_rate=10, random_seed=15)
         sites = sorted(random.sample(list(ts.sites()), self.num_test_sites))
@@ -177,3 +300,265 @@ class TestLdCalculator(unittest.TestCase):
         self.verify_matrix(ts)
         self.verify_max_distance(ts)
         self.verify_max_mutations(ts)
+        self.verify_statistics(ts)
+        self.verify_decay(ts)
+
+
+def get_site_stats(ts, sample_sets, windows):
+    """
+    Returns the diversity, segregating sites, divergence and SFS for the
+    specified sample sets in each window, computed directly from the
+    genotypes.
+    """
+    K = len(sample_sets)
+    W = len(windows) - 1
+    max_size = max(len(s) for s in sample_sets)
+    pi = np.zeros((W, K))
+    segsites = np.zeros((W, K))
+    divergence = np.zeros((W, K, K))
+    sfs = np.zeros((W, K, max_size + 1))
+    samples = list(ts.samples())
+    indexes = [[samples.index(u) for u in s] for s in sample_sets]
+    for variant in ts.variants():
+        w = np.searchsorted(windows, variant.position, side="right") - 1
+        g = variant.genotypes
+        counts = [np.sum(g[index]) for index in indexes]
+        for k, index in enumerate(indexes):
+            n = len(index)
+            c = counts[k]
+            if n > 1:
+                pi[w, k] += 2 * c * (n - c) / (n * (n - 1))
+            segsites[w, k] += 0 < c < n
+            sfs[w, k, c] += 1
+        for k in range(K):
+            for j in range(K):
+                if k == j:
+                    divergence[w, k, j] = pi[w, k]
+                else:
+                    n = len(indexes[k])
+                    m = len(indexes[j])
+                    divergence[w, k, j] += (
+                        counts[k] * (m - counts[j]) +
+                        (n - counts[k]) * counts[j]) / (n * m)
+    return pi, segsites, divergence, sfs
+
+
+def tajimas_d(n, pi, S):
+    if n < 3 or S == 0:
+        return np.nan
+    a1 = sum(1 / j for j in range(1, n))
+    a2 = sum(1 / j**2 for j in range(1, n))
+    b1 = (n + 1) / (3 * (n - 1))
+    b2 = 2 * (n**2 + n + 3) / (9 * n * (n - 1))
+    c1 = b1 - 1 / a1
+    c2 = b2 - (n + 2) / (a1 * n) + a2 / a1**2
+    e1 = c1 / a1
+    e2 = c2 / (a1**2 + a2)
+    return (pi - S / a1) / np.sqrt(e1 * S + e2 * S * (S - 1))
+
+
+def get_sfs(ts, sample_sets, windows, folded=False):
+    """
+    Returns the joint site frequency spectrum of the specified sample sets
+    in each window, computed directly from the genotypes.
+    """
+    sizes = [len(s) for s in sample_sets]
+    N = sum(sizes)
+    sfs = np.zeros([len(windows) - 1] + [n + 1 for n in sizes])
+    samples = list(ts.samples())
+    indexes = [[samples.index(u) for u in s] for s in sample_sets]
+    for variant in ts.variants():
+        w = np.searchsorted(windows, variant.position, side="right") - 1
+        counts = [int(np.sum(variant.genotypes[index])) for index in indexes]
+        if folded and 2 * sum(counts) > N:
+            counts = [n - c for n, c in zip(sizes, counts)]
+        sfs[tuple([w] + counts)] += 1
+    return sfs
+
+
+class TestSiteStats(unittest.TestCase):
+    """
+    Tests for the windowed site statistics computed over multiple
+    sample sets.
+    """
+    def verify(self, ts, sample_sets, windows):
+        pi, S, divergence, sfs = get_site_stats(ts, sample_sets, windows)
+        stats = ts.site_stats(
+            sample_sets, ["diversity", "segregating_sites", "tajimas_d"],
+            windows=windows)
+        W = len(windows) - 1
+        self.assertEqual(stats.shape, (W, 3, len(sample_sets)))
+        self.assertTrue(np.allclose(stats[:, 0], pi))
+        self.assertTrue(np.array_equal(stats[:, 1], S))
+        D = np.array([
+            [tajimas_d(len(s), pi[w, k], S[w, k])
+                for k, s in enumerate(sample_sets)] for w in range(W)])
+        self.assertTrue(np.allclose(stats[:, 2], D, equal_nan=True))
+        self.assertTrue(np.allclose(
+            ts.site_divergence(sample_sets, windows=windows), divergence))
+        _, _, ll_sfs = ts.get_ll_tree_sequence().get_site_stats(
+            sample_sets=sample_sets, windows=windows, statistics=[],
+            sfs=True)
+        self.assertTrue(np.array_equal(ll_sfs, sfs))
+        # The results don't depend on the number of threads
+        for num_threads in [2, 3, 10]:
+            other = ts.site_stats(
+                sample_sets, ["diversity", "segregating_sites", "tajimas_d"],
+                windows=windows, num_threads=num_threads)
+            self.assertTrue(np.allclose(stats, other, equal_nan=True))
+
+    def test_single_tree(self):
+        ts = msprime.simulate(10, mutation_rate=5, random_seed=1)
+        self.assertGreater(ts.num_sites, 0)
+        self.verify(ts, [range(10)], [0, 1])
+        self.verify(ts, [[0, 1, 2], [3, 4, 5, 6], [7, 8, 9]], [0, 0.5, 1])
+
+    def test_many_trees(self):
+        ts = msprime.simulate(
+            20, mutation_rate=5, recombination_rate=5, random_seed=2)
+        self.assertGreater(ts.num_trees, 2)
+        sample_sets = [range(20), range(10), range(0, 20, 3), [4, 9]]
+        self.verify(ts, sample_sets, [0, 1])
+        self.verify(ts, sample_sets, np.linspace(0, 1, 11))
+
+    def test_pairwise_diversity(self):
+        ts = msprime.simulate(
+            15, mutation_rate=5, recombination_rate=5, random_seed=3)
+        samples = [1, 3, 5, 7, 9]
+        stats = ts.site_stats([samples])
+        self.assertAlmostEqual(
+            stats[0, 0, 0], ts.get_pairwise_diversity(samples))
+
+    def test_errors(self):
+        ts = msprime.simulate(10, mutation_rate=5, random_seed=1)
+        self.assertRaises(ValueError, ts.site_stats, [[0, 1]], ["xxx"])
+        self.assertRaises(ValueError, ts.site_stats, [])
+        self.assertRaises(
+            ValueError, ts.site_stats, [[0, 1]], windows=[0, 0.5])
+        self.assertRaises(
+            _msprime.LibraryError, ts.site_stats, [[0, 1], []])
+        self.assertRaises(
+            _msprime.LibraryError, ts.site_stats, [[0, 0]])
+        self.assertRaises(IndexError, ts.site_stats, [[0, 100]])
+
+
+class TestSiteFrequencySpectrum(unittest.TestCase):
+    """
+    Tests for the one-way and joint site frequency spectra.
+    """
+    def verify(self, ts, sample_sets, windows):
+        for folded in [False, True]:
+            sfs = ts.site_frequency_spectrum(
+                sample_sets, windows=windows, folded=folded)
+            expected = get_sfs(ts, sample_sets, windows, folded)
+            self.assertEqual(sfs.shape, expected.shape)
+            self.assertTrue(np.array_equal(sfs, expected))
+            self.assertEqual(np.sum(sfs), ts.num_sites)
+
+    def test_one_way(self):
+        ts = msprime.simulate(
+            12, mutation_rate=5, recombination_rate=2, random_seed=4)
+        self.assertGreater(ts.num_sites, 0)
+        self.verify(ts, [range(12)], [0, 1])
+        self.verify(ts, [[1, 4, 7, 9]], [0, 0.3, 0.6, 1])
+        sfs = ts.site_frequency_spectrum()
+        self.assertEqual(sfs.shape, (1, 13))
+        self.assertEqual(sfs[0, 0], 0)
+        self.assertEqual(sfs[0, 12], 0)
+
+    def test_folded_one_way(self):
+        ts = msprime.simulate(11, mutation_rate=5, random_seed=5)
+        sfs = ts.site_frequency_spectrum(folded=True)
+        unfolded = ts.site_frequency_spectrum()
+        self.assertTrue(np.all(sfs[0, 6:] == 0))
+        for j in range(1, 6):
+            self.assertEqual(sfs[0, j], unfolded[0, j] + unfolded[0, 11 - j])
+
+    def test_joint_two_way(self):
+        ts = msprime.simulate(
+            10, mutation_rate=5, recombination_rate=2, random_seed=6)
+        self.verify(ts, [range(4), range(4, 10)], [0, 1])
+        self.verify(ts, [[0, 2, 4], [1, 3]], [0, 0.5, 1])
+
+    def test_joint_three_way(self):
+        ts = msprime.simulate(
+            9, mutation_rate=5, recombination_rate=2, random_seed=7)
+        sample_sets = [range(3), range(3, 6), range(6, 9)]
+        self.verify(ts, sample_sets, [0, 1])
+        sfs = ts.site_frequency_spectrum(sample_sets)
+        self.assertEqual(sfs.shape, (1, 4, 4, 4))
+        # Marginalising gives the spectrum of each set.
+        for j, s in enumerate(sample_sets):
+            axes = tuple(k + 1 for k in range(3) if k != j)
+            self.assertTrue(np.array_equal(
+                np.sum(sfs, axis=axes),
+                ts.site_frequency_spectrum([s])))
+
+    def test_errors(self):
+        ts = msprime.simulate(10, mutation_rate=5, random_seed=1)
+        self.assertRaises(ValueError, ts.site_frequency_spectrum, [])
+        self.assertRaises(
+            ValueError, ts.site_frequency_spectrum, windows=[0, 0.5])
+        self.assertRaises(
+            _msprime.LibraryError, ts.site_frequency_spectrum, [[0], []])
+        self.assertRaises(
+            _msprime.LibraryError, ts.site_frequency_spectrum, [[0, 0]])
+        self.assertRaises(IndexError, ts.site_frequency_spectrum, [[100]])
+
+
+class TestBranchLengthSfs(unittest.TestCase):
+    """
+    Tests for the incrementally maintained branch lengths by leaf count
+    and the branch length SFS.
+    """
+    def get_branch_length_by_count(self, tree):
+        n = tree.get_sample_size()
+        lengths = np.zeros(n + 1)
+        for u in tree.nodes():
+            if u != tree.root:
+                lengths[tree.get_num_leaves(u)] += tree.get_branch_length(u)
+        return lengths
+
+    def verify(self, ts, windows):
+        n = ts.get_sample_size()
+        expected = np.zeros((len(windows) - 1, n + 1))
+        trees = zip(ts.trees(), ts.trees(branch_lengths=True))
+        for tree, incremental in trees:
+            lengths = self.get_branch_length_by_count(tree)
+            self.assertTrue(np.allclose(
+                incremental.get_branch_length_by_count(), lengths))
+            self.assertAlmostEqual(
+                incremental.get_total_branch_length(),
+                tree.get_total_branch_length())
+            left, right = tree.interval
+            for w in range(len(windows) - 1):
+                overlap = min(right, windows[w + 1]) - max(left, windows[w])
+                if overlap > 0:
+                    expected[w] += lengths * overlap / (
+                        windows[w + 1] - windows[w])
+        sfs = ts.branch_sfs(windows)
+        self.assertTrue(np.allclose(sfs, expected))
+        # The branch diversity is a weighted sum of the branch SFS.
+        k = np.arange(n + 1)
+        pi = np.sum(sfs * 2 * k * (n - k) / (n * (n - 1)), axis=1)
+        diversity = ts.branch_diversity([list(ts.samples())], windows)
+        self.assertTrue(np.allclose(pi, diversity[:, 0]))
+
+    def test_single_tree(self):
+        ts = msprime.simulate(10, random_seed=1)
+        self.verify(ts, [0, 1])
+        self.verify(ts, [0, 0.25, 1])
+
+    def test_many_trees(self):
+        ts = msprime.simulate(15, recombination_rate=5, random_seed=2)
+        self.assertGreater(ts.num_trees, 2)
+        self.verify(ts, [0, 1])
+        self.verify(ts, np.linspace(0, 1, 7))
+
+    def test_errors(self):
+        ts = msprime.simulate(5, random_seed=1)
+        self.assertRaises(ValueError, ts.branch_sfs, [0, 0.5])
+        self.assertRaises(
+            ValueError, next, ts.trees(leaf_counts=False, branch_lengths=True))
+        tree = next(ts.trees())
+        self.assertRaises(RuntimeError, tree.get_branch_length_by_count)
@@ -22,12 +22,18 @@ Test cases for threading enabled aspects of the API.
 from __future__ import print_function
 from __future__ import division
 
-import unittest
-import threading
+import os
 import random
+import shutil
+import sys
+import tempfile
+import threading
+import time
+import unittest
 
 import numpy as np
 
+import _msprime
 import msprime
 
 
@@ -168,3 +174,256 @@ class TestLdCalculatorReplicates(unittest.TestCase):
         results = run_threads(worker, m)
         for j in range(m):
             self.assertEqual(results[j][0], m - j - 1)
+
+    def verify_reader_modifier_conflict(self, reader):
+        # Run the reader repeatedly in another thread while trying to
+        # modify the tree sequence in this one. Loading from a missing file
+        # fails without changing the tree sequence, so the only outcomes are
+        # a RuntimeError while a query is in flight and a LibraryError
+        # otherwise.
+        ts = msprime.simulate(
+            100, mutation_rate=20, recombination_rate=10, random_seed=5)
+        ll_ts = ts.get_ll_tree_sequence()
+        ld_calc = msprime.LdCalculator(ts)
+        missing = os.path.join(tempfile.gettempdir(), "msp_missing_dir", "x")
+        done = threading.Event()
+        conflicts = []
+
+        def worker(thread_index, results):
+            start = time.time()
+            while not done.is_set() and time.time() - start < 30:
+                try:
+                    reader(ld_calc, ts.get_num_sites())
+                except RuntimeError:
+                    # The load in the other thread was in flight.
+                    pass
+
+        thread = threading.Thread(target=worker, args=(0, None))
+        thread.start()
+        try:
+            while thread.is_alive() and len(conflicts) == 0:
+                try:
+                    ll_ts.load(missing)
+                except RuntimeError as e:
+                    conflicts.append(e)
+                except _msprime.LibraryError:
+                    pass
+        finally:
+            done.set()
+            thread.join()
+        self.assertGreater(len(conflicts), 0)
+        self.assertIn("in use", str(conflicts[0]))
+
+    def test_get_r2_modifier_conflict(self):
+
+        def reader(ld_calc, m):
+            for j in range(m):
+                ld_calc.get_r2(0, j)
+
+        self.verify_reader_modifier_conflict(reader)
+
+    def test_get_r2_array_modifier_conflict(self):
+
+        def reader(ld_calc, m):
+            for j in range(m):
+                ld_calc.get_r2_array(j)
+
+        self.verify_reader_modifier_conflict(reader)
+
+
+class TestSimulatorConflicts(unittest.TestCase):
+    """
+    Tests that a simulator is not run while its tables are being populated
+    in another thread.
+    """
+    def test_populate_tables_run_conflict(self):
+        # Repeatedly populate tables from a completed simulation in another
+        # thread while calling run in this one. Running a completed
+        # simulation does nothing, so the only outcomes are a RuntimeError
+        # while the tables are being populated and success otherwise.
+        sim = _msprime.Simulator(
+            [(0, 0) for _ in range(100)], _msprime.RandomGenerator(5),
+            num_loci=1000, scaled_recombination_rate=1)
+        sim.run()
+        done = threading.Event()
+        conflicts = []
+
+        def worker(thread_index, results):
+            start = time.time()
+            while not done.is_set() and time.time() - start < 30:
+                try:
+                    sim.populate_tables(
+                        _msprime.NodeTable(), _msprime.EdgesetTable(),
+                        _msprime.MigrationTable())
+                except RuntimeError:
+                    # The run in the other thread was in flight.
+                    pass
+
+        thread = threading.Thread(target=worker, args=(0, None))
+        thread.start()
+        try:
+            while thread.is_alive() and len(conflicts) == 0:
+                try:
+                    sim.run()
+                except RuntimeError as e:
+                    conflicts.append(e)
+        finally:
+            done.set()
+            thread.join()
+        self.assertGreater(len(conflicts), 0)
+        self.assertIn("in use", str(conflicts[0]))
+        self.assertEqual(sim.get_num_ancestors(), 0)
+
+
+class TestTreeSequenceThreads(unittest.TestCase):
+    """
+    Tests that operations which release the GIL give the same results
+    when run concurrently as they do sequentially.
+    """
+    num_threads = 8
+
+    def setUp(self):
+        self.temp_dir = tempfile.mkdtemp(prefix="msp_threads_")
+
+    def tearDown(self):
+        shutil.rmtree(self.temp_dir)
+
+    def get_tree_sequence(self, seed=5):
+        return msprime.simulate(
+            20, mutation_rate=5, recombination_rate=5, random_seed=seed)
+
+    def test_shared_simplify(self):
+        ts = self.get_tree_sequence()
+        samples = [0, 1, 2, 3, 4]
+        records = list(ts.simplify(samples).records())
+        self.assertGreater(len(records), 0)
+
+        def worker(thread_index, results):
+            results[thread_index] = list(ts.simplify(samples).records())
+
+        results = run_threads(worker, self.num_threads)
+        for result in results:
+            self.assertEqual(records, result)
+
+    def test_shared_pairwise_diversity(self):
+        ts = self.get_tree_sequence()
+        pi = ts.get_pairwise_diversity()
+        self.assertGreater(pi, 0)
+
+        def worker(thread_index, results):
+            results[thread_index] = ts.get_pairwise_diversity()
+
+        results = run_threads(worker, self.num_threads)
+        for result in results:
+            self.assertEqual(pi, result)
+
+    def test_shared_haplotypes(self):
+        ts = self.get_tree_sequence()
+        haplotypes = list(ts.haplotypes())
+
+        def worker(thread_index, results):
+            results[thread_index] = list(ts.haplotypes())
+
+        results = run_threads(worker, self.num_threads)
+        for result in results:
+            self.assertEqual(haplotypes, result)
+
+    def test_shared_vcf(self):
+        ts = self.get_tree_sequence()
+        filename = os.path.join(self.temp_dir, "reference.vcf")
+        with open(filename, "w") as f:
+            ts.write_vcf(f, 2)
+        with open(filename) as f:
+            vcf = f.read()
+
+        def worker(thread_index, results):
+            filename = os.path.join(
+                self.temp_dir, "{}.vcf".format(thread_index))
+            with open(filename, "w") as f:
+                ts.write_vcf(f, 2)
+            with open(filename) as f:
+                results[thread_index] = f.read()
+
+        results = run_threads(worker, self.num_threads)
+        for result in results:
+            self.assertEqual(vcf, result)
+
+    def test_independent_files(self):
+        files = []
+        for j in range(self.num_threads):
+            ts = self.get_tree_sequence(j + 1)
+            filename = os.path.join(self.temp_dir, "{}.hdf5".format(j))
+            ts.dump(filename)
+            files.append(filename)
+        expected = [
+            list(msprime.load(filename).records()) for filename in files]
+
+        def worker(thread_index, results):
+            ts = msprime.load(files[thread_index])
+            filename = os.path.join(self.temp_dir, "out_{}.hdf5".format(
+                thread_index))
+            ts.dump(filename, zlib_compression=thread_index % 2 == 0)
+            results[thread_index] = list(msprime.load(filename).records())
+
+        results = run_threads(worker, self.num_threads)
+        self.assertEqual(expected, results)
+
+
+def process_files(files, num_threads, output_dir):
+    """
+    Loads, simplifies, computes the diversity of and dumps the specified
+    files using the specified number of threads. Each thread works on its
+    own subset of the files.
+    """
+    samples = list(range(10))
+
+    def worker(thread_index, results):
+        results[thread_index] = []
+        for filename in files[thread_index::num_threads]:
+            ts = msprime.load(filename)
+            subset = ts.simplify(samples)
+            results[thread_index].append(subset.get_pairwise_diversity())
+            subset.dump(os.path.join(output_dir, os.path.basename(filename)))
+
+    return run_threads(worker, num_threads)
+
+
+def run_file_benchmark(num_files=16, max_threads=8):
+    """
+    Times processing independent files with increasing numbers of threads.
+    Since the GIL is released for file I/O, simplify and diversity
+    calculations the speedup should be close to linear up to the number
+    of available cores.
+    """
+    temp_dir = tempfile.mkdtemp(prefix="msp_threads_bench_")
+    try:
+        files = []
+        for j in range(num_files):
+            ts = msprime.simulate(
+                1000, Ne=1e4, length=1e6, recombination_rate=1e-8,
+                mutation_rate=1e-8, random_seed=j + 1)
+            filename = os.path.join(temp_dir, "{}.hdf5".format(j))
+            ts.dump(filename)
+            files.append(filename)
+        output_dir = os.path.join(temp_dir, "out")
+        os.mkdir(output_dir)
+        base_time = None
+        num_threads = 1
+        while num_threads <= max_threads:
+            before = time.time()
+            process_files(files, num_threads, output_dir)
+            duration = time.time() - before
+            if base_time is None:
+                base_time = duration
+            print("threads = {}\ttime = {:.3f}\tspeedup = {:.2f}".format(
+                num_threads, duration, base_time / duration))
+            num_threads *= 2
+    finally:
+        shutil.rmtree(temp_dir)
+
+
+if __name__ == "__main__":
+    max_threads = 8
+    if len(sys.argv) > 1:
+        max_threads = int(sys.argv[1])
+    run_file_benchmark(max_threads=max_threads)